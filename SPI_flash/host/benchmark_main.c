@@ -0,0 +1,51 @@
+#include "sim.h"
+#include "sim_flash.h"
+#include "SPI_flash.h"
+#include "benchmark.h"
+
+#include <stdio.h>
+
+/*
+ * The firmware benchmark (see ../src/benchmark.h) on the simulated chip.
+ *
+ * All times are simulated: they follow from the bus clock, the flash chip
+ * timing and the CPU cost of peripheral access (see sim/sim.h), so a driver
+ * change shows up as a change in these numbers. Computation without
+ * peripheral access is free in the model: the LZSS speed is not meaningful
+ * here, see test_lzss for a host measurement.
+ */
+
+static const GPIO cs_pin = {0, 17};
+
+void SSP1_IRQHandler(void)
+{
+    SPI_flash_IRQHandler(LPC_SSP1);
+}
+
+static void print(const char *line)
+{
+    fputs(line, stdout);
+}
+
+int main(void)
+{
+    sim_init(NULL);
+    GPIO_HAL_set(&cs_pin, HIGH);
+
+    SimFlash chip;
+    if(!sim_flash_open(&chip, NULL, NULL)
+            || !sim_flash_attach(&chip, LPC_SSP1, &cs_pin)) {
+        return 1;
+    }
+
+    SPIFlash flash;
+    if(!SPI_flash_init_auto(&flash, LPC_SSP1, &cs_pin)) {
+        return 1;
+    }
+    const bool ok = benchmark_run(&flash, print);
+
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    sim_flash_close(&chip);
+    return (ok && !stats.ignored_commands) ? 0 : 1;
+}
@@ -0,0 +1,142 @@
+#ifndef SIM_CHIP_H
+#define SIM_CHIP_H
+
+/**
+ * Host replacement for the lpcopen chip.h: only the parts that are used by
+ * the SPI flash driver and its modules. The SSP, NVIC and PRIMASK are
+ * simulated, see sim.h.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define STATIC static
+#define INLINE inline
+
+typedef enum {RESET = 0, SET = !RESET} FlagStatus;
+
+typedef enum {
+    TIMER_16_0_IRQn = 16,
+    TIMER_32_0_IRQn = 18,
+    SSP1_IRQn       = 14,
+    SSP0_IRQn       = 20,
+} IRQn_Type;
+
+
+// SSP
+
+typedef struct {
+    volatile uint32_t CR0;
+    volatile uint32_t CR1;
+    volatile uint32_t DR;
+    volatile const uint32_t SR;
+    volatile uint32_t CPSR;
+    volatile uint32_t IMSC;
+    volatile const uint32_t RIS;
+    volatile const uint32_t MIS;
+    volatile uint32_t ICR;
+} LPC_SSP_T;
+
+extern LPC_SSP_T sim_SSP_regs[2];
+#define LPC_SSP0    (&sim_SSP_regs[0])
+#define LPC_SSP1    (&sim_SSP_regs[1])
+
+#define SSP_CLOCK_MODE0         (0)
+#define SSP_FRAMEFORMAT_SPI     (0)
+#define SSP_BITS_8              (7)
+
+#define SSP_STAT_TFE            (1 << 0)
+#define SSP_STAT_TNF            (1 << 1)
+#define SSP_STAT_RNE            (1 << 2)
+#define SSP_STAT_RFF            (1 << 3)
+#define SSP_STAT_BSY            (1 << 4)
+
+#define SSP_RORIM               (1 << 0)
+#define SSP_RTIM                (1 << 1)
+#define SSP_RXIM                (1 << 2)
+#define SSP_TXIM                (1 << 3)
+
+#define SSP_RORRIS              (1 << 0)
+#define SSP_RTRIS               (1 << 1)
+#define SSP_RXRIS               (1 << 2)
+#define SSP_TXRIS               (1 << 3)
+
+#define SSP_RORIC               (1 << 0)
+#define SSP_RTIC                (1 << 1)
+#define SSP_INT_CLEAR_BITMASK   (SSP_RORIC | SSP_RTIC)
+
+typedef struct {
+    uint32_t frameFormat;
+    uint32_t bits;
+    uint32_t clockMode;
+} SSP_ConfigFormat;
+
+void Chip_SSP_Init(LPC_SSP_T *pSSP);
+void Chip_SSP_Enable(LPC_SSP_T *pSSP);
+void Chip_SSP_Disable(LPC_SSP_T *pSSP);
+void Chip_SSP_SetFormat(LPC_SSP_T *pSSP, uint32_t bits, uint32_t frameFormat,
+        uint32_t clockMode);
+void Chip_SSP_SetMaster(LPC_SSP_T *pSSP, bool master);
+void Chip_SSP_SetBitRate(LPC_SSP_T *pSSP, uint32_t bitRate);
+FlagStatus Chip_SSP_GetStatus(LPC_SSP_T *pSSP, uint32_t Stat);
+void Chip_SSP_SendFrame(LPC_SSP_T *pSSP, uint16_t tx_data);
+uint16_t Chip_SSP_ReceiveFrame(LPC_SSP_T *pSSP);
+FlagStatus Chip_SSP_GetRawIntStatus(LPC_SSP_T *pSSP, uint32_t RawInt);
+void Chip_SSP_ClearIntPending(LPC_SSP_T *pSSP, uint32_t IntClear);
+void Chip_SSP_Int_FlushData(LPC_SSP_T *pSSP);
+uint32_t Chip_SSP_WriteFrames_Blocking(LPC_SSP_T *pSSP, const uint8_t *buffer,
+        uint32_t buffer_len);
+uint32_t Chip_SSP_ReadFrames_Blocking(LPC_SSP_T *pSSP, uint8_t *buffer,
+        uint32_t buffer_len);
+
+
+// Cortex-M0 core
+
+void NVIC_EnableIRQ(IRQn_Type IRQn);
+void NVIC_DisableIRQ(IRQn_Type IRQn);
+
+void __disable_irq(void);
+void __enable_irq(void);
+uint32_t __get_PRIMASK(void);
+void __WFI(void);
+
+typedef struct {
+    volatile uint32_t CPUID;
+    volatile uint32_t ICSR;
+    uint32_t RESERVED0;
+    volatile uint32_t AIRCR;
+} SCB_Type;
+
+extern SCB_Type sim_SCB;
+#define SCB     (&sim_SCB)
+
+#define SCB_AIRCR_VECTKEY_Pos       (16)
+#define SCB_AIRCR_SYSRESETREQ_Msk   (1UL << 2)
+
+extern uint32_t SystemCoreClock;
+
+
+// GPIO (not simulated: the driver uses GPIO_HAL, see lpc_tools/GPIO_HAL.h)
+
+typedef struct {
+    volatile uint8_t B[128][32];
+    volatile uint32_t W[32][32];
+    uint32_t RESERVED0[960];
+    volatile uint32_t DIR[32];
+    volatile uint32_t MASK[32];
+    volatile uint32_t PIN[32];
+    volatile uint32_t MPIN[32];
+    volatile uint32_t SET[32];
+    volatile uint32_t CLR[32];
+    volatile uint32_t NOT[32];
+} LPC_GPIO_T;
+
+extern LPC_GPIO_T sim_GPIO_regs;
+#define LPC_GPIO    (&sim_GPIO_regs)
+
+
+// Delivers the simulated interrupts while the driver waits for them
+void sim_wait_for_irq(void);
+#define SPI_FLASH_WAIT_HOOK() sim_wait_for_irq()
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef SIM_GPIO_HAL_H
+#define SIM_GPIO_HAL_H
+
+/**
+ * Host replacement for lpc_tools/GPIO_HAL.h: pins are simulated, so that
+ * a chip select can be connected to a simulated flash chip (see sim.h).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    uint8_t port;
+    uint8_t pin;
+} GPIO;
+
+#define LOW     (false)
+#define HIGH    (true)
+
+void GPIO_HAL_set(const GPIO *gpio, bool state);
+bool GPIO_HAL_get(const GPIO *gpio);
+void GPIO_HAL_toggle(const GPIO *gpio);
+
+#endif
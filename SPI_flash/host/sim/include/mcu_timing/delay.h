@@ -0,0 +1,17 @@
+#ifndef SIM_DELAY_H
+#define SIM_DELAY_H
+
+/**
+ * Host replacement for mcu_timing/delay.h: all time is simulated time
+ * (see sim.h), so results do not depend on the host.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+void delay_init(void);
+void delay_us(uint32_t us);
+uint64_t delay_get_timestamp(void);
+uint32_t delay_calc_time_us(uint64_t start, uint64_t end);
+
+#endif
@@ -0,0 +1,670 @@
+#include "sim.h"
+#include <mcu_timing/delay.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SSP_COUNT               (2)
+#define SSP_FIFO_DEPTH          (8)
+#define SSP_FIFO_HALF           (SSP_FIFO_DEPTH/2)
+
+// The RX timeout interrupt is raised after 32 bit periods without activity
+#define SSP_RX_TIMEOUT_FRAMES   (4)
+
+#define SIM_MAX_DEVICES         (4)
+
+// Give up on a wait that makes no progress: it would hang on hardware
+#define SIM_MAX_IDLE_WAITS      (10000000UL)
+#define SIM_MAX_IRQ_LOOPS       (1000000UL)
+
+LPC_SSP_T sim_SSP_regs[SSP_COUNT];
+SCB_Type sim_SCB;
+LPC_GPIO_T sim_GPIO_regs;
+uint32_t SystemCoreClock;
+
+// Provided by the code under test, like the vector table on hardware
+void SSP0_IRQHandler(void) __attribute__((weak));
+void SSP1_IRQHandler(void) __attribute__((weak));
+void SSP0_IRQHandler(void) {}
+void SSP1_IRQHandler(void) {}
+
+typedef struct {
+    GPIO cs_pin;
+    const SimSPIDeviceOps *ops;
+    void *device;
+    bool selected;
+} SimDevice;
+
+typedef struct {
+    SimTime frame_time;
+
+    uint8_t tx[SSP_FIFO_DEPTH];
+    size_t tx_head;
+    size_t tx_count;
+    SimTime frame_end;          // end of tx[tx_head], that is being shifted
+
+    uint8_t rx[SSP_FIFO_DEPTH];
+    size_t rx_head;
+    size_t rx_count;
+    SimTime rx_activity;        // last frame received or read
+    SimTime rt_cleared;         // last time the RX timeout was cleared
+    bool overrun;
+
+    SimDevice devices[SIM_MAX_DEVICES];
+    size_t device_count;
+
+    SimSSPStats stats;
+} SimSSP;
+
+static struct {
+    SimConfig config;
+    SimTime cycle_time;
+    SimTime now;
+
+    bool primask;
+    bool in_irq;
+    uint32_t NVIC_enabled;
+    uint32_t idle_waits;
+
+    uint32_t GPIO_state[2];
+    SimSSP SSP[SSP_COUNT];
+} sim;
+
+static void advance_to(SimTime t);
+
+
+void sim_fatal(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "SIM FATAL at %llu ns: ",
+            (unsigned long long)(sim.now / SIM_PS_PER_NS));
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    abort();
+}
+
+void sim_get_default_config(SimConfig *config)
+{
+    config->cpu_hz = 48000000;
+    config->cycles_per_access = 6;
+    config->irq_cycles = 32;
+}
+
+void sim_init(const SimConfig *config)
+{
+    memset(&sim, 0, sizeof(sim));
+    if(config) {
+        sim.config = *config;
+    } else {
+        sim_get_default_config(&sim.config);
+    }
+    sim.cycle_time = (1000 * SIM_PS_PER_MS) / sim.config.cpu_hz;
+    sim.GPIO_state[0] = sim.GPIO_state[1] = 0xFFFFFFFF;
+
+    memset(sim_SSP_regs, 0, sizeof(sim_SSP_regs));
+    memset(&sim_SCB, 0, sizeof(sim_SCB));
+    SystemCoreClock = sim.config.cpu_hz;
+}
+
+SimTime sim_time(void)
+{
+    return sim.now;
+}
+
+void sim_cpu(uint32_t cycles)
+{
+    advance_to(sim.now + (cycles * sim.cycle_time));
+}
+
+void sim_run_until(SimTime t)
+{
+    advance_to(t);
+}
+
+static void access(void)
+{
+    sim_cpu(sim.config.cycles_per_access);
+}
+
+
+/*
+ * SSP
+ */
+
+static size_t SSP_index(LPC_SSP_T *SSP)
+{
+    if(SSP == LPC_SSP0) {
+        return 0;
+    }
+    if(SSP == LPC_SSP1) {
+        return 1;
+    }
+    sim_fatal("unknown SSP %p", (void*)SSP);
+    return 0;
+}
+
+static SimSSP *get_SSP(LPC_SSP_T *SSP)
+{
+    return &sim.SSP[SSP_index(SSP)];
+}
+
+static SimTime SSP_rt_time(const SimSSP *ssp)
+{
+    return ssp->rx_activity + (SSP_RX_TIMEOUT_FRAMES * ssp->frame_time);
+}
+
+static uint32_t SSP_raw_int_status(const SimSSP *ssp)
+{
+    uint32_t ris = 0;
+    if(ssp->overrun) {
+        ris|= SSP_RORRIS;
+    }
+    const SimTime rt_time = SSP_rt_time(ssp);
+    if(ssp->rx_count && (sim.now >= rt_time) && (ssp->rt_cleared < rt_time)) {
+        ris|= SSP_RTRIS;
+    }
+    if(ssp->rx_count >= SSP_FIFO_HALF) {
+        ris|= SSP_RXRIS;
+    }
+    if(ssp->tx_count <= SSP_FIFO_HALF) {
+        ris|= SSP_TXRIS;
+    }
+    return ris;
+}
+
+/**
+ * Shift the frame at the head of the TX FIFO: exchange it with the
+ * selected device(s) and store the result in the RX FIFO.
+ */
+static void SSP_complete_frame(SimSSP *ssp)
+{
+    const uint8_t mosi = ssp->tx[ssp->tx_head];
+    ssp->tx_head = (ssp->tx_head + 1) % SSP_FIFO_DEPTH;
+    ssp->tx_count--;
+
+    // MISO is pulled up: nothing selected reads as 0xFF
+    uint8_t miso = 0xFF;
+    for(size_t i=0;i<ssp->device_count;i++) {
+        SimDevice *dev = &ssp->devices[i];
+        if(dev->selected) {
+            miso&= dev->ops->exchange(dev->device, mosi);
+        }
+    }
+
+    if(ssp->rx_count == SSP_FIFO_DEPTH) {
+        ssp->overrun = true;
+        ssp->stats.rx_overruns++;
+    } else {
+        ssp->rx[(ssp->rx_head + ssp->rx_count) % SSP_FIFO_DEPTH] = miso;
+        ssp->rx_count++;
+    }
+    ssp->rx_activity = sim.now;
+    ssp->stats.frames++;
+    ssp->stats.busy_time+= ssp->frame_time;
+
+    // The next frame follows without a gap
+    if(ssp->tx_count) {
+        ssp->frame_end+= ssp->frame_time;
+    }
+}
+
+/**
+ * Time of the next SSP event after now: a frame that completes,
+ * or an RX timeout that would raise an interrupt.
+ */
+static SimTime next_event(void)
+{
+    SimTime next = SIM_TIME_NEVER;
+    for(size_t i=0;i<SSP_COUNT;i++) {
+        const SimSSP *ssp = &sim.SSP[i];
+        if(ssp->tx_count && (ssp->frame_end < next)) {
+            next = ssp->frame_end;
+        }
+        const SimTime rt_time = SSP_rt_time(ssp);
+        if(ssp->rx_count && (sim_SSP_regs[i].IMSC & SSP_RTIM)
+                && (ssp->rt_cleared < rt_time) && (rt_time > sim.now)
+                && (rt_time < next)) {
+            next = rt_time;
+        }
+    }
+    return next;
+}
+
+static void complete_due_frames(void)
+{
+    for(size_t i=0;i<SSP_COUNT;i++) {
+        SimSSP *ssp = &sim.SSP[i];
+        while(ssp->tx_count && (ssp->frame_end <= sim.now)) {
+            SSP_complete_frame(ssp);
+        }
+    }
+}
+
+
+/*
+ * Interrupts
+ */
+
+static IRQn_Type SSP_IRQn(size_t index)
+{
+    return index ? SSP1_IRQn : SSP0_IRQn;
+}
+
+static void run_handler(size_t index)
+{
+    SimSSP *ssp = &sim.SSP[index];
+
+    sim.in_irq = true;
+    ssp->stats.irq_count++;
+    sim_cpu(sim.config.irq_cycles / 2);
+    if(index) {
+        SSP1_IRQHandler();
+    } else {
+        SSP0_IRQHandler();
+    }
+    sim_cpu(sim.config.irq_cycles / 2);
+    sim.in_irq = false;
+}
+
+/**
+ * Run the handlers of all pending interrupts, if they can preempt now
+ */
+static void deliver_irqs(void)
+{
+    if(sim.in_irq || sim.primask) {
+        return;
+    }
+    for(uint32_t loops=0;loops<SIM_MAX_IRQ_LOOPS;loops++) {
+        bool delivered = false;
+        for(size_t i=0;i<SSP_COUNT;i++) {
+            if(!(sim.NVIC_enabled & (1UL << SSP_IRQn(i)))) {
+                continue;
+            }
+            if(SSP_raw_int_status(&sim.SSP[i]) & sim_SSP_regs[i].IMSC) {
+                run_handler(i);
+                delivered = true;
+            }
+        }
+        if(!delivered) {
+            return;
+        }
+    }
+    sim_fatal("interrupt stays pending after its handler");
+}
+
+static void advance_to(SimTime t)
+{
+    while(true) {
+        deliver_irqs();
+        const SimTime next = next_event();
+        if(next > t) {
+            break;
+        }
+        if(next > sim.now) {
+            sim.now = next;
+        }
+        sim.idle_waits = 0;
+        complete_due_frames();
+    }
+    if(sim.now < t) {
+        sim.now = t;
+    }
+    deliver_irqs();
+}
+
+void sim_wait_for_irq(void)
+{
+    const SimTime next = next_event();
+    if(next == SIM_TIME_NEVER) {
+        if(++sim.idle_waits > SIM_MAX_IDLE_WAITS) {
+            sim_fatal("waiting for an interrupt that never comes");
+        }
+        access();
+        return;
+    }
+    advance_to(next);
+}
+
+void NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+    sim.NVIC_enabled|= (1UL << IRQn);
+    deliver_irqs();
+}
+
+void NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+    sim.NVIC_enabled&= ~(1UL << IRQn);
+}
+
+void __disable_irq(void)
+{
+    sim.primask = true;
+}
+
+void __enable_irq(void)
+{
+    sim.primask = false;
+    deliver_irqs();
+}
+
+uint32_t __get_PRIMASK(void)
+{
+    return sim.primask;
+}
+
+void __WFI(void)
+{
+    // A pending interrupt wakes up the core, even if PRIMASK is set
+    const SimTime next = next_event();
+    if(next == SIM_TIME_NEVER) {
+        sim_fatal("WFI without any event to wake up");
+    }
+    advance_to(next);
+}
+
+
+/*
+ * SSP API
+ */
+
+bool sim_SSP_attach(LPC_SSP_T *SSP, const GPIO *cs_pin,
+        const SimSPIDeviceOps *ops, void *device)
+{
+    SimSSP *ssp = get_SSP(SSP);
+    if(ssp->device_count >= SIM_MAX_DEVICES) {
+        return false;
+    }
+    SimDevice *dev = &ssp->devices[ssp->device_count++];
+    dev->cs_pin = *cs_pin;
+    dev->ops = ops;
+    dev->device = device;
+    dev->selected = !GPIO_HAL_get(cs_pin);
+    return true;
+}
+
+void sim_SSP_get_stats(LPC_SSP_T *SSP, SimSSPStats *stats)
+{
+    *stats = get_SSP(SSP)->stats;
+}
+
+void sim_SSP_reset_stats(LPC_SSP_T *SSP)
+{
+    memset(&get_SSP(SSP)->stats, 0, sizeof(SimSSPStats));
+}
+
+void Chip_SSP_Init(LPC_SSP_T *pSSP)
+{
+    SimSSP *ssp = get_SSP(pSSP);
+    ssp->tx_count = 0;
+    ssp->rx_count = 0;
+    ssp->overrun = false;
+    pSSP->IMSC = 0;
+    access();
+}
+
+void Chip_SSP_Enable(LPC_SSP_T *pSSP)
+{
+    access();
+}
+
+void Chip_SSP_Disable(LPC_SSP_T *pSSP)
+{
+    access();
+}
+
+void Chip_SSP_SetFormat(LPC_SSP_T *pSSP, uint32_t bits, uint32_t frameFormat,
+        uint32_t clockMode)
+{
+    if(bits != SSP_BITS_8) {
+        sim_fatal("only 8-bit frames are simulated");
+    }
+    access();
+}
+
+void Chip_SSP_SetMaster(LPC_SSP_T *pSSP, bool master)
+{
+    access();
+}
+
+void Chip_SSP_SetBitRate(LPC_SSP_T *pSSP, uint32_t bitRate)
+{
+    // Same divider search as lpcopen: the highest rate <= bitRate
+    const uint32_t ssp_clk = SystemCoreClock;
+    uint32_t cr0_div = 0;
+    uint32_t prescale = 2;
+    uint32_t cmp_clk = 0xFFFFFFFF;
+    while(cmp_clk > bitRate) {
+        cmp_clk = ssp_clk / ((cr0_div + 1) * prescale);
+        if(cmp_clk > bitRate) {
+            cr0_div++;
+            if(cr0_div > 0xFF) {
+                cr0_div = 0;
+                prescale+= 2;
+            }
+        }
+    }
+    get_SSP(pSSP)->frame_time = (8 * 1000 * SIM_PS_PER_MS) / cmp_clk;
+    access();
+}
+
+FlagStatus Chip_SSP_GetStatus(LPC_SSP_T *pSSP, uint32_t Stat)
+{
+    access();
+    const SimSSP *ssp = get_SSP(pSSP);
+
+    uint32_t status = 0;
+    if(!ssp->tx_count) {
+        status|= SSP_STAT_TFE;
+    }
+    if(ssp->tx_count < SSP_FIFO_DEPTH) {
+        status|= SSP_STAT_TNF;
+    }
+    if(ssp->rx_count) {
+        status|= SSP_STAT_RNE;
+    }
+    if(ssp->rx_count == SSP_FIFO_DEPTH) {
+        status|= SSP_STAT_RFF;
+    }
+    if(ssp->tx_count) {
+        status|= SSP_STAT_BSY;
+    }
+    return (status & Stat) ? SET : RESET;
+}
+
+void Chip_SSP_SendFrame(LPC_SSP_T *pSSP, uint16_t tx_data)
+{
+    access();
+    SimSSP *ssp = get_SSP(pSSP);
+    if(!ssp->frame_time) {
+        sim_fatal("SSP bit rate is not set");
+    }
+    if(ssp->tx_count == SSP_FIFO_DEPTH) {
+        ssp->stats.tx_overflows++;
+        return;
+    }
+    if(!ssp->tx_count) {
+        ssp->frame_end = sim.now + ssp->frame_time;
+    }
+    ssp->tx[(ssp->tx_head + ssp->tx_count) % SSP_FIFO_DEPTH] = tx_data;
+    ssp->tx_count++;
+}
+
+uint16_t Chip_SSP_ReceiveFrame(LPC_SSP_T *pSSP)
+{
+    access();
+    SimSSP *ssp = get_SSP(pSSP);
+    if(!ssp->rx_count) {
+        return 0;
+    }
+    const uint8_t data = ssp->rx[ssp->rx_head];
+    ssp->rx_head = (ssp->rx_head + 1) % SSP_FIFO_DEPTH;
+    ssp->rx_count--;
+    ssp->rx_activity = sim.now;
+    return data;
+}
+
+FlagStatus Chip_SSP_GetRawIntStatus(LPC_SSP_T *pSSP, uint32_t RawInt)
+{
+    access();
+    return (SSP_raw_int_status(get_SSP(pSSP)) & RawInt) ? SET : RESET;
+}
+
+void Chip_SSP_ClearIntPending(LPC_SSP_T *pSSP, uint32_t IntClear)
+{
+    access();
+    SimSSP *ssp = get_SSP(pSSP);
+    if(IntClear & SSP_RORIC) {
+        ssp->overrun = false;
+    }
+    if(IntClear & SSP_RTIC) {
+        ssp->rt_cleared = sim.now;
+    }
+}
+
+/*
+ * These are implemented as in lpcopen, on top of the simulated registers
+ */
+
+void Chip_SSP_Int_FlushData(LPC_SSP_T *pSSP)
+{
+    while(Chip_SSP_GetStatus(pSSP, SSP_STAT_BSY)) {}
+
+    while(Chip_SSP_GetStatus(pSSP, SSP_STAT_RNE)) {
+        Chip_SSP_ReceiveFrame(pSSP);
+    }
+    Chip_SSP_ClearIntPending(pSSP, SSP_INT_CLEAR_BITMASK);
+}
+
+uint32_t Chip_SSP_WriteFrames_Blocking(LPC_SSP_T *pSSP, const uint8_t *buffer,
+        uint32_t buffer_len)
+{
+    uint32_t tx_cnt = 0;
+    uint32_t rx_cnt = 0;
+
+    while(Chip_SSP_GetStatus(pSSP, SSP_STAT_RNE)) {
+        Chip_SSP_ReceiveFrame(pSSP);
+    }
+    Chip_SSP_ClearIntPending(pSSP, SSP_INT_CLEAR_BITMASK);
+
+    while((tx_cnt < buffer_len) || (rx_cnt < buffer_len)) {
+        if((Chip_SSP_GetStatus(pSSP, SSP_STAT_TNF) == SET)
+                && (tx_cnt < buffer_len)) {
+            Chip_SSP_SendFrame(pSSP, buffer[tx_cnt]);
+            tx_cnt++;
+        }
+        if(Chip_SSP_GetRawIntStatus(pSSP, SSP_RORRIS) == SET) {
+            return 0;
+        }
+        while((Chip_SSP_GetStatus(pSSP, SSP_STAT_RNE) == SET)
+                && (rx_cnt < buffer_len)) {
+            Chip_SSP_ReceiveFrame(pSSP);
+            rx_cnt++;
+        }
+    }
+    return tx_cnt;
+}
+
+uint32_t Chip_SSP_ReadFrames_Blocking(LPC_SSP_T *pSSP, uint8_t *buffer,
+        uint32_t buffer_len)
+{
+    uint32_t tx_cnt = 0;
+    uint32_t rx_cnt = 0;
+
+    while(Chip_SSP_GetStatus(pSSP, SSP_STAT_RNE)) {
+        Chip_SSP_ReceiveFrame(pSSP);
+    }
+    Chip_SSP_ClearIntPending(pSSP, SSP_INT_CLEAR_BITMASK);
+
+    while(rx_cnt < buffer_len) {
+        if((Chip_SSP_GetStatus(pSSP, SSP_STAT_TNF) == SET)
+                && (tx_cnt < buffer_len)) {
+            Chip_SSP_SendFrame(pSSP, 0xFF);
+            tx_cnt++;
+        }
+        if(Chip_SSP_GetRawIntStatus(pSSP, SSP_RORRIS) == SET) {
+            return 0;
+        }
+        while((Chip_SSP_GetStatus(pSSP, SSP_STAT_RNE) == SET)
+                && (rx_cnt < buffer_len)) {
+            buffer[rx_cnt++] = Chip_SSP_ReceiveFrame(pSSP);
+        }
+    }
+    return rx_cnt;
+}
+
+
+/*
+ * GPIO
+ */
+
+static bool GPIO_state(const GPIO *gpio)
+{
+    return (sim.GPIO_state[gpio->port & 1] >> (gpio->pin & 31)) & 1;
+}
+
+void GPIO_HAL_set(const GPIO *gpio, bool state)
+{
+    access();
+    const uint32_t mask = 1UL << (gpio->pin & 31);
+    if(state) {
+        sim.GPIO_state[gpio->port & 1]|= mask;
+    } else {
+        sim.GPIO_state[gpio->port & 1]&= ~mask;
+    }
+
+    for(size_t i=0;i<SSP_COUNT;i++) {
+        SimSSP *ssp = &sim.SSP[i];
+        for(size_t d=0;d<ssp->device_count;d++) {
+            SimDevice *dev = &ssp->devices[d];
+            if((dev->cs_pin.port != gpio->port)
+                    || (dev->cs_pin.pin != gpio->pin)
+                    || (dev->selected == !state)) {
+                continue;
+            }
+            dev->selected = !state;
+            dev->ops->select(dev->device, dev->selected);
+        }
+    }
+}
+
+bool GPIO_HAL_get(const GPIO *gpio)
+{
+    access();
+    return GPIO_state(gpio);
+}
+
+void GPIO_HAL_toggle(const GPIO *gpio)
+{
+    GPIO_HAL_set(gpio, !GPIO_state(gpio));
+}
+
+
+/*
+ * mcu_timing
+ */
+
+void delay_init(void)
+{
+}
+
+void delay_us(uint32_t us)
+{
+    access();
+    advance_to(sim.now + (us * SIM_PS_PER_US));
+}
+
+uint64_t delay_get_timestamp(void)
+{
+    access();
+    return sim.now;
+}
+
+uint32_t delay_calc_time_us(uint64_t start, uint64_t end)
+{
+    const uint64_t us = (end - start) / SIM_PS_PER_US;
+    return (us > UINT32_MAX) ? UINT32_MAX : us;
+}
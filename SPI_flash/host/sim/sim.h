@@ -0,0 +1,96 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <chip.h>
+#include <lpc_tools/GPIO_HAL.h>
+
+/**
+ * Simulated LPC11U core and SSP bus, to run the SPI flash driver on a host.
+ *
+ * All time is simulated, in picoseconds:
+ * - every peripheral access of the code under test (Chip_SSP_*, GPIO_HAL,
+ *   delay_get_timestamp(), ...) costs cycles_per_access CPU cycles. Other
+ *   code takes no time at all: this is a model of the bus, not of the CPU.
+ * - frames are shifted out back-to-back at the configured bit rate, with
+ *   8-frame TX and RX FIFOs.
+ * - the SSP interrupt (RX half full, RX timeout) is delivered as soon as it is
+ *   pending, unmasked and PRIMASK is cleared, and costs irq_cycles.
+ * - delay_us() and SPI_FLASH_WAIT_HOOK() advance the time to the next event.
+ *
+ * Results therefore only depend on the code under test and the configuration.
+ */
+
+typedef uint64_t SimTime;
+
+#define SIM_PS_PER_NS       (1000ULL)
+#define SIM_PS_PER_US       (1000000ULL)
+#define SIM_PS_PER_MS       (1000000000ULL)
+
+#define SIM_TIME_NEVER      (UINT64_MAX)
+
+typedef struct {
+    uint32_t cpu_hz;
+    uint32_t cycles_per_access;
+    uint32_t irq_cycles;            // interrupt entry and exit
+} SimConfig;
+
+typedef struct {
+    uint32_t frames;
+    SimTime busy_time;              // time that the bus was clocking
+    uint32_t irq_count;
+    uint32_t rx_overruns;
+    uint32_t tx_overflows;          // frames written with a full TX FIFO
+} SimSSPStats;
+
+/**
+ * An SPI device on a simulated SSP bus, selected by a chip select GPIO
+ */
+typedef struct {
+    void (*select)(void *device, bool selected);
+    uint8_t (*exchange)(void *device, uint8_t mosi);
+} SimSPIDeviceOps;
+
+/**
+ * Default configuration: 48MHz core clock, as on the board
+ */
+void sim_get_default_config(SimConfig *config);
+
+/**
+ * Reset the time, the core and all peripherals. Devices are detached.
+ *
+ * @param config    NULL for the default configuration
+ */
+void sim_init(const SimConfig *config);
+
+SimTime sim_time(void);
+
+/**
+ * Spend CPU cycles: pending events and interrupts are handled meanwhile
+ */
+void sim_cpu(uint32_t cycles);
+
+/**
+ * Advance the time, handling all events and interrupts on the way
+ */
+void sim_run_until(SimTime t);
+
+/**
+ * Connect a device to an SSP bus. It is selected while its chip select
+ * GPIO is low.
+ */
+bool sim_SSP_attach(LPC_SSP_T *SSP, const GPIO *cs_pin,
+        const SimSPIDeviceOps *ops, void *device);
+
+void sim_SSP_get_stats(LPC_SSP_T *SSP, SimSSPStats *stats);
+void sim_SSP_reset_stats(LPC_SSP_T *SSP);
+
+/**
+ * Print an error and abort: for conditions that would hang on hardware
+ */
+void sim_fatal(const char *fmt, ...);
+
+#endif
@@ -0,0 +1,599 @@
+#include "sim_flash.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum SimFlashCommand {
+    CMD_WRITE_ENABLE        = 0x06,
+    CMD_WRITE_DISABLE       = 0x04,
+    CMD_READ_STATUS         = 0x05,
+    CMD_READ_DATA           = 0x03,
+    CMD_READ_DATA_FAST      = 0x0B,
+    CMD_PROGRAM_PAGE        = 0x02,
+    CMD_ERASE_SECTOR        = 0x20,
+    CMD_ERASE_BLOCK32       = 0x52,
+    CMD_ERASE_BLOCK64       = 0xD8,
+    CMD_ERASE_CHIP          = 0xC7,
+    CMD_ERASE_CHIP_ALT      = 0x60,
+    CMD_POWER_DOWN          = 0xB9,
+    CMD_POWER_UP            = 0xAB,
+    CMD_READ_JEDEC_ID       = 0x9F,
+    CMD_READ_SFDP           = 0x5A,
+    CMD_SUSPEND             = 0x75,
+    CMD_RESUME              = 0x7A,
+};
+
+enum SimFlashOp {
+    OP_NONE = 0,
+    OP_PROGRAM,
+    OP_ERASE,
+};
+
+#define STATUS_WIP          (1 << 0)
+#define STATUS_WEL          (1 << 1)
+
+#define SFDP_BFPT_ADDRESS   (0x30)
+#define SFDP_BFPT_DWORDS    (16)
+
+static void flash_select(void *device, bool selected);
+static uint8_t flash_exchange(void *device, uint8_t mosi);
+
+static const SimSPIDeviceOps flash_ops = {
+    .select = flash_select,
+    .exchange = flash_exchange,
+};
+
+
+void sim_flash_get_default_config(SimFlashConfig *config)
+{
+    config->size = 0x80000;
+    config->JEDEC_ID[0] = 0xEF;
+    config->JEDEC_ID[1] = 0x40;
+    config->JEDEC_ID[2] = 0x13;
+
+    config->page_program_us = 400;
+    config->sector_erase_us = 45000;
+    config->block32_erase_us = 120000;
+    config->block64_erase_us = 150000;
+    config->chip_erase_us = 1000000;
+    config->wake_us = 3;
+    config->suspend_us = 20;
+}
+
+static void put_le32(uint8_t *bytes, uint32_t value)
+{
+    for(size_t i=0;i<4;i++) {
+        bytes[i] = (value >> (8*i)) & 0xFF;
+    }
+}
+
+/**
+ * Encode a time as an SFDP (count-1, units) field, rounded up
+ */
+static uint32_t SFDP_time(uint32_t time, const uint32_t *units,
+        size_t unit_count, size_t count_bits)
+{
+    const uint32_t max_count = 1UL << count_bits;
+    for(size_t u=0;u<unit_count;u++) {
+        const uint32_t count = (time + units[u] - 1) / units[u];
+        if(count <= max_count) {
+            return ((count ? count : 1) - 1) | (u << count_bits);
+        }
+    }
+    return (max_count - 1) | ((unit_count - 1) << count_bits);
+}
+
+/**
+ * JESD216B header and basic flash parameter table that match the config
+ */
+static void build_SFDP(SimFlash *flash)
+{
+    const SimFlashConfig *cfg = &flash->config;
+    uint8_t *sfdp = flash->SFDP;
+    memset(sfdp, 0xFF, sizeof(flash->SFDP));
+
+    put_le32(sfdp + 0, 0x50444653);             // "SFDP"
+    put_le32(sfdp + 4, 0xFF000106);             // rev 1.6, 1 header
+    put_le32(sfdp + 8, 0x10010600);             // BFPT 1.6, 16 dwords
+    put_le32(sfdp + 12, 0xFF000000 | SFDP_BFPT_ADDRESS);
+
+    const uint32_t erase_units_ms[] = {1, 16, 128, 1000};
+    const uint32_t chip_erase_units_ms[] = {16, 256, 4000, 64000};
+    const uint32_t program_units_us[] = {8, 64};
+    const uint32_t latency_units_us[] = {1, 8, 64};
+
+    uint32_t dw[SFDP_BFPT_DWORDS];
+    memset(dw, 0, sizeof(dw));
+    dw[0] = 0xFFF120E5;
+    dw[1] = (cfg->size * 8) - 1;
+    dw[2] = 0x6B08EB44;
+    dw[3] = 0xBB423B08;
+    dw[4] = 0xFFFFFFFE;
+    dw[5] = 0xFF00FFFF;
+    dw[6] = 0xFF00FFFF;
+    dw[7] = 0x520F200C;                         // 4K: 0x20, 32K: 0x52
+    dw[8] = 0x0000D810;                         // 64K: 0xD8
+    dw[9] = 6                                   // max = 14 * typical
+        | (SFDP_time(cfg->sector_erase_us / 1000, erase_units_ms, 4, 5) << 4)
+        | (SFDP_time(cfg->block32_erase_us / 1000, erase_units_ms, 4, 5) << 11)
+        | (SFDP_time(cfg->block64_erase_us / 1000, erase_units_ms, 4, 5) << 18);
+    dw[10] = 3                                  // max = 8 * typical
+        | (8 << 4)                              // 256 byte pages
+        | (SFDP_time(cfg->page_program_us, program_units_us, 2, 5) << 8)
+        | (SFDP_time(cfg->chip_erase_us / 1000, chip_erase_units_ms, 4, 5)
+                << 24);
+    const uint32_t latency = SFDP_time(cfg->suspend_us,
+            latency_units_us, 3, 5) + (1 << 5); // units start at 128ns
+    dw[11] = (latency << 24) | (latency << 13); // erase and program
+    dw[12] = 0x757A757A;
+
+    for(size_t i=0;i<SFDP_BFPT_DWORDS;i++) {
+        put_le32(sfdp + SFDP_BFPT_ADDRESS + 4*i, dw[i]);
+    }
+}
+
+bool sim_flash_open(SimFlash *flash, const char *path,
+        const SimFlashConfig *config)
+{
+    memset(flash, 0, sizeof(*flash));
+    if(config) {
+        flash->config = *config;
+    } else {
+        sim_flash_get_default_config(&flash->config);
+    }
+    const size_t size = flash->config.size;
+    if(!size || (size % SIM_FLASH_SECTOR_SIZE)) {
+        return false;
+    }
+
+    // Shared, so that a forked process writes to the same image
+    bool blank = true;
+    flash->fd = -1;
+    if(path) {
+        flash->fd = open(path, O_RDWR | O_CREAT, 0644);
+        if(flash->fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if(fstat(flash->fd, &st)) {
+            close(flash->fd);
+            return false;
+        }
+        if(st.st_size && ((size_t)st.st_size != size)) {
+            close(flash->fd);
+            return false;
+        }
+        blank = !st.st_size;
+        if(blank && ftruncate(flash->fd, size)) {
+            close(flash->fd);
+            return false;
+        }
+        flash->memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, flash->fd, 0);
+    } else {
+        flash->memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    if(flash->memory == MAP_FAILED) {
+        if(flash->fd >= 0) {
+            close(flash->fd);
+        }
+        return false;
+    }
+    if(blank) {
+        memset(flash->memory, 0xFF, size);
+    }
+
+    flash->erase_counts = calloc(size / SIM_FLASH_SECTOR_SIZE,
+            sizeof(uint32_t));
+    if(!flash->erase_counts) {
+        sim_flash_close(flash);
+        return false;
+    }
+    build_SFDP(flash);
+    return true;
+}
+
+void sim_flash_close(SimFlash *flash)
+{
+    if(flash->memory && (flash->memory != MAP_FAILED)) {
+        munmap(flash->memory, flash->config.size);
+    }
+    if(flash->fd >= 0) {
+        close(flash->fd);
+    }
+    free(flash->erase_counts);
+    flash->memory = NULL;
+    flash->erase_counts = NULL;
+    flash->fd = -1;
+}
+
+bool sim_flash_attach(SimFlash *flash, LPC_SSP_T *SSP, const GPIO *cs_pin)
+{
+    return sim_SSP_attach(SSP, cs_pin, &flash_ops, flash);
+}
+
+void sim_flash_set_power_cut(SimFlash *flash, uint32_t command,
+        SimFlashPowerCutFunc cb, void *cb_ctx)
+{
+    flash->command_count = 0;
+    flash->power_cut_at = command;
+    flash->power_cut = cb;
+    flash->power_cut_ctx = cb_ctx;
+}
+
+void sim_flash_power_on(SimFlash *flash)
+{
+    flash->selected = false;
+    flash->ignore = false;
+    flash->pos = 0;
+    flash->write_enabled = false;
+    flash->powered_down = false;
+    flash->awake_time = 0;
+    flash->op = OP_NONE;
+    flash->suspended = false;
+    flash->power_lost = false;
+    flash->command_count = 0;
+    flash->power_cut_at = 0;
+}
+
+void sim_flash_get_stats(SimFlash *flash, SimFlashStats *stats)
+{
+    *stats = flash->stats;
+}
+
+void sim_flash_reset_stats(SimFlash *flash)
+{
+    memset(&flash->stats, 0, sizeof(flash->stats));
+}
+
+uint32_t sim_flash_get_erase_count(SimFlash *flash, uint32_t address)
+{
+    return flash->erase_counts[(address % flash->config.size)
+        / SIM_FLASH_SECTOR_SIZE];
+}
+
+
+/*
+ * Operations
+ */
+
+static void op_apply(SimFlash *flash)
+{
+    if(flash->op == OP_PROGRAM) {
+        for(size_t i=0;i<SIM_FLASH_PAGE_SIZE;i++) {
+            if(flash->op_page_written[i]) {
+                flash->memory[flash->op_address + i]&= flash->op_page[i];
+            }
+        }
+    } else if(flash->op == OP_ERASE) {
+        memset(flash->memory + flash->op_address, 0xFF, flash->op_size);
+        for(uint32_t a=0;a<flash->op_size;a+= SIM_FLASH_SECTOR_SIZE) {
+            flash->erase_counts[(flash->op_address + a)
+                / SIM_FLASH_SECTOR_SIZE]++;
+        }
+        flash->stats.sector_erases+= flash->op_size / SIM_FLASH_SECTOR_SIZE;
+    }
+    flash->op = OP_NONE;
+}
+
+/**
+ * An operation that is interrupted by a power cut leaves its area
+ * in an undefined state: some bits are erased or programmed, some not.
+ */
+static void op_tear(SimFlash *flash)
+{
+    uint32_t seed = 0x9E3779B9 ^ flash->command_count;
+    for(uint32_t i=0;i<flash->op_size;i++) {
+        seed = (seed * 1103515245) + 12345;
+        const uint8_t random = seed >> 16;
+        if(flash->op == OP_ERASE) {
+            flash->memory[flash->op_address + i]|= random;
+        } else if(flash->op_page_written[i]) {
+            flash->memory[flash->op_address + i]&=
+                (flash->op_page[i] | random);
+        }
+    }
+    flash->op = OP_NONE;
+}
+
+static void update(SimFlash *flash)
+{
+    if(flash->op && !flash->suspended && (sim_time() >= flash->op_end)) {
+        op_apply(flash);
+    }
+}
+
+static bool is_busy(SimFlash *flash)
+{
+    if(flash->suspended) {
+        return (sim_time() < flash->suspend_end);
+    }
+    return (flash->op != OP_NONE);
+}
+
+bool sim_flash_is_busy(SimFlash *flash)
+{
+    update(flash);
+    return is_busy(flash);
+}
+
+static void op_start(SimFlash *flash, uint8_t op, uint32_t address,
+        uint32_t size, uint32_t time_us)
+{
+    flash->op = op;
+    flash->op_address = address;
+    flash->op_size = size;
+    flash->op_end = sim_time() + (time_us * SIM_PS_PER_US);
+    flash->write_enabled = false;
+}
+
+static void erase_start(SimFlash *flash, uint32_t size, uint32_t time_us)
+{
+    const uint32_t address = (flash->address % flash->config.size)
+        & ~(size - 1);
+    op_start(flash, OP_ERASE, address, size, time_us);
+}
+
+/**
+ * Decide at the first byte whether the chip listens to a command
+ */
+static bool command_accepted(SimFlash *flash, uint8_t opcode)
+{
+    if(flash->powered_down) {
+        return (opcode == CMD_POWER_UP);
+    }
+    if(sim_time() < flash->awake_time) {
+        return false;
+    }
+    if(is_busy(flash)) {
+        return (opcode == CMD_READ_STATUS)
+            || ((opcode == CMD_SUSPEND) && !flash->suspended);
+    }
+    if(flash->suspended) {
+        switch(opcode) {
+            case CMD_READ_DATA:
+            case CMD_READ_DATA_FAST:
+            case CMD_READ_STATUS:
+            case CMD_READ_JEDEC_ID:
+            case CMD_READ_SFDP:
+            case CMD_RESUME:
+                return true;
+            default:
+                return false;
+        }
+    }
+    switch(opcode) {
+        case CMD_WRITE_ENABLE:
+        case CMD_WRITE_DISABLE:
+        case CMD_READ_STATUS:
+        case CMD_READ_DATA:
+        case CMD_READ_DATA_FAST:
+        case CMD_PROGRAM_PAGE:
+        case CMD_ERASE_SECTOR:
+        case CMD_ERASE_BLOCK32:
+        case CMD_ERASE_BLOCK64:
+        case CMD_ERASE_CHIP:
+        case CMD_ERASE_CHIP_ALT:
+        case CMD_POWER_DOWN:
+        case CMD_POWER_UP:
+        case CMD_READ_JEDEC_ID:
+        case CMD_READ_SFDP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Execute the command at the rising edge of chip select
+ */
+static bool command_end(SimFlash *flash)
+{
+    const SimFlashConfig *cfg = &flash->config;
+    const bool address_only = (flash->pos == 4);
+
+    switch(flash->opcode) {
+        case CMD_WRITE_ENABLE:
+            flash->write_enabled = true;
+            return true;
+        case CMD_WRITE_DISABLE:
+            flash->write_enabled = false;
+            return true;
+        case CMD_READ_STATUS:
+            flash->stats.status_polls++;
+            return true;
+
+        case CMD_PROGRAM_PAGE:
+            if(!flash->write_enabled || (flash->pos <= 4)) {
+                return false;
+            }
+            memcpy(flash->op_page, flash->page, sizeof(flash->page));
+            memcpy(flash->op_page_written, flash->page_written,
+                    sizeof(flash->page_written));
+            op_start(flash, OP_PROGRAM,
+                    (flash->address % cfg->size) & ~(SIM_FLASH_PAGE_SIZE - 1),
+                    SIM_FLASH_PAGE_SIZE, cfg->page_program_us);
+            flash->stats.page_programs++;
+            flash->stats.bytes_programmed+= (flash->pos - 4)
+                > SIM_FLASH_PAGE_SIZE ? SIM_FLASH_PAGE_SIZE : (flash->pos - 4);
+            return true;
+
+        case CMD_ERASE_SECTOR:
+            if(!flash->write_enabled || !address_only) {
+                return false;
+            }
+            erase_start(flash, 0x1000, cfg->sector_erase_us);
+            return true;
+        case CMD_ERASE_BLOCK32:
+            if(!flash->write_enabled || !address_only) {
+                return false;
+            }
+            erase_start(flash, 0x8000, cfg->block32_erase_us);
+            return true;
+        case CMD_ERASE_BLOCK64:
+            if(!flash->write_enabled || !address_only) {
+                return false;
+            }
+            erase_start(flash, 0x10000, cfg->block64_erase_us);
+            return true;
+        case CMD_ERASE_CHIP:
+        case CMD_ERASE_CHIP_ALT:
+            if(!flash->write_enabled || (flash->pos != 1)) {
+                return false;
+            }
+            op_start(flash, OP_ERASE, 0, cfg->size, cfg->chip_erase_us);
+            return true;
+
+        case CMD_POWER_DOWN:
+            flash->powered_down = true;
+            return true;
+        case CMD_POWER_UP:
+            if(flash->powered_down) {
+                flash->powered_down = false;
+                flash->awake_time = sim_time()
+                    + (cfg->wake_us * SIM_PS_PER_US);
+            }
+            return true;
+
+        case CMD_SUSPEND:
+            if(!flash->op) {
+                return false;
+            }
+            flash->suspended = true;
+            flash->op_remaining = (flash->op_end > sim_time())
+                ? (flash->op_end - sim_time()) : 0;
+            flash->suspend_end = sim_time()
+                + (cfg->suspend_us * SIM_PS_PER_US);
+            return true;
+        case CMD_RESUME:
+            flash->suspended = false;
+            flash->op_end = sim_time() + flash->op_remaining;
+            return true;
+
+        default:
+            return true;
+    }
+}
+
+static void power_cut(SimFlash *flash)
+{
+    if(flash->op) {
+        op_tear(flash);
+    }
+    flash->suspended = false;
+    flash->write_enabled = false;
+    flash->power_lost = true;
+    if(flash->power_cut) {
+        flash->power_cut(flash->power_cut_ctx);
+    }
+}
+
+static void flash_select(void *device, bool selected)
+{
+    SimFlash *flash = device;
+    update(flash);
+    flash->selected = selected;
+    if(flash->power_lost) {
+        return;
+    }
+    if(selected) {
+        flash->pos = 0;
+        flash->ignore = false;
+        flash->address = 0;
+        memset(flash->page_written, 0, sizeof(flash->page_written));
+        return;
+    }
+    if(!flash->pos) {
+        return;
+    }
+
+    if(!flash->ignore) {
+        if(command_end(flash)) {
+            flash->stats.commands[flash->opcode]++;
+        } else {
+            flash->stats.ignored_commands++;
+        }
+    }
+    flash->command_count++;
+    if(flash->power_cut_at && (flash->command_count == flash->power_cut_at)) {
+        power_cut(flash);
+    }
+}
+
+static uint8_t flash_exchange(void *device, uint8_t mosi)
+{
+    SimFlash *flash = device;
+    update(flash);
+    if(flash->power_lost) {
+        return 0xFF;
+    }
+
+    const size_t pos = flash->pos++;
+    if(!pos) {
+        flash->opcode = mosi;
+        flash->ignore = !command_accepted(flash, mosi);
+        if(flash->ignore) {
+            flash->stats.ignored_commands++;
+        }
+        return 0xFF;
+    }
+    if(flash->ignore) {
+        return 0xFF;
+    }
+
+    // Address phase of the commands that have one
+    const bool has_address = (flash->opcode == CMD_READ_DATA)
+        || (flash->opcode == CMD_READ_DATA_FAST)
+        || (flash->opcode == CMD_READ_SFDP)
+        || (flash->opcode == CMD_PROGRAM_PAGE)
+        || (flash->opcode == CMD_ERASE_SECTOR)
+        || (flash->opcode == CMD_ERASE_BLOCK32)
+        || (flash->opcode == CMD_ERASE_BLOCK64);
+    if(has_address && (pos <= 3)) {
+        flash->address = (flash->address << 8) | mosi;
+        return 0xFF;
+    }
+
+    switch(flash->opcode) {
+        case CMD_READ_STATUS:
+            return (is_busy(flash) ? STATUS_WIP : 0)
+                | (flash->write_enabled ? STATUS_WEL : 0);
+
+        case CMD_READ_JEDEC_ID:
+            return (pos <= 3) ? flash->config.JEDEC_ID[pos-1] : 0xFF;
+
+        case CMD_READ_DATA_FAST:
+        case CMD_READ_SFDP:
+            if(pos == 4) {
+                return 0xFF;    // dummy byte
+            }
+            if(flash->opcode == CMD_READ_SFDP) {
+                const uint32_t address = flash->address++;
+                return (address < SIM_FLASH_SFDP_SIZE)
+                    ? flash->SFDP[address] : 0xFF;
+            }
+            // fall through
+        case CMD_READ_DATA: {
+            const uint32_t address = flash->address++ % flash->config.size;
+            flash->stats.bytes_read++;
+            return flash->memory[address];
+        }
+
+        case CMD_PROGRAM_PAGE: {
+            // Data wraps around within the page
+            const size_t offset = ((flash->address % SIM_FLASH_PAGE_SIZE)
+                    + (pos - 4)) % SIM_FLASH_PAGE_SIZE;
+            flash->page[offset] = mosi;
+            flash->page_written[offset] = true;
+            return 0xFF;
+        }
+
+        default:
+            return 0xFF;
+    }
+}
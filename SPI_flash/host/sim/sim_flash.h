@@ -0,0 +1,149 @@
+#ifndef SIM_FLASH_H
+#define SIM_FLASH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "sim.h"
+
+/**
+ * Simulated SPI NOR flash chip, stored in a memory-mapped image file.
+ *
+ * Decodes READ (0x03, 0x0B), PAGE PROGRAM (0x02), SECTOR/BLOCK/CHIP ERASE
+ * (0x20, 0x52, 0xD8, 0xC7/0x60), READ STATUS (0x05), WRITE ENABLE/DISABLE
+ * (0x06, 0x04), JEDEC ID (0x9F), SFDP (0x5A), deep power-down (0xB9, 0xAB)
+ * and erase/program suspend/resume (0x75, 0x7A).
+ *
+ * Programs and erases keep WIP set for their configured time, and take
+ * effect when they complete. Like a real chip, it ignores commands while
+ * it is busy or powered down, or when they are not write enabled: these
+ * are counted in the stats, so tests can check that the driver never
+ * sends them.
+ *
+ * Power can be cut at a command boundary, see sim_flash_set_power_cut().
+ */
+
+#define SIM_FLASH_PAGE_SIZE     (256)
+#define SIM_FLASH_SECTOR_SIZE   (0x1000)
+#define SIM_FLASH_SFDP_SIZE     (0x80)
+
+typedef struct {
+    uint32_t size;
+    uint8_t JEDEC_ID[3];
+
+    // Operation times (typical = actual: the simulation is deterministic)
+    uint32_t page_program_us;
+    uint32_t sector_erase_us;       // 4K
+    uint32_t block32_erase_us;
+    uint32_t block64_erase_us;
+    uint32_t chip_erase_us;
+    uint32_t wake_us;               // tRES1
+    uint32_t suspend_us;            // tSUS
+} SimFlashConfig;
+
+typedef struct {
+    uint32_t commands[256];         // per opcode
+    uint32_t ignored_commands;      // busy, powered down or not enabled
+    uint32_t bytes_read;
+    uint32_t bytes_programmed;
+    uint32_t page_programs;
+    uint32_t sector_erases;         // in 4K sectors, also for block erases
+    uint32_t status_polls;
+} SimFlashStats;
+
+typedef void (*SimFlashPowerCutFunc)(void *ctx);
+
+typedef struct {
+    SimFlashConfig config;
+    uint8_t *memory;
+    int fd;
+    uint8_t SFDP[SIM_FLASH_SFDP_SIZE];
+
+    // Erase count of each 4K sector
+    uint32_t *erase_counts;
+
+    // Command that is being received
+    bool selected;
+    bool ignore;
+    uint8_t opcode;
+    size_t pos;
+    uint32_t address;
+    uint8_t page[SIM_FLASH_PAGE_SIZE];
+    bool page_written[SIM_FLASH_PAGE_SIZE];
+
+    // Device state
+    bool write_enabled;
+    bool powered_down;
+    SimTime awake_time;             // commands are ignored until then
+
+    // Operation in progress
+    uint8_t op;
+    uint32_t op_address;
+    uint32_t op_size;
+    SimTime op_end;
+    bool suspended;
+    SimTime op_remaining;
+    SimTime suspend_end;
+    uint8_t op_page[SIM_FLASH_PAGE_SIZE];
+    bool op_page_written[SIM_FLASH_PAGE_SIZE];
+
+    // Power cut injection
+    uint32_t command_count;
+    uint32_t power_cut_at;
+    SimFlashPowerCutFunc power_cut;
+    void *power_cut_ctx;
+    bool power_lost;
+
+    SimFlashStats stats;
+} SimFlash;
+
+
+/**
+ * Default configuration: 512K (4Mbit), Winbond-like ID and timing
+ */
+void sim_flash_get_default_config(SimFlashConfig *config);
+
+/**
+ * Open (or create) an image file and map it. A new image is blank (0xFF).
+ *
+ * @param path  NULL for an anonymous image
+ */
+bool sim_flash_open(SimFlash *flash, const char *path,
+        const SimFlashConfig *config);
+
+void sim_flash_close(SimFlash *flash);
+
+/**
+ * Connect to an SSP bus, selected by cs_pin
+ */
+bool sim_flash_attach(SimFlash *flash, LPC_SSP_T *SSP, const GPIO *cs_pin);
+
+/**
+ * Cut the power at the end of command number 'command' (counted from 1)
+ * from now: an erase or program that is in progress is torn, leaving
+ * its area in an undefined state. Then 'cb' is called, which is not
+ * expected to return. If it does, the chip stays unpowered.
+ *
+ * @param command   0 to disable
+ */
+void sim_flash_set_power_cut(SimFlash *flash, uint32_t command,
+        SimFlashPowerCutFunc cb, void *cb_ctx);
+
+/**
+ * Power up after a power cut (or power on reset): the memory contents are
+ * kept, all other state is reset.
+ */
+void sim_flash_power_on(SimFlash *flash);
+
+bool sim_flash_is_busy(SimFlash *flash);
+
+void sim_flash_get_stats(SimFlash *flash, SimFlashStats *stats);
+void sim_flash_reset_stats(SimFlash *flash);
+
+/**
+ * Erase count of the 4K sector that holds 'address'
+ */
+uint32_t sim_flash_get_erase_count(SimFlash *flash, uint32_t address);
+
+#endif
@@ -0,0 +1,271 @@
+#include "test_common.h"
+
+#include <string.h>
+
+/*
+ * The interrupt-driven transfer engine: transfers run from the SSP
+ * interrupt while the caller continues, and report through a callback.
+ */
+
+typedef struct {
+    uint32_t calls;
+    bool ok;
+    SimTime time;
+} Completion;
+
+static void on_done(void *ctx, bool ok)
+{
+    Completion *done = ctx;
+    done->calls++;
+    done->ok = ok;
+    done->time = sim_time();
+}
+
+static uint8_t data[4096];
+static uint8_t result[4096];
+
+static void fill_pattern(uint8_t *dst, size_t size)
+{
+    for(size_t i=0;i<size;i++) {
+        dst[i] = (i * 7) ^ (i >> 8);
+    }
+}
+
+/**
+ * Do other work until the transfer is done: count the work done meanwhile
+ */
+static uint32_t work_until_done(const Completion *done)
+{
+    uint32_t work = 0;
+    while(!done->calls) {
+        sim_cpu(100);
+        work++;
+    }
+    return work;
+}
+
+/**
+ * Read 4K asynchronously at the given bit rate while the main loop works.
+ *
+ * @return  Share of the CPU left to the main loop during the transfer (%)
+ */
+static double read_async_at(uint32_t bit_rate, const char *name)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+    Chip_SSP_SetBitRate(LPC_SSP1, bit_rate);
+    fill_pattern(data, sizeof(data));
+    memcpy(chip.memory + 0x1000, data, sizeof(data));
+    sim_SSP_reset_stats(LPC_SSP1);
+
+    Completion done = {0};
+    const SimTime t_start = sim_time();
+    CHECK(SPI_flash_read_async(&flash, 0x1000, result, sizeof(result),
+                on_done, &done));
+    const SimTime t_return = sim_time();
+
+    // The call only starts the transfer
+    CHECK(!done.calls);
+    CHECK(SPI_flash_is_transfer_busy(&flash));
+    CHECK(!SPI_flash_read_async(&flash, 0, result, 16, on_done, &done));
+
+    const uint32_t work = work_until_done(&done);
+    CHECK(done.calls == 1);
+    CHECK(done.ok);
+    CHECK(!SPI_flash_is_transfer_busy(&flash));
+    CHECK(!memcmp(result, data, sizeof(data)));
+
+    // Chip select is released
+    CHECK(GPIO_HAL_get(&test_cs_pin));
+
+    SimSSPStats SSP_stats;
+    sim_SSP_get_stats(LPC_SSP1, &SSP_stats);
+    CHECK(SSP_stats.irq_count > 0);
+    CHECK(SSP_stats.rx_overruns == 0);
+    CHECK(SSP_stats.tx_overflows == 0);
+
+    SimConfig config;
+    sim_get_default_config(&config);
+    const double transfer_us = (done.time - t_start) / 1e6;
+    const double work_us = (work * 100.0 * 1e6) / config.cpu_hz;
+    const double cpu_free = (100.0 * work_us) / transfer_us;
+
+    test_report(name, "read_4K_call", (t_return - t_start) / 1e6, "us");
+    test_report(name, "read_4K_done", transfer_us, "us");
+    test_report(name, "read_4K_irqs", SSP_stats.irq_count, "");
+    test_report(name, "read_4K_cpu_free", cpu_free, "%");
+    sim_flash_close(&chip);
+    return cpu_free;
+}
+
+static void test_read_async(void)
+{
+    // At 24MHz, draining the FIFO takes more CPU time than the bus:
+    // the interrupt handler keeps the CPU busy for the whole transfer.
+    read_async_at(24000000, "async_24MHz");
+
+    // At lower bit rates, the main loop runs between interrupts
+    CHECK(read_async_at(4000000, "async_4MHz") > 50);
+}
+
+static void test_read_async_short(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+    memcpy(chip.memory, "abcd", 4);
+
+    // A transfer that fits in the FIFO completes without the interrupt
+    Completion done = {0};
+    CHECK(SPI_flash_read_async(&flash, 0, result, 4, on_done, &done));
+    CHECK(done.calls == 1);
+    CHECK(done.ok);
+    CHECK(!memcmp(result, "abcd", 4));
+    sim_flash_close(&chip);
+}
+
+static void test_program_async(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+    fill_pattern(data, 256);
+
+    Completion done = {0};
+    CHECK(SPI_flash_program_async(&flash, 0x200, data, 256,
+                on_done, &done));
+    work_until_done(&done);
+    CHECK(done.ok);
+
+    // The callback comes when the data is sent: the chip is still busy
+    CHECK(sim_flash_is_busy(&chip));
+    CHECK(SPI_flash_wait_ready(&flash));
+    CHECK(!memcmp(chip.memory + 0x200, data, 256));
+
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.commands[0x06] == 1);
+    CHECK(stats.page_programs == 1);
+    CHECK(stats.ignored_commands == 0);
+    sim_flash_close(&chip);
+}
+
+static void test_queue(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+    fill_pattern(data, 256);
+
+    Completion done[3] = {{0}};
+    SPIFlashOp ops[3] = {
+        {.type = SPI_FLASH_OP_ERASE_BLOCK, .address = 0x4000,
+            .cb = on_done, .cb_ctx = &done[0]},
+        {.type = SPI_FLASH_OP_PROGRAM, .address = 0x4000,
+            .buffer = data, .size = 256, .cb = on_done, .cb_ctx = &done[1]},
+        {.type = SPI_FLASH_OP_READ, .address = 0x4000,
+            .buffer = result, .size = 256, .cb = on_done, .cb_ctx = &done[2]},
+    };
+    memset(chip.memory + 0x4000, 0, 256);
+    for(size_t i=0;i<3;i++) {
+        CHECK(SPI_flash_submit(&flash, &ops[i]));
+    }
+
+    uint32_t polls = 0;
+    while(!SPI_flash_queue_is_empty(&flash)) {
+        SPI_flash_poll(&flash);
+        sim_cpu(4800);  // 100us of other work
+        polls++;
+        CHECK(polls < 100000);
+    }
+    for(size_t i=0;i<3;i++) {
+        CHECK(done[i].calls == 1);
+        CHECK(done[i].ok);
+    }
+    CHECK(done[0].time < done[1].time);
+    CHECK(done[1].time < done[2].time);
+    CHECK(!memcmp(result, data, 256));
+
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.ignored_commands == 0);
+    sim_flash_close(&chip);
+}
+
+/**
+ * Stream an unaligned object in chunks at the given bit rate, with
+ * 'work_cycles' of processing per chunk
+ *
+ * @return  The stream statistics
+ */
+static SPIFlashStream stream_object(uint32_t bit_rate, uint32_t work_cycles)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+    Chip_SSP_SetBitRate(LPC_SSP1, bit_rate);
+    fill_pattern(data, sizeof(data));
+    memcpy(chip.memory, data, sizeof(data));
+
+    // 5 whole chunks and a partial one, ending before the end of the data
+    const uint32_t address = 0x103;
+    const size_t size = 3000;
+    const size_t chunk_size = 512;
+    static uint8_t buffers[2 * 512];
+    sim_flash_reset_stats(&chip);
+
+    SPIFlashStream stream;
+    CHECK(SPI_flash_stream_begin(&flash, &stream,
+                address, size, buffers, chunk_size));
+    size_t offset = 0;
+    const uint8_t *chunk;
+    size_t len;
+    while((chunk = SPI_flash_stream_next(&stream, &len))) {
+        const size_t expected = ((size - offset) < chunk_size)
+            ? (size - offset) : chunk_size;
+        CHECK(len == expected);
+        CHECK(!memcmp(chunk, data + address + offset, len));
+        offset+= len;
+        sim_cpu(work_cycles);
+    }
+    CHECK(!stream.error);
+    CHECK(offset == size);
+    CHECK(stream.chunk_count == 6);
+
+    // Nothing is read past the end of the range
+    const uint32_t stalls = stream.stall_count;
+    CHECK(!SPI_flash_stream_next(&stream, &len));
+    CHECK(stream.stall_count == stalls);
+    SPI_flash_stream_end(&stream);
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.bytes_read == size);
+    CHECK(stats.commands[0x03] + stats.commands[0x0B] == 6);
+    sim_flash_close(&chip);
+    return stream;
+}
+
+static void test_stream(void)
+{
+    // Processing a chunk (4ms) takes longer than fetching the next one:
+    // only the first chunk is waited for
+    SPIFlashStream stream = stream_object(4000000, 4 * 48000);
+    CHECK(stream.stall_count == 1);
+
+    // The consumer is faster than the bus: it waits for every chunk
+    stream = stream_object(4000000, 0);
+    CHECK(stream.stall_count == stream.chunk_count);
+    CHECK(stream.stall_time_us > 0);
+    test_report("stream", "stall_time", stream.stall_time_us, "us");
+}
+
+int main(void)
+{
+    test_read_async();
+    test_read_async_short();
+    test_program_async();
+    test_queue();
+    test_stream();
+    return 0;
+}
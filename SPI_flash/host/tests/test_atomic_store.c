@@ -0,0 +1,157 @@
+#include "test_common.h"
+
+#include <string.h>
+
+#include "atomic_store.h"
+
+/*
+ * Power-loss injection for the atomic store: the power is cut at every SPI
+ * command of an update. After each cut, the store must mount with either
+ * the old or the new data, and keep working.
+ */
+
+#define STORE_START     (0x30000)
+#define STORE_SLOT_SIZE (0x1000)
+#define STORE_REGION    ((2 * SIM_FLASH_SECTOR_SIZE) + (2 * STORE_SLOT_SIZE))
+
+// Commit records per metadata block
+#define RECORDS_PER_BLOCK   (SIM_FLASH_SECTOR_SIZE / 32)
+
+static uint8_t data[STORE_SLOT_SIZE];
+static uint8_t result[STORE_SLOT_SIZE];
+static uint8_t baseline[STORE_REGION];
+
+static size_t version_length(uint32_t version)
+{
+    return 3000 + ((version * 37) % 1000);
+}
+
+static void fill_version(uint8_t *dst, uint32_t version)
+{
+    for(size_t i=0;i<version_length(version);i++) {
+        dst[i] = (i * 13) ^ (version * 101) ^ (i >> 8);
+    }
+}
+
+/**
+ * Write and commit the data of a version, in page-sized parts
+ */
+static void update(AtomicStore *store, uint32_t version)
+{
+    const size_t length = version_length(version);
+    fill_version(data, version);
+
+    CHECK(atomic_store_begin(store));
+    for(size_t offset=0;offset<length;offset+=SIM_FLASH_PAGE_SIZE) {
+        size_t len = length - offset;
+        if(len > SIM_FLASH_PAGE_SIZE) {
+            len = SIM_FLASH_PAGE_SIZE;
+        }
+        CHECK(atomic_store_write(store, offset, data + offset, len));
+    }
+    CHECK(atomic_store_commit(store, length));
+}
+
+/**
+ * Check if the store holds the data of a version
+ */
+static bool has_version(AtomicStore *store, uint32_t version)
+{
+    const size_t length = version_length(version);
+    if(atomic_store_get_length(store) != length) {
+        return false;
+    }
+    fill_version(data, version);
+    CHECK(atomic_store_read(store, 0, result, length));
+    return !memcmp(result, data, length);
+}
+
+typedef struct {
+    AtomicStore *store;
+    uint32_t version;
+} UpdateWorkload;
+
+static void update_workload(void *ctx)
+{
+    UpdateWorkload *w = ctx;
+    update(w->store, w->version);
+}
+
+/**
+ * Cut the power at every command of the update to version+1, starting
+ * from a store with 'commits' commits of which the last is 'version'
+ */
+static void power_loss_during_update(uint32_t commits, const char *name)
+{
+    static SimFlash chip;
+    static SPIFlash flash;
+    static AtomicStore store;
+    test_flash_init(&flash, &chip, NULL);
+    CHECK(atomic_store_init(&store, &flash, STORE_START, STORE_SLOT_SIZE));
+    for(uint32_t version=1;version<=commits;version++) {
+        update(&store, version);
+    }
+    const uint32_t version = commits;
+    memcpy(baseline, chip.memory + STORE_START, STORE_REGION);
+
+    uint32_t cut_points = 0;
+    uint32_t old_count = 0;
+    uint32_t max_recovery_us = 0;
+    for(uint32_t cut=1;;cut++) {
+        memcpy(chip.memory + STORE_START, baseline, STORE_REGION);
+        test_power_on(&flash, &chip);
+        CHECK(atomic_store_init(&store, &flash, STORE_START, STORE_SLOT_SIZE));
+        CHECK(has_version(&store, version));
+
+        UpdateWorkload workload = {.store = &store, .version = version + 1};
+        if(!test_run_with_power_cut(&chip, cut, update_workload, &workload)) {
+            // Completed before the cut: all cut points were tried
+            update(&store, version + 1);
+            CHECK(has_version(&store, version + 1));
+            break;
+        }
+        cut_points++;
+
+        // All or nothing: the old or the new data
+        test_power_on(&flash, &chip);
+        CHECK(atomic_store_init(&store, &flash, STORE_START, STORE_SLOT_SIZE));
+        if(store.recovery_us > max_recovery_us) {
+            max_recovery_us = store.recovery_us;
+        }
+        uint32_t recovered = version + 1;
+        if(has_version(&store, version)) {
+            recovered = version;
+            old_count++;
+        } else {
+            CHECK(has_version(&store, version + 1));
+        }
+
+        // The store keeps working, also after a remount
+        update(&store, recovered + 1);
+        CHECK(has_version(&store, recovered + 1));
+        CHECK(atomic_store_init(&store, &flash, STORE_START, STORE_SLOT_SIZE));
+        CHECK(has_version(&store, recovered + 1));
+    }
+    CHECK(cut_points > 0);
+    CHECK(old_count > 0);
+    CHECK(old_count < cut_points);
+
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.ignored_commands == 0);
+
+    test_report(name, "cut_points", cut_points, "");
+    test_report(name, "recovered_old", old_count, "");
+    test_report(name, "recovered_new", cut_points - old_count, "");
+    test_report(name, "max_recovery", max_recovery_us, "us");
+    sim_flash_close(&chip);
+}
+
+int main(void)
+{
+    power_loss_during_update(1, "atomic_update");
+
+    // The metadata block is full: the commit erases the other one first
+    power_loss_during_update(RECORDS_PER_BLOCK, "atomic_update_meta_switch");
+    return 0;
+}
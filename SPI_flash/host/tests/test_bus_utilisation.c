@@ -0,0 +1,120 @@
+#include "test_common.h"
+
+#include <string.h>
+
+/*
+ * Bus utilisation of a read, before and after the FIFO-pipelined transfer
+ * core: the time that the bus clock runs, relative to the time the read
+ * takes from call to return.
+ *
+ * 'before' is the original read path: a status poll and then the command
+ * and data phase as separate Chip_SSP_WriteFrames_Blocking() and
+ * Chip_SSP_ReadFrames_Blocking() calls.
+ */
+
+#define CMD_READ_STATUS     (0x05)
+#define CMD_READ_DATA       (0x03)
+#define STATUS_WIP          (1 << 0)
+
+static uint8_t result[4096];
+
+static void baseline_transfer_begin(void)
+{
+    Chip_SSP_Int_FlushData(LPC_SSP1);
+    GPIO_HAL_set(&test_cs_pin, LOW);
+}
+
+static bool baseline_read(uint32_t address, void *dst, size_t size)
+{
+    uint8_t status;
+    const uint8_t status_cmd = CMD_READ_STATUS;
+    baseline_transfer_begin();
+    bool ok = (Chip_SSP_WriteFrames_Blocking(LPC_SSP1, &status_cmd, 1) == 1);
+    ok&= (Chip_SSP_ReadFrames_Blocking(LPC_SSP1, &status, 1) == 1);
+    GPIO_HAL_set(&test_cs_pin, HIGH);
+    if(!ok || (status & STATUS_WIP)) {
+        return false;
+    }
+
+    const uint8_t cmd[] = {
+        CMD_READ_DATA,
+        (address >> 16) & 0xFF,
+        (address >> 8 ) & 0xFF,
+        (address >> 0 ) & 0xFF
+    };
+    baseline_transfer_begin();
+    ok&= (Chip_SSP_WriteFrames_Blocking(LPC_SSP1, cmd, sizeof(cmd))
+            == sizeof(cmd));
+    ok&= (Chip_SSP_ReadFrames_Blocking(LPC_SSP1, dst, size) == size);
+    GPIO_HAL_set(&test_cs_pin, HIGH);
+    return ok;
+}
+
+typedef struct {
+    double time_us;
+    double utilisation;
+} Measurement;
+
+static Measurement measure(SPIFlash *flash, size_t size, bool baseline)
+{
+    sim_SSP_reset_stats(LPC_SSP1);
+    const SimTime t_start = sim_time();
+    if(baseline) {
+        CHECK(baseline_read(0x2000, result, size));
+    } else {
+        CHECK(SPI_flash_read(flash, 0x2000, result, size));
+    }
+    const SimTime time = sim_time() - t_start;
+
+    SimSSPStats stats;
+    sim_SSP_get_stats(LPC_SSP1, &stats);
+    CHECK(stats.rx_overruns == 0);
+
+    const Measurement m = {
+        .time_us = time / 1e6,
+        .utilisation = (100.0 * stats.busy_time) / time,
+    };
+    return m;
+}
+
+int main(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+    for(size_t i=0;i<sizeof(result);i++) {
+        chip.memory[0x2000 + i] = i;
+    }
+
+    const size_t sizes[] = {16, 256, 4096};
+    for(size_t i=0;i<(sizeof(sizes)/sizeof(sizes[0]));i++) {
+        const size_t size = sizes[i];
+        char param[32];
+
+        memset(result, 0, sizeof(result));
+        const Measurement before = measure(&flash, size, true);
+        CHECK(!memcmp(result, chip.memory + 0x2000, size));
+
+        memset(result, 0, sizeof(result));
+        const Measurement after = measure(&flash, size, false);
+        CHECK(!memcmp(result, chip.memory + 0x2000, size));
+
+        snprintf(param, sizeof(param), "read_%u_before", (unsigned)size);
+        test_report("bus_utilisation", param, before.utilisation, "%");
+        snprintf(param, sizeof(param), "read_%u_after", (unsigned)size);
+        test_report("bus_utilisation", param, after.utilisation, "%");
+        snprintf(param, sizeof(param), "read_%u_before", (unsigned)size);
+        test_report("read_time", param, before.time_us, "us");
+        snprintf(param, sizeof(param), "read_%u_after", (unsigned)size);
+        test_report("read_time", param, after.time_us, "us");
+
+        CHECK(after.utilisation > before.utilisation);
+        CHECK(after.time_us < before.time_us);
+    }
+
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.ignored_commands == 0);
+    sim_flash_close(&chip);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "test_common.h"
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define TEST_EXIT_POWER_CUT     (42)
+
+const GPIO test_cs_pin = {0, 17};
+
+void SSP1_IRQHandler(void)
+{
+    SPI_flash_IRQHandler(LPC_SSP1);
+}
+
+void test_board_init(SimFlash *chip, const SimFlashConfig *config)
+{
+    sim_init(NULL);
+    GPIO_HAL_set(&test_cs_pin, HIGH);
+    CHECK(sim_flash_open(chip, NULL, config));
+    CHECK(sim_flash_attach(chip, LPC_SSP1, &test_cs_pin));
+}
+
+void test_flash_init(SPIFlash *flash, SimFlash *chip,
+        const SimFlashConfig *config)
+{
+    test_board_init(chip, config);
+    CHECK(SPI_flash_init(flash, LPC_SSP1, &test_cs_pin,
+                SIM_FLASH_PAGE_SIZE, SIM_FLASH_SECTOR_SIZE,
+                chip->config.size));
+}
+
+void test_power_on(SPIFlash *flash, SimFlash *chip)
+{
+    sim_init(NULL);
+    GPIO_HAL_set(&test_cs_pin, HIGH);
+    sim_flash_power_on(chip);
+    CHECK(sim_flash_attach(chip, LPC_SSP1, &test_cs_pin));
+    CHECK(SPI_flash_init(flash, LPC_SSP1, &test_cs_pin,
+                SIM_FLASH_PAGE_SIZE, SIM_FLASH_SECTOR_SIZE,
+                chip->config.size));
+}
+
+static void on_power_cut(void *ctx)
+{
+    _exit(TEST_EXIT_POWER_CUT);
+}
+
+bool test_run_with_power_cut(SimFlash *chip, uint32_t cut,
+        TestWorkload workload, void *ctx)
+{
+    fflush(NULL);
+    const pid_t pid = fork();
+    CHECK(pid >= 0);
+    if(!pid) {
+        sim_flash_set_power_cut(chip, cut, on_power_cut, NULL);
+        workload(ctx);
+        _exit(0);
+    }
+
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status));
+    CHECK((WEXITSTATUS(status) == 0)
+            || (WEXITSTATUS(status) == TEST_EXIT_POWER_CUT));
+    return (WEXITSTATUS(status) == TEST_EXIT_POWER_CUT);
+}
+
+void test_report(const char *test, const char *param,
+        double value, const char *unit)
+{
+    printf("BENCH,%s,%s,%.2f,%s\n", test, param, value, unit);
+}
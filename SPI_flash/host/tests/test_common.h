@@ -0,0 +1,60 @@
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+#include "sim_flash.h"
+#include "SPI_flash.h"
+
+#define CHECK(cond) do {                                                    \
+    if(!(cond)) {                                                           \
+        fprintf(stderr, "%s:%d: CHECK failed: %s\n",                        \
+                __FILE__, __LINE__, #cond);                                 \
+        exit(1);                                                            \
+    }                                                                       \
+} while(0)
+
+// Chip select of the flash chip on SSP1, as on the board
+extern const GPIO test_cs_pin;
+
+/**
+ * Reset the simulation and connect a blank flash chip to SSP1
+ *
+ * @param config    NULL for the default chip
+ */
+void test_board_init(SimFlash *chip, const SimFlashConfig *config);
+
+/**
+ * test_board_init() and SPI_flash_init() with the geometry of the chip
+ */
+void test_flash_init(SPIFlash *flash, SimFlash *chip,
+        const SimFlashConfig *config);
+
+/**
+ * Power the chip up again after a power cut: reset the simulation and
+ * SPI_flash_init() as after a reset of the board. The memory is kept.
+ */
+void test_power_on(SPIFlash *flash, SimFlash *chip);
+
+typedef void (*TestWorkload)(void *ctx);
+
+/**
+ * Run a workload in a child process, with the power of the chip cut at the
+ * end of command number 'cut'. Like the memory of a real chip, its image is
+ * shared with the child. Everything else the child did is lost, as with a
+ * reset of the board: call test_power_on() before using the chip again.
+ *
+ * @return  True if the power was cut, false if the workload completed first
+ */
+bool test_run_with_power_cut(SimFlash *chip, uint32_t cut,
+        TestWorkload workload, void *ctx);
+
+/**
+ * Print a result line in the same format as the firmware benchmark
+ */
+void test_report(const char *test, const char *param,
+        double value, const char *unit);
+
+#endif
@@ -0,0 +1,205 @@
+#include "test_common.h"
+
+#include <mcu_timing/delay.h>
+#include <string.h>
+
+/*
+ * Pool of pre-erased blocks: blank blocks are not erased again, a burst
+ * after idle time only pays page program time, and taken blocks are not
+ * touched until they are released.
+ */
+
+#define POOL_ADDRESS    (0x10000)
+#define POOL_BLOCKS     (4)
+#define POOL_TARGET     (2)
+#define MAX_POLLS       (10000)
+
+static uint8_t data[SIM_FLASH_SECTOR_SIZE];
+static uint8_t result[SIM_FLASH_SECTOR_SIZE];
+
+static void fill_pattern(uint8_t *dst, size_t size, uint32_t seed)
+{
+    for(size_t i=0;i<size;i++) {
+        dst[i] = (i * 7) ^ seed;
+    }
+}
+
+/**
+ * Poll the driver as the idle loop of the firmware would, until the pool
+ * has 'count' blocks ready
+ */
+static void poll_until_ready(SPIFlash *flash, SPIFlashErasePool *pool,
+        size_t count)
+{
+    for(size_t i=0;(i < MAX_POLLS) && (pool->ready_count < count);i++) {
+        SPI_flash_poll(flash);
+        delay_us(100);
+    }
+    CHECK(pool->ready_count == count);
+}
+
+static uint32_t sector_erases(SimFlash *chip)
+{
+    SimFlashStats stats;
+    sim_flash_get_stats(chip, &stats);
+    return stats.sector_erases;
+}
+
+static void test_blank_skip(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    SPIFlashErasePool pool;
+    test_flash_init(&flash, &chip, NULL);
+    CHECK(SPI_flash_erase_pool_init(&flash, &pool,
+                POOL_ADDRESS, POOL_BLOCKS, POOL_TARGET));
+
+    // Only the non-blank one of the first two blocks is erased
+    fill_pattern(data, SIM_FLASH_PAGE_SIZE, 1);
+    CHECK(SPI_flash_program(&flash, POOL_ADDRESS + SIM_FLASH_SECTOR_SIZE
+                + SIM_FLASH_SECTOR_SIZE - SIM_FLASH_PAGE_SIZE,
+                data, SIM_FLASH_PAGE_SIZE));
+    CHECK(SPI_flash_wait_ready(&flash));
+
+    poll_until_ready(&flash, &pool, POOL_TARGET);
+    CHECK(pool.blank_skips == 1);
+    CHECK(pool.erases == 1);
+    CHECK(sector_erases(&chip) == 1);
+    CHECK(sim_flash_get_erase_count(&chip, POOL_ADDRESS) == 0);
+    CHECK(sim_flash_get_erase_count(&chip,
+                POOL_ADDRESS + SIM_FLASH_SECTOR_SIZE) == 1);
+
+    // The pool stops at the target
+    for(size_t i=0;i<100;i++) {
+        SPI_flash_poll(&flash);
+        delay_us(100);
+    }
+    CHECK(pool.ready_count == POOL_TARGET);
+    CHECK(sector_erases(&chip) == 1);
+    sim_flash_close(&chip);
+}
+
+/**
+ * Write a whole block to each of the ready blocks, with no polling in
+ * between: all erases happened before the burst.
+ */
+static void test_burst(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    SPIFlashErasePool pool;
+    test_flash_init(&flash, &chip, NULL);
+
+    // Dirty the whole region, so the pool has to erase every block
+    fill_pattern(data, sizeof(data), 2);
+    for(size_t i=0;i<POOL_BLOCKS;i++) {
+        CHECK(SPI_flash_write(&flash, POOL_ADDRESS
+                    + (i * SIM_FLASH_SECTOR_SIZE), data, sizeof(data)));
+        CHECK(SPI_flash_wait_ready(&flash));
+    }
+    CHECK(SPI_flash_erase_pool_init(&flash, &pool,
+                POOL_ADDRESS, POOL_BLOCKS, POOL_TARGET));
+    poll_until_ready(&flash, &pool, POOL_TARGET);
+    CHECK(pool.erases == POOL_TARGET);
+
+    const uint32_t erases = sector_erases(&chip);
+    const SimTime t_start = sim_time();
+    for(size_t i=0;i<POOL_TARGET;i++) {
+        uint32_t address;
+        CHECK(SPI_flash_erase_pool_take(&flash, &address));
+        CHECK(address == POOL_ADDRESS + (i * SIM_FLASH_SECTOR_SIZE));
+        fill_pattern(data, sizeof(data), 3 + i);
+        CHECK(SPI_flash_write(&flash, address, data, sizeof(data)));
+    }
+    CHECK(SPI_flash_wait_ready(&flash));
+    const SimTime burst_time = sim_time() - t_start;
+    CHECK(sector_erases(&chip) == erases);
+
+    // Page program time plus the transfers, nowhere near a sector erase
+    const uint32_t pages = POOL_TARGET
+        * (SIM_FLASH_SECTOR_SIZE / SIM_FLASH_PAGE_SIZE);
+    CHECK(burst_time < (pages * (chip.config.page_program_us + 300)
+                * SIM_PS_PER_US));
+    CHECK(burst_time < (chip.config.sector_erase_us * SIM_PS_PER_US));
+    test_report("erase_pool_burst", "per_page",
+            (double)burst_time / pages / SIM_PS_PER_US, "us");
+
+    for(size_t i=0;i<POOL_TARGET;i++) {
+        fill_pattern(data, sizeof(data), 3 + i);
+        CHECK(SPI_flash_read(&flash, POOL_ADDRESS
+                    + (i * SIM_FLASH_SECTOR_SIZE), result, sizeof(result)));
+        CHECK(!memcmp(result, data, sizeof(data)));
+    }
+    CHECK(!SPI_flash_erase_pool_take(&flash, &(uint32_t){0}));
+    CHECK(pool.misses == 1);
+    sim_flash_close(&chip);
+}
+
+/**
+ * Take the blocks all the way around the ring: taken blocks are not erased
+ * again until they are released, in order.
+ */
+static void test_release(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    SPIFlashErasePool pool;
+    test_flash_init(&flash, &chip, NULL);
+    CHECK(SPI_flash_erase_pool_init(&flash, &pool,
+                POOL_ADDRESS, POOL_BLOCKS, POOL_TARGET));
+
+    uint32_t taken[POOL_BLOCKS];
+    for(size_t i=0;i<POOL_BLOCKS;i++) {
+        poll_until_ready(&flash, &pool,
+                (POOL_BLOCKS - i) < POOL_TARGET ? (POOL_BLOCKS - i)
+                : POOL_TARGET);
+        CHECK(SPI_flash_erase_pool_take(&flash, &taken[i]));
+        fill_pattern(data, sizeof(data), 4 + i);
+        CHECK(SPI_flash_write(&flash, taken[i], data, sizeof(data)));
+        CHECK(SPI_flash_wait_ready(&flash));
+    }
+
+    // All blocks are taken: the pool leaves them alone
+    for(size_t i=0;i<1000;i++) {
+        SPI_flash_poll(&flash);
+        delay_us(100);
+    }
+    CHECK(pool.ready_count == 0);
+    CHECK(sector_erases(&chip) == 0);
+    for(size_t i=0;i<POOL_BLOCKS;i++) {
+        fill_pattern(data, sizeof(data), 4 + i);
+        CHECK(SPI_flash_read(&flash, taken[i], result, sizeof(result)));
+        CHECK(!memcmp(result, data, sizeof(data)));
+    }
+
+    // Blocks are released oldest first
+    CHECK(!SPI_flash_erase_pool_release(&flash, taken[1]));
+    CHECK(SPI_flash_erase_pool_release(&flash, taken[0]));
+    poll_until_ready(&flash, &pool, 1);
+    CHECK(sector_erases(&chip) == 1);
+    CHECK(sim_flash_get_erase_count(&chip, taken[0]) == 1);
+    for(size_t i=1;i<POOL_BLOCKS;i++) {
+        fill_pattern(data, sizeof(data), 4 + i);
+        CHECK(SPI_flash_read(&flash, taken[i], result, sizeof(result)));
+        CHECK(!memcmp(result, data, sizeof(data)));
+    }
+
+    // The ring wraps around to the released block
+    uint32_t address;
+    CHECK(SPI_flash_erase_pool_take(&flash, &address));
+    CHECK(address == taken[0]);
+    for(size_t i=1;i<POOL_BLOCKS;i++) {
+        CHECK(SPI_flash_erase_pool_release(&flash, taken[i]));
+    }
+    CHECK(SPI_flash_erase_pool_release(&flash, address));
+    CHECK(!SPI_flash_erase_pool_release(&flash, address));
+    sim_flash_close(&chip);
+}
+
+int main(void)
+{
+    test_blank_skip();
+    test_burst();
+    test_release();
+    return 0;
+}
@@ -0,0 +1,174 @@
+#include "test_common.h"
+
+#include <string.h>
+
+#include "flash_counter.h"
+
+/*
+ * The persistent counter: increments continue across slot, page and block
+ * boundaries, and a reboot at any point, also with the power cut during an
+ * increment, recovers the count.
+ */
+
+#define COUNTER_START   (0x20000)
+#define COUNTER_BLOCKS  (2)
+#define COUNTER_REGION  (COUNTER_BLOCKS * SIM_FLASH_SECTOR_SIZE)
+
+// Increments per slot and per block, see flash_counter.c
+#define SLOT_BITS       (8 * (FLASH_COUNTER_SLOT_SIZE - 8))
+#define BLOCK_COUNT     (SLOT_BITS * (SIM_FLASH_SECTOR_SIZE \
+            / FLASH_COUNTER_SLOT_SIZE))
+
+static uint8_t baseline[COUNTER_REGION];
+
+static void reboot(SPIFlash *flash, SimFlash *chip, FlashCounter *counter,
+        uint32_t expected)
+{
+    test_power_on(flash, chip);
+    CHECK(flash_counter_init(counter, flash, COUNTER_START, COUNTER_BLOCKS));
+    uint32_t value;
+    CHECK(flash_counter_get(counter, &value));
+    CHECK(value == expected);
+}
+
+/**
+ * Count one at a time over the slots of the first page and into the next
+ * page, with reboots on the way
+ */
+static void test_page_rollover(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    FlashCounter counter;
+    test_flash_init(&flash, &chip, NULL);
+    CHECK(flash_counter_init(&counter, &flash, COUNTER_START, COUNTER_BLOCKS));
+
+    const uint32_t slots_per_page = SIM_FLASH_PAGE_SIZE
+        / FLASH_COUNTER_SLOT_SIZE;
+    const uint32_t total = (slots_per_page * SLOT_BITS) + 10;
+    uint32_t value = 0;
+    sim_flash_reset_stats(&chip);
+    for(uint32_t i=1;i<=total;i++) {
+        CHECK(flash_counter_add(&counter, 1));
+        if(!(i % 97) || ((i % SLOT_BITS) <= 1)) {
+            CHECK(flash_counter_get(&counter, &value));
+            CHECK(value == i);
+        }
+        if(!(i % 500)) {
+            reboot(&flash, &chip, &counter, i);
+        }
+    }
+    reboot(&flash, &chip, &counter, total);
+
+    // A single byte program per increment, plus a header per slot.
+    // The first block was erased by the first init only.
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.page_programs == (total + slots_per_page));
+    CHECK(stats.sector_erases == 0);
+    CHECK(sim_flash_get_erase_count(&chip, COUNTER_START) == 1);
+
+    // The first slot of the second page holds the last 10 increments
+    CHECK(chip.memory[COUNTER_START + SIM_FLASH_PAGE_SIZE + 8] == 0x00);
+    CHECK(chip.memory[COUNTER_START + SIM_FLASH_PAGE_SIZE + 9] == 0xFC);
+    CHECK(chip.memory[COUNTER_START + SIM_FLASH_PAGE_SIZE + 10] == 0xFF);
+    sim_flash_close(&chip);
+}
+
+/**
+ * Fill whole blocks with large increments: the region wraps around, and
+ * each block is erased only when counting moves into it
+ */
+static void test_block_rollover(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    FlashCounter counter;
+    test_flash_init(&flash, &chip, NULL);
+    CHECK(flash_counter_init(&counter, &flash, COUNTER_START, COUNTER_BLOCKS));
+
+    uint32_t value = 0;
+    for(uint32_t block=1;block<=(2 * COUNTER_BLOCKS);block++) {
+        CHECK(flash_counter_add(&counter, BLOCK_COUNT));
+        value+= BLOCK_COUNT;
+        reboot(&flash, &chip, &counter, value);
+
+        // Counting moves into the next block with the next increment
+        CHECK(flash_counter_add(&counter, 1));
+        value++;
+        reboot(&flash, &chip, &counter, value);
+    }
+    CHECK(sim_flash_get_erase_count(&chip, COUNTER_START) == 3);
+    CHECK(sim_flash_get_erase_count(&chip,
+                COUNTER_START + SIM_FLASH_SECTOR_SIZE) == 2);
+    sim_flash_close(&chip);
+}
+
+typedef struct {
+    FlashCounter *counter;
+    uint32_t increments;
+} AddWorkload;
+
+static void add_workload(void *ctx)
+{
+    AddWorkload *workload = ctx;
+    for(uint32_t i=0;i<workload->increments;i++) {
+        CHECK(flash_counter_add(workload->counter, 1));
+    }
+}
+
+/**
+ * Cut the power at every command of a few increments that move counting
+ * into the next block: at most the increment in progress is lost
+ */
+static void test_power_cut(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    FlashCounter counter;
+    test_flash_init(&flash, &chip, NULL);
+    CHECK(flash_counter_init(&counter, &flash, COUNTER_START, COUNTER_BLOCKS));
+    const uint32_t start = BLOCK_COUNT - 2;
+    CHECK(flash_counter_add(&counter, start));
+    memcpy(baseline, chip.memory + COUNTER_START, COUNTER_REGION);
+
+    const uint32_t increments = 4;
+    uint32_t cut_points = 0;
+    for(uint32_t cut=1;;cut++) {
+        memcpy(chip.memory + COUNTER_START, baseline, COUNTER_REGION);
+        reboot(&flash, &chip, &counter, start);
+
+        AddWorkload workload = {.counter = &counter,
+            .increments = increments};
+        if(!test_run_with_power_cut(&chip, cut, add_workload, &workload)) {
+            add_workload(&workload);
+            uint32_t value;
+            CHECK(flash_counter_get(&counter, &value));
+            CHECK(value == start + increments);
+            break;
+        }
+        cut_points++;
+
+        test_power_on(&flash, &chip);
+        CHECK(flash_counter_init(&counter, &flash,
+                    COUNTER_START, COUNTER_BLOCKS));
+        uint32_t value;
+        CHECK(flash_counter_get(&counter, &value));
+        CHECK((value >= start) && (value <= (start + increments)));
+
+        // And counting continues from there
+        CHECK(flash_counter_add(&counter, 1));
+        reboot(&flash, &chip, &counter, value + 1);
+    }
+    CHECK(cut_points >= increments);
+    test_report("flash_counter", "cut_points", cut_points, "");
+    sim_flash_close(&chip);
+}
+
+int main(void)
+{
+    test_page_rollover();
+    test_block_rollover();
+    test_power_cut();
+    return 0;
+}
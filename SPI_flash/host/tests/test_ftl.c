@@ -0,0 +1,191 @@
+#include "test_common.h"
+
+#include <mcu_timing/delay.h>
+#include <string.h>
+#include <math.h>
+
+#include "FTL.h"
+
+/*
+ * The flash translation layer: write amplification and the erase count
+ * distribution of the sectors, as counted by the simulated chip.
+ */
+
+#define FTL_START       (0x10000)
+#define FTL_BLOCKS      (16)
+#define FTL_LPNS        (192)
+
+#define HOST_WRITES     (6000)
+#define POLLS_PER_WRITE (4)
+
+static uint16_t map[FTL_LPNS];
+static FTLBlock blocks[FTL_BLOCKS];
+
+// Version of each logical page: its contents are derived from it
+static uint32_t versions[FTL_LPNS];
+
+static uint8_t data[256];
+static uint8_t result[256];
+
+// Longest FTL_poll() call
+static SimTime max_poll_time;
+
+static uint32_t rng_state;
+
+static uint32_t rng(void)
+{
+    rng_state = (rng_state * 1103515245) + 12345;
+    return rng_state >> 8;
+}
+
+static void fill_page(uint8_t *dst, size_t size, uint32_t lpn,
+        uint32_t version)
+{
+    for(size_t i=0;i<size;i++) {
+        dst[i] = (lpn * 31) ^ (version * 7) ^ i;
+    }
+}
+
+static void write_page(FTL *ftl, uint32_t lpn)
+{
+    const size_t size = FTL_get_page_size(ftl);
+    versions[lpn]++;
+    fill_page(data, size, lpn, versions[lpn]);
+    CHECK(FTL_write(ftl, lpn, data));
+
+    // The main loop polls a few times, doing other work in between
+    for(size_t i=0;i<POLLS_PER_WRITE;i++) {
+        delay_us(1000);
+        const SimTime t_start = sim_time();
+        FTL_poll(ftl);
+        const SimTime poll_time = sim_time() - t_start;
+        if(poll_time > max_poll_time) {
+            max_poll_time = poll_time;
+        }
+    }
+}
+
+static void verify_all(FTL *ftl)
+{
+    const size_t size = FTL_get_page_size(ftl);
+    for(uint32_t lpn=0;lpn<FTL_LPNS;lpn++) {
+        CHECK(FTL_read(ftl, lpn, result));
+        if(versions[lpn]) {
+            fill_page(data, size, lpn, versions[lpn]);
+        } else {
+            memset(data, 0xFF, size);
+        }
+        CHECK(!memcmp(result, data, size));
+    }
+}
+
+/**
+ * Report the erase counts of the FTL sectors, as seen by the chip
+ *
+ * @return  Highest erase count
+ */
+static uint32_t report_erase_counts(SimFlash *chip, const char *name)
+{
+    uint32_t min = UINT32_MAX;
+    uint32_t max = 0;
+    double sum = 0;
+    double sum_sq = 0;
+    for(size_t i=0;i<FTL_BLOCKS;i++) {
+        const uint32_t count = sim_flash_get_erase_count(chip,
+                FTL_START + (i * SIM_FLASH_SECTOR_SIZE));
+        if(count < min) {
+            min = count;
+        }
+        if(count > max) {
+            max = count;
+        }
+        sum += count;
+        sum_sq += (double)count * count;
+    }
+    const double mean = sum / FTL_BLOCKS;
+    const double stddev = sqrt((sum_sq / FTL_BLOCKS) - (mean * mean));
+
+    test_report(name, "erase_count_min", min, "");
+    test_report(name, "erase_count_max", max, "");
+    test_report(name, "erase_count_mean", mean, "");
+    test_report(name, "erase_count_stddev", stddev, "");
+    return max;
+}
+
+/**
+ * Write every logical page once, then HOST_WRITES updates. A share of
+ * hot_percent of the updates goes to the first 10% of the logical pages.
+ */
+static void run_workload(const char *name, uint32_t hot_percent)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    FTL ftl;
+    test_flash_init(&flash, &chip, NULL);
+    CHECK(FTL_init(&ftl, &flash, FTL_START, FTL_BLOCKS,
+                map, FTL_LPNS, blocks));
+
+    memset(versions, 0, sizeof(versions));
+    rng_state = 1;
+    max_poll_time = 0;
+    for(uint32_t lpn=0;lpn<FTL_LPNS;lpn++) {
+        write_page(&ftl, lpn);
+    }
+    const uint32_t hot_lpns = FTL_LPNS / 10;
+    for(uint32_t i=0;i<HOST_WRITES;i++) {
+        uint32_t lpn;
+        if((rng() % 100) < hot_percent) {
+            lpn = rng() % hot_lpns;
+        } else {
+            lpn = hot_lpns + (rng() % (FTL_LPNS - hot_lpns));
+        }
+        write_page(&ftl, lpn);
+    }
+    verify_all(&ftl);
+
+    FTLStats stats;
+    FTL_get_stats(&ftl, &stats);
+    CHECK(stats.host_writes == FTL_LPNS + HOST_WRITES);
+
+    // The chip sees the same erases as the FTL counts, including the
+    // format of every block on the first mount
+    SimFlashStats chip_stats;
+    sim_flash_get_stats(&chip, &chip_stats);
+    CHECK(chip_stats.ignored_commands == 0);
+    CHECK(chip_stats.sector_erases == stats.erases);
+
+    const double write_amplification =
+        (double)(stats.host_writes + stats.gc_writes) / stats.host_writes;
+    const double erases_per_write = (double)stats.erases / stats.host_writes;
+    test_report(name, "write_amplification", write_amplification, "");
+    test_report(name, "erases_per_write", erases_per_write, "");
+    const uint32_t max = report_erase_counts(&chip, name);
+
+    // Rewriting in place costs an erase per write, of the same sector
+    test_report(name, "in_place_erases_per_write", 1.0, "");
+    CHECK(erases_per_write < 0.5);
+
+    // Wear is spread over all sectors: hot data does not wear out its own
+    const double mean_erases = (double)stats.erases / FTL_BLOCKS;
+    CHECK(max < (2 * mean_erases));
+
+    // Background garbage collection never waits for a 45ms sector erase:
+    // a poll takes at most the page programs of copying a page
+    test_report(name, "max_poll_time", max_poll_time / 1e6, "us");
+    CHECK(max_poll_time < (10 * SIM_PS_PER_MS));
+
+    // All state is rebuilt from the flash
+    memset(map, 0, sizeof(map));
+    memset(blocks, 0, sizeof(blocks));
+    CHECK(FTL_init(&ftl, &flash, FTL_START, FTL_BLOCKS,
+                map, FTL_LPNS, blocks));
+    verify_all(&ftl);
+    sim_flash_close(&chip);
+}
+
+int main(void)
+{
+    run_workload("ftl_uniform", 10);
+    run_workload("ftl_hot_cold", 90);
+    return 0;
+}
@@ -0,0 +1,156 @@
+#include "test_common.h"
+
+#include <string.h>
+
+#include "fw_update.h"
+
+/*
+ * A/B slot selection of the firmware staging area: an update never
+ * overwrites the newest valid image.
+ */
+
+#define FW_START        (0x40000)
+#define FW_SLOT_SIZE    (0x10000)
+
+static uint8_t page_buffer[SIM_FLASH_PAGE_SIZE];
+static uint8_t image[0x8000];
+
+static size_t image_size(uint32_t version)
+{
+    return 0x2000 + (version * 0x100) + 13;
+}
+
+static void fill_image(uint32_t version)
+{
+    for(size_t i=0;i<image_size(version);i++) {
+        image[i] = (i * 29) ^ version ^ (i >> 9);
+    }
+}
+
+/**
+ * Write an image in pieces as they would arrive over a link.
+ *
+ * @param size  Amount of the image to write: pass less than the image
+ *              size to simulate an interrupted download
+ * @param finish Call fw_update_finish(), which must succeed
+ *
+ * @return      The slot that was written
+ */
+static size_t write_image(FWUpdate *fw, uint32_t version, size_t size,
+        bool finish)
+{
+    fill_image(version);
+    CHECK(fw_update_begin(fw, version, image_size(version), page_buffer));
+    const size_t slot = fw->write_slot;
+    for(size_t offset=0;offset<size;offset+=100) {
+        size_t len = size - offset;
+        if(len > 100) {
+            len = 100;
+        }
+        CHECK(fw_update_write(fw, image + offset, len));
+    }
+    if(finish) {
+        CHECK(fw_update_finish(fw));
+    }
+    return slot;
+}
+
+static void check_newest(FWUpdate *fw, size_t slot, uint32_t version)
+{
+    size_t newest;
+    FWImageHeader header;
+    CHECK(fw_update_find_newest(fw, &newest, &header));
+    CHECK(newest == slot);
+    CHECK(header.version == version);
+    CHECK(header.size == image_size(version));
+}
+
+static void test_slot_selection(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    FWUpdate fw;
+    test_flash_init(&flash, &chip, NULL);
+    CHECK(fw_update_init(&fw, &flash, FW_START, FW_SLOT_SIZE));
+
+    size_t slot;
+    FWImageHeader header;
+    CHECK(!fw_update_find_newest(&fw, &slot, &header));
+
+    // Updates alternate between the slots
+    CHECK(write_image(&fw, 1, image_size(1), true) == 0);
+    check_newest(&fw, 0, 1);
+    CHECK(write_image(&fw, 2, image_size(2), true) == 1);
+    check_newest(&fw, 1, 2);
+    CHECK(write_image(&fw, 3, image_size(3), true) == 0);
+    check_newest(&fw, 0, 3);
+
+    // The image in flash is exactly what was written
+    CHECK(!memcmp(chip.memory + FW_START + SIM_FLASH_PAGE_SIZE,
+                image, image_size(3)));
+
+    // An interrupted download is never valid: the newest image stays
+    CHECK(write_image(&fw, 4, image_size(4) / 2, false) == 1);
+    CHECK(!fw_update_get_image(&fw, 1, &header));
+    check_newest(&fw, 0, 3);
+
+    // So is a download that was not complete when finished
+    CHECK(write_image(&fw, 4, image_size(4) - 1, false) == 1);
+    CHECK(!fw_update_finish(&fw));
+    CHECK(!fw_update_get_image(&fw, 1, &header));
+    check_newest(&fw, 0, 3);
+
+    // The retry goes to the same slot
+    CHECK(write_image(&fw, 4, image_size(4), true) == 1);
+    check_newest(&fw, 1, 4);
+
+    // Damage to the newest image: fall back to the other one, and let
+    // the next update replace the damaged image
+    chip.memory[FW_START + FW_SLOT_SIZE + SIM_FLASH_PAGE_SIZE + 1000]^= 0x01;
+    CHECK(!fw_update_get_image(&fw, 1, &header));
+    check_newest(&fw, 0, 3);
+    CHECK(write_image(&fw, 5, image_size(5), true) == 1);
+    check_newest(&fw, 1, 5);
+
+    // A damaged header is not valid either
+    chip.memory[FW_START + offsetof(FWImageHeader, version)]^= 0x80;
+    CHECK(!fw_update_get_image(&fw, 0, &header));
+    check_newest(&fw, 1, 5);
+
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.ignored_commands == 0);
+    sim_flash_close(&chip);
+}
+
+static void test_invalid_arguments(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    FWUpdate fw;
+    test_flash_init(&flash, &chip, NULL);
+
+    CHECK(!fw_update_init(&fw, &flash, FW_START + 0x100, FW_SLOT_SIZE));
+    CHECK(!fw_update_init(&fw, &flash, FW_START, FW_SLOT_SIZE + 0x100));
+    CHECK(!fw_update_init(&fw, &flash, chip.config.size - FW_SLOT_SIZE,
+                FW_SLOT_SIZE));
+    CHECK(fw_update_init(&fw, &flash, FW_START, FW_SLOT_SIZE));
+
+    // The image and its header page must fit in a slot
+    CHECK(!fw_update_begin(&fw, 1, FW_SLOT_SIZE, page_buffer));
+    CHECK(!fw_update_begin(&fw, 1, 0, page_buffer));
+    CHECK(!fw_update_write(&fw, image, 1));
+    CHECK(!fw_update_finish(&fw));
+
+    // Writing more than announced fails
+    CHECK(fw_update_begin(&fw, 1, 100, page_buffer));
+    CHECK(!fw_update_write(&fw, image, 101));
+    sim_flash_close(&chip);
+}
+
+int main(void)
+{
+    test_slot_selection();
+    test_invalid_arguments();
+    return 0;
+}
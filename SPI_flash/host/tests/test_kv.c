@@ -0,0 +1,249 @@
+#include "test_common.h"
+
+#include <string.h>
+
+#include "kv_store.h"
+
+/*
+ * The key-value store: the time to rebuild the index at boot, and
+ * recovery from a power loss during compaction.
+ */
+
+#define KV_START        (0x20000)
+#define KV_KEYS         (20)
+#define KV_VALUE_SIZE   (40)
+#define KV_INDEX_SIZE   (64)
+
+// Size of each record in flash: header, key and value, padded
+#define KV_RECORD_SIZE  (56)
+
+static KVIndexEntry index_mem[KV_INDEX_SIZE];
+
+// Version of the value of each key, 0 if it was never set
+static uint32_t versions[KV_KEYS];
+
+static void make_key(char *key, uint32_t n)
+{
+    snprintf(key, KV_MAX_KEY_LEN, "key%02u", (unsigned)n);
+}
+
+static void make_value(uint8_t *value, uint32_t n, uint32_t version)
+{
+    memset(value, 0, KV_VALUE_SIZE);
+    snprintf((char*)value, KV_VALUE_SIZE, "value %u of key %u",
+            (unsigned)version, (unsigned)n);
+}
+
+static void set_key(KVStore *kv, uint32_t n)
+{
+    char key[KV_MAX_KEY_LEN];
+    uint8_t value[KV_VALUE_SIZE];
+    make_key(key, n);
+    make_value(value, n, versions[n] + 1);
+    CHECK(kv_set(kv, key, value, sizeof(value)));
+    versions[n]++;
+}
+
+/**
+ * Check that a key has the value of the given version
+ */
+static bool key_has_version(KVStore *kv, uint32_t n, uint32_t version)
+{
+    char key[KV_MAX_KEY_LEN];
+    uint8_t value[KV_VALUE_SIZE];
+    uint8_t expected[KV_VALUE_SIZE];
+    make_key(key, n);
+
+    size_t len;
+    if(!kv_get(kv, key, value, sizeof(value), &len)) {
+        return (version == 0);
+    }
+    make_value(expected, n, version);
+    return (len == sizeof(value)) && !memcmp(value, expected, sizeof(value));
+}
+
+static void verify_all(KVStore *kv)
+{
+    for(uint32_t n=0;n<KV_KEYS;n++) {
+        CHECK(key_has_version(kv, n, versions[n]));
+    }
+}
+
+static void test_basic(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    KVStore kv;
+    test_flash_init(&flash, &chip, NULL);
+    CHECK(kv_init(&kv, &flash, KV_START, 4, index_mem, KV_INDEX_SIZE));
+
+    CHECK(kv_set(&kv, "serial", "1234", 4));
+    CHECK(kv_set(&kv, "offset", "\x01\x02", 2));
+    CHECK(kv_set(&kv, "serial", "5678", 4));
+    CHECK(kv_delete(&kv, "offset"));
+    CHECK(!kv_delete(&kv, "offset"));
+
+    // All of it survives a remount
+    CHECK(kv_init(&kv, &flash, KV_START, 4, index_mem, KV_INDEX_SIZE));
+    char value[8];
+    size_t len;
+    CHECK(kv_get(&kv, "serial", value, sizeof(value), &len));
+    CHECK((len == 4) && !memcmp(value, "5678", 4));
+    CHECK(!kv_get(&kv, "offset", value, sizeof(value), &len));
+
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.ignored_commands == 0);
+    sim_flash_close(&chip);
+}
+
+/**
+ * Fill a store of sector_count sectors with updates, remount it and
+ * report the time kv_init() takes to rebuild the index
+ */
+static void rebuild_time(size_t sector_count, const char *name)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    KVStore kv;
+    test_flash_init(&flash, &chip, NULL);
+    CHECK(kv_init(&kv, &flash, KV_START, sector_count,
+                index_mem, KV_INDEX_SIZE));
+
+    // Fill all sectors but the free one, which is never written
+    memset(versions, 0, sizeof(versions));
+    for(uint32_t i=0;(kv.free_count > 1)
+            || ((kv.sector_size - kv.write_offset) >= KV_RECORD_SIZE);i++) {
+        set_key(&kv, i % KV_KEYS);
+    }
+
+    CHECK(kv_init(&kv, &flash, KV_START, sector_count,
+                index_mem, KV_INDEX_SIZE));
+    verify_all(&kv);
+
+    KVStats stats;
+    kv_get_stats(&kv, &stats);
+    CHECK(stats.compactions == 0);
+    test_report(name, "rebuild_records", stats.rebuild_records, "");
+    test_report(name, "rebuild_time", stats.rebuild_us, "us");
+    test_report(name, "rebuild_per_record",
+            (double)stats.rebuild_us / stats.rebuild_records, "us");
+    sim_flash_close(&chip);
+}
+
+static void test_rebuild_time(void)
+{
+    rebuild_time(2, "kv_rebuild_2_sectors");
+    rebuild_time(4, "kv_rebuild_4_sectors");
+    rebuild_time(8, "kv_rebuild_8_sectors");
+}
+
+typedef struct {
+    KVStore *kv;
+    uint32_t key;
+} SetWorkload;
+
+static void set_workload(void *ctx)
+{
+    SetWorkload *w = ctx;
+    set_key(w->kv, w->key);
+}
+
+/**
+ * Cut the power at every command of a kv_set() that compacts, and check
+ * that the store mounts with all data intact and keeps working
+ */
+static void test_power_loss_during_compaction(void)
+{
+    const size_t sector_count = 3;
+
+    static SimFlash chip;
+    static SPIFlash flash;
+    static KVStore kv;
+    test_flash_init(&flash, &chip, NULL);
+    CHECK(kv_init(&kv, &flash, KV_START, sector_count,
+                index_mem, KV_INDEX_SIZE));
+
+    // Set all keys, then update only the second half of them up to the
+    // point where the next set takes the last free sector: the compaction
+    // then copies the first half
+    memset(versions, 0, sizeof(versions));
+    for(uint32_t n=0;n<KV_KEYS;n++) {
+        set_key(&kv, n);
+    }
+    uint32_t next = KV_KEYS / 2;
+    while((kv.free_count > 1)
+            || ((kv.sector_size - kv.write_offset) >= KV_RECORD_SIZE)) {
+        set_key(&kv, next);
+        next = (next + 1) < KV_KEYS ? (next + 1) : (KV_KEYS / 2);
+    }
+    KVStats stats;
+    kv_get_stats(&kv, &stats);
+    CHECK(stats.compactions == 0);
+
+    const size_t region_size = sector_count * SIM_FLASH_SECTOR_SIZE;
+    static uint8_t baseline[3 * SIM_FLASH_SECTOR_SIZE];
+    static uint32_t baseline_versions[KV_KEYS];
+    memcpy(baseline, chip.memory + KV_START, region_size);
+    memcpy(baseline_versions, versions, sizeof(versions));
+
+    uint32_t cut_points = 0;
+    uint32_t max_recovery_us = 0;
+    for(uint32_t cut=1;;cut++) {
+        memcpy(chip.memory + KV_START, baseline, region_size);
+        memcpy(versions, baseline_versions, sizeof(versions));
+        test_power_on(&flash, &chip);
+        CHECK(kv_init(&kv, &flash, KV_START, sector_count,
+                    index_mem, KV_INDEX_SIZE));
+
+        SetWorkload workload = {.kv = &kv, .key = next};
+        if(!test_run_with_power_cut(&chip, cut, set_workload, &workload)) {
+            // Completed before the cut: all cut points were tried
+            set_key(&kv, next);
+            kv_get_stats(&kv, &stats);
+            CHECK(stats.compactions == 1);
+            break;
+        }
+        cut_points++;
+
+        // After the power cut: the key has its old or new value,
+        // all others are intact
+        test_power_on(&flash, &chip);
+        CHECK(kv_init(&kv, &flash, KV_START, sector_count,
+                    index_mem, KV_INDEX_SIZE));
+        kv_get_stats(&kv, &stats);
+        if(stats.rebuild_us > max_recovery_us) {
+            max_recovery_us = stats.rebuild_us;
+        }
+        if(key_has_version(&kv, next, versions[next] + 1)) {
+            versions[next]++;
+        }
+        verify_all(&kv);
+
+        // The store keeps working: write through all sectors again
+        for(uint32_t i=0;i<(sector_count * 80);i++) {
+            set_key(&kv, (next + i) % KV_KEYS);
+        }
+        verify_all(&kv);
+        CHECK(kv_init(&kv, &flash, KV_START, sector_count,
+                    index_mem, KV_INDEX_SIZE));
+        verify_all(&kv);
+    }
+    CHECK(cut_points > 0);
+
+    SimFlashStats chip_stats;
+    sim_flash_get_stats(&chip, &chip_stats);
+    CHECK(chip_stats.ignored_commands == 0);
+
+    test_report("kv_power_loss", "cut_points", cut_points, "");
+    test_report("kv_power_loss", "max_recovery", max_recovery_us, "us");
+    sim_flash_close(&chip);
+}
+
+int main(void)
+{
+    test_basic();
+    test_rebuild_time();
+    test_power_loss_during_compaction();
+    return 0;
+}
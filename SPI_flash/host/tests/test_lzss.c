@@ -0,0 +1,218 @@
+#include "test_common.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "lzss.h"
+
+/*
+ * Compression ratio and speed of LZSS on traces like the ones the ADC
+ * pressure sensor logs. The simulator does not model the CPU, so the speed
+ * is measured on the host: in TSC cycles on x86, in ns elsewhere. Compare
+ * results between revisions on the same host, not with the Cortex-M0.
+ */
+
+#define TRACE_SIZE      (16 * 1024)
+#define TIMING_RUNS     (20)
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HOST_TIME_UNIT  "cycles/B"
+
+static uint64_t host_time(void)
+{
+    return __rdtsc();
+}
+#else
+#define HOST_TIME_UNIT  "ns/B"
+
+static uint64_t host_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return ((uint64_t)t.tv_sec * 1000000000ULL) + t.tv_nsec;
+}
+#endif
+
+// Same layout as SampleRecord in adc_pressure_sensor/src/sample_log.h
+typedef struct {
+    uint32_t time_ms;
+    int32_t value;
+} Record;
+
+static uint8_t trace[TRACE_SIZE];
+static uint8_t compressed[2 * TRACE_SIZE];
+static uint8_t decompressed[TRACE_SIZE];
+
+static uint32_t rng_state;
+
+static uint32_t rng(void)
+{
+    rng_state = (rng_state * 1103515245) + 12345;
+    return rng_state >> 8;
+}
+
+/**
+ * Pressure around 101kPa, read every 100ms, with the occasional step of
+ * ADC noise: the records that sample_log stores
+ */
+static size_t make_records(uint8_t *dst, size_t size)
+{
+    Record record = {.time_ms = 0, .value = 101};
+    size_t len = 0;
+    while((len + sizeof(record)) <= size) {
+        record.time_ms+= 100;
+        if(!(rng() % 8)) {
+            record.value+= (rng() & 1) ? 1 : -1;
+        }
+        memcpy(dst + len, &record, sizeof(record));
+        len+= sizeof(record);
+    }
+    return len;
+}
+
+/**
+ * Similar values as text lines, as main.c prints them over the UART
+ */
+static size_t make_text(uint8_t *dst, size_t size)
+{
+    int value = 101;
+    size_t len = 0;
+    for(;;) {
+        if(!(rng() % 8)) {
+            value+= (rng() & 1) ? 1 : -1;
+        }
+        char line[16];
+        const int n = snprintf(line, sizeof(line), "%d\r\n", value);
+        if((len + n) > size) {
+            return len;
+        }
+        memcpy(dst + len, line, n);
+        len+= n;
+    }
+}
+
+/**
+ * Raw 10-bit ADC readings of a slow sine with 2 bits of noise, stored as
+ * 16 bits: only the repeats in the high bytes are found
+ */
+static size_t make_raw_adc(uint8_t *dst, size_t size)
+{
+    static const int16_t sine[16] = {
+        0, 38, 71, 92, 100, 92, 71, 38, 0, -38, -71, -92, -100, -92, -71, -38,
+    };
+    size_t len = 0;
+    for(uint32_t i=0;(len + sizeof(uint16_t)) <= size;i++) {
+        const uint16_t reading = 512 + sine[(i / 64) % 16] + (rng() & 3);
+        memcpy(dst + len, &reading, sizeof(reading));
+        len+= sizeof(reading);
+    }
+    return len;
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t pos;
+} Buffer;
+
+static bool write_buffer(void *ctx, const uint8_t *data, size_t len)
+{
+    Buffer *buf = ctx;
+    if(len > (buf->size - buf->pos)) {
+        return false;
+    }
+    memcpy(buf->data + buf->pos, data, len);
+    buf->pos+= len;
+    return true;
+}
+
+static bool read_buffer(void *ctx, uint8_t *data, size_t *len)
+{
+    Buffer *buf = ctx;
+    if(*len > (buf->size - buf->pos)) {
+        *len = buf->size - buf->pos;
+    }
+    memcpy(data, buf->data + buf->pos, *len);
+    buf->pos+= *len;
+    return true;
+}
+
+/**
+ * Compress in record-sized writes, as a logger would
+ *
+ * @return  Compressed size
+ */
+static size_t compress(const uint8_t *src, size_t size, size_t write_size)
+{
+    static LZSSEncoder enc;
+    Buffer out = {.data = compressed, .size = sizeof(compressed)};
+    lzss_encoder_init(&enc, write_buffer, &out);
+    for(size_t offset=0;offset<size;offset+=write_size) {
+        size_t len = size - offset;
+        if(len > write_size) {
+            len = write_size;
+        }
+        CHECK(lzss_encoder_write(&enc, src + offset, len));
+    }
+    CHECK(lzss_encoder_finish(&enc));
+    return out.pos;
+}
+
+static size_t decompress(size_t compressed_size)
+{
+    static LZSSDecoder dec;
+    Buffer in = {.data = compressed, .size = compressed_size};
+    lzss_decoder_init(&dec, read_buffer, &in);
+    const size_t len = lzss_decoder_read(&dec, decompressed,
+            sizeof(decompressed));
+    CHECK(lzss_decoder_ok(&dec));
+    return len;
+}
+
+/**
+ * Report the ratio and the fastest of TIMING_RUNS runs
+ *
+ * @return  Compressed size in % of the original
+ */
+static double bench_trace(const char *name, size_t size, size_t write_size)
+{
+    uint64_t encode_best = UINT64_MAX;
+    uint64_t decode_best = UINT64_MAX;
+    size_t compressed_size = 0;
+    for(size_t run=0;run<TIMING_RUNS;run++) {
+        const uint64_t t_start = host_time();
+        compressed_size = compress(trace, size, write_size);
+        const uint64_t t_encoded = host_time();
+        CHECK(decompress(compressed_size) == size);
+        const uint64_t t_decoded = host_time();
+
+        if((t_encoded - t_start) < encode_best) {
+            encode_best = t_encoded - t_start;
+        }
+        if((t_decoded - t_encoded) < decode_best) {
+            decode_best = t_decoded - t_encoded;
+        }
+        CHECK(!memcmp(decompressed, trace, size));
+    }
+
+    const double ratio = (100.0 * compressed_size) / size;
+    test_report(name, "ratio", ratio, "%");
+    test_report(name, "encode", (double)encode_best / size, HOST_TIME_UNIT);
+    test_report(name, "decode", (double)decode_best / size, HOST_TIME_UNIT);
+    return ratio;
+}
+
+int main(void)
+{
+    rng_state = 1;
+    size_t size = make_records(trace, sizeof(trace));
+    CHECK(bench_trace("lzss_records", size, sizeof(Record)) < 60);
+
+    size = make_text(trace, sizeof(trace));
+    CHECK(bench_trace("lzss_text", size, 16) < 50);
+
+    size = make_raw_adc(trace, sizeof(trace));
+    CHECK(bench_trace("lzss_raw_adc", size, sizeof(uint16_t)) < 75);
+    return 0;
+}
@@ -0,0 +1,180 @@
+#include "test_common.h"
+
+#include <mcu_timing/delay.h>
+#include <string.h>
+
+#include "sample_log.h"
+
+/*
+ * The circular sample log of adc_pressure_sensor: after a reboot at any
+ * page, also after the log wrapped around, the newest page is found and
+ * the sector after it is erased ahead.
+ */
+
+#define LOG_START       (0x40000)
+#define LOG_SECTORS     (4)
+#define PAGES_PER_SECTOR    (SIM_FLASH_SECTOR_SIZE / SIM_FLASH_PAGE_SIZE)
+#define LOG_PAGES       (LOG_SECTORS * PAGES_PER_SECTOR)
+#define RECORDS_PER_PAGE    ((SIM_FLASH_PAGE_SIZE - 4) / sizeof(SampleRecord))
+#define MAX_POLLS       (10000)
+
+static uint32_t buffers[2 * SIM_FLASH_PAGE_SIZE / sizeof(uint32_t)];
+
+static SampleRecord make_record(uint32_t seq, size_t i)
+{
+    const SampleRecord record = {
+        .time_ms = (seq * RECORDS_PER_PAGE) + i,
+        .value = (int32_t)(seq * 31) - (int32_t)i,
+    };
+    return record;
+}
+
+/**
+ * Append a page of records and poll until it is written, together with
+ * any erase ahead
+ */
+static void write_page(SPIFlash *flash, SampleLog *log, uint32_t seq)
+{
+    for(size_t i=0;i<RECORDS_PER_PAGE;i++) {
+        const SampleRecord record = make_record(seq, i);
+        CHECK(sample_log_append(log, &record));
+    }
+    for(size_t i=0;(sample_log_newest_seq(log) != seq)
+            || !SPI_flash_queue_is_empty(flash);i++) {
+        CHECK(i < MAX_POLLS);
+        sample_log_poll(log);
+        delay_us(100);
+    }
+    sample_log_poll(log);
+}
+
+static void check_page(SampleLog *log, uint32_t seq)
+{
+    SampleRecord records[RECORDS_PER_PAGE];
+    CHECK(sample_log_read_page(log, seq, records, RECORDS_PER_PAGE)
+            == RECORDS_PER_PAGE);
+    for(size_t i=0;i<RECORDS_PER_PAGE;i++) {
+        const SampleRecord expected = make_record(seq, i);
+        CHECK(!memcmp(&records[i], &expected, sizeof(expected)));
+    }
+}
+
+static bool sector_is_blank(SimFlash *chip, size_t sector)
+{
+    const uint8_t *data = chip->memory + LOG_START
+        + (sector * SIM_FLASH_SECTOR_SIZE);
+    for(size_t i=0;i<SIM_FLASH_SECTOR_SIZE;i++) {
+        if(data[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void reboot(SPIFlash *flash, SimFlash *chip, SampleLog *log)
+{
+    test_power_on(flash, chip);
+    CHECK(sample_log_init(log, flash, LOG_START, LOG_SECTORS,
+                buffers, sizeof(buffers)));
+}
+
+/**
+ * Fill the log past one wrap, and reboot after every page
+ */
+static void test_reboot(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    SampleLog log;
+    test_flash_init(&flash, &chip, NULL);
+    CHECK(sample_log_init(&log, &flash, LOG_START, LOG_SECTORS,
+                buffers, sizeof(buffers)));
+    CHECK(sample_log_newest_seq(&log) == SAMPLE_LOG_SEQ_NONE);
+
+    const uint32_t pages = (2 * LOG_PAGES) + PAGES_PER_SECTOR + 3;
+    for(uint32_t seq=0;seq<pages;seq++) {
+        write_page(&flash, &log, seq);
+        reboot(&flash, &chip, &log);
+        CHECK(sample_log_newest_seq(&log) == seq);
+        check_page(&log, seq);
+
+        // The erase ahead was done before the reboot: nothing to erase
+        SampleLogStats stats;
+        sample_log_get_stats(&log, &stats);
+        CHECK(stats.erases == 0);
+
+        // The next page is blank, and after the first page of a sector,
+        // so is the sector after it
+        const size_t next_page = (seq + 1) % LOG_PAGES;
+        const size_t sector = next_page / PAGES_PER_SECTOR;
+        if(next_page % PAGES_PER_SECTOR) {
+            CHECK(sector_is_blank(&chip, (sector + 1) % LOG_SECTORS));
+        } else {
+            CHECK(sector_is_blank(&chip, sector));
+        }
+
+        // Pages of the sector before the one being written are still there
+        if(seq >= PAGES_PER_SECTOR) {
+            check_page(&log, seq - PAGES_PER_SECTOR);
+        }
+    }
+
+    // The oldest sectors were overwritten
+    SampleRecord record;
+    CHECK(!sample_log_read_page(&log, pages - LOG_PAGES, &record, 1));
+    // Sector 0 was erased ahead of each wrap only, never at boot
+    CHECK(sim_flash_get_erase_count(&chip, LOG_START) == 2);
+    sim_flash_close(&chip);
+}
+
+/**
+ * A reset before the erase ahead finished: the sector still holds old
+ * pages, and is erased at boot
+ */
+static void test_interrupted_erase(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    SampleLog log;
+    test_flash_init(&flash, &chip, NULL);
+    CHECK(sample_log_init(&log, &flash, LOG_START, LOG_SECTORS,
+                buffers, sizeof(buffers)));
+
+    // Past one wrap, ending with the first page of the last sector
+    const uint32_t last = LOG_PAGES + ((LOG_SECTORS - 1) * PAGES_PER_SECTOR);
+    for(uint32_t seq=0;seq<=last;seq++) {
+        write_page(&flash, &log, seq);
+    }
+
+    // Sector 0 was erased ahead: fake the old pages it held
+    CHECK(sector_is_blank(&chip, 0));
+    for(size_t page=0;page<PAGES_PER_SECTOR;page++) {
+        const uint32_t seq = LOG_PAGES + page;
+        memcpy(chip.memory + LOG_START + (page * SIM_FLASH_PAGE_SIZE),
+                &seq, sizeof(seq));
+    }
+
+    reboot(&flash, &chip, &log);
+    CHECK(sample_log_newest_seq(&log) == last);
+    check_page(&log, last);
+    SampleLogStats stats;
+    sample_log_get_stats(&log, &stats);
+    CHECK(stats.erases == 1);
+    CHECK(sector_is_blank(&chip, 0));
+
+    // Writing continues in the last sector, then wraps to sector 0
+    for(uint32_t seq=last+1;seq<=(last + PAGES_PER_SECTOR);seq++) {
+        write_page(&flash, &log, seq);
+    }
+    reboot(&flash, &chip, &log);
+    CHECK(sample_log_newest_seq(&log) == last + PAGES_PER_SECTOR);
+    check_page(&log, last + PAGES_PER_SECTOR);
+    sim_flash_close(&chip);
+}
+
+int main(void)
+{
+    test_reboot();
+    test_interrupted_erase();
+    return 0;
+}
@@ -0,0 +1,559 @@
+#include "test_common.h"
+
+#include <mcu_timing/delay.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The simulated chip decodes the command set of the driver, and its timing
+ * makes throughput and latency deterministic.
+ */
+
+static uint8_t buffer[4096];
+static uint8_t readback[4096];
+
+static void fill_pattern(uint8_t *data, size_t size, uint32_t seed)
+{
+    for(size_t i=0;i<size;i++) {
+        seed = (seed * 1103515245) + 12345;
+        data[i] = seed >> 16;
+    }
+}
+
+static void test_JEDEC_ID(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+
+    JEDECID ID;
+    CHECK(SPI_flash_read_JEDEC_ID(&flash, &ID));
+    CHECK(ID.attributes.manufacturer == 0xEF);
+    CHECK(ID.attributes.device == 0x40);
+    CHECK(ID.attributes.size_code == 0x13);
+    sim_flash_close(&chip);
+}
+
+static void test_SFDP(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_board_init(&chip, NULL);
+    CHECK(SPI_flash_init_auto(&flash, LPC_SSP1, &test_cs_pin));
+
+    SPIFlashInfo info;
+    SPI_flash_get_info(&flash, &info);
+    CHECK(info.page_size == 256);
+    CHECK(info.erase_block_size == 0x1000);
+    CHECK(info.total_size == 0x80000);
+    CHECK(info.erase_types[0].size == 0x1000);
+    CHECK(info.erase_types[0].opcode == 0x20);
+    // SFDP times are rounded up to its units
+    CHECK(info.erase_types[0].typ_time_ms == 48);
+    CHECK(info.erase_types[1].size == 0x8000);
+    CHECK(info.erase_types[2].size == 0x10000);
+    CHECK(info.erase_types[2].opcode == 0xD8);
+    CHECK(info.page_program_us == 448);
+    CHECK(info.suspend_latency_us == 20);
+    sim_flash_close(&chip);
+}
+
+static void test_program_erase(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+
+    const uint32_t address = 0x3000;
+    fill_pattern(buffer, sizeof(buffer), 1);
+    CHECK(SPI_flash_write(&flash, address, buffer, sizeof(buffer)));
+    CHECK(SPI_flash_wait_ready(&flash));
+    CHECK(!memcmp(chip.memory + address, buffer, sizeof(buffer)));
+    CHECK(SPI_flash_read(&flash, address, readback, sizeof(readback)));
+    CHECK(!memcmp(readback, buffer, sizeof(buffer)));
+
+    // Programming only clears bits
+    const uint8_t zeros[4] = {0};
+    CHECK(SPI_flash_program(&flash, address, zeros, sizeof(zeros)));
+    CHECK(SPI_flash_wait_ready(&flash));
+    CHECK(!memcmp(chip.memory + address, zeros, sizeof(zeros)));
+
+    CHECK(SPI_flash_erase_block(&flash, address));
+    CHECK(SPI_flash_wait_ready(&flash));
+    for(size_t i=0;i<0x1000;i++) {
+        CHECK(chip.memory[address + i] == 0xFF);
+    }
+    CHECK(sim_flash_get_erase_count(&chip, address) == 1);
+
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.page_programs == 17);
+    CHECK(stats.sector_erases == 1);
+    CHECK(stats.ignored_commands == 0);
+    sim_flash_close(&chip);
+}
+
+static void check_blank(SimFlash *chip, uint32_t address, size_t size)
+{
+    for(size_t i=0;i<size;i++) {
+        CHECK(chip->memory[address + i] == 0xFF);
+    }
+}
+
+static void test_write(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+
+    // Unaligned start and end: split at each page boundary
+    const uint32_t address = 0x1080;
+    const size_t size = 700;
+    fill_pattern(buffer, size, 5);
+    CHECK(SPI_flash_write(&flash, address, buffer, size));
+    CHECK(SPI_flash_wait_ready(&flash));
+
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.page_programs == 4);
+    CHECK(stats.commands[0x02] == 4);
+    CHECK(stats.bytes_programmed == size);
+    CHECK(stats.ignored_commands == 0);
+    CHECK(SPI_flash_read(&flash, address, readback, size));
+    CHECK(!memcmp(readback, buffer, size));
+    check_blank(&chip, 0x1000, address - 0x1000);
+    check_blank(&chip, address + size, 0x1400 - (address + size));
+    sim_flash_close(&chip);
+}
+
+static void test_writer(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+
+    SPIFlashWriter writer;
+    uint8_t page_buffer[256];
+    CHECK(!SPI_flash_writer_begin(&flash, &writer, 0x2000, NULL));
+
+    // A partial first page, three whole ones and a partial last page
+    const uint32_t address = 0x2030;
+    const size_t size = 1000;
+    const size_t chunks[] = {1, 37, 300, 5, 250, 256, 151};
+    fill_pattern(buffer, size, 6);
+
+    const SimTime t_start = sim_time();
+    CHECK(SPI_flash_writer_begin(&flash, &writer, address, page_buffer));
+    size_t offset = 0;
+    for(size_t i=0;i<(sizeof(chunks) / sizeof(chunks[0]));i++) {
+        CHECK(SPI_flash_writer_append(&writer, buffer + offset, chunks[i]));
+        offset+= chunks[i];
+    }
+    CHECK(offset == size);
+
+    // The last 24 bytes wait in the page buffer for the finish
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.page_programs == 4);
+    check_blank(&chip, 0x2400, 0x100);
+
+    CHECK(SPI_flash_writer_finish(&writer));
+    const SimTime write_time = sim_time() - t_start;
+    CHECK(!sim_flash_is_busy(&chip));
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.page_programs == 5);
+    CHECK(stats.bytes_programmed == size);
+    CHECK(stats.ignored_commands == 0);
+    CHECK(writer.bytes_written == size);
+    CHECK(SPI_flash_read(&flash, address, readback, size));
+    CHECK(!memcmp(readback, buffer, size));
+    check_blank(&chip, 0x2000, address - 0x2000);
+    check_blank(&chip, address + size, 0x2500 - (address + size));
+
+    // The throughput is over the whole stream, up to the last program
+    const uint32_t bytes_per_sec = SPI_flash_writer_bytes_per_sec(&writer);
+    const double expected = (double)size * SIM_PS_PER_MS * 1000 / write_time;
+    CHECK(bytes_per_sec > (expected * 0.99));
+    CHECK(bytes_per_sec < (expected * 1.01));
+    CHECK(bytes_per_sec < (256 * 1000000 / chip.config.page_program_us));
+    test_report("sim_writer", "throughput", bytes_per_sec / 1024.0, "KB/s");
+    sim_flash_close(&chip);
+}
+
+static void update_range(SPIFlash *flash, uint32_t address, size_t size,
+        uint32_t skipped, uint32_t programmed, uint32_t erased)
+{
+    SPIFlashUpdateStats stats;
+    CHECK(SPI_flash_update_range(flash, address, buffer, size, &stats));
+    CHECK(stats.pages_skipped == skipped);
+    CHECK(stats.pages_programmed == programmed);
+    CHECK(stats.blocks_erased == erased);
+}
+
+static void test_update_range(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+
+    // Half of each of two 4K blocks
+    const uint32_t address = 0x10800;
+    const size_t size = 0x1000;
+    fill_pattern(buffer, size, 2);
+    update_range(&flash, address, size, 0, 16, 0);
+    CHECK(!memcmp(chip.memory + address, buffer, size));
+
+    // Nothing changed: nothing written
+    update_range(&flash, address, size, 16, 0, 0);
+
+    // Only bits cleared: programmed in place
+    buffer[0x100]&= 0x0F;
+    update_range(&flash, address, size, 15, 1, 0);
+    CHECK(!memcmp(chip.memory + address, buffer, size));
+
+    // A bit set: the block is erased and its part of the range programmed
+    buffer[0xA00] = ~chip.memory[address + 0xA00];
+    update_range(&flash, address, size, 8, 8, 1);
+    CHECK(!memcmp(chip.memory + address, buffer, size));
+
+    // Data outside the range in a block that needs an erase: fail without
+    // writing anything, also not the pages that need no erase
+    const uint8_t outside = 0x00;
+    CHECK(SPI_flash_program(&flash, address + size + 0x10, &outside, 1));
+    CHECK(SPI_flash_wait_ready(&flash));
+    static uint8_t before[0x2000];
+    memcpy(before, chip.memory + 0x10000, sizeof(before));
+    SimFlashStats stats_before;
+    sim_flash_get_stats(&chip, &stats_before);
+
+    buffer[0x10]&= 0xF0;
+    buffer[0xA00] = ~buffer[0xA00];
+    CHECK(!SPI_flash_update_range(&flash, address, buffer, size, NULL));
+    CHECK(!memcmp(chip.memory + 0x10000, before, sizeof(before)));
+
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.page_programs == stats_before.page_programs);
+    CHECK(stats.sector_erases == stats_before.sector_erases);
+    CHECK(stats.ignored_commands == 0);
+    sim_flash_close(&chip);
+}
+
+/**
+ * Erase a range, and check that the plan is what the chip saw: the erase
+ * commands per opcode, and every sector erased once inside the range only
+ */
+static void erase_range(SimFlash *chip, SPIFlash *flash,
+        uint32_t address, size_t size, const uint32_t count[3])
+{
+    SPIFlashErasePlan plan;
+    CHECK(SPI_flash_erase_plan(flash, address, size, &plan));
+    CHECK(!plan.chip_erase);
+    CHECK(plan.command_count == (count[0] + count[1] + count[2]));
+    for(size_t i=0;i<3;i++) {
+        CHECK(plan.count[i] == count[i]);
+    }
+
+    SPIFlashErasePlan executed;
+    sim_flash_reset_stats(chip);
+    CHECK(SPI_flash_erase_range(flash, address, size, &executed));
+    CHECK(SPI_flash_wait_ready(flash));
+    CHECK(!memcmp(&executed, &plan, sizeof(plan)));
+
+    SimFlashStats stats;
+    sim_flash_get_stats(chip, &stats);
+    CHECK(stats.commands[0x20] == count[0]);
+    CHECK(stats.commands[0x52] == count[1]);
+    CHECK(stats.commands[0xD8] == count[2]);
+    CHECK(stats.commands[0xC7] + stats.commands[0x60] == 0);
+    CHECK(stats.sector_erases == (size / SIM_FLASH_SECTOR_SIZE));
+    CHECK(stats.ignored_commands == 0);
+    for(uint32_t sector=0;sector<chip->config.size;
+            sector+=SIM_FLASH_SECTOR_SIZE) {
+        const bool inside = (sector >= address)
+            && (sector < (address + size));
+        CHECK(sim_flash_get_erase_count(chip, sector) == (inside ? 1 : 0));
+    }
+}
+
+static void test_readv(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+    fill_pattern(chip.memory + 0x1000, 0x2000, 7);
+
+    // Each request has a guard byte after it
+    static uint8_t results[9][32];
+    memset(results, 0xA5, sizeof(results));
+    const SPIFlashIOV iov[] = {
+        {0x1100, results[0], 4},    // far from the others: own command
+        {0x1020, results[1], 10},   // 8 byte gap after 0x1010
+        {0x1008, results[2], 16},   // overlaps 0x1000: own command
+        {0x1000, results[3], 16},
+        {0x1FF0, results[4], 16},
+        {0x2010, results[5], 16},   // gap of SPI_FLASH_READV_MAX_GAP
+        {0x1010, results[6], 8},    // adjacent to 0x1008, not to 0x1000
+        {0x2031, results[7], 16},   // gap of one more: own command
+        {0x1000, NULL, 0},          // empty: skipped
+    };
+    const size_t count = sizeof(iov) / sizeof(iov[0]);
+    sim_flash_reset_stats(&chip);
+    CHECK(SPI_flash_readv(&flash, iov, count));
+
+    for(size_t i=0;i<count;i++) {
+        CHECK(!memcmp(results[i], chip.memory + iov[i].address,
+                    iov[i].size));
+        CHECK(results[i][iov[i].size] == 0xA5);
+    }
+
+    // 0x1000 | 0x1008 | 0x1010, 0x1020 | 0x1100 | 0x1FF0, 0x2010 | 0x2031
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.commands[0x03] == 6);
+    CHECK(stats.bytes_read == (4 + 10 + 16 + 16 + 16 + 16 + 8 + 16)
+            + 8 + SPI_FLASH_READV_MAX_GAP);
+    CHECK(stats.ignored_commands == 0);
+
+    // Nothing is read if a request is out of bounds
+    const SPIFlashIOV bad[] = {
+        {0x1000, results[0], 4},
+        {chip.config.size - 2, results[1], 4},
+    };
+    sim_flash_reset_stats(&chip);
+    CHECK(!SPI_flash_readv(&flash, bad, 2));
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.commands[0x03] == 0);
+    sim_flash_close(&chip);
+}
+
+static void test_erase_range(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_board_init(&chip, NULL);
+    CHECK(SPI_flash_init_auto(&flash, LPC_SSP1, &test_cs_pin));
+
+    // Data just outside the range survives
+    fill_pattern(buffer, 512, 4);
+    CHECK(SPI_flash_write(&flash, 0x6F00, buffer, 256));
+    CHECK(SPI_flash_wait_ready(&flash));
+    CHECK(SPI_flash_write(&flash, 0x21000, buffer + 256, 256));
+    CHECK(SPI_flash_wait_ready(&flash));
+
+    // 4K up to 32K alignment, 32K up to 64K alignment, 64K, 4K at the end
+    erase_range(&chip, &flash, 0x7000, 0x1A000, (const uint32_t[]){2, 1, 1});
+    CHECK(!memcmp(chip.memory + 0x6F00, buffer, 256));
+    CHECK(!memcmp(chip.memory + 0x21000, buffer + 256, 256));
+    for(size_t i=0x7000;i<0x21000;i++) {
+        CHECK(chip.memory[i] == 0xFF);
+    }
+    sim_flash_close(&chip);
+
+    // Aligned ranges use the single largest command
+    test_board_init(&chip, NULL);
+    CHECK(SPI_flash_init_auto(&flash, LPC_SSP1, &test_cs_pin));
+    erase_range(&chip, &flash, 0x30000, 0x10000, (const uint32_t[]){0, 0, 1});
+    sim_flash_close(&chip);
+    test_board_init(&chip, NULL);
+    CHECK(SPI_flash_init_auto(&flash, LPC_SSP1, &test_cs_pin));
+    erase_range(&chip, &flash, 0x48000, 0x8000, (const uint32_t[]){0, 1, 0});
+    sim_flash_close(&chip);
+
+    // The whole chip is a single chip erase
+    test_board_init(&chip, NULL);
+    CHECK(SPI_flash_init_auto(&flash, LPC_SSP1, &test_cs_pin));
+    CHECK(SPI_flash_write(&flash, 0x7FF00, buffer, 256));
+    CHECK(SPI_flash_wait_ready(&flash));
+    SPIFlashErasePlan plan;
+    sim_flash_reset_stats(&chip);
+    CHECK(SPI_flash_erase_range(&flash, 0, chip.config.size, &plan));
+    CHECK(SPI_flash_wait_ready(&flash));
+    CHECK(plan.chip_erase);
+    CHECK(plan.command_count == 1);
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.commands[0xC7] + stats.commands[0x60] == 1);
+    CHECK(stats.commands[0x20] + stats.commands[0x52]
+            + stats.commands[0xD8] == 0);
+    CHECK(chip.memory[0x7FF00] == 0xFF);
+
+    // Unaligned or out of range: nothing is erased
+    sim_flash_reset_stats(&chip);
+    CHECK(!SPI_flash_erase_range(&flash, 0x1800, 0x1000, NULL));
+    CHECK(!SPI_flash_erase_range(&flash, 0x1000, 0x800, NULL));
+    CHECK(!SPI_flash_erase_range(&flash, 0x7F000, 0x2000, NULL));
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.sector_erases == 0);
+    sim_flash_close(&chip);
+}
+
+static void test_timing(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+
+    // WIP is set for the configured time: the driver may not finish earlier.
+    // The transfer itself takes ~130us, the driver polls every 50us after
+    // the typical time.
+    fill_pattern(buffer, 256, 2);
+    SimTime t_start = sim_time();
+    CHECK(SPI_flash_program(&flash, 0, buffer, 256));
+    CHECK(SPI_flash_wait_ready(&flash));
+    const SimTime program_time = sim_time() - t_start;
+    CHECK(program_time >= 400 * SIM_PS_PER_US);
+    CHECK(program_time < 700 * SIM_PS_PER_US);
+    test_report("sim", "page_program", program_time / 1e6, "us");
+
+    t_start = sim_time();
+    CHECK(SPI_flash_erase_block(&flash, 0));
+    CHECK(SPI_flash_wait_ready(&flash));
+    const SimTime erase_time = sim_time() - t_start;
+    CHECK(erase_time >= 45 * SIM_PS_PER_MS);
+    CHECK(erase_time < 52 * SIM_PS_PER_MS);
+    test_report("sim", "sector_erase", erase_time / 1e6, "us");
+
+    // 4K takes 4096 + 4 frames of 333ns at 24MHz, plus CPU overhead
+    t_start = sim_time();
+    CHECK(SPI_flash_read(&flash, 0, readback, sizeof(readback)));
+    const SimTime read_time = sim_time() - t_start;
+    CHECK(read_time > (4100 * 333 * SIM_PS_PER_NS));
+    test_report("sim", "read_4K", read_time / 1e6, "us");
+    test_report("sim", "read_4K_throughput",
+            (sizeof(readback) * 1e6) / (read_time / 1e6) / 1024, "KB/s");
+
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.ignored_commands == 0);
+    sim_flash_close(&chip);
+}
+
+/**
+ * Without known timing, the status is polled at an interval, not
+ * continuously
+ */
+static void test_unknown_timing(void)
+{
+    SimFlashConfig config;
+    sim_flash_get_default_config(&config);
+    config.JEDEC_ID[0] = 0x12;
+
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, &config);
+    SPIFlashInfo info;
+    SPI_flash_get_info(&flash, &info);
+    CHECK(info.page_program_us == 0);
+    CHECK(info.erase_types[0].typ_time_ms == 0);
+
+    sim_flash_reset_stats(&chip);
+    const SimTime t_start = sim_time();
+    CHECK(SPI_flash_erase_block(&flash, 0));
+    CHECK(SPI_flash_wait_ready(&flash));
+    const SimTime erase_time = sim_time() - t_start;
+    CHECK(erase_time >= 45 * SIM_PS_PER_MS);
+    CHECK(erase_time < 46 * SIM_PS_PER_MS);
+
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.status_polls <= (config.sector_erase_us / 100) + 2);
+    test_report("sim", "unknown_timing_erase_polls", stats.status_polls, "");
+    sim_flash_close(&chip);
+}
+
+static SimTime run_sequence(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+
+    fill_pattern(buffer, sizeof(buffer), 3);
+    CHECK(SPI_flash_write(&flash, 0x10000, buffer, sizeof(buffer)));
+    CHECK(SPI_flash_wait_ready(&flash));
+    CHECK(SPI_flash_read(&flash, 0x10000, readback, sizeof(readback)));
+    CHECK(SPI_flash_erase_block(&flash, 0x10000));
+    CHECK(SPI_flash_wait_ready(&flash));
+    sim_flash_close(&chip);
+    return sim_time();
+}
+
+static void test_deterministic(void)
+{
+    const SimTime t = run_sequence();
+    CHECK(run_sequence() == t);
+}
+
+static void test_power_down(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+    SPI_flash_set_power_down(&flash, 1000, 30);
+
+    delay_us(2000);
+    SPI_flash_poll(&flash);
+    CHECK(chip.powered_down);
+
+    // The chip ignores everything but a wake-up: the driver sends that first
+    fill_pattern(buffer, 16, 4);
+    CHECK(SPI_flash_program(&flash, 0x100, buffer, 16));
+    CHECK(SPI_flash_wait_ready(&flash));
+    CHECK(!chip.powered_down);
+    CHECK(!memcmp(chip.memory + 0x100, buffer, 16));
+
+    SimFlashStats stats;
+    sim_flash_get_stats(&chip, &stats);
+    CHECK(stats.commands[0xB9] == 1);
+    CHECK(stats.commands[0xAB] == 1);
+    CHECK(stats.ignored_commands == 0);
+    sim_flash_close(&chip);
+}
+
+static void test_image_file(void)
+{
+    char path[] = "/tmp/sim_flash_XXXXXX";
+    const int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+    unlink(path);
+
+    SimFlash chip;
+    SPIFlash flash;
+    sim_init(NULL);
+    GPIO_HAL_set(&test_cs_pin, HIGH);
+    CHECK(sim_flash_open(&chip, path, NULL));
+    CHECK(sim_flash_attach(&chip, LPC_SSP1, &test_cs_pin));
+    CHECK(SPI_flash_init(&flash, LPC_SSP1, &test_cs_pin,
+                256, 0x1000, chip.config.size));
+
+    fill_pattern(buffer, 256, 5);
+    CHECK(SPI_flash_program(&flash, 0x2000, buffer, 256));
+    CHECK(SPI_flash_wait_ready(&flash));
+    sim_flash_close(&chip);
+
+    // The image keeps its contents
+    CHECK(sim_flash_open(&chip, path, NULL));
+    CHECK(!memcmp(chip.memory + 0x2000, buffer, 256));
+    CHECK(chip.memory[0] == 0xFF);
+    sim_flash_close(&chip);
+    unlink(path);
+}
+
+int main(void)
+{
+    test_JEDEC_ID();
+    test_SFDP();
+    test_program_erase();
+    test_write();
+    test_writer();
+    test_update_range();
+    test_readv();
+    test_erase_range();
+    test_timing();
+    test_unknown_timing();
+    test_deterministic();
+    test_power_down();
+    test_image_file();
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "test_common.h"
+
+#include <string.h>
+
+/*
+ * Data striped over two flash chips: the chips hold alternating stripes,
+ * and a read reassembles them. With a chip on each SSP bus, both are read
+ * in parallel.
+ */
+
+#define DATA_SIZE       (8000)
+
+static const GPIO cs_pin_b_SSP0 = {0, 2};
+static const GPIO cs_pin_b_SSP1 = {0, 3};
+
+static uint8_t data[DATA_SIZE];
+static uint8_t result[DATA_SIZE + 1];
+
+void SSP0_IRQHandler(void)
+{
+    SPI_flash_IRQHandler(LPC_SSP0);
+}
+
+static void fill_pattern(uint8_t *dst, size_t size, uint32_t seed)
+{
+    for(size_t i=0;i<size;i++) {
+        seed = (seed * 1103515245) + 12345;
+        dst[i] = seed >> 16;
+    }
+}
+
+/**
+ * Connect chip a to SSP1 as usual, and chip b to SSP0 or to SSP1 as well
+ */
+static void two_chips_init(SPIFlash *flash_a, SimFlash *chip_a,
+        SPIFlash *flash_b, SimFlash *chip_b, bool shared_bus)
+{
+    test_flash_init(flash_a, chip_a, NULL);
+
+    LPC_SSP_T *SSP_b = shared_bus ? LPC_SSP1 : LPC_SSP0;
+    const GPIO *cs_b = shared_bus ? &cs_pin_b_SSP1 : &cs_pin_b_SSP0;
+    GPIO_HAL_set(cs_b, HIGH);
+    CHECK(sim_flash_open(chip_b, NULL, NULL));
+    CHECK(sim_flash_attach(chip_b, SSP_b, cs_b));
+    CHECK(SPI_flash_init(flash_b, SSP_b, cs_b,
+                SIM_FLASH_PAGE_SIZE, SIM_FLASH_SECTOR_SIZE,
+                chip_b->config.size));
+}
+
+/**
+ * Check that each byte of the data is where the striping puts it
+ */
+static void check_layout(SimFlash *chip_a, SimFlash *chip_b,
+        uint32_t address, size_t size, size_t stripe_size)
+{
+    for(uint32_t i=0;i<size;i++) {
+        const uint32_t striped = address + i;
+        const uint32_t stripe = striped / stripe_size;
+        const uint32_t device_address = ((stripe / 2) * stripe_size)
+            + (striped % stripe_size);
+        const SimFlash *chip = (stripe % 2) ? chip_b : chip_a;
+        CHECK(chip->memory[device_address] == data[i]);
+    }
+}
+
+static void check_read(SPIFlash *flash_a, SPIFlash *flash_b,
+        uint32_t address, uint32_t offset, size_t size, size_t stripe_size)
+{
+    memset(result, 0, sizeof(result));
+    CHECK(SPI_flash_read_striped(flash_a, flash_b, address + offset,
+                result, size, stripe_size));
+    CHECK(!memcmp(result, data + offset, size));
+
+    // Nothing is written past the end of the result
+    CHECK(result[size] == 0);
+}
+
+static void test_stripe_size(size_t stripe_size)
+{
+    SimFlash chip_a, chip_b;
+    SPIFlash flash_a, flash_b;
+    two_chips_init(&flash_a, &chip_a, &flash_b, &chip_b, false);
+
+    // Unaligned start and a size that is no multiple of the stripe size
+    const uint32_t address = 3 * stripe_size + 7;
+    fill_pattern(data, sizeof(data), stripe_size);
+    CHECK(SPI_flash_write_striped(&flash_a, &flash_b, address,
+                data, sizeof(data), stripe_size));
+    CHECK(SPI_flash_wait_ready(&flash_a));
+    CHECK(SPI_flash_wait_ready(&flash_b));
+    check_layout(&chip_a, &chip_b, address, sizeof(data), stripe_size);
+
+    check_read(&flash_a, &flash_b, address, 0, sizeof(data), stripe_size);
+    check_read(&flash_a, &flash_b, address, 1, 1, stripe_size);
+    check_read(&flash_a, &flash_b, address, stripe_size - 8, 2,
+            stripe_size);
+    check_read(&flash_a, &flash_b, address, 13, stripe_size, stripe_size);
+    check_read(&flash_a, &flash_b, address, 101, 3 * stripe_size + 5,
+            stripe_size);
+    check_read(&flash_a, &flash_b, address, 999, sizeof(data) - 999 - 3,
+            stripe_size);
+
+    // A chip that is still erasing is waited for
+    CHECK(SPI_flash_erase_block(&flash_b, 0x40000));
+    check_read(&flash_a, &flash_b, address, 0, sizeof(data), stripe_size);
+
+    SimFlashStats stats_a, stats_b;
+    sim_flash_get_stats(&chip_a, &stats_a);
+    sim_flash_get_stats(&chip_b, &stats_b);
+    CHECK(stats_a.ignored_commands == 0);
+    CHECK(stats_b.ignored_commands == 0);
+    sim_flash_close(&chip_a);
+    sim_flash_close(&chip_b);
+}
+
+/**
+ * @return  Time to read the data, in ps
+ */
+static SimTime read_time(bool shared_bus)
+{
+    const size_t stripe_size = 512;
+    SimFlash chip_a, chip_b;
+    SPIFlash flash_a, flash_b;
+    two_chips_init(&flash_a, &chip_a, &flash_b, &chip_b, shared_bus);
+
+    fill_pattern(data, sizeof(data), 1);
+    CHECK(SPI_flash_write_striped(&flash_a, &flash_b, 0,
+                data, sizeof(data), stripe_size));
+    CHECK(SPI_flash_wait_ready(&flash_a));
+    CHECK(SPI_flash_wait_ready(&flash_b));
+
+    const SimTime t_start = sim_time();
+    CHECK(SPI_flash_read_striped(&flash_a, &flash_b, 0,
+                result, sizeof(data), stripe_size));
+    const SimTime time = sim_time() - t_start;
+    CHECK(!memcmp(result, data, sizeof(data)));
+
+    test_report(shared_bus ? "striped_shared_bus" : "striped_two_buses",
+            "read_throughput",
+            (sizeof(data) * 1e6) / (time / 1e6) / 1024, "KB/s");
+    sim_flash_close(&chip_a);
+    sim_flash_close(&chip_b);
+    return time;
+}
+
+int main(void)
+{
+    test_stripe_size(256);
+    test_stripe_size(100);
+    test_stripe_size(1000);
+
+    // Two buses are read in parallel, but both are fed by the same
+    // interrupt-driven CPU: in the simulation, the CPU time per frame
+    // already limits a single bus (see test_sim read_4K_throughput)
+    const SimTime shared_time = read_time(true);
+    const SimTime parallel_time = read_time(false);
+    CHECK(parallel_time <= shared_time);
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include "test_common.h"
+
+#include <mcu_timing/delay.h>
+#include <string.h>
+
+/*
+ * Urgent reads during an erase: the erase is suspended for the read and
+ * still completes after the resume, also when the chip suspends late.
+ */
+
+#define ERASE_ADDRESS   (0x1000)
+#define READ_ADDRESS    (0x0)
+#define READ_SIZE       (256)
+
+static uint8_t data[READ_SIZE];
+static uint8_t result[READ_SIZE];
+
+static void fill_pattern(uint8_t *dst, size_t size, uint32_t seed)
+{
+    for(size_t i=0;i<size;i++) {
+        dst[i] = (i * 13) ^ seed;
+    }
+}
+
+/**
+ * Erase a programmed block, with 'reads' urgent reads of another block
+ * while it runs
+ *
+ * @return  The urgent read statistics
+ */
+static SPIFlashUrgentReadStats read_during_erase(SimFlash *chip,
+        SPIFlash *flash, size_t reads)
+{
+    fill_pattern(data, sizeof(data), 1);
+    CHECK(SPI_flash_program(flash, READ_ADDRESS, data, sizeof(data)));
+    CHECK(SPI_flash_wait_ready(flash));
+    CHECK(SPI_flash_program(flash, ERASE_ADDRESS, data, sizeof(data)));
+    CHECK(SPI_flash_wait_ready(flash));
+
+    CHECK(SPI_flash_erase_block(flash, ERASE_ADDRESS));
+    for(size_t i=0;i<reads;i++) {
+        CHECK(sim_flash_is_busy(chip));
+        memset(result, 0, sizeof(result));
+        CHECK(SPI_flash_read_urgent(flash, READ_ADDRESS,
+                    result, sizeof(result)));
+        CHECK(!memcmp(result, data, sizeof(data)));
+        delay_us(1000);
+    }
+
+    // The erase completes after the resume
+    CHECK(SPI_flash_wait_ready(flash));
+    CHECK(!sim_flash_is_busy(chip));
+    for(size_t i=0;i<SIM_FLASH_SECTOR_SIZE;i++) {
+        CHECK(chip->memory[ERASE_ADDRESS + i] == 0xFF);
+    }
+    CHECK(sim_flash_get_erase_count(chip, ERASE_ADDRESS) == 1);
+
+    SimFlashStats chip_stats;
+    sim_flash_get_stats(chip, &chip_stats);
+    CHECK(chip_stats.ignored_commands == 0);
+
+    SPIFlashUrgentReadStats stats;
+    SPI_flash_get_urgent_read_stats(flash, &stats);
+    CHECK(stats.read_count == reads);
+    return stats;
+}
+
+/**
+ * @param idle_latency_us   Time of the same read with no erase running
+ */
+static void test_suspend(uint32_t idle_latency_us)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+    SPIFlashInfo info;
+    SPI_flash_get_info(&flash, &info);
+    CHECK(info.suspend_latency_us);
+
+    const SPIFlashUrgentReadStats stats = read_during_erase(&chip, &flash, 5);
+    CHECK(stats.suspend_count == 5);
+    CHECK(stats.suspend_timeouts == 0);
+
+    // The suspend latency is added to the read, instead of the 45ms erase
+    CHECK(stats.max_latency_us
+            <= (idle_latency_us + info.suspend_latency_us + 10));
+    test_report("urgent_read", "max_latency", stats.max_latency_us, "us");
+    sim_flash_close(&chip);
+}
+
+static void test_late_suspend(void)
+{
+    // The chip takes longer to suspend than the part table says
+    SimFlashConfig config;
+    sim_flash_get_default_config(&config);
+    config.suspend_us = 200;
+
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, &config);
+    SPIFlashInfo info;
+    SPI_flash_get_info(&flash, &info);
+    CHECK(info.suspend_latency_us < config.suspend_us);
+
+    const SPIFlashUrgentReadStats stats = read_during_erase(&chip, &flash, 1);
+    CHECK(stats.suspend_count == 1);
+    CHECK(stats.suspend_timeouts == 1);
+    test_report("urgent_read_late_suspend", "max_latency",
+            stats.max_latency_us, "us");
+    sim_flash_close(&chip);
+}
+
+/**
+ * @return  Latency of an urgent read with nothing running
+ */
+static uint32_t test_idle(void)
+{
+    SimFlash chip;
+    SPIFlash flash;
+    test_flash_init(&flash, &chip, NULL);
+
+    fill_pattern(data, sizeof(data), 2);
+    CHECK(SPI_flash_program(&flash, READ_ADDRESS, data, sizeof(data)));
+    CHECK(SPI_flash_wait_ready(&flash));
+    CHECK(SPI_flash_read_urgent(&flash, READ_ADDRESS, result, sizeof(result)));
+    CHECK(!memcmp(result, data, sizeof(data)));
+
+    SPIFlashUrgentReadStats stats;
+    SPI_flash_get_urgent_read_stats(&flash, &stats);
+    CHECK(stats.read_count == 1);
+    CHECK(stats.suspend_count == 0);
+
+    SimFlashStats chip_stats;
+    sim_flash_get_stats(&chip, &chip_stats);
+    CHECK(chip_stats.commands[0x75] == 0);
+    test_report("urgent_read_idle", "latency", stats.last_latency_us, "us");
+    sim_flash_close(&chip);
+    return stats.last_latency_us;
+}
+
+int main(void)
+{
+    test_suspend(test_idle());
+    test_late_suspend();
+    return 0;
+}
@@ -0,0 +1,546 @@
+#include "FTL.h"
+
+#include <string.h>
+
+#define FTL_BLOCK_MAGIC         (0x4C425446)    // "FTBL"
+#define FTL_NONE                ((size_t)-1)
+#define FTL_ERASED_SEQ          (0xFFFFFFFF)
+#define FTL_COMMITTED           (0x0000)
+
+// User writes never take the last free block: it is kept for garbage collection
+#define FTL_GC_RESERVE_BLOCKS   (1)
+
+// FTL_poll() collects garbage while there are fewer free blocks than this
+#define FTL_GC_FREE_BLOCKS      (2)
+
+// Move cold data when a block is this many erases behind the most worn block
+#define FTL_WEAR_LEVEL_THRESHOLD    (16)
+
+// Garbage collection copies pages through a buffer of this size
+#define FTL_COPY_CHUNK          (64)
+
+/**
+ * Stored at the start of page 0 of each block. The rest of page 0 is unused.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t erase_count;
+} BlockHeader;
+
+/**
+ * Stored at the start of each data page.
+ *
+ * A page is written in three steps: seq + lpn, then the data, then the
+ * committed marker. A page with a seq but without the marker was
+ * interrupted by a power loss: it is not free, but its data is not valid.
+ */
+typedef struct {
+    uint32_t seq;
+    uint16_t lpn;
+    uint16_t committed;
+} PageHeader;
+
+_Static_assert(sizeof(PageHeader) == FTL_PAGE_HEADER_SIZE,
+        "FTL_PAGE_HEADER_SIZE should match the page header");
+
+
+static uint32_t page_address(const FTL *ftl, size_t ppn)
+{
+    return ftl->start_address + (ppn * ftl->page_size);
+}
+
+static uint32_t block_address(const FTL *ftl, size_t block)
+{
+    return ftl->start_address + (block * ftl->block_size);
+}
+
+static bool flash_read(FTL *ftl, uint32_t address, void *dst, size_t size)
+{
+    return SPI_flash_read_when_ready(ftl->flash, address, dst, size);
+}
+
+static bool flash_program(FTL *ftl, uint32_t address,
+        const void *src, size_t size)
+{
+    return SPI_flash_wait_ready(ftl->flash)
+        && SPI_flash_program(ftl->flash, address, src, size);
+}
+
+static bool read_page_header(FTL *ftl, size_t ppn, PageHeader *header)
+{
+    return flash_read(ftl, page_address(ftl, ppn), header, sizeof(*header));
+}
+
+/**
+ * Start erasing a block, without waiting for the erase to finish
+ */
+static bool block_format_start(FTL *ftl, size_t block)
+{
+    FTLBlock *b = &ftl->blocks[block];
+
+    if(!SPI_flash_wait_ready(ftl->flash)
+            || !SPI_flash_erase_range(ftl->flash, block_address(ftl, block),
+                ftl->block_size, NULL)) {
+        return false;
+    }
+    b->state = FTL_BLOCK_ERASING;
+    b->erase_count++;
+    ftl->stats.erases++;
+    return true;
+}
+
+/**
+ * Write the header with the new erase count, once the erase is done
+ */
+static bool block_format_finish(FTL *ftl, size_t block)
+{
+    FTLBlock *b = &ftl->blocks[block];
+
+    const BlockHeader header = {
+        .magic = FTL_BLOCK_MAGIC,
+        .erase_count = b->erase_count,
+    };
+    if(!flash_program(ftl, block_address(ftl, block),
+                &header, sizeof(header))) {
+        return false;
+    }
+    b->valid_count = 0;
+    b->state = FTL_BLOCK_FREE;
+    ftl->free_count++;
+    return true;
+}
+
+/**
+ * Erase a block and write its header with the new erase count
+ */
+static bool block_format(FTL *ftl, size_t block)
+{
+    return block_format_start(ftl, block) && block_format_finish(ftl, block);
+}
+
+/**
+ * Scan a formatted block: map its valid pages and return the amount of
+ * data pages in use.
+ */
+static bool block_scan(FTL *ftl, size_t block, size_t *used)
+{
+    *used = 0;
+    for(size_t page=1;page<ftl->pages_per_block;page++) {
+        const size_t ppn = (block * ftl->pages_per_block) + page;
+
+        PageHeader header;
+        if(!read_page_header(ftl, ppn, &header)) {
+            return false;
+        }
+        // Pages are written in order: the rest of the block is free
+        if(header.seq == FTL_ERASED_SEQ) {
+            break;
+        }
+        *used = page;
+
+        if((ftl->seq == FTL_ERASED_SEQ) || (header.seq > ftl->seq)) {
+            ftl->seq = header.seq;
+        }
+        if((header.committed != FTL_COMMITTED)
+                || (header.lpn >= ftl->lpn_count)) {
+            continue;
+        }
+
+        // Keep the newest copy of each logical page
+        const uint16_t mapped = ftl->map[header.lpn];
+        if(mapped != FTL_UNMAPPED) {
+            PageHeader mapped_header;
+            if(!read_page_header(ftl, mapped, &mapped_header)) {
+                return false;
+            }
+            if(mapped_header.seq > header.seq) {
+                continue;
+            }
+        }
+        ftl->map[header.lpn] = ppn;
+    }
+    return true;
+}
+
+/**
+ * Select the free block with the lowest erase count
+ */
+static size_t select_free_block(FTL *ftl)
+{
+    size_t result = FTL_NONE;
+    for(size_t i=0;i<ftl->block_count;i++) {
+        const FTLBlock *b = &ftl->blocks[i];
+        if(b->state != FTL_BLOCK_FREE) {
+            continue;
+        }
+        if((result == FTL_NONE)
+                || (b->erase_count < ftl->blocks[result].erase_count)) {
+            result = i;
+        }
+    }
+    return result;
+}
+
+/**
+ * Select a block to garbage collect, or FTL_NONE if no block is worth it
+ */
+static size_t select_victim(FTL *ftl)
+{
+    const size_t data_pages = ftl->pages_per_block - 1;
+
+    uint32_t max_erase_count = 0;
+    size_t coldest = FTL_NONE;
+    size_t emptiest = FTL_NONE;
+    for(size_t i=0;i<ftl->block_count;i++) {
+        const FTLBlock *b = &ftl->blocks[i];
+        if(b->erase_count > max_erase_count) {
+            max_erase_count = b->erase_count;
+        }
+        if(b->state != FTL_BLOCK_FULL) {
+            continue;
+        }
+        if((coldest == FTL_NONE)
+                || (b->erase_count < ftl->blocks[coldest].erase_count)) {
+            coldest = i;
+        }
+        if((emptiest == FTL_NONE)
+                || (b->valid_count < ftl->blocks[emptiest].valid_count)
+                || ((b->valid_count == ftl->blocks[emptiest].valid_count)
+                    && (b->erase_count < ftl->blocks[emptiest].erase_count))) {
+            emptiest = i;
+        }
+    }
+    if(coldest == FTL_NONE) {
+        return FTL_NONE;
+    }
+
+    // Static wear leveling: a block holding cold data is hardly ever
+    // erased, so move its data to let the block take part again
+    if((max_erase_count - ftl->blocks[coldest].erase_count)
+            > FTL_WEAR_LEVEL_THRESHOLD) {
+        return coldest;
+    }
+
+    // Collecting a block without garbage does not free any space
+    if(ftl->blocks[emptiest].valid_count >= data_pages) {
+        return FTL_NONE;
+    }
+    return emptiest;
+}
+
+/**
+ * Get the next free physical page, or FTL_UNMAPPED if none is available
+ */
+static size_t alloc_page(FTL *ftl, bool for_gc)
+{
+    // Once garbage collection took the reserve block, its pages are needed
+    // to finish the victim: user writes wait until that block is erased
+    if(!for_gc && (ftl->gc_block != FTL_NONE)
+            && (ftl->free_count < FTL_GC_RESERVE_BLOCKS)) {
+        return FTL_UNMAPPED;
+    }
+    if((ftl->active_block != FTL_NONE)
+            && (ftl->active_page >= ftl->pages_per_block)) {
+        ftl->blocks[ftl->active_block].state = FTL_BLOCK_FULL;
+        ftl->active_block = FTL_NONE;
+    }
+    if(ftl->active_block == FTL_NONE) {
+        if(!for_gc && (ftl->free_count <= FTL_GC_RESERVE_BLOCKS)) {
+            return FTL_UNMAPPED;
+        }
+        const size_t block = select_free_block(ftl);
+        if(block == FTL_NONE) {
+            return FTL_UNMAPPED;
+        }
+        ftl->blocks[block].state = FTL_BLOCK_ACTIVE;
+        ftl->free_count--;
+        ftl->active_block = block;
+        ftl->active_page = 1;
+    }
+    return (ftl->active_block * ftl->pages_per_block) + ftl->active_page++;
+}
+
+/**
+ * Write a page, with the data either from RAM or copied from another page
+ */
+static bool program_page(FTL *ftl, size_t ppn, uint16_t lpn,
+        const uint8_t *data, size_t src_ppn)
+{
+    const uint32_t address = page_address(ftl, ppn);
+    const size_t data_size = FTL_get_page_size(ftl);
+
+    PageHeader header = {
+        .seq = ++ftl->seq,
+        .lpn = lpn,
+        .committed = 0xFFFF,
+    };
+    if(!flash_program(ftl, address, &header, sizeof(header))) {
+        return false;
+    }
+
+    if(data) {
+        if(!flash_program(ftl, address + FTL_PAGE_HEADER_SIZE,
+                    data, data_size)) {
+            return false;
+        }
+    } else {
+        const uint32_t src_address = page_address(ftl, src_ppn);
+        uint8_t chunk[FTL_COPY_CHUNK];
+        for(size_t offset=0;offset<data_size;offset+=sizeof(chunk)) {
+            size_t len = data_size - offset;
+            if(len > sizeof(chunk)) {
+                len = sizeof(chunk);
+            }
+            const size_t data_offset = FTL_PAGE_HEADER_SIZE + offset;
+            if(!flash_read(ftl, src_address + data_offset, chunk, len)
+                    || !flash_program(ftl, address + data_offset, chunk, len)) {
+                return false;
+            }
+        }
+    }
+
+    header.committed = FTL_COMMITTED;
+    return flash_program(ftl, address + offsetof(PageHeader, committed),
+            &header.committed, sizeof(header.committed));
+}
+
+static void map_update(FTL *ftl, uint16_t lpn, size_t ppn)
+{
+    const uint16_t old = ftl->map[lpn];
+    if(old != FTL_UNMAPPED) {
+        ftl->blocks[old / ftl->pages_per_block].valid_count--;
+    }
+    ftl->map[lpn] = ppn;
+    ftl->blocks[ppn / ftl->pages_per_block].valid_count++;
+}
+
+/**
+ * Do a single step of garbage collection: copy one valid page out of the
+ * victim block, start erasing it once no valid pages are left, or finish
+ * the block that a previous step started to erase.
+ *
+ * @return  False if no progress could be made
+ */
+static bool gc_step(FTL *ftl)
+{
+    if(ftl->erase_block != FTL_NONE) {
+        if(!block_format_finish(ftl, ftl->erase_block)) {
+            return false;
+        }
+        ftl->erase_block = FTL_NONE;
+        return true;
+    }
+
+    if(ftl->gc_block == FTL_NONE) {
+        ftl->gc_block = select_victim(ftl);
+        if(ftl->gc_block == FTL_NONE) {
+            return false;
+        }
+        ftl->gc_page = 1;
+    }
+    const size_t block = ftl->gc_block;
+
+    while(ftl->blocks[block].valid_count
+            && (ftl->gc_page < ftl->pages_per_block)) {
+        const size_t ppn = (block * ftl->pages_per_block) + ftl->gc_page++;
+
+        PageHeader header;
+        if(!read_page_header(ftl, ppn, &header)) {
+            return false;
+        }
+        if((header.committed != FTL_COMMITTED)
+                || (header.lpn >= ftl->lpn_count)
+                || (ftl->map[header.lpn] != ppn)) {
+            continue;
+        }
+
+        const size_t new_ppn = alloc_page(ftl, true);
+        if((new_ppn == FTL_UNMAPPED)
+                || !program_page(ftl, new_ppn, header.lpn, NULL, ppn)) {
+            return false;
+        }
+        map_update(ftl, header.lpn, new_ppn);
+        ftl->stats.gc_writes++;
+        return true;
+    }
+
+    ftl->gc_block = FTL_NONE;
+    if(!block_format_start(ftl, block)) {
+        return false;
+    }
+    ftl->erase_block = block;
+    return true;
+}
+
+bool FTL_init(FTL *ftl, SPIFlash *flash,
+        uint32_t start_address, size_t block_count,
+        uint16_t *map, size_t lpn_count, FTLBlock *blocks)
+{
+    SPIFlashInfo info;
+    SPI_flash_get_info(flash, &info);
+
+    ftl->flash = flash;
+    ftl->start_address = start_address;
+    ftl->page_size = info.page_size;
+    ftl->block_size = info.erase_block_size;
+    ftl->block_count = block_count;
+    ftl->pages_per_block = info.erase_block_size / info.page_size;
+    ftl->map = map;
+    ftl->lpn_count = lpn_count;
+    ftl->blocks = blocks;
+    ftl->free_count = 0;
+    ftl->seq = FTL_ERASED_SEQ;
+    ftl->active_block = FTL_NONE;
+    ftl->active_page = 0;
+    ftl->gc_block = FTL_NONE;
+    ftl->gc_page = 0;
+    ftl->erase_block = FTL_NONE;
+    memset(&ftl->stats, 0, sizeof(ftl->stats));
+
+    if((start_address % ftl->block_size)
+            || ((start_address + (block_count * ftl->block_size))
+                > info.total_size)) {
+        return false;
+    }
+    if((block_count * ftl->pages_per_block) >= FTL_UNMAPPED) {
+        return false;
+    }
+    if((block_count < 3) || (lpn_count
+                > ((block_count - 2) * (ftl->pages_per_block - 1)))) {
+        return false;
+    }
+
+    for(size_t i=0;i<lpn_count;i++) {
+        map[i] = FTL_UNMAPPED;
+    }
+
+    bool needs_format = false;
+    for(size_t i=0;i<block_count;i++) {
+        FTLBlock *b = &blocks[i];
+        b->valid_count = 0;
+
+        BlockHeader header;
+        if(!flash_read(ftl, block_address(ftl, i), &header, sizeof(header))) {
+            return false;
+        }
+        if(header.magic != FTL_BLOCK_MAGIC) {
+            b->erase_count = 0;
+            b->state = FTL_BLOCK_FULL;
+            needs_format = true;
+            continue;
+        }
+        b->erase_count = header.erase_count;
+
+        // A partially written block is not written any further:
+        // garbage collection reclaims its free pages later
+        size_t used;
+        if(!block_scan(ftl, i, &used)) {
+            return false;
+        }
+        if(used) {
+            b->state = FTL_BLOCK_FULL;
+        } else {
+            b->state = FTL_BLOCK_FREE;
+            ftl->free_count++;
+        }
+    }
+    if(ftl->seq == FTL_ERASED_SEQ) {
+        ftl->seq = 0;
+    }
+
+    for(size_t i=0;i<lpn_count;i++) {
+        if(map[i] != FTL_UNMAPPED) {
+            blocks[map[i] / ftl->pages_per_block].valid_count++;
+        }
+    }
+
+    if(needs_format) {
+        for(size_t i=0;i<block_count;i++) {
+            if(blocks[i].valid_count || (blocks[i].state != FTL_BLOCK_FULL)) {
+                continue;
+            }
+            BlockHeader header;
+            if(!flash_read(ftl, block_address(ftl, i),
+                        &header, sizeof(header))) {
+                return false;
+            }
+            if((header.magic != FTL_BLOCK_MAGIC) && !block_format(ftl, i)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+size_t FTL_get_page_size(const FTL *ftl)
+{
+    return ftl->page_size - FTL_PAGE_HEADER_SIZE;
+}
+
+bool FTL_read(FTL *ftl, uint32_t lpn, void *data)
+{
+    if(lpn >= ftl->lpn_count) {
+        return false;
+    }
+    const uint16_t ppn = ftl->map[lpn];
+    if(ppn == FTL_UNMAPPED) {
+        memset(data, 0xFF, FTL_get_page_size(ftl));
+        return true;
+    }
+    return flash_read(ftl, page_address(ftl, ppn) + FTL_PAGE_HEADER_SIZE,
+            data, FTL_get_page_size(ftl));
+}
+
+bool FTL_write(FTL *ftl, uint32_t lpn, const void *data)
+{
+    if(lpn >= ftl->lpn_count) {
+        return false;
+    }
+
+    size_t ppn = alloc_page(ftl, false);
+    while(ppn == FTL_UNMAPPED) {
+        if(!gc_step(ftl)) {
+            return false;
+        }
+        ppn = alloc_page(ftl, false);
+    }
+
+    if(!program_page(ftl, ppn, lpn, data, 0)) {
+        return false;
+    }
+    map_update(ftl, lpn, ppn);
+    ftl->stats.host_writes++;
+    return true;
+}
+
+void FTL_poll(FTL *ftl)
+{
+    if((ftl->gc_block == FTL_NONE) && (ftl->erase_block == FTL_NONE)
+            && (ftl->free_count >= FTL_GC_FREE_BLOCKS)) {
+        return;
+    }
+
+    // Never wait here: not for a transfer, nor for an erase to finish
+    if(SPI_flash_is_busy(ftl->flash)) {
+        return;
+    }
+    gc_step(ftl);
+}
+
+void FTL_get_stats(FTL *ftl, FTLStats *stats)
+{
+    *stats = ftl->stats;
+
+    stats->erase_count_min = UINT32_MAX;
+    stats->erase_count_max = 0;
+    for(size_t i=0;i<ftl->block_count;i++) {
+        const uint32_t count = ftl->blocks[i].erase_count;
+        if(count < stats->erase_count_min) {
+            stats->erase_count_min = count;
+        }
+        if(count > stats->erase_count_max) {
+            stats->erase_count_max = count;
+        }
+    }
+}
+
@@ -0,0 +1,136 @@
+#ifndef FTL_H
+#define FTL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "SPI_flash.h"
+
+// Size of the header in front of the data in each physical page
+#define FTL_PAGE_HEADER_SIZE    (8)
+
+// Value of unmapped entries in the logical to physical page map
+#define FTL_UNMAPPED            (0xFFFF)
+
+typedef enum {
+    FTL_BLOCK_FREE,     // erased, ready to be written
+    FTL_BLOCK_ACTIVE,   // currently being written
+    FTL_BLOCK_FULL,     // written, candidate for garbage collection
+    FTL_BLOCK_ERASING,  // erased by garbage collection, header not written
+} FTLBlockState;
+
+/**
+ * RAM state per erase block
+ */
+typedef struct {
+    uint32_t erase_count;
+    uint16_t valid_count;   // pages that are still mapped
+    uint8_t state;          // FTLBlockState
+} FTLBlock;
+
+typedef struct {
+    uint32_t host_writes;       // pages written via FTL_write()
+    uint32_t gc_writes;         // pages copied by garbage collection
+    uint32_t erases;
+    uint32_t erase_count_min;
+    uint32_t erase_count_max;
+} FTLStats;
+
+/**
+ * Flash translation layer instance, see FTL_init(). All fields are private.
+ */
+typedef struct {
+    SPIFlash *flash;
+    uint32_t start_address;
+    size_t page_size;
+    size_t block_size;
+    size_t block_count;
+    size_t pages_per_block;
+
+    uint16_t *map;
+    size_t lpn_count;
+    FTLBlock *blocks;
+    size_t free_count;
+
+    uint32_t seq;
+    size_t active_block;
+    size_t active_page;
+
+    // Block currently being garbage collected
+    size_t gc_block;
+    size_t gc_page;
+
+    // Block that garbage collection started to erase
+    size_t erase_block;
+
+    FTLStats stats;
+} FTL;
+
+
+/**
+ * Mount a flash translation layer on a region of SPI flash.
+ *
+ * Logical pages are written out of place: each write goes to the next free
+ * physical page, and the old copy becomes garbage. Garbage collection
+ * copies the remaining valid pages out of a block and erases it, preferring
+ * blocks with the fewest valid pages, but moving cold data out of blocks
+ * that fall behind in erase count.
+ *
+ * All state is rebuilt from the flash by scanning the page headers. Blocks
+ * that were never formatted are erased on the first mount.
+ *
+ * RAM use is sizeof(FTL) + 2 bytes per logical page + sizeof(FTLBlock) per
+ * erase block: e.g. 384 logical pages on 16 blocks fit in about 1K.
+ *
+ * @param start_address Start of the region, aligned to an erase block
+ * @param block_count   Size of the region in erase blocks
+ * @param map           Memory for the page map: lpn_count entries
+ * @param lpn_count     Number of logical pages. At least two blocks worth of
+ *                      pages are needed as spare for garbage collection.
+ * @param blocks        Memory for the block state: block_count entries
+ */
+bool FTL_init(FTL *ftl, SPIFlash *flash,
+        uint32_t start_address, size_t block_count,
+        uint16_t *map, size_t lpn_count, FTLBlock *blocks);
+
+/**
+ * Size of a logical page in bytes: the flash page size minus the header
+ */
+size_t FTL_get_page_size(const FTL *ftl);
+
+/**
+ * Read a logical page. Pages that were never written read as 0xFF.
+ *
+ * @param data  Buffer of FTL_get_page_size() bytes
+ */
+bool FTL_read(FTL *ftl, uint32_t lpn, void *data);
+
+/**
+ * Write a logical page.
+ *
+ * If no free page is left, garbage collection runs first: this may take
+ * several block erase times. Call FTL_poll() regularly to avoid this.
+ *
+ * @param data  FTL_get_page_size() bytes of data
+ */
+bool FTL_write(FTL *ftl, uint32_t lpn, const void *data);
+
+/**
+ * Background garbage collection: call this regularly, e.g. from the main loop.
+ *
+ * Each call copies at most a single page, or starts the erase of a block
+ * and returns. The header of the erased block is written by a later call,
+ * once the erase is done: this never waits for an erase.
+ */
+void FTL_poll(FTL *ftl);
+
+/**
+ * Get the write and erase statistics.
+ *
+ * Write amplification is (host_writes + gc_writes) / host_writes.
+ */
+void FTL_get_stats(FTL *ftl, FTLStats *stats);
+
+#endif
+
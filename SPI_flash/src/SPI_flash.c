@@ -1,5 +1,6 @@
 #include "SPI_flash.h"
 #include <lpc_tools/GPIO_HAL.h>
+#include <mcu_timing/delay.h>
 
 #include <string.h>
 
@@ -9,15 +10,21 @@
 // Frequency: what is the maximum possible freq? AT25S can go > 50Mhz!
 #define SPI_FLASH_BITRATE   (24000000)
 
-typedef struct {
-    LPC_SSP_T *SSP;
-    const GPIO *cs_pin;
+// The SSP has an 8-frame deep FIFO in both directions
+#define SSP_FIFO_DEPTH      (8)
+
+// Clocked out while receiving data
+#define SPI_DUMMY_BYTE      (0xFF)
 
-    size_t page_size;
-    size_t pages_per_block;
+// Called in loops that wait for the SSP interrupt handler to make progress.
+// The host build (see host/) delivers its simulated interrupts here.
+#ifndef SPI_FLASH_WAIT_HOOK
+#define SPI_FLASH_WAIT_HOOK()
+#endif
 
-    size_t block_count;
-} SPIFlash;
+// SPI_flash_update_range() compares flash and new data through a buffer
+// of this size
+#define SPI_FLASH_COMPARE_CHUNK (32)
 
 enum SPI_flash_command {
     SPI_FLASH_CMD_WRITE_ENABLE          = 0x06,
@@ -31,19 +38,77 @@ enum SPI_flash_command {
     SPI_FLASH_CMD_READ_DATA_FAST_DUAL   = 0x3B,
 
     SPI_FLASH_CMD_PROGRAM_PAGE          = 0x02,
-    
+
     SPI_FLASH_CMD_ERASE_SECTOR          = 0x20,
     SPI_FLASH_CMD_ERASE_BLOCK           = 0xD8,
     SPI_FLASH_CMD_ERASE_CHIP            = 0xC7,
     SPI_FLASH_CMD_ERASE_CHIP_ALT        = 0x60,
-    
+
     SPI_FLASH_CMD_POWER_DOWN            = 0xB9,
     SPI_FLASH_CMD_POWER_UP              = 0xAB,
 
     SPI_FLASH_CMD_READ_JEDEC_ID         = 0x9F,
+    SPI_FLASH_CMD_READ_SFDP             = 0x5A,
+
+    SPI_FLASH_CMD_SUSPEND               = 0x75,
+    SPI_FLASH_CMD_RESUME                = 0x7A,
+};
+
+// Default tRES1: time to wake up from deep power-down. Typically a few us,
+// but some parts need up to 30us.
+#define SPI_FLASH_DEFAULT_WAKE_TIME_US  (30)
+
+// After the typical time of an operation, the status is polled this many
+// times per typical time, but not more often than every MIN_POLL_US
+#define SPI_FLASH_POLLS_PER_TYP_TIME    (8)
+#define SPI_FLASH_MIN_POLL_US           (10)
+
+// Poll interval for an operation of which the timing is not known: short
+// compared to a page program, but without occupying the bus all the time
+#define SPI_FLASH_UNKNOWN_POLL_US       (100)
+
+/**
+ * Known parts, for features that are not (reliably) described by SFDP.
+ * Matched on the JEDEC manufacturer ID.
+ *
+ * The timing is typical for the common families (W25Q, GD25Q, MX25L) and
+ * only used if SFDP does not provide it.
+ */
+typedef struct {
+    uint8_t manufacturer;
+
+    uint8_t suspend_opcode;
+    uint8_t resume_opcode;
+    uint32_t suspend_latency_us;    // tSUS
+    uint32_t resume_interval_us;    // minimum time between resume and suspend
+
+    uint32_t page_program_us;       // tPP
+    uint32_t sector_erase_ms;       // tSE: 4K
+    uint32_t block_erase_ms;        // tBE: 64K
+    uint8_t program_max_factor;     // maximum time = typical time * factor
+    uint8_t erase_max_factor;
+} SPIFlashPart;
+
+static const SPIFlashPart part_table[] = {
+    // Winbond
+    {0xEF, SPI_FLASH_CMD_SUSPEND, SPI_FLASH_CMD_RESUME, 20, 20,
+        400, 45, 150, 8, 14},
+    // GigaDevice
+    {0xC8, SPI_FLASH_CMD_SUSPEND, SPI_FLASH_CMD_RESUME, 30, 100,
+        600, 50, 250, 4, 8},
+    // Macronix
+    {0xC2, 0xB0, 0x30, 20, 100,
+        500, 25, 250, 6, 8},
 };
 
-SPIFlash flash;
+// JEDEC JESD216 Serial Flash Discoverable Parameters
+#define SFDP_SIGNATURE              (0x50444653) // "SFDP", little endian
+#define SFDP_HEADER_SIZE            (8)
+#define SFDP_BFPT_ID                (0x00)
+#define SFDP_BFPT_MAX_DWORDS        (16)
+
+// The instance that currently uses each SSP bus, see SPI_flash_IRQHandler()
+static SPIFlash *bus_owner[2];
 
 enum statusBits {
     WIP     = (1 << 0),
@@ -58,236 +123,2367 @@ enum statusBits {
 
 
 
-static void SPI_transfer_begin(void)
+/**
+ * All SSP register access of this driver goes through either the Chip_SSP_*
+ * API or this function, so the hardware layer is easy to substitute:
+ * the host build (see host/) links it against a simulated SSP.
+ */
+static void SSP_set_int_mask(LPC_SSP_T *LPC_SSP, uint32_t mask)
+{
+    LPC_SSP->IMSC = mask;
+}
+
+static void SPI_transfer_begin(SPIFlash *ctx)
 {
-	Chip_SSP_Int_FlushData(flash.SSP);
-    GPIO_HAL_set(flash.cs_pin, LOW);
+	Chip_SSP_Int_FlushData(ctx->SSP);
+    GPIO_HAL_set(ctx->cs_pin, LOW);
 }
-static void SPI_transfer_end(void)
+static void SPI_transfer_end(SPIFlash *ctx)
 {
-    GPIO_HAL_set(flash.cs_pin, HIGH);
+    GPIO_HAL_set(ctx->cs_pin, HIGH);
 }
-static size_t SPI_read_blocking(uint8_t* buffer, size_t sizeof_buffer)
+
+static void SPI_int_enable(SPIFlash *ctx)
 {
-	return Chip_SSP_ReadFrames_Blocking(flash.SSP, buffer, sizeof_buffer);
+    // RX half full or RX timeout: both mean there is data to drain
+    SSP_set_int_mask(ctx->SSP, (SSP_RXIM | SSP_RTIM));
 }
-static size_t SPI_write_blocking(const uint8_t* buffer, size_t sizeof_buffer)
+static void SPI_int_disable(SPIFlash *ctx)
 {
-    return Chip_SSP_WriteFrames_Blocking(flash.SSP,
-            (uint8_t*)buffer, sizeof_buffer);
+    SSP_set_int_mask(ctx->SSP, 0);
+    Chip_SSP_ClearIntPending(ctx->SSP, SSP_INT_CLEAR_BITMASK);
 }
 
-static bool get_status(uint8_t *result_status)
+static const SPITransfer write_enable_transfer = {
+    .header = {SPI_FLASH_CMD_WRITE_ENABLE},
+    .header_len = 1,
+};
+
+static const SPITransfer *job_current_transfer(SPIFlash *ctx)
 {
-    const uint8_t cmd = SPI_FLASH_CMD_READ_STATUS;
-    SPI_transfer_begin();
-    bool ok = true;
-    ok&= (SPI_write_blocking(&cmd, 1) == 1);
-    ok&= (SPI_read_blocking(result_status, 1) == 1);
-    SPI_transfer_end();
-    return ok;
+    if(ctx->job.in_write_enable) {
+        return &write_enable_transfer;
+    }
+    return &ctx->job.transfer;
 }
 
-static bool is_busy(void)
+static void job_start_transfer(SPIFlash *ctx)
 {
-    uint8_t status;
-    if(!get_status(&status) || (status & WIP)) {
+    ctx->job.tx_count = 0;
+    ctx->job.rx_count = 0;
+    SPI_transfer_begin(ctx);
+}
+
+/**
+ * Move frames between the SSP FIFOs and the current transfer.
+ *
+ * The header and data phase are treated as one continuous stream of frames,
+ * so the TX FIFO is kept topped up across the command, address and data bytes
+ * while RX is drained in the same loop. This keeps the bus busy without gaps.
+ *
+ * Returns true when all transfers of the job are done.
+ */
+static bool job_pump(SPIFlash *ctx)
+{
+    SPIJob *job = &ctx->job;
+
+    while(true) {
+        const SPITransfer *xfer = job_current_transfer(ctx);
+        const size_t header_len = xfer->header_len;
+        const size_t len = header_len + xfer->data_len;
+
+        size_t rx_count = job->rx_count;
+        size_t tx_count = job->tx_count;
+        do {
+            while((rx_count < len)
+                    && Chip_SSP_GetStatus(ctx->SSP, SSP_STAT_RNE)) {
+                const uint8_t data = Chip_SSP_ReceiveFrame(ctx->SSP);
+                if(xfer->rx && (rx_count >= header_len)) {
+                    xfer->rx[rx_count - header_len] = data;
+                }
+                rx_count++;
+            }
+
+            // Never have more frames in flight than the RX FIFO can hold
+            while((tx_count < len)
+                    && ((tx_count - rx_count) < SSP_FIFO_DEPTH)
+                    && Chip_SSP_GetStatus(ctx->SSP, SSP_STAT_TNF)) {
+                uint8_t data = SPI_DUMMY_BYTE;
+                if(tx_count < header_len) {
+                    data = xfer->header[tx_count];
+                } else if(xfer->tx) {
+                    data = xfer->tx[tx_count - header_len];
+                }
+                Chip_SSP_SendFrame(ctx->SSP, data);
+                tx_count++;
+            }
+
+            // Keep going while the last frames are close: returning from
+            // the interrupt and waiting for the RX timeout costs more.
+        } while((rx_count < len) && ((len - rx_count) <= SSP_FIFO_DEPTH)
+                && (tx_count == len));
+
+        job->rx_count = rx_count;
+        job->tx_count = tx_count;
+        if(rx_count < len) {
+            return false;
+        }
+        if(!xfer->keep_selected) {
+            SPI_transfer_end(ctx);
+        }
+
+        if(job->in_write_enable) {
+            job->in_write_enable = false;
+            job_start_transfer(ctx);
+            continue;
+        }
         return true;
     }
-    return false;
 }
 
-static bool send_write_enable(void)
+static size_t SSP_get_index(LPC_SSP_T *LPC_SSP)
 {
-    SPI_transfer_begin();
-    bool ok = true;
-    const uint8_t cmd[] = {
-        SPI_FLASH_CMD_WRITE_ENABLE,
-    };
-    const size_t cmd_size = sizeof(cmd);
+    if(LPC_SSP == LPC_SSP0) {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Claim the SSP bus for a job of this instance.
+ *
+ * Fails if the bus is in use, possibly by another instance sharing the bus.
+ */
+static bool bus_acquire(SPIFlash *ctx)
+{
+    SPIFlash **owner = &bus_owner[SSP_get_index(ctx->SSP)];
 
-    ok&= (SPI_write_blocking(cmd, cmd_size) == cmd_size);
-    SPI_transfer_end();
+    const uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    const bool ok = (*owner == NULL);
+    if(ok) {
+        *owner = ctx;
+    }
+    if(!primask) {
+        __enable_irq();
+    }
     return ok;
 }
 
+static void bus_release(SPIFlash *ctx)
+{
+    bus_owner[SSP_get_index(ctx->SSP)] = NULL;
+}
+
+static void job_finish(SPIFlash *ctx)
+{
+    SPI_int_disable(ctx);
 
+    SPIFlashCallback cb = ctx->job.cb;
+    void *cb_ctx = ctx->job.cb_ctx;
+    bus_release(ctx);
+    ctx->job.busy = false;
 
-bool SPI_flash_init(LPC_SSP_T *LPC_SSP, const GPIO *cs_pin,
-        size_t page_size, size_t erase_block_size, size_t total_size)
+    if(cb) {
+        cb(cb_ctx, true);
+    }
+}
+
+/**
+ * Check if the SSP bus is in use by a job of this or another instance
+ */
+static bool job_is_busy(SPIFlash *ctx)
 {
-    if(!page_size) {
+    return (bus_owner[SSP_get_index(ctx->SSP)] != NULL);
+}
+
+static bool job_setup(SPIFlash *ctx, bool write_enable,
+        SPIFlashCallback cb, void *cb_ctx)
+{
+    SPIJob *job = &ctx->job;
+    if(!bus_acquire(ctx)) {
         return false;
     }
-    if(page_size > erase_block_size) {
+
+    job->in_write_enable = write_enable;
+    job->cb = cb;
+    job->cb_ctx = cb_ctx;
+    job->busy = true;
+
+    job_start_transfer(ctx);
+    return true;
+}
+
+/**
+ * Start ctx->job.transfer, optionally preceded by a WRITE_ENABLE command.
+ *
+ * The job is driven by SPI_flash_IRQHandler(). When it is done, cb is called
+ * (from the interrupt handler).
+ */
+static bool job_start(SPIFlash *ctx, bool write_enable,
+        SPIFlashCallback cb, void *cb_ctx)
+{
+    if(!job_setup(ctx, write_enable, cb, cb_ctx)) {
         return false;
     }
-    if(erase_block_size > total_size) {
+
+    // Fill the TX FIFO before enabling the interrupt:
+    // from then on, the job is owned by the interrupt handler.
+    if(job_pump(ctx)) {
+        job_finish(ctx);
+        return true;
+    }
+    SPI_int_enable(ctx);
+    return true;
+}
+
+/**
+ * Wait for the current job to finish.
+ *
+ * NOTE: this relies on the SSP interrupt, so do not call this from an
+ * interrupt with an equal or higher priority.
+ */
+static void job_wait(SPIFlash *ctx)
+{
+    while(ctx->job.busy) {
+        SPI_FLASH_WAIT_HOOK();
+    }
+}
+
+/**
+ * Run a transfer by polling the SSP instead of using the interrupt.
+ *
+ * This uses the same transfer core as the interrupt, but for short commands
+ * (status, write enable, ...) the interrupt overhead would dominate.
+ */
+static bool job_run_blocking(SPIFlash *ctx, const SPITransfer *xfer,
+        bool write_enable)
+{
+    if(job_is_busy(ctx)) {
+        return false;
+    }
+    ctx->job.transfer = *xfer;
+    if(!job_setup(ctx, write_enable, NULL, NULL)) {
         return false;
     }
 
-    flash.SSP = LPC_SSP;
-    flash.cs_pin = cs_pin;
-    flash.page_size = page_size;
-    flash.pages_per_block = erase_block_size/page_size;
-    flash.block_count = total_size/erase_block_size;
+    while(!job_pump(ctx)) {
+    }
+    bus_release(ctx);
+    ctx->job.busy = false;
+    return true;
+}
+
+static bool get_status(SPIFlash *ctx, uint8_t *result_status)
+{
+    const SPITransfer xfer = {
+        .header = {SPI_FLASH_CMD_READ_STATUS},
+        .header_len = 1,
+        .rx = result_status,
+        .data_len = 1,
+    };
+    return job_run_blocking(ctx, &xfer, false);
+}
 
-    static SSP_ConfigFormat ssp_format;
-    Chip_SSP_Init(LPC_SSP);
-	ssp_format.frameFormat = SSP_FRAMEFORMAT_SPI;
-	ssp_format.bits = SSP_BITS_8;
-	ssp_format.clockMode = SPI_FLASH_MODE;
-	Chip_SSP_SetFormat(LPC_SSP, ssp_format.bits, ssp_format.frameFormat, ssp_format.clockMode);
-	Chip_SSP_SetMaster(LPC_SSP, true);
-    Chip_SSP_SetBitRate(LPC_SSP, SPI_FLASH_BITRATE);
+/**
+ * Wake up the flash chip from deep power-down. It ignores all other
+ * commands until it is woken up and tRES1 has passed.
+ */
+static bool wake_up(SPIFlash *ctx)
+{
+    const uint64_t t_start = delay_get_timestamp();
 
-	Chip_SSP_Enable(LPC_SSP);
+    ctx->powered_down = false;
+    const SPITransfer xfer = {
+        .header = {SPI_FLASH_CMD_POWER_UP},
+        .header_len = 1,
+    };
+    if(!job_run_blocking(ctx, &xfer, false)) {
+        ctx->powered_down = true;
+        return false;
+    }
+    delay_us(ctx->wake_time_us);
+
+    const uint64_t t_end = delay_get_timestamp();
+    SPIFlashPowerStats *stats = &ctx->power_stats;
+    stats->time_asleep_us+= delay_calc_time_us(ctx->t_power_down, t_start);
+    stats->last_wake_latency_us = delay_calc_time_us(t_start, t_end);
+    stats->total_wake_latency_us+= stats->last_wake_latency_us;
+    stats->wake_count++;
     return true;
 }
 
-bool SPI_flash_read_JEDEC_ID(JEDECID *ID)
+/**
+ * Call this before accessing the flash chip: it restarts the idle period
+ * and transparently wakes up the chip if it was powered down.
+ */
+static bool access_begin(SPIFlash *ctx)
 {
-    memset(ID, 0, sizeof(*ID));
+    if(job_is_busy(ctx)) {
+        return false;
+    }
+    ctx->t_last_access = delay_get_timestamp();
+    if(ctx->powered_down) {
+        return wake_up(ctx);
+    }
+    return true;
+}
 
-    const uint8_t cmd = SPI_FLASH_CMD_READ_JEDEC_ID;
-    ID->attributes.reserved = 0;
+/**
+ * Remember the expected duration of an erase or program operation
+ * that is started now.
+ */
+static void op_timing_start(SPIFlash *ctx, uint32_t typ_us, uint8_t max_factor)
+{
+    const uint64_t max_us = (uint64_t)typ_us * max_factor;
 
-    SPI_transfer_begin();
-    bool ok = true;
-    ok&= (SPI_write_blocking(&cmd, 1) == 1);
-    ok&= (SPI_read_blocking(ID->bytes+1, 3) == 3);
-    SPI_transfer_end();
+    ctx->t_op_start = delay_get_timestamp();
+    ctx->op_typ_us = typ_us;
+    ctx->op_max_us = (max_us > UINT32_MAX) ? UINT32_MAX : max_us;
+}
 
-    // Check if the results are within the expected range.
-    // Note: even better would be to check the parity
-    // according to the JEDEC standard JEP106?
-    for(size_t i=1;i<sizeof(JEDECID);i++) {
-        if((ID->bytes[i] == 0) || (ID->bytes[i] == 0xFF)) {
-            ok = false;
+/**
+ * Start the job of an erase or program operation with the given timing
+ */
+static bool op_job_start(SPIFlash *ctx, uint32_t typ_us, uint8_t max_factor,
+        SPIFlashCallback cb, void *cb_ctx)
+{
+    op_timing_start(ctx, typ_us, max_factor);
+    if(!job_start(ctx, true, cb, cb_ctx)) {
+        ctx->op_typ_us = 0;
+        return false;
+    }
+    return true;
+}
+
+static uint32_t op_elapsed_us(SPIFlash *ctx)
+{
+    return delay_calc_time_us(ctx->t_op_start, delay_get_timestamp());
+}
+
+/**
+ * True if the running operation is certainly not done yet:
+ * there is no need to ask the flash chip.
+ */
+static bool op_expected_busy(SPIFlash *ctx)
+{
+    return ctx->op_typ_us && (op_elapsed_us(ctx) < ctx->op_typ_us);
+}
+
+static bool is_busy(SPIFlash *ctx)
+{
+    uint8_t status;
+    if(job_is_busy(ctx) || op_expected_busy(ctx) || !access_begin(ctx)
+            || !get_status(ctx, &status) || (status & WIP)) {
+        return true;
+    }
+    ctx->op_typ_us = 0;
+    return false;
+}
+
+/**
+ * Wait until the flash chip has finished erasing or programming.
+ *
+ * If the duration of the operation is known, this sleeps until its typical
+ * time has passed before polling, and gives up after its maximum time.
+ * Otherwise, it polls every SPI_FLASH_UNKNOWN_POLL_US.
+ */
+static bool wait_while_busy(SPIFlash *ctx)
+{
+    if(!access_begin(ctx)) {
+        return false;
+    }
+
+    uint32_t poll_us = SPI_FLASH_UNKNOWN_POLL_US;
+    const uint32_t max_us = ctx->op_typ_us ? ctx->op_max_us : 0;
+    if(ctx->op_typ_us) {
+        const uint32_t elapsed_us = op_elapsed_us(ctx);
+        if(elapsed_us < ctx->op_typ_us) {
+            ctx->sleep(ctx->op_typ_us - elapsed_us);
+        }
+        poll_us = ctx->op_typ_us / SPI_FLASH_POLLS_PER_TYP_TIME;
+        if(poll_us < SPI_FLASH_MIN_POLL_US) {
+            poll_us = SPI_FLASH_MIN_POLL_US;
+        }
+    }
+
+    uint8_t status;
+    while(true) {
+        if(!get_status(ctx, &status)) {
+            return false;
+        }
+        if(!(status & WIP)) {
             break;
         }
+        if(max_us && (op_elapsed_us(ctx) > max_us)) {
+            return false;
+        }
+        ctx->sleep(poll_us);
     }
-    return ok;
+    ctx->op_typ_us = 0;
+    return true;
 }
 
-bool SPI_flash_read(uint32_t address, void *result, size_t sizeof_result)
+static uint8_t *cache_entry_data(SPIFlash *ctx, size_t entry)
 {
-    if(is_busy()) {
-        return false;
+    return ctx->cache->data + (entry * ctx->page_size);
+}
+
+/**
+ * Find the cache entry for a page.
+ *
+ * Returns the entry index, or entry_count if the page is not in the cache.
+ */
+static size_t cache_lookup(SPIFlash *ctx, uint32_t page_address)
+{
+    const SPIFlashCache *cache = ctx->cache;
+
+    size_t i;
+    for(i=0;i<cache->entry_count;i++) {
+        if(cache->tags[i].page_address == page_address) {
+            break;
+        }
     }
+    return i;
+}
 
-    const uint32_t end_address = (flash.page_size * flash.pages_per_block)
-        * flash.block_count;
+/**
+ * Select an entry to replace: an unused one or else the least recently used
+ */
+static size_t cache_select_victim(SPIFlash *ctx)
+{
+    const SPIFlashCache *cache = ctx->cache;
 
-    if(address >= end_address) {
+    size_t victim = 0;
+    for(size_t i=0;i<cache->entry_count;i++) {
+        const SPIFlashCacheTag *tag = &cache->tags[i];
+        if(tag->page_address == SPI_FLASH_CACHE_INVALID) {
+            return i;
+        }
+        if(tag->last_used < cache->tags[victim].last_used) {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+/**
+ * Drop all cached pages that overlap with the given range
+ */
+static void cache_invalidate(SPIFlash *ctx, uint32_t address, size_t size)
+{
+    SPIFlashCache *cache = ctx->cache;
+    if(!cache) {
+        return;
+    }
+
+    for(size_t i=0;i<cache->entry_count;i++) {
+        SPIFlashCacheTag *tag = &cache->tags[i];
+        if(tag->page_address == SPI_FLASH_CACHE_INVALID) {
+            continue;
+        }
+        if((tag->page_address < address)
+                && ((address - tag->page_address) >= ctx->page_size)) {
+            continue;
+        }
+        if((tag->page_address >= address)
+                && ((tag->page_address - address) >= size)) {
+            continue;
+        }
+        tag->page_address = SPI_FLASH_CACHE_INVALID;
+    }
+}
+
+static IRQn_Type SSP_get_IRQn(LPC_SSP_T *LPC_SSP)
+{
+    if(LPC_SSP == LPC_SSP0) {
+        return SSP0_IRQn;
+    }
+    return SSP1_IRQn;
+}
+
+
+
+static void SSP_setup(SPIFlash *ctx, LPC_SSP_T *LPC_SSP, const GPIO *cs_pin)
+{
+    ctx->SSP = LPC_SSP;
+    ctx->cs_pin = cs_pin;
+    memset(&ctx->job, 0, sizeof(ctx->job));
+    ctx->queue_head = NULL;
+    ctx->queue_tail = NULL;
+
+    ctx->cache = NULL;
+    ctx->erase_pool = NULL;
+
+    ctx->power_down_idle_us = 0;
+    ctx->wake_time_us = SPI_FLASH_DEFAULT_WAKE_TIME_US;
+    ctx->powered_down = false;
+    ctx->t_last_access = delay_get_timestamp();
+    memset(&ctx->power_stats, 0, sizeof(ctx->power_stats));
+
+    ctx->suspend_opcode = 0;
+    ctx->resume_opcode = 0;
+    ctx->suspend_latency_us = 0;
+    ctx->resume_interval_us = 0;
+    ctx->suspendable = false;
+    ctx->t_resume = ctx->t_last_access;
+    memset(&ctx->urgent_stats, 0, sizeof(ctx->urgent_stats));
+
+    ctx->op_typ_us = 0;
+    ctx->op_max_us = 0;
+    ctx->sleep = delay_us;
+
+    static SSP_ConfigFormat ssp_format;
+    Chip_SSP_Init(LPC_SSP);
+	ssp_format.frameFormat = SSP_FRAMEFORMAT_SPI;
+	ssp_format.bits = SSP_BITS_8;
+	ssp_format.clockMode = SPI_FLASH_MODE;
+	Chip_SSP_SetFormat(LPC_SSP, ssp_format.bits, ssp_format.frameFormat, ssp_format.clockMode);
+	Chip_SSP_SetMaster(LPC_SSP, true);
+    Chip_SSP_SetBitRate(LPC_SSP, SPI_FLASH_BITRATE);
+
+	Chip_SSP_Enable(LPC_SSP);
+
+    SPI_int_disable(ctx);
+    NVIC_EnableIRQ(SSP_get_IRQn(LPC_SSP));
+}
+
+static bool set_geometry(SPIFlash *ctx, size_t page_size, size_t erase_block_size,
+        size_t total_size)
+{
+    if(!page_size) {
+        return false;
+    }
+    if(page_size > erase_block_size) {
         return false;
     }
-    if((address + sizeof_result) >= end_address) {
+    if(erase_block_size > total_size) {
         return false;
     }
 
-    SPI_transfer_begin();
-    bool ok = true;
-    const uint8_t cmd[] = {
-        SPI_FLASH_CMD_READ_DATA,
-        (address >> 16) & 0xFF,
-        (address >> 8 ) & 0xFF,
-        (address >> 0 ) & 0xFF
-    };
-    const size_t cmd_size = sizeof(cmd);
+    ctx->page_size = page_size;
+    ctx->pages_per_block = erase_block_size/page_size;
+    ctx->block_count = total_size/erase_block_size;
+    return true;
+}
 
-    ok&= (SPI_write_blocking(cmd, cmd_size) == cmd_size);
-    ok&= (SPI_read_blocking(result, sizeof_result) == sizeof_result);
-    SPI_transfer_end();
-    return ok;
+/**
+ * Typical erase time of a size without an erase time from SFDP,
+ * estimated from the 4K and 64K erase times of the part.
+ */
+static uint32_t part_erase_time_ms(const SPIFlashPart *part, uint32_t size)
+{
+    if(size <= 0x1000) {
+        return part->sector_erase_ms;
+    }
+    const uint32_t time_ms = (uint64_t)part->block_erase_ms * size / 0x10000;
+    return (time_ms > part->sector_erase_ms) ? time_ms : part->sector_erase_ms;
 }
 
-bool SPI_flash_erase_block(uint32_t block_address)
+/**
+ * Fill in features from the part table, if not known yet
+ */
+static void apply_part_table(SPIFlash *ctx)
 {
-    if(is_busy()) {
-        return false;
+    JEDECID ID;
+    if(!SPI_flash_read_JEDEC_ID(ctx, &ID)) {
+        return;
+    }
+    const SPIFlashPart *part = NULL;
+    for(size_t i=0;i<(sizeof(part_table)/sizeof(part_table[0]));i++) {
+        if(part_table[i].manufacturer == ID.attributes.manufacturer) {
+            part = &part_table[i];
+            break;
+        }
+    }
+    if(!part) {
+        return;
     }
 
-    const uint32_t block_size = flash.page_size * flash.pages_per_block;
-    uint32_t mask = (block_size-1);
-    if(block_address & mask) {
-        return false;
+    if(!ctx->suspend_opcode) {
+        ctx->suspend_opcode = part->suspend_opcode;
+        ctx->resume_opcode = part->resume_opcode;
+        ctx->suspend_latency_us = part->suspend_latency_us;
+        ctx->resume_interval_us = part->resume_interval_us;
     }
 
-    uint32_t end_address = block_size * flash.block_count;
-    if(block_address >= end_address) {
+    if(!ctx->page_program_us) {
+        ctx->page_program_us = part->page_program_us;
+        ctx->program_max_factor = part->program_max_factor;
+    }
+    if(!ctx->erase_max_factor) {
+        ctx->erase_max_factor = part->erase_max_factor;
+    }
+    for(size_t i=0;i<SPI_FLASH_ERASE_TYPE_COUNT;i++) {
+        SPIFlashEraseType *type = &ctx->erase_types[i];
+        if(type->size && !type->typ_time_ms) {
+            type->typ_time_ms = part_erase_time_ms(part, type->size);
+        }
+    }
+    if(!ctx->chip_erase_ms) {
+        const uint32_t total_size = (ctx->page_size * ctx->pages_per_block)
+            * ctx->block_count;
+        ctx->chip_erase_ms = part_erase_time_ms(part, total_size);
+    }
+}
+
+bool SPI_flash_init(SPIFlash *ctx, LPC_SSP_T *LPC_SSP, const GPIO *cs_pin,
+        size_t page_size, size_t erase_block_size, size_t total_size)
+{
+    if(!set_geometry(ctx, page_size, erase_block_size, total_size)) {
         return false;
     }
-    
-    bool ok = true;
-    ok&= send_write_enable();
-
-    SPI_transfer_begin();
-    const uint8_t cmd[] = {
-        SPI_FLASH_CMD_ERASE_SECTOR,
-        (block_address >> 16) & 0xFF,
-        (block_address >> 8 ) & 0xFF,
-        (block_address >> 0 ) & 0xFF
-    };
-    const size_t cmd_size = sizeof(cmd);
 
-    ok&= (SPI_write_blocking(cmd, cmd_size) == cmd_size);
-    SPI_transfer_end();
-    return ok;
+    memset(ctx->erase_types, 0, sizeof(ctx->erase_types));
+    ctx->erase_types[0].size = erase_block_size;
+    ctx->erase_types[0].opcode = SPI_FLASH_CMD_ERASE_SECTOR;
+
+    // 64K block erase (0xD8) is supported by practically all parts
+    const size_t block_erase_size = 0x10000;
+    if((erase_block_size < block_erase_size)
+            && (total_size >= block_erase_size)) {
+        ctx->erase_types[1].size = block_erase_size;
+        ctx->erase_types[1].opcode = SPI_FLASH_CMD_ERASE_BLOCK;
+    }
+
+    ctx->erase_block_opcode = SPI_FLASH_CMD_ERASE_SECTOR;
+    ctx->page_program_us = 0;
+    ctx->chip_erase_ms = 0;
+    ctx->program_max_factor = 0;
+    ctx->erase_max_factor = 0;
+
+    SSP_setup(ctx, LPC_SSP, cs_pin);
+    apply_part_table(ctx);
+    return true;
 }
 
-bool SPI_flash_erase_all(void)
+static bool read_SFDP(SPIFlash *ctx, uint32_t address,
+        void *result, size_t sizeof_result)
 {
-    if(is_busy()) {
+    if(!access_begin(ctx)) {
         return false;
     }
+    const SPITransfer xfer = {
+        .header = {
+            SPI_FLASH_CMD_READ_SFDP,
+            (address >> 16) & 0xFF,
+            (address >> 8 ) & 0xFF,
+            (address >> 0 ) & 0xFF,
+            SPI_DUMMY_BYTE
+        },
+        .header_len = 5,
+        .rx = result,
+        .data_len = sizeof_result,
+    };
+    return job_run_blocking(ctx, &xfer, false);
+}
 
-    bool ok = true;
-    ok&= send_write_enable();
+static uint32_t get_le32(const uint8_t *bytes)
+{
+    return ((uint32_t)bytes[0] << 0)
+        | ((uint32_t)bytes[1] << 8)
+        | ((uint32_t)bytes[2] << 16)
+        | ((uint32_t)bytes[3] << 24);
+}
 
-    SPI_transfer_begin();
-    const uint8_t cmd[] = {
-        SPI_FLASH_CMD_ERASE_CHIP
-    };
-    const size_t cmd_size = sizeof(cmd);
+// BFPT DWORD n (1-based, as in the JESD216 standard)
+#define BFPT_DWORD(table, n) get_le32((table) + 4*((n)-1))
 
-    ok&= (SPI_write_blocking(cmd, cmd_size) == cmd_size);
-    SPI_transfer_end();
-    return ok;
+static uint32_t SFDP_erase_time_ms(uint32_t field)
+{
+    const uint32_t units_ms[] = {1, 16, 128, 1000};
+    return ((field & 0x1F) + 1) * units_ms[(field >> 5) & 0x3];
+}
+
+static void sort_erase_types(SPIFlashEraseType *types, size_t count)
+{
+    for(size_t i=1;i<count;i++) {
+        const SPIFlashEraseType t = types[i];
+        size_t j = i;
+        for(;(j > 0) && (types[j-1].size > t.size);j--) {
+            types[j] = types[j-1];
+        }
+        types[j] = t;
+    }
 }
 
-bool SPI_flash_program(uint32_t address, const void *src, size_t sizeof_src)
+bool SPI_flash_init_auto(SPIFlash *ctx, LPC_SSP_T *LPC_SSP, const GPIO *cs_pin)
 {
-    if(is_busy()) {
+    SSP_setup(ctx, LPC_SSP, cs_pin);
+
+    uint8_t header[2*SFDP_HEADER_SIZE];
+    if(!read_SFDP(ctx, 0, header, sizeof(header))) {
+        return false;
+    }
+    if(get_le32(header) != SFDP_SIGNATURE) {
         return false;
     }
 
-    const uint32_t end_address = (flash.page_size * flash.pages_per_block)
-        * flash.block_count;
-    if(address >= end_address) {
+    // The first parameter header should point to the basic flash table
+    const uint8_t *param = header + SFDP_HEADER_SIZE;
+    if(param[0] != SFDP_BFPT_ID) {
+        return false;
+    }
+    size_t dword_count = param[3];
+    const uint32_t table_address = get_le32(param + 4) & 0xFFFFFF;
+    if(dword_count < 9) {
         return false;
     }
+    if(dword_count > SFDP_BFPT_MAX_DWORDS) {
+        dword_count = SFDP_BFPT_MAX_DWORDS;
+    }
 
-    const uint32_t page_offset = (address & (flash.page_size-1));
-    if(sizeof_src > (flash.page_size - page_offset)) {
+    uint8_t table[4*SFDP_BFPT_MAX_DWORDS];
+    memset(table, 0, sizeof(table));
+    if(!read_SFDP(ctx, table_address, table, 4*dword_count)) {
         return false;
     }
 
+    // Density (in bits). Only 3-byte addressing is supported.
+    const uint32_t density = BFPT_DWORD(table, 2);
+    uint32_t total_size;
+    if(density & (1UL << 31)) {
+        const uint32_t bits_log2 = density & 0x7FFFFFFF;
+        if((bits_log2 < 3) || (bits_log2 > (24+3))) {
+            return false;
+        }
+        total_size = 1UL << (bits_log2 - 3);
+    } else {
+        total_size = (density / 8) + 1;
+    }
+    if(total_size > (1UL << 24)) {
+        return false;
+    }
+
+    // Erase types: size (2^N bytes) and opcode, DWORD 8 and 9
+    memset(ctx->erase_types, 0, sizeof(ctx->erase_types));
+    const uint32_t erase_dwords[2] = {
+        BFPT_DWORD(table, 8),
+        BFPT_DWORD(table, 9)
+    };
+    // Typical erase times are in DWORD 10 (JESD216A and later)
+    const uint32_t erase_times = (dword_count >= 10)
+        ? BFPT_DWORD(table, 10) : 0;
+
+    size_t erase_type_count = 0;
+    for(size_t i=0;i<SPI_FLASH_ERASE_TYPE_COUNT;i++) {
+        const uint32_t field = erase_dwords[i/2] >> (16*(i%2));
+        const uint8_t size_log2 = field & 0xFF;
+        if(!size_log2 || (size_log2 > 24)) {
+            continue;
+        }
+        SPIFlashEraseType *type = &ctx->erase_types[erase_type_count++];
+        type->size = 1UL << size_log2;
+        type->opcode = (field >> 8) & 0xFF;
+        type->typ_time_ms = erase_times
+            ? SFDP_erase_time_ms(erase_times >> (4 + 7*i)) : 0;
+    }
+    if(!erase_type_count) {
+        return false;
+    }
+    sort_erase_types(ctx->erase_types, erase_type_count);
+    ctx->erase_max_factor = erase_times ? 2*((erase_times & 0xF) + 1) : 0;
+
+    // Page size, program time and chip erase time: DWORD 11 (JESD216A)
+    size_t page_size = 256;
+    ctx->page_program_us = 0;
+    ctx->chip_erase_ms = 0;
+    ctx->program_max_factor = 0;
+    if(dword_count >= 11) {
+        const uint32_t dw11 = BFPT_DWORD(table, 11);
+        const uint32_t program_units_us[] = {8, 64};
+        const uint32_t chip_erase_units_ms[] = {16, 256, 4000, 64000};
+
+        page_size = 1UL << ((dw11 >> 4) & 0xF);
+        ctx->program_max_factor = 2*((dw11 & 0xF) + 1);
+        ctx->page_program_us = (((dw11 >> 8) & 0x1F) + 1)
+            * program_units_us[(dw11 >> 13) & 0x1];
+        ctx->chip_erase_ms = (((dw11 >> 24) & 0x1F) + 1)
+            * chip_erase_units_ms[(dw11 >> 29) & 0x3];
+    }
+
+    // Suspend/resume: DWORD 12 and 13 (JESD216B)
+    if(dword_count >= 13) {
+        const uint32_t dw12 = BFPT_DWORD(table, 12);
+        const uint32_t dw13 = BFPT_DWORD(table, 13);
+        const uint32_t latency_units_ns[] = {128, 1000, 8000, 64000};
+
+        // Bit 31 is cleared if suspend/resume is supported
+        if(!(dw12 & (1UL << 31))) {
+            const uint32_t erase_latency_ns = (((dw12 >> 24) & 0x1F) + 1)
+                * latency_units_ns[(dw12 >> 29) & 0x3];
+            const uint32_t program_latency_ns = (((dw12 >> 13) & 0x1F) + 1)
+                * latency_units_ns[(dw12 >> 18) & 0x3];
+            const uint32_t latency_ns = (erase_latency_ns > program_latency_ns)
+                ? erase_latency_ns : program_latency_ns;
+
+            ctx->suspend_opcode = (dw13 >> 24) & 0xFF;
+            ctx->resume_opcode = (dw13 >> 16) & 0xFF;
+            ctx->suspend_latency_us = (latency_ns + 999) / 1000;
+            ctx->resume_interval_us = (((dw12 >> 20) & 0xF) + 1) * 64;
+        }
+    }
+
+    // SPI_flash_erase_block() uses the finest erase granularity
+    ctx->erase_block_opcode = ctx->erase_types[0].opcode;
+    if(!set_geometry(ctx, page_size, ctx->erase_types[0].size, total_size)) {
+        return false;
+    }
+    apply_part_table(ctx);
+    return true;
+}
+
+void SPI_flash_get_info(SPIFlash *ctx, SPIFlashInfo *info)
+{
+    info->page_size = ctx->page_size;
+    info->erase_block_size = ctx->page_size * ctx->pages_per_block;
+    info->total_size = info->erase_block_size * ctx->block_count;
+    memcpy(info->erase_types, ctx->erase_types, sizeof(info->erase_types));
+    info->page_program_us = ctx->page_program_us;
+    info->chip_erase_ms = ctx->chip_erase_ms;
+    info->program_max_factor = ctx->program_max_factor;
+    info->erase_max_factor = ctx->erase_max_factor;
+    info->suspend_latency_us = ctx->suspend_opcode
+        ? ctx->suspend_latency_us : 0;
+}
+
+void SPI_flash_IRQHandler(LPC_SSP_T *LPC_SSP)
+{
+    Chip_SSP_ClearIntPending(LPC_SSP, SSP_INT_CLEAR_BITMASK);
+
+    SPIFlash *ctx = bus_owner[SSP_get_index(LPC_SSP)];
+    if(!ctx || !ctx->job.busy) {
+        SSP_set_int_mask(LPC_SSP, 0);
+        return;
+    }
+    if(job_pump(ctx)) {
+        job_finish(ctx);
+    }
+}
+
+bool SPI_flash_is_transfer_busy(SPIFlash *ctx)
+{
+    return job_is_busy(ctx);
+}
+
+bool SPI_flash_is_busy(SPIFlash *ctx)
+{
+    return is_busy(ctx);
+}
+
+bool SPI_flash_wait_ready(SPIFlash *ctx)
+{
+    job_wait(ctx);
+    return wait_while_busy(ctx);
+}
+
+bool SPI_flash_read_JEDEC_ID(SPIFlash *ctx, JEDECID *ID)
+{
+    memset(ID, 0, sizeof(*ID));
+    if(!access_begin(ctx)) {
+        return false;
+    }
+
+    ID->attributes.reserved = 0;
+
+    const SPITransfer xfer = {
+        .header = {SPI_FLASH_CMD_READ_JEDEC_ID},
+        .header_len = 1,
+        .rx = ID->bytes+1,
+        .data_len = 3,
+    };
+    bool ok = job_run_blocking(ctx, &xfer, false);
+
+    // Check if the results are within the expected range.
+    // Note: even better would be to check the parity
+    // according to the JEDEC standard JEP106?
+    for(size_t i=1;i<sizeof(JEDECID);i++) {
+        if((ID->bytes[i] == 0) || (ID->bytes[i] == 0xFF)) {
+            ok = false;
+            break;
+        }
+    }
+    return ok;
+}
+
+bool SPI_flash_read_async(SPIFlash *ctx, uint32_t address,
+        void *result, size_t sizeof_result,
+        SPIFlashCallback cb, void *cb_ctx)
+{
+    if(is_busy(ctx)) {
+        return false;
+    }
+
+    const uint32_t end_address = (ctx->page_size * ctx->pages_per_block)
+        * ctx->block_count;
+
+    if(address >= end_address) {
+        return false;
+    }
+    if(sizeof_result > (end_address - address)) {
+        return false;
+    }
+
+    const SPITransfer xfer = {
+        .header = {
+            SPI_FLASH_CMD_READ_DATA,
+            (address >> 16) & 0xFF,
+            (address >> 8 ) & 0xFF,
+            (address >> 0 ) & 0xFF
+        },
+        .header_len = 4,
+        .rx = result,
+        .data_len = sizeof_result,
+    };
+    ctx->job.transfer = xfer;
+    return job_start(ctx, false, cb, cb_ctx);
+}
+
+static bool read_blocking(SPIFlash *ctx, uint32_t address,
+        void *result, size_t sizeof_result)
+{
+    if(!SPI_flash_read_async(ctx, address, result, sizeof_result, NULL, NULL)) {
+        return false;
+    }
+    job_wait(ctx);
+    return true;
+}
+
+/**
+ * Read through the page cache: each page that is not in the cache yet
+ * is read completely, replacing the least recently used entry.
+ */
+static bool cache_read(SPIFlash *ctx, uint32_t address,
+        uint8_t *result, size_t sizeof_result)
+{
+    SPIFlashCache *cache = ctx->cache;
+
+    while(sizeof_result) {
+        const uint32_t page_address = address & ~(ctx->page_size-1);
+        const size_t offset = address - page_address;
+        size_t chunk = ctx->page_size - offset;
+        if(chunk > sizeof_result) {
+            chunk = sizeof_result;
+        }
+
+        size_t entry = cache_lookup(ctx, page_address);
+        if(entry < cache->entry_count) {
+            cache->hits++;
+        } else {
+            cache->misses++;
+            entry = cache_select_victim(ctx);
+
+            SPIFlashCacheTag *tag = &cache->tags[entry];
+            tag->page_address = SPI_FLASH_CACHE_INVALID;
+            if(!read_blocking(ctx, page_address,
+                        cache_entry_data(ctx, entry), ctx->page_size)) {
+                return false;
+            }
+            tag->page_address = page_address;
+        }
+        cache->tags[entry].last_used = ++cache->use_count;
+
+        memcpy(result, cache_entry_data(ctx, entry) + offset, chunk);
+        address+= chunk;
+        result+= chunk;
+        sizeof_result-= chunk;
+    }
+    return true;
+}
+
+bool SPI_flash_read(SPIFlash *ctx, uint32_t address,
+        void *result, size_t sizeof_result)
+{
+    // Large reads bypass the cache: they would only evict
+    // the small, frequently used data it is meant for.
+    if(ctx->cache && (sizeof_result <= ctx->page_size)) {
+        return cache_read(ctx, address, result, sizeof_result);
+    }
+    return read_blocking(ctx, address, result, sizeof_result);
+}
+
+bool SPI_flash_read_when_ready(SPIFlash *ctx, uint32_t address,
+        void *result, size_t sizeof_result)
+{
+    return SPI_flash_wait_ready(ctx)
+        && SPI_flash_read(ctx, address, result, sizeof_result);
+}
+
+/**
+ * Index of the request that follows 'prev' in address order, or count if
+ * there is none. Pass count as prev to get the first request. Requests at
+ * the same address are ordered by index, empty requests are skipped.
+ *
+ * This is O(n^2), but the lists are short and it needs no RAM to sort.
+ */
+static size_t iov_next(const SPIFlashIOV *iov, size_t count, size_t prev)
+{
+    size_t next = count;
+    for(size_t i=0;i<count;i++) {
+        if(!iov[i].size) {
+            continue;
+        }
+        if((prev < count) && ((iov[i].address < iov[prev].address)
+                    || ((iov[i].address == iov[prev].address) && (i <= prev)))) {
+            continue;
+        }
+        if((next == count) || (iov[i].address < iov[next].address)) {
+            next = i;
+        }
+    }
+    return next;
+}
+
+/**
+ * Continue the current command with another transfer,
+ * while the bus is held by the caller.
+ */
+static void job_run_continued(SPIFlash *ctx, const SPITransfer *xfer)
+{
+    ctx->job.transfer = *xfer;
+    job_start_transfer(ctx);
+    while(!job_pump(ctx)) {
+    }
+}
+
+bool SPI_flash_readv(SPIFlash *ctx, const SPIFlashIOV *iov, size_t count)
+{
+    const uint32_t end_address = (ctx->page_size * ctx->pages_per_block)
+        * ctx->block_count;
+
+    for(size_t i=0;i<count;i++) {
+        if((iov[i].address >= end_address)
+                || (iov[i].size > (end_address - iov[i].address))) {
+            return false;
+        }
+    }
+    if(is_busy(ctx)) {
+        return false;
+    }
+
+    size_t i = iov_next(iov, count, count);
+    while(i < count) {
+        const uint32_t address = iov[i].address;
+        const SPITransfer xfer = {
+            .header = {
+                SPI_FLASH_CMD_READ_DATA,
+                (address >> 16) & 0xFF,
+                (address >> 8 ) & 0xFF,
+                (address >> 0 ) & 0xFF
+            },
+            .header_len = 4,
+            .rx = iov[i].buffer,
+            .data_len = iov[i].size,
+            .keep_selected = true,
+        };
+        ctx->job.transfer = xfer;
+        if(!job_setup(ctx, false, NULL, NULL)) {
+            return false;
+        }
+        while(!job_pump(ctx)) {
+        }
+
+        // Extend the command with the following requests, as long as
+        // they do not overlap and the gap is small. Overlapping requests
+        // start a new command.
+        uint32_t position = address + iov[i].size;
+        size_t next = iov_next(iov, count, i);
+        while((next < count) && (iov[next].address >= position)
+                && ((iov[next].address - position) <= SPI_FLASH_READV_MAX_GAP)) {
+            const size_t gap = iov[next].address - position;
+            if(gap) {
+                const SPITransfer skip = {
+                    .data_len = gap,
+                    .keep_selected = true,
+                };
+                job_run_continued(ctx, &skip);
+            }
+            const SPITransfer data = {
+                .rx = iov[next].buffer,
+                .data_len = iov[next].size,
+                .keep_selected = true,
+            };
+            job_run_continued(ctx, &data);
+
+            position = iov[next].address + iov[next].size;
+            next = iov_next(iov, count, next);
+        }
+
+        SPI_transfer_end(ctx);
+        bus_release(ctx);
+        ctx->job.busy = false;
+        i = next;
+    }
+    return true;
+}
+
+static uint32_t erase_time_ms(SPIFlash *ctx, size_t size)
+{
+    for(size_t i=0;i<SPI_FLASH_ERASE_TYPE_COUNT;i++) {
+        if(ctx->erase_types[i].size == size) {
+            return ctx->erase_types[i].typ_time_ms;
+        }
+    }
+    return 0;
+}
+
+static bool erase_start(SPIFlash *ctx, uint8_t opcode,
+        uint32_t address, size_t size,
+        SPIFlashCallback cb, void *cb_ctx)
+{
+    cache_invalidate(ctx, address, size);
+    ctx->suspendable = true;
+
+    const SPITransfer xfer = {
+        .header = {
+            opcode,
+            (address >> 16) & 0xFF,
+            (address >> 8 ) & 0xFF,
+            (address >> 0 ) & 0xFF
+        },
+        .header_len = 4,
+    };
+    ctx->job.transfer = xfer;
+    return op_job_start(ctx, 1000*erase_time_ms(ctx, size),
+            ctx->erase_max_factor, cb, cb_ctx);
+}
+
+static bool erase_block_start(SPIFlash *ctx, uint32_t block_address,
+        SPIFlashCallback cb, void *cb_ctx)
+{
+    if(is_busy(ctx)) {
+        return false;
+    }
+
+    const uint32_t block_size = ctx->page_size * ctx->pages_per_block;
+    uint32_t mask = (block_size-1);
+    if(block_address & mask) {
+        return false;
+    }
+
+    uint32_t end_address = block_size * ctx->block_count;
+    if(block_address >= end_address) {
+        return false;
+    }
+
+    return erase_start(ctx, ctx->erase_block_opcode, block_address,
+            block_size, cb, cb_ctx);
+}
+
+bool SPI_flash_erase_block(SPIFlash *ctx, uint32_t block_address)
+{
+    if(!erase_block_start(ctx, block_address, NULL, NULL)) {
+        return false;
+    }
+    job_wait(ctx);
+    return true;
+}
+
+static bool erase_all_start(SPIFlash *ctx, SPIFlashCallback cb, void *cb_ctx)
+{
+    if(is_busy(ctx)) {
+        return false;
+    }
+
+    cache_invalidate(ctx, 0, UINT32_MAX);
+    ctx->suspendable = false;
+
+    const SPITransfer xfer = {
+        .header = {SPI_FLASH_CMD_ERASE_CHIP},
+        .header_len = 1,
+    };
+    ctx->job.transfer = xfer;
+    return op_job_start(ctx, 1000*ctx->chip_erase_ms,
+            ctx->erase_max_factor, cb, cb_ctx);
+}
+
+bool SPI_flash_erase_all(SPIFlash *ctx)
+{
+    if(!erase_all_start(ctx, NULL, NULL)) {
+        return false;
+    }
+    job_wait(ctx);
+    return true;
+}
+
+bool SPI_flash_program_async(SPIFlash *ctx, uint32_t address,
+        const void *src, size_t sizeof_src,
+        SPIFlashCallback cb, void *cb_ctx)
+{
+    if(is_busy(ctx)) {
+        return false;
+    }
+
+    const uint32_t end_address = (ctx->page_size * ctx->pages_per_block)
+        * ctx->block_count;
+    if(address >= end_address) {
+        return false;
+    }
+
+    const uint32_t page_offset = (address & (ctx->page_size-1));
+    if(sizeof_src > (ctx->page_size - page_offset)) {
+        return false;
+    }
+
+    cache_invalidate(ctx, address, sizeof_src);
+    ctx->suspendable = true;
+
+    const SPITransfer xfer = {
+        .header = {
+            SPI_FLASH_CMD_PROGRAM_PAGE,
+            (address >> 16) & 0xFF,
+            (address >> 8 ) & 0xFF,
+            (address >> 0 ) & 0xFF
+        },
+        .header_len = 4,
+        .tx = src,
+        .data_len = sizeof_src,
+    };
+    ctx->job.transfer = xfer;
+    return op_job_start(ctx, ctx->page_program_us,
+            ctx->program_max_factor, cb, cb_ctx);
+}
+
+bool SPI_flash_program(SPIFlash *ctx, uint32_t address,
+        const void *src, size_t sizeof_src)
+{
+    if(!SPI_flash_program_async(ctx, address, src, sizeof_src, NULL, NULL)) {
+        return false;
+    }
+    job_wait(ctx);
+    return true;
+}
+
+bool SPI_flash_write(SPIFlash *ctx, uint32_t address,
+        const void *src, size_t sizeof_src)
+{
+    const uint8_t *src_bytes = src;
+
+    while(sizeof_src) {
+        const uint32_t page_offset = (address & (ctx->page_size-1));
+        size_t chunk = ctx->page_size - page_offset;
+        if(chunk > sizeof_src) {
+            chunk = sizeof_src;
+        }
+
+        if(!wait_while_busy(ctx)) {
+            return false;
+        }
+        if(!SPI_flash_program(ctx, address, src_bytes, chunk)) {
+            return false;
+        }
+        address+= chunk;
+        src_bytes+= chunk;
+        sizeof_src-= chunk;
+    }
+    return true;
+}
+
+static bool writer_flush(SPIFlashWriter *writer)
+{
+    SPIFlash *ctx = writer->flash;
+
+    if(!writer->buffer_count) {
+        return true;
+    }
+
+    // The previous page may still be programming
+    // while the caller was filling the buffer
+    bool ok = wait_while_busy(ctx);
+    ok = ok && SPI_flash_program(ctx, writer->address,
+            writer->page_buffer, writer->buffer_count);
+
+    writer->address+= writer->buffer_count;
+    writer->bytes_written+= writer->buffer_count;
+    writer->buffer_count = 0;
+    return ok;
+}
+
+bool SPI_flash_writer_begin(SPIFlash *ctx, SPIFlashWriter *writer,
+        uint32_t address, uint8_t *page_buffer)
+{
+    writer->flash = ctx;
+    writer->address = address;
+    writer->page_buffer = page_buffer;
+    writer->buffer_count = 0;
+    writer->bytes_written = 0;
+    writer->t_start = delay_get_timestamp();
+    writer->t_end = writer->t_start;
+    writer->ok = (page_buffer != NULL);
+    return writer->ok;
+}
+
+bool SPI_flash_writer_append(SPIFlashWriter *writer,
+        const void *data, size_t sizeof_data)
+{
+    SPIFlash *ctx = writer->flash;
+    const uint8_t *data_bytes = data;
+
+    while(writer->ok && sizeof_data) {
+        const uint32_t page_offset = (writer->address & (ctx->page_size-1));
+        const size_t page_remaining = ctx->page_size - page_offset;
+
+        size_t chunk = page_remaining - writer->buffer_count;
+        if(chunk > sizeof_data) {
+            chunk = sizeof_data;
+        }
+        memcpy(writer->page_buffer + writer->buffer_count, data_bytes, chunk);
+        writer->buffer_count+= chunk;
+        data_bytes+= chunk;
+        sizeof_data-= chunk;
+
+        if(writer->buffer_count == page_remaining) {
+            writer->ok = writer_flush(writer);
+        }
+    }
+    return writer->ok;
+}
+
+bool SPI_flash_writer_finish(SPIFlashWriter *writer)
+{
+    if(writer->ok) {
+        writer->ok = writer_flush(writer);
+    }
+    if(writer->ok) {
+        writer->ok = wait_while_busy(writer->flash);
+    }
+    writer->t_end = delay_get_timestamp();
+    return writer->ok;
+}
+
+uint32_t SPI_flash_writer_bytes_per_sec(const SPIFlashWriter *writer)
+{
+    const uint64_t time_us = delay_calc_time_us(writer->t_start, writer->t_end);
+    if(!time_us) {
+        return 0;
+    }
+    return ((uint64_t)writer->bytes_written * 1000000) / time_us;
+}
+
+bool SPI_flash_submit(SPIFlash *ctx, SPIFlashOp *op)
+{
+    if(!op) {
+        return false;
+    }
+    op->next = NULL;
+    op->ok = false;
+    op->state = SPI_FLASH_OP_STATE_QUEUED;
+
+    if(ctx->queue_tail) {
+        ctx->queue_tail->next = op;
+    } else {
+        ctx->queue_head = op;
+    }
+    ctx->queue_tail = op;
+    return true;
+}
+
+bool SPI_flash_queue_is_empty(SPIFlash *ctx)
+{
+    return (ctx->queue_head == NULL);
+}
+
+static void op_transfer_done(void *op_ctx, bool ok)
+{
+    SPIFlashOp *op = op_ctx;
+
+    op->ok = ok;
+    if(ok && (op->type != SPI_FLASH_OP_READ)) {
+        op->state = SPI_FLASH_OP_STATE_WAIT_READY;
+    } else {
+        op->state = SPI_FLASH_OP_STATE_DONE;
+    }
+}
+
+static bool op_start(SPIFlash *ctx, SPIFlashOp *op)
+{
+    switch(op->type) {
+        case SPI_FLASH_OP_READ:
+            return SPI_flash_read_async(ctx, op->address, op->buffer, op->size,
+                    op_transfer_done, op);
+
+        case SPI_FLASH_OP_PROGRAM:
+            return SPI_flash_program_async(ctx, op->address, op->buffer, op->size,
+                    op_transfer_done, op);
+
+        case SPI_FLASH_OP_ERASE_BLOCK:
+            return erase_block_start(ctx, op->address, op_transfer_done, op);
+
+        case SPI_FLASH_OP_ERASE_ALL:
+            return erase_all_start(ctx, op_transfer_done, op);
+    }
+    return false;
+}
+
+/**
+ * Advance the operation at the head of the queue by one step.
+ *
+ * Returns true if progress was made.
+ */
+static bool queue_step(SPIFlash *ctx)
+{
+    SPIFlashOp *op = ctx->queue_head;
+    if(!op) {
+        return false;
+    }
+
+    switch(op->state) {
+        case SPI_FLASH_OP_STATE_QUEUED:
+            if(is_busy(ctx)) {
+                return false;
+            }
+            op->state = SPI_FLASH_OP_STATE_TRANSFER;
+            if(!op_start(ctx, op)) {
+                op->ok = false;
+                op->state = SPI_FLASH_OP_STATE_DONE;
+            }
+            return true;
+
+        case SPI_FLASH_OP_STATE_TRANSFER:
+            // waiting for op_transfer_done()
+            return false;
+
+        case SPI_FLASH_OP_STATE_WAIT_READY:
+            if(is_busy(ctx)) {
+                return false;
+            }
+            op->state = SPI_FLASH_OP_STATE_DONE;
+            return true;
+
+        case SPI_FLASH_OP_STATE_DONE:
+            ctx->queue_head = op->next;
+            if(!ctx->queue_head) {
+                ctx->queue_tail = NULL;
+            }
+            if(op->cb) {
+                op->cb(op->cb_ctx, op->ok);
+            }
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Put the flash chip in deep power-down if it was not accessed for
+ * at least the configured idle period.
+ */
+static void power_down_if_idle(SPIFlash *ctx)
+{
+    if(!ctx->power_down_idle_us || ctx->powered_down
+            || job_is_busy(ctx) || ctx->queue_head) {
+        return;
+    }
+    const uint64_t now = delay_get_timestamp();
+    if(delay_calc_time_us(ctx->t_last_access, now) < ctx->power_down_idle_us) {
+        return;
+    }
+
+    // Do not interrupt an erase or program operation
+    uint8_t status;
+    if(!get_status(ctx, &status) || (status & WIP)) {
+        return;
+    }
+
+    const SPITransfer xfer = {
+        .header = {SPI_FLASH_CMD_POWER_DOWN},
+        .header_len = 1,
+    };
+    if(job_run_blocking(ctx, &xfer, false)) {
+        ctx->powered_down = true;
+        ctx->t_power_down = now;
+        ctx->power_stats.power_down_count++;
+    }
+}
+
+static uint32_t erase_pool_block_address(SPIFlash *ctx, size_t index)
+{
+    const SPIFlashErasePool *pool = ctx->erase_pool;
+    const uint32_t block_size = ctx->page_size * ctx->pages_per_block;
+    return pool->start_address
+        + ((index % pool->block_count) * block_size);
+}
+
+/**
+ * Prepare the next block of the erase pool, a small step at a time:
+ * blank-check a single chunk, or start/finish an erase.
+ */
+static void erase_pool_step(SPIFlash *ctx)
+{
+    SPIFlashErasePool *pool = ctx->erase_pool;
+
+    if(pool->erase_busy) {
+        if(pool->erase_op.state != SPI_FLASH_OP_STATE_DONE) {
+            return;
+        }
+        pool->erase_busy = false;
+        if(pool->erase_op.ok) {
+            pool->erases++;
+            pool->ready_count++;
+        }
+        return;
+    }
+    if((pool->ready_count >= pool->target_count)
+            || ((pool->taken_count + pool->ready_count) >= pool->block_count)
+            || job_is_busy(ctx) || ctx->queue_head) {
+        return;
+    }
+
+    const uint32_t block_size = ctx->page_size * ctx->pages_per_block;
+    const uint32_t block_address = erase_pool_block_address(ctx,
+            pool->next_block + pool->ready_count);
+    if(!pool->checking) {
+        pool->checking = true;
+        pool->check_offset = 0;
+    }
+
+    // Reads bypass the page cache: they would only pollute it
+    if(!read_blocking(ctx, block_address + pool->check_offset,
+                pool->check_buffer, sizeof(pool->check_buffer))) {
+        return;
+    }
+    for(size_t i=0;i<sizeof(pool->check_buffer);i++) {
+        if(pool->check_buffer[i] != 0xFF) {
+            pool->checking = false;
+
+            const SPIFlashOp erase = {
+                .type = SPI_FLASH_OP_ERASE_BLOCK,
+                .address = block_address,
+            };
+            pool->erase_op = erase;
+            pool->erase_busy = SPI_flash_submit(ctx, &pool->erase_op);
+            return;
+        }
+    }
+
+    pool->check_offset+= sizeof(pool->check_buffer);
+    if(pool->check_offset >= block_size) {
+        pool->checking = false;
+        pool->blank_skips++;
+        pool->ready_count++;
+    }
+}
+
+void SPI_flash_poll(SPIFlash *ctx)
+{
+    while(queue_step(ctx)) {
+    }
+    if(ctx->erase_pool) {
+        erase_pool_step(ctx);
+    }
+    power_down_if_idle(ctx);
+}
+
+void SPI_flash_set_power_down(SPIFlash *ctx,
+        uint32_t idle_timeout_us, uint32_t wake_time_us)
+{
+    ctx->power_down_idle_us = idle_timeout_us;
+    ctx->wake_time_us = wake_time_us;
+}
+
+void SPI_flash_set_sleep_func(SPIFlash *ctx, SPIFlashSleepFunc sleep)
+{
+    ctx->sleep = sleep ? sleep : delay_us;
+}
+
+void SPI_flash_get_power_stats(SPIFlash *ctx, SPIFlashPowerStats *stats)
+{
+    *stats = ctx->power_stats;
+    if(ctx->powered_down) {
+        stats->time_asleep_us+= delay_calc_time_us(ctx->t_power_down,
+                delay_get_timestamp());
+    }
+}
+
+/**
+ * Select the largest erase type that can be used at the given address
+ * without erasing past end_address. Erase sizes are powers of two, so
+ * repeating this gives the fewest erase commands for a range.
+ */
+static size_t erase_plan_next_type(SPIFlash *ctx,
+        uint32_t address, uint32_t end_address)
+{
+    for(size_t i=SPI_FLASH_ERASE_TYPE_COUNT;i-- > 1;) {
+        const uint32_t type_size = ctx->erase_types[i].size;
+        if(type_size && !(address & (type_size-1))
+                && (type_size <= (end_address - address))) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+bool SPI_flash_erase_plan(SPIFlash *ctx, uint32_t start_address, size_t size,
+        SPIFlashErasePlan *plan)
+{
+    memset(plan, 0, sizeof(*plan));
+
+    const uint32_t block_size = ctx->page_size * ctx->pages_per_block;
+    const uint32_t end_address = block_size * ctx->block_count;
+    if((start_address & (block_size-1)) || (size & (block_size-1))) {
+        return false;
+    }
+    if((start_address > end_address) || (size > (end_address - start_address))) {
+        return false;
+    }
+
+    if((start_address == 0) && (size == end_address)) {
+        plan->chip_erase = true;
+        plan->command_count = 1;
+        return true;
+    }
+
+    uint32_t address = start_address;
+    while(address < (start_address + size)) {
+        const size_t type = erase_plan_next_type(ctx,
+                address, start_address + size);
+        plan->count[type]++;
+        plan->command_count++;
+        address+= ctx->erase_types[type].size;
+    }
+    return true;
+}
+
+bool SPI_flash_erase_range(SPIFlash *ctx, uint32_t start_address, size_t size,
+        SPIFlashErasePlan *plan)
+{
+    SPIFlashErasePlan local_plan;
+    if(!plan) {
+        plan = &local_plan;
+    }
+    if(!SPI_flash_erase_plan(ctx, start_address, size, plan)) {
+        return false;
+    }
+    if(plan->chip_erase) {
+        return SPI_flash_erase_all(ctx);
+    }
+
+    uint32_t address = start_address;
+    while(address < (start_address + size)) {
+        const size_t type = erase_plan_next_type(ctx,
+                address, start_address + size);
+
+        if(!wait_while_busy(ctx)) {
+            return false;
+        }
+        if(!erase_start(ctx, ctx->erase_types[type].opcode, address,
+                    ctx->erase_types[type].size, NULL, NULL)) {
+            return false;
+        }
+        job_wait(ctx);
+        address+= ctx->erase_types[type].size;
+    }
+    return true;
+}
+
+typedef enum {
+    UPDATE_SKIP,
+    UPDATE_PROGRAM,
+    UPDATE_ERASE,
+} UpdateAction;
+
+/**
+ * Compare flash contents to new data (or to blank if src is NULL)
+ * to find out what it takes to update it.
+ */
+static bool update_compare(SPIFlash *ctx, uint32_t address,
+        const uint8_t *src, size_t size, UpdateAction *action)
+{
+    uint8_t chunk[SPI_FLASH_COMPARE_CHUNK];
+
+    *action = UPDATE_SKIP;
+    for(size_t offset=0;offset<size;offset+=sizeof(chunk)) {
+        size_t len = size - offset;
+        if(len > sizeof(chunk)) {
+            len = sizeof(chunk);
+        }
+        if(!wait_while_busy(ctx)
+                || !read_blocking(ctx, address + offset, chunk, len)) {
+            return false;
+        }
+        for(size_t i=0;i<len;i++) {
+            const uint8_t data = src ? src[offset + i] : 0xFF;
+            if((chunk[i] & data) != data) {
+                *action = UPDATE_ERASE;
+                return true;
+            }
+            if(chunk[i] != data) {
+                *action = UPDATE_PROGRAM;
+            }
+        }
+    }
+    return true;
+}
+
+static bool is_blank_data(const uint8_t *data, size_t size)
+{
+    for(size_t i=0;i<size;i++) {
+        if(data[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t update_page_chunk(SPIFlash *ctx, uint32_t address,
+        uint32_t end_address)
+{
+    size_t chunk = ctx->page_size - (address & (ctx->page_size-1));
+    if(chunk > (end_address - address)) {
+        chunk = end_address - address;
+    }
+    return chunk;
+}
+
+/**
+ * What an update changes, see update_plan()
+ */
+typedef struct {
+    // From the first page that changes to the end of the last one.
+    // Both are at the end of the range if nothing changes.
+    uint32_t first;
+    uint32_t end;
+
+    // True if a block in [first, end) needs an erase
+    bool erase;
+} UpdatePlan;
+
+/**
+ * Check that the parts of an erase block outside [range_start, range_end)
+ * are blank, so erasing the block loses nothing.
+ */
+static bool update_outside_blank(SPIFlash *ctx, uint32_t block_address,
+        uint32_t range_start, uint32_t range_end)
+{
+    const uint32_t block_end = block_address
+        + (ctx->page_size * ctx->pages_per_block);
+
+    UpdateAction before = UPDATE_SKIP;
+    UpdateAction after = UPDATE_SKIP;
+    if((block_address < range_start)
+            && !update_compare(ctx, block_address, NULL,
+                range_start - block_address, &before)) {
+        return false;
+    }
+    if((range_end < block_end)
+            && !update_compare(ctx, range_end, NULL,
+                block_end - range_end, &after)) {
+        return false;
+    }
+    return (before == UPDATE_SKIP) && (after == UPDATE_SKIP);
+}
+
+/**
+ * Compare [address, address+size) to the new data without writing anything,
+ * and find out what changes.
+ *
+ * A block that needs an erase is in the plan as far as it is in
+ * [address, address+size): all of that is programmed again after the erase.
+ * Its remaining pages are not compared.
+ *
+ * @param range_start, range_end    The range of the whole update: parts of
+ *                                  blocks outside it must be blank to erase
+ *
+ * @return  False if a block needs an erase but holds data outside the range
+ */
+static bool update_plan(SPIFlash *ctx, uint32_t address, const uint8_t *src,
+        size_t size, uint32_t range_start, uint32_t range_end,
+        UpdatePlan *plan)
+{
+    const uint32_t block_size = ctx->page_size * ctx->pages_per_block;
+    const uint32_t end_address = address + size;
+
+    plan->first = end_address;
+    plan->end = end_address;
+    plan->erase = false;
+    for(uint32_t page=address;page<end_address;) {
+        const size_t chunk = update_page_chunk(ctx, page, end_address);
+
+        UpdateAction action;
+        if(!update_compare(ctx, page, src + (page - address), chunk,
+                    &action)) {
+            return false;
+        }
+        uint32_t change_start = page;
+        uint32_t change_end = page + chunk;
+        if(action == UPDATE_ERASE) {
+            const uint32_t block_address = page & ~(block_size-1);
+            if(!update_outside_blank(ctx, block_address,
+                        range_start, range_end)) {
+                return false;
+            }
+            plan->erase = true;
+            if(block_address > address) {
+                change_start = block_address;
+            } else {
+                change_start = address;
+            }
+            change_end = block_address + block_size;
+            if(change_end > end_address) {
+                change_end = end_address;
+            }
+        }
+        if(action != UPDATE_SKIP) {
+            if(change_start < plan->first) {
+                plan->first = change_start;
+            }
+            plan->end = change_end;
+        }
+        page = change_end;
+    }
+    return true;
+}
+
+/**
+ * Apply the plan for the part of one erase block in [plan->first, plan->end)
+ *
+ * @param address   Start of the range that src holds the new data for
+ */
+static bool update_block(SPIFlash *ctx, uint32_t address, const uint8_t *src,
+        const UpdatePlan *plan, SPIFlashUpdateStats *stats)
+{
+    if(plan->erase) {
+        const uint32_t block_size = ctx->page_size * ctx->pages_per_block;
+        if(!wait_while_busy(ctx)
+                || !erase_start(ctx, ctx->erase_block_opcode,
+                    plan->first & ~(block_size-1), block_size, NULL, NULL)) {
+            return false;
+        }
+        job_wait(ctx);
+        stats->blocks_erased++;
+    }
+
+    for(uint32_t page=plan->first;page<plan->end;) {
+        const size_t chunk = update_page_chunk(ctx, page, plan->end);
+        const uint8_t *data = src + (page - address);
+
+        bool program;
+        if(plan->erase) {
+            program = !is_blank_data(data, chunk);
+        } else {
+            // Only pages in between the first and last change are read again
+            UpdateAction action;
+            if(!update_compare(ctx, page, data, chunk, &action)
+                    || (action == UPDATE_ERASE)) {
+                return false;
+            }
+            program = (action == UPDATE_PROGRAM);
+        }
+        if(program) {
+            if(!wait_while_busy(ctx)
+                    || !SPI_flash_program(ctx, page, data, chunk)) {
+                return false;
+            }
+            stats->pages_programmed++;
+        }
+        page+= chunk;
+    }
+    return true;
+}
+
+bool SPI_flash_update_range(SPIFlash *ctx, uint32_t address,
+        const void *src, size_t sizeof_src, SPIFlashUpdateStats *stats)
+{
+    SPIFlashUpdateStats local_stats;
+    if(!stats) {
+        stats = &local_stats;
+    }
+    memset(stats, 0, sizeof(*stats));
+
+    const uint32_t block_size = ctx->page_size * ctx->pages_per_block;
+    const uint32_t flash_end = block_size * ctx->block_count;
+    if((address >= flash_end) || (sizeof_src > (flash_end - address))) {
+        return false;
+    }
+    if(!sizeof_src) {
+        return true;
+    }
+    const uint8_t *src_bytes = src;
+    const uint32_t end_address = address + sizeof_src;
+
+    // Find out what changes before writing anything: an update that
+    // cannot be done fails without changing the flash
+    UpdatePlan plan;
+    if(!update_plan(ctx, address, src_bytes, sizeof_src,
+                address, end_address, &plan)) {
+        return false;
+    }
+    const bool single_block = ((plan.first & ~(block_size-1))
+            == ((plan.end - 1) & ~(block_size-1)));
+
+    for(uint32_t start=plan.first;start<plan.end;) {
+        uint32_t end = (start & ~(block_size-1)) + block_size;
+        if(end > plan.end) {
+            end = plan.end;
+        }
+
+        // Without an erase anywhere, or in a single block, the plan of the
+        // whole range is the plan of the block. Otherwise, find out which
+        // blocks need the erase: the blank check was done above.
+        UpdatePlan block_plan = {.first = start, .end = end, .erase = false};
+        if(single_block) {
+            block_plan = plan;
+        } else if(plan.erase) {
+            const uint32_t block_address = start & ~(block_size-1);
+            if(!update_plan(ctx, start, src_bytes + (start - address),
+                        end - start, block_address,
+                        block_address + block_size, &block_plan)) {
+                return false;
+            }
+        }
+        if(!update_block(ctx, address, src_bytes, &block_plan, stats)) {
+            return false;
+        }
+        start = end;
+    }
+
+    const uint32_t page_count = ((end_address - 1) / ctx->page_size)
+        - (address / ctx->page_size) + 1;
+    stats->pages_skipped = page_count - stats->pages_programmed;
+    return wait_while_busy(ctx);
+}
+
+/**
+ * First address in the striped address space at or after 'address'
+ * that is stored on the given device (0 or 1).
+ */
+static uint32_t striped_next(uint32_t address, size_t stripe_size,
+        size_t device)
+{
+    if(((address / stripe_size) % 2) != device) {
+        address = ((address / stripe_size) + 1) * stripe_size;
+    }
+    return address;
+}
+
+static uint32_t striped_device_address(uint32_t address, size_t stripe_size)
+{
+    return (address / (2*stripe_size)) * stripe_size + (address % stripe_size);
+}
+
+bool SPI_flash_read_striped(SPIFlash *flash_a, SPIFlash *flash_b,
+        uint32_t address, void *result, size_t sizeof_result,
+        size_t stripe_size)
+{
+    if(!stripe_size) {
+        return false;
+    }
+
+    SPIFlash *devices[2] = {flash_a, flash_b};
+    uint8_t *result_bytes = result;
+    const uint32_t end_address = address + sizeof_result;
+    uint32_t next[2] = {
+        striped_next(address, stripe_size, 0),
+        striped_next(address, stripe_size, 1)
+    };
+
+    // A read cannot start while a chip is erasing or programming
+    if(!SPI_flash_wait_ready(flash_a) || !SPI_flash_wait_ready(flash_b)) {
+        return false;
+    }
+
+    // Keep both chips busy: start the next stripe on a chip
+    // as soon as its previous stripe is done.
     bool ok = true;
-    ok&= send_write_enable();
-
-    SPI_transfer_begin();
-    const uint8_t cmd[] = {
-        SPI_FLASH_CMD_PROGRAM_PAGE,
-        (address >> 16) & 0xFF,
-        (address >> 8 ) & 0xFF,
-        (address >> 0 ) & 0xFF
+    while(ok && ((next[0] < end_address) || (next[1] < end_address))) {
+        bool started = false;
+        for(size_t d=0;d<2;d++) {
+            if((next[d] >= end_address) || job_is_busy(devices[d])) {
+                continue;
+            }
+            size_t chunk = stripe_size - (next[d] % stripe_size);
+            if(chunk > (end_address - next[d])) {
+                chunk = end_address - next[d];
+            }
+            if(!SPI_flash_read_async(devices[d],
+                        striped_device_address(next[d], stripe_size),
+                        result_bytes + (next[d] - address), chunk,
+                        NULL, NULL)) {
+                ok = false;
+                break;
+            }
+            next[d] = striped_next(next[d] + chunk, stripe_size, d);
+            started = true;
+        }
+        if(!started) {
+            SPI_FLASH_WAIT_HOOK();
+        }
+    }
+    job_wait(flash_a);
+    job_wait(flash_b);
+    return ok;
+}
+
+bool SPI_flash_write_striped(SPIFlash *flash_a, SPIFlash *flash_b,
+        uint32_t address, const void *src, size_t sizeof_src,
+        size_t stripe_size)
+{
+    if(!stripe_size) {
+        return false;
+    }
+
+    SPIFlash *devices[2] = {flash_a, flash_b};
+    const uint8_t *src_bytes = src;
+    const uint32_t end_address = address + sizeof_src;
+
+    while(address < end_address) {
+        const size_t d = (address / stripe_size) % 2;
+        size_t chunk = stripe_size - (address % stripe_size);
+        if(chunk > (end_address - address)) {
+            chunk = end_address - address;
+        }
+        if(!wait_while_busy(devices[d])) {
+            return false;
+        }
+        if(!SPI_flash_write(devices[d],
+                    striped_device_address(address, stripe_size),
+                    src_bytes, chunk)) {
+            return false;
+        }
+        address+= chunk;
+        src_bytes+= chunk;
+    }
+    return true;
+}
+
+bool SPI_flash_cache_init(SPIFlash *ctx, SPIFlashCache *cache,
+        void *mem, size_t sizeof_mem)
+{
+    ctx->cache = NULL;
+
+    const size_t entry_size = sizeof(SPIFlashCacheTag) + ctx->page_size;
+    const size_t entry_count = sizeof_mem / entry_size;
+    if(!cache || !mem || !entry_count) {
+        return false;
+    }
+
+    cache->tags = mem;
+    cache->data = (uint8_t*)mem + (entry_count * sizeof(SPIFlashCacheTag));
+    cache->entry_count = entry_count;
+    cache->use_count = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    for(size_t i=0;i<entry_count;i++) {
+        cache->tags[i].page_address = SPI_FLASH_CACHE_INVALID;
+        cache->tags[i].last_used = 0;
+    }
+
+    ctx->cache = cache;
+    return true;
+}
+
+bool SPI_flash_erase_pool_init(SPIFlash *ctx, SPIFlashErasePool *pool,
+        uint32_t start_address, size_t block_count, size_t target_count)
+{
+    ctx->erase_pool = NULL;
+
+    const uint32_t block_size = ctx->page_size * ctx->pages_per_block;
+    if((start_address % block_size) || !target_count
+            || (target_count >= block_count)
+            || ((start_address / block_size) + block_count)
+                > ctx->block_count) {
+        return false;
+    }
+
+    pool->start_address = start_address;
+    pool->block_count = block_count;
+    pool->target_count = target_count;
+    pool->next_block = 0;
+    pool->ready_count = 0;
+    pool->taken_count = 0;
+    pool->checking = false;
+    pool->check_offset = 0;
+    pool->erase_busy = false;
+    pool->erases = 0;
+    pool->blank_skips = 0;
+    pool->misses = 0;
+
+    ctx->erase_pool = pool;
+    return true;
+}
+
+bool SPI_flash_erase_pool_take(SPIFlash *ctx, uint32_t *block_address)
+{
+    SPIFlashErasePool *pool = ctx->erase_pool;
+    if(!pool) {
+        return false;
+    }
+    if(!pool->ready_count) {
+        pool->misses++;
+        return false;
+    }
+
+    // The block being prepared keeps its index: next_block + ready_count
+    *block_address = erase_pool_block_address(ctx, pool->next_block);
+    pool->next_block = (pool->next_block + 1) % pool->block_count;
+    pool->ready_count--;
+    pool->taken_count++;
+    return true;
+}
+
+bool SPI_flash_erase_pool_release(SPIFlash *ctx, uint32_t block_address)
+{
+    SPIFlashErasePool *pool = ctx->erase_pool;
+    if(!pool || !pool->taken_count) {
+        return false;
+    }
+    const size_t oldest = pool->next_block + pool->block_count
+        - pool->taken_count;
+    if(block_address != erase_pool_block_address(ctx, oldest)) {
+        return false;
+    }
+    pool->taken_count--;
+    return true;
+}
+
+static bool send_command(SPIFlash *ctx, uint8_t opcode)
+{
+    const SPITransfer xfer = {
+        .header = {opcode},
+        .header_len = 1,
     };
-    const size_t cmd_size = sizeof(cmd);
+    return job_run_blocking(ctx, &xfer, false);
+}
+
+/**
+ * Send the suspend command for the running erase or program operation.
+ *
+ * Once this succeeded, the operation must be resumed, also if the chip
+ * does not report being suspended in time.
+ */
+static bool suspend(SPIFlash *ctx)
+{
+    // Some time is needed between a resume and the next suspend,
+    // to let the operation make progress
+    const uint32_t since_resume_us = delay_calc_time_us(ctx->t_resume,
+            delay_get_timestamp());
+    if(since_resume_us < ctx->resume_interval_us) {
+        ctx->sleep(ctx->resume_interval_us - since_resume_us);
+    }
+    return send_command(ctx, ctx->suspend_opcode);
+}
+
+/**
+ * Wait up to suspend_latency_us for the chip to suspend
+ *
+ * @return  True once the chip is suspended and ready for a read
+ */
+static bool wait_suspended(SPIFlash *ctx)
+{
+    const uint64_t t_suspend = delay_get_timestamp();
+    while(true) {
+        uint8_t status;
+        if(!get_status(ctx, &status)) {
+            return false;
+        }
+        if(!(status & WIP)) {
+            return true;
+        }
+        if(delay_calc_time_us(t_suspend, delay_get_timestamp())
+                > ctx->suspend_latency_us) {
+            return false;
+        }
+        ctx->sleep(1);
+    }
+}
 
-    ok&= (SPI_write_blocking(cmd, cmd_size) == cmd_size);
-    ok&= (SPI_write_blocking(src, sizeof_src) == sizeof_src);
-    SPI_transfer_end();
+static bool resume(SPIFlash *ctx)
+{
+    const bool ok = send_command(ctx, ctx->resume_opcode);
+    ctx->t_resume = delay_get_timestamp();
+    return ok;
+}
+
+bool SPI_flash_read_urgent(SPIFlash *ctx, uint32_t address,
+        void *result, size_t sizeof_result)
+{
+    const uint64_t t_start = delay_get_timestamp();
+
+    // A transfer on the bus always finishes quickly
+    job_wait(ctx);
+    if(!access_begin(ctx)) {
+        return false;
+    }
+
+    uint8_t status;
+    if(!get_status(ctx, &status)) {
+        return false;
+    }
+
+    SPIFlashUrgentReadStats *stats = &ctx->urgent_stats;
+    bool suspended = false;
+    bool ready = !(status & WIP);
+    if(!ready && ctx->suspendable && ctx->suspend_opcode) {
+        if(!suspend(ctx)) {
+            return false;
+        }
+        suspended = true;
+        ready = wait_suspended(ctx);
+        if(!ready) {
+            // Late: the chip suspends or finishes the operation at some
+            // point, either way WIP clears. It is resumed after the read.
+            stats->suspend_timeouts++;
+        }
+    }
+    if(!ready && !wait_while_busy(ctx)) {
+        if(suspended) {
+            resume(ctx);
+        }
+        return false;
+    }
+
+    // While suspended, the operation does not count as running: only the
+    // time it ran before is subtracted from its expected duration.
+    uint32_t op_typ_us = ctx->op_typ_us;
+    uint32_t op_max_us = ctx->op_max_us;
+    if(suspended && op_typ_us) {
+        const uint32_t elapsed_us = op_elapsed_us(ctx);
+        op_typ_us = (elapsed_us < op_typ_us) ? (op_typ_us - elapsed_us) : 1;
+        if(op_max_us) {
+            op_max_us = (elapsed_us < op_max_us) ? (op_max_us - elapsed_us) : 1;
+        }
+        ctx->op_typ_us = 0;
+    }
+
+    const bool ok = read_blocking(ctx, address, result, sizeof_result);
+
+    stats->read_count++;
+    stats->last_latency_us = delay_calc_time_us(t_start, delay_get_timestamp());
+    if(stats->last_latency_us > stats->max_latency_us) {
+        stats->max_latency_us = stats->last_latency_us;
+    }
+
+    if(suspended) {
+        stats->suspend_count++;
+        const bool resumed = resume(ctx);
+        ctx->t_op_start = ctx->t_resume;
+        ctx->op_typ_us = op_typ_us;
+        ctx->op_max_us = op_max_us;
+        return ok && resumed;
+    }
     return ok;
 }
 
+void SPI_flash_get_urgent_read_stats(SPIFlash *ctx,
+        SPIFlashUrgentReadStats *stats)
+{
+    *stats = ctx->urgent_stats;
+}
+
+static void stream_fetch_done(void *cb_ctx, bool ok)
+{
+    SPIFlashStream *stream = cb_ctx;
+
+    // The buffer that was fetched is the one before fetch_buffer
+    const size_t b = stream->fetch_buffer ^ 1;
+    if(ok) {
+        stream->state[b] = SPI_FLASH_STREAM_READY;
+    } else {
+        stream->state[b] = SPI_FLASH_STREAM_FREE;
+        stream->error = true;
+    }
+}
+
+/**
+ * Start fetching the next chunk if its buffer is free and the bus is idle
+ */
+static void stream_fetch_start(SPIFlashStream *stream)
+{
+    const size_t b = stream->fetch_buffer;
+    if((stream->state[b] != SPI_FLASH_STREAM_FREE)
+            || (stream->fetch_address >= stream->end_address)) {
+        return;
+    }
+
+    size_t len = stream->end_address - stream->fetch_address;
+    if(len > stream->chunk_size) {
+        len = stream->chunk_size;
+    }
+    stream->len[b] = len;
+    stream->state[b] = SPI_FLASH_STREAM_FETCHING;
+    stream->fetch_buffer^= 1;
+
+    if(!SPI_flash_read_async(stream->flash, stream->fetch_address,
+                stream->buffers[b], len, stream_fetch_done, stream)) {
+        // Busy: retry later
+        stream->fetch_buffer^= 1;
+        stream->state[b] = SPI_FLASH_STREAM_FREE;
+        return;
+    }
+    stream->fetch_address+= len;
+}
+
+bool SPI_flash_stream_begin(SPIFlash *ctx, SPIFlashStream *stream,
+        uint32_t address, size_t size, void *buffers, size_t chunk_size)
+{
+    if(!chunk_size) {
+        return false;
+    }
+    stream->flash = ctx;
+    stream->buffers[0] = buffers;
+    stream->buffers[1] = (uint8_t*)buffers + chunk_size;
+    stream->chunk_size = chunk_size;
+    stream->state[0] = SPI_FLASH_STREAM_FREE;
+    stream->state[1] = SPI_FLASH_STREAM_FREE;
+    stream->fetch_address = address;
+    stream->end_address = address + size;
+    stream->fetch_buffer = 0;
+    stream->consume_buffer = 0;
+    stream->error = false;
+    stream->chunk_count = 0;
+    stream->stall_count = 0;
+    stream->stall_time_us = 0;
+
+    stream_fetch_start(stream);
+    return true;
+}
+
+const uint8_t *SPI_flash_stream_next(SPIFlashStream *stream, size_t *len)
+{
+    // Release the previous chunk
+    const size_t previous = stream->consume_buffer ^ 1;
+    if(stream->state[previous] == SPI_FLASH_STREAM_HELD) {
+        stream->state[previous] = SPI_FLASH_STREAM_FREE;
+    }
+    stream_fetch_start(stream);
+
+    const size_t b = stream->consume_buffer;
+    if(stream->state[b] != SPI_FLASH_STREAM_READY) {
+        const uint64_t t_start = delay_get_timestamp();
+        stream->stall_count++;
+
+        while(stream->state[b] != SPI_FLASH_STREAM_READY) {
+            if(stream->error) {
+                return NULL;
+            }
+            if(stream->state[b] == SPI_FLASH_STREAM_FREE) {
+                if(stream->fetch_address >= stream->end_address) {
+                    // End of the stream: this was not a stall
+                    stream->stall_count--;
+                    return NULL;
+                }
+                stream_fetch_start(stream);
+            }
+            SPI_FLASH_WAIT_HOOK();
+        }
+        stream->stall_time_us+= delay_calc_time_us(t_start,
+                delay_get_timestamp());
+    }
+
+    stream->state[b] = SPI_FLASH_STREAM_HELD;
+    stream->consume_buffer^= 1;
+    stream->chunk_count++;
+
+    // Fetch ahead while the consumer processes this chunk
+    stream_fetch_start(stream);
+
+    *len = stream->len[b];
+    return stream->buffers[b];
+}
+
+void SPI_flash_stream_end(SPIFlashStream *stream)
+{
+    while((stream->state[0] == SPI_FLASH_STREAM_FETCHING)
+            || (stream->state[1] == SPI_FLASH_STREAM_FETCHING)) {
+        SPI_FLASH_WAIT_HOOK();
+    }
+}
@@ -19,11 +19,347 @@ typedef union
 	uint8_t bytes[4];
 } JEDECID;
 
+#define SPI_FLASH_ERASE_TYPE_COUNT  (4)
+
+typedef struct {
+    uint32_t size;          // bytes, 0 if this entry is unused
+    uint8_t opcode;
+    uint32_t typ_time_ms;   // typical erase time, 0 if unknown
+} SPIFlashEraseType;
+
+/**
+ * Flash chip geometry and timing, see SPI_flash_get_info()
+ */
+typedef struct {
+    size_t page_size;
+    size_t erase_block_size;
+    size_t total_size;
+
+    // Supported erase commands, sorted by size (smallest first)
+    SPIFlashEraseType erase_types[SPI_FLASH_ERASE_TYPE_COUNT];
+
+    // Typical timing, 0 if unknown
+    uint32_t page_program_us;
+    uint32_t chip_erase_ms;
+
+    // Maximum time = typical time * factor, 0 if unknown
+    uint8_t program_max_factor;
+    uint8_t erase_max_factor;
+
+    // Maximum time to suspend an erase or program operation (tSUS),
+    // 0 if suspend is not supported. See SPI_flash_read_urgent().
+    uint32_t suspend_latency_us;
+} SPIFlashInfo;
+
+/**
+ * The erase commands used to erase a range, see SPI_flash_erase_range()
+ */
+typedef struct {
+    // Number of erase commands per erase type (as in SPIFlashInfo.erase_types)
+    uint32_t count[SPI_FLASH_ERASE_TYPE_COUNT];
+
+    // True if the range is erased with a single chip erase command
+    bool chip_erase;
+
+    uint32_t command_count;
+} SPIFlashErasePlan;
+
+/**
+ * What SPI_flash_update_range() had to do
+ */
+typedef struct {
+    uint32_t pages_skipped;     // already contained the new data
+    uint32_t pages_programmed;
+    uint32_t blocks_erased;
+} SPIFlashUpdateStats;
+
+/**
+ * Deep power-down statistics, see SPI_flash_set_power_down()
+ */
+typedef struct {
+    uint32_t power_down_count;
+    uint64_t time_asleep_us;
+
+    // Latency added to the first access after a power-down
+    uint32_t wake_count;
+    uint32_t last_wake_latency_us;
+    uint64_t total_wake_latency_us;
+} SPIFlashPowerStats;
+
+/**
+ * Statistics of SPI_flash_read_urgent()
+ */
+typedef struct {
+    uint32_t read_count;
+    uint32_t suspend_count;     // reads that suspended an erase or program
+    uint32_t suspend_timeouts;  // not suspended within suspend_latency_us
+    uint32_t last_latency_us;
+    uint32_t max_latency_us;    // from the call until the data is read
+} SPIFlashUrgentReadStats;
+
+// Largest gap between two requests of SPI_flash_readv() that is read and
+// discarded instead of starting a new command. A new command costs 4 header
+// bytes plus CS toggling and transfer setup in software: at 24MHz, the
+// latter is worth a few more bytes.
+#define SPI_FLASH_READV_MAX_GAP     (16)
+
+/**
+ * One request of SPI_flash_readv()
+ */
+typedef struct {
+    uint32_t address;
+    void *buffer;
+    size_t size;
+} SPIFlashIOV;
+
+#define SPI_FLASH_CACHE_INVALID     (0xFFFFFFFF)
+
+typedef struct {
+    uint32_t page_address;  // SPI_FLASH_CACHE_INVALID if unused
+    uint32_t last_used;
+} SPIFlashCacheTag;
+
+/**
+ * RAM page cache for SPI_flash_read(), see SPI_flash_cache_init()
+ */
+typedef struct {
+    SPIFlashCacheTag *tags;
+    uint8_t *data;
+    size_t entry_count;
+    uint32_t use_count;
+
+    // Statistics: reads served from RAM vs pages read from flash
+    uint32_t hits;
+    uint32_t misses;
+} SPIFlashCache;
+
+/**
+ * Called when an asynchronous operation is finished.
+ *
+ * NOTE: this is called from the SSP interrupt handler.
+ *
+ * @param ctx   The context pointer that was passed with the operation
+ * @param ok    True if the operation was succesfull
+ */
+typedef void (*SPIFlashCallback)(void *ctx, bool ok);
+
+/**
+ * Wait for (at least) the given time, see SPI_flash_set_sleep_func()
+ */
+typedef void (*SPIFlashSleepFunc)(uint32_t us);
+
+enum SPIFlashOpType {
+    SPI_FLASH_OP_READ,
+    SPI_FLASH_OP_PROGRAM,
+    SPI_FLASH_OP_ERASE_BLOCK,
+    SPI_FLASH_OP_ERASE_ALL,
+};
+
+enum SPIFlashOpState {
+    SPI_FLASH_OP_STATE_QUEUED,
+    SPI_FLASH_OP_STATE_TRANSFER,
+    SPI_FLASH_OP_STATE_WAIT_READY,
+    SPI_FLASH_OP_STATE_DONE,
+};
+
+/**
+ * A queued flash operation, see SPI_flash_submit().
+ *
+ * The caller owns the memory of the operation (and its buffer):
+ * it should remain valid until the callback is called.
+ */
+typedef struct SPIFlashOp {
+    enum SPIFlashOpType type;
+    uint32_t address;   // ignored for SPI_FLASH_OP_ERASE_ALL
+    void *buffer;       // READ: destination, PROGRAM: source
+    size_t size;        // size of buffer in bytes
+
+    // called from SPI_flash_poll() when the operation is finished
+    SPIFlashCallback cb;
+    void *cb_ctx;
+
+    // private
+    struct SPIFlashOp *next;
+    volatile enum SPIFlashOpState state;
+    bool ok;
+} SPIFlashOp;
+
+#define SPI_FLASH_BLANK_CHECK_CHUNK (64)
+
+/**
+ * Pool of pre-erased blocks, see SPI_flash_erase_pool_init()
+ */
+typedef struct {
+    uint32_t start_address;
+    size_t block_count;
+    size_t target_count;
+
+    // Blocks are handed out in order: the ready ones follow next_block,
+    // the taken ones that were not released yet precede it
+    size_t next_block;
+    volatile size_t ready_count;
+    size_t taken_count;
+
+    // Preparation of the block after the ready ones
+    bool checking;
+    uint32_t check_offset;
+    bool erase_busy;
+    SPIFlashOp erase_op;
+    uint8_t check_buffer[SPI_FLASH_BLANK_CHECK_CHUNK];
+
+    // Statistics
+    uint32_t erases;
+    uint32_t blank_skips;   // blocks that were already blank
+    uint32_t misses;        // SPI_flash_erase_pool_take() found none ready
+} SPIFlashErasePool;
+
+/**
+ * A single command to the flash chip: the command header (opcode and
+ * optional address) is written, followed by an optional data phase.
+ */
+typedef struct {
+    uint8_t header[5];
+    size_t header_len;
+
+    const uint8_t *tx;  // data to write, or NULL to clock out dummy bytes
+    uint8_t *rx;        // buffer for received data, or NULL to discard it
+    size_t data_len;
+
+    // Leave CS asserted afterwards: the next transfer continues this command
+    bool keep_selected;
+} SPITransfer;
+
+/**
+ * An asynchronous job: an optional WRITE_ENABLE command followed by a
+ * transfer. Once started, the job is driven by the SSP interrupt.
+ */
+typedef struct {
+    volatile bool busy;
+
+    SPITransfer transfer;
+
+    // progress of the current transfer, counted over header and data
+    bool in_write_enable;
+    size_t tx_count;
+    size_t rx_count;
+
+    SPIFlashCallback cb;
+    void *cb_ctx;
+} SPIJob;
+
+/**
+ * SPI flash driver instance, initialized by SPI_flash_init().
+ *
+ * Multiple instances may share an SSP bus (each with its own chip select),
+ * or use different SSP peripherals. All fields are private.
+ */
+typedef struct {
+    LPC_SSP_T *SSP;
+    const GPIO *cs_pin;
+
+    size_t page_size;
+    size_t pages_per_block;
+
+    size_t block_count;
+
+    // Supported erase commands, sorted by size (smallest first)
+    SPIFlashEraseType erase_types[SPI_FLASH_ERASE_TYPE_COUNT];
+    uint8_t erase_block_opcode;
+
+    // Typical timing, 0 if unknown (see SPIFlashInfo)
+    uint32_t page_program_us;
+    uint32_t chip_erase_ms;
+    uint8_t program_max_factor;
+    uint8_t erase_max_factor;
+
+    // Erase/program suspend, opcodes are 0 if not supported
+    uint8_t suspend_opcode;
+    uint8_t resume_opcode;
+    uint32_t suspend_latency_us;
+    uint32_t resume_interval_us;
+    bool suspendable;   // the last started operation can be suspended
+    uint64_t t_resume;
+    SPIFlashUrgentReadStats urgent_stats;
+
+    // Expected duration of the running erase or program operation,
+    // 0 if unknown or nothing is running. See SPI_flash_set_sleep_func().
+    uint64_t t_op_start;
+    uint32_t op_typ_us;
+    uint32_t op_max_us;
+    SPIFlashSleepFunc sleep;
+
+    SPIJob job;
+
+    // Optional page cache, see SPI_flash_cache_init()
+    SPIFlashCache *cache;
+
+    // Optional pre-erased blocks, see SPI_flash_erase_pool_init()
+    SPIFlashErasePool *erase_pool;
+
+    // Deep power-down policy, see SPI_flash_set_power_down()
+    uint32_t power_down_idle_us;
+    uint32_t wake_time_us;
+    bool powered_down;
+    uint64_t t_last_access;
+    uint64_t t_power_down;
+    SPIFlashPowerStats power_stats;
+
+    // Operations submitted via SPI_flash_submit(), see SPI_flash_poll()
+    SPIFlashOp *queue_head;
+    SPIFlashOp *queue_tail;
+} SPIFlash;
+
+enum SPIFlashStreamBufferState {
+    SPI_FLASH_STREAM_FREE,
+    SPI_FLASH_STREAM_FETCHING,
+    SPI_FLASH_STREAM_READY,
+    SPI_FLASH_STREAM_HELD,      // returned to the consumer
+};
+
+/**
+ * Double-buffered stream reader state, see SPI_flash_stream_begin()
+ */
+typedef struct {
+    SPIFlash *flash;
+    uint8_t *buffers[2];
+    size_t chunk_size;
+    size_t len[2];
+    volatile enum SPIFlashStreamBufferState state[2];
+
+    uint32_t fetch_address;
+    uint32_t end_address;
+    size_t fetch_buffer;
+    size_t consume_buffer;
+    volatile bool error;
+
+    // Statistics: the consumer stalls when a chunk is not fetched yet
+    uint32_t chunk_count;
+    uint32_t stall_count;
+    uint64_t stall_time_us;
+} SPIFlashStream;
+
+/**
+ * Streaming writer state, see SPI_flash_writer_begin()
+ */
+typedef struct {
+    SPIFlash *flash;
+    uint32_t address;
+    uint8_t *page_buffer;
+    size_t buffer_count;
+
+    uint32_t bytes_written;
+    uint64_t t_start;
+    uint64_t t_end;
+    bool ok;
+} SPIFlashWriter;
 
 
 /**
  * Initialize the SPI flash, assuming the specified size parameters.
  *
+ * The instance ctx is passed to all other functions. Each flash chip needs
+ * its own instance, also when multiple chips share an SSP bus.
+ *
  * @param page_size         The size of the programmable pages in the flash chip.
  *                          This should match with the specific chip datasheet.
  *                          Typical value: 256.
@@ -34,9 +370,59 @@ typedef union
  *
  * @param total_size        Total size of the flash memory in bytes.
  */
-bool SPI_flash_init(LPC_SSP_T *LPC_SSP, const GPIO *cs_pin,
+bool SPI_flash_init(SPIFlash *ctx, LPC_SSP_T *LPC_SSP, const GPIO *cs_pin,
         size_t page_size, size_t erase_block_size, size_t total_size);
 
+/**
+ * Initialize the SPI flash, reading the size parameters from the chip.
+ *
+ * The geometry and timing are read from the JEDEC SFDP table (JESD216).
+ * SPI_flash_erase_block() will use the smallest supported erase size,
+ * see SPI_flash_get_info() for the results.
+ *
+ * Returns false if the chip does not support SFDP: use SPI_flash_init()
+ * with values from the datasheet instead.
+ */
+bool SPI_flash_init_auto(SPIFlash *ctx, LPC_SSP_T *LPC_SSP, const GPIO *cs_pin);
+
+/**
+ * Get the geometry and timing of the flash chip
+ */
+void SPI_flash_get_info(SPIFlash *ctx, SPIFlashInfo *info);
+
+/**
+ * SSP interrupt handler for the SPI flash driver.
+ *
+ * Call this from the interrupt handler of each SSP peripheral that is used
+ * by an SPI flash instance, e.g. from SSP1_IRQHandler() with LPC_SSP1.
+ * It drives the transfer of the instance that currently uses the bus.
+ */
+void SPI_flash_IRQHandler(LPC_SSP_T *LPC_SSP);
+
+/**
+ * Check if a transfer is still in progress on the SSP bus of this instance.
+ *
+ * While a transfer is in progress, all other calls to any instance on the
+ * same bus will fail.
+ */
+bool SPI_flash_is_transfer_busy(SPIFlash *ctx);
+
+/**
+ * Check if a transfer is in progress, or the flash chip is erasing or
+ * programming, without waiting.
+ *
+ * Until the typical time of the operation has passed, this does not even
+ * read the status register (see SPI_flash_set_sleep_func()).
+ */
+bool SPI_flash_is_busy(SPIFlash *ctx);
+
+/**
+ * Wait until the flash chip has finished erasing or programming.
+ *
+ * @return  False if the chip status could not be read
+ */
+bool SPI_flash_wait_ready(SPIFlash *ctx);
+
 /**
  * Get manufacturer and device info according to the JEDEC standard
  *
@@ -45,14 +431,53 @@ bool SPI_flash_init(LPC_SSP_T *LPC_SSP, const GPIO *cs_pin,
  *
  * If false is returned, you should check the hardware connections.
  */
-bool SPI_flash_read_JEDEC_ID(JEDECID *ID);
+bool SPI_flash_read_JEDEC_ID(SPIFlash *ctx, JEDECID *ID);
 
 /**
  * Read data from flash.
  *
  * Read any amount of data within bounds of the flash memory
  */
-bool SPI_flash_read(uint32_t address, void *result, size_t sizeof_result);
+bool SPI_flash_read(SPIFlash *ctx, uint32_t address,
+        void *result, size_t sizeof_result);
+
+/**
+ * SPI_flash_wait_ready(), then SPI_flash_read(): for reads that may follow
+ * an erase or program operation, which SPI_flash_read() does not wait for.
+ */
+bool SPI_flash_read_when_ready(SPIFlash *ctx, uint32_t address,
+        void *result, size_t sizeof_result);
+
+/**
+ * Read a list of (small) ranges with as few READ commands as possible.
+ *
+ * The requests are handled in address order. Requests that are contiguous or
+ * close to each other are read with a single READ command: gaps of up to
+ * SPI_FLASH_READV_MAX_GAP bytes are clocked in and discarded, as that is
+ * cheaper than a new command. Overlapping requests get a command of their
+ * own. The requests may be given in any order and the list is not modified.
+ *
+ * This bypasses the page cache.
+ *
+ * @return  False if a request is out of bounds or the flash is busy
+ */
+bool SPI_flash_readv(SPIFlash *ctx, const SPIFlashIOV *iov, size_t count);
+
+/**
+ * Start reading data from flash in the background.
+ *
+ * The transfer is driven by the SSP interrupt and handles the chip select
+ * by itself. When all data is read, cb is called with cb_ctx.
+ * The result buffer should remain valid until then.
+ *
+ * @param cb        Completion callback, may be NULL
+ *
+ * @return          False if the transfer could not be started, in which case
+ *                  the callback will not be called.
+ */
+bool SPI_flash_read_async(SPIFlash *ctx, uint32_t address,
+        void *result, size_t sizeof_result,
+        SPIFlashCallback cb, void *cb_ctx);
 
 /**
  * Erase a block of memory at the given address.
@@ -60,12 +485,57 @@ bool SPI_flash_read(uint32_t address, void *result, size_t sizeof_result);
  * NOTE: the address should be aligned to a multipe of erase_block_size
  * as supplied to SPI_flash_init.
  */
-bool SPI_flash_erase_block(uint32_t block_address);
+bool SPI_flash_erase_block(SPIFlash *ctx, uint32_t block_address);
 
 /**
  * Erase all flash memory
  */
-bool SPI_flash_erase_all(void);
+bool SPI_flash_erase_all(SPIFlash *ctx);
+
+/**
+ * Calculate how a range would be erased by SPI_flash_erase_range(),
+ * without erasing anything.
+ */
+bool SPI_flash_erase_plan(SPIFlash *ctx, uint32_t start_address, size_t size,
+        SPIFlashErasePlan *plan);
+
+/**
+ * Erase a range of memory with the fewest, largest erase commands possible.
+ *
+ * At each address the largest supported erase size that is aligned and fits
+ * in the remaining range is used (e.g. 4K/32K/64K). A range covering the whole
+ * flash memory uses a single chip erase.
+ *
+ * NOTE: start_address and size should be aligned to a multiple of
+ * erase_block_size (the smallest erase size).
+ *
+ * @param plan  If not NULL, the plan that was executed is stored here.
+ */
+bool SPI_flash_erase_range(SPIFlash *ctx, uint32_t start_address, size_t size,
+        SPIFlashErasePlan *plan);
+
+/**
+ * Update a range of flash to the given data, doing as little as possible.
+ *
+ * The range is read back one page at a time and compared to the new data:
+ *  - pages that already match are skipped;
+ *  - pages that only need bits cleared (1 -> 0) are programmed without
+ *    erasing;
+ *  - an erase block is only erased if one of its pages needs a bit set.
+ *    Parts of that block outside the range are lost by the erase, so they
+ *    must be blank.
+ *
+ * The whole range is compared before anything is written: if it cannot be
+ * updated, this fails without changing the flash. Only the pages from the
+ * first to the last change are read again to write them.
+ *
+ * Rewriting a large, mostly unchanged image then costs little more than
+ * reading it.
+ *
+ * @param stats If not NULL, what was done is stored here.
+ */
+bool SPI_flash_update_range(SPIFlash *ctx, uint32_t address,
+        const void *src, size_t sizeof_src, SPIFlashUpdateStats *stats);
 
 /**
  * Program a range of previously erased memory.
@@ -74,7 +544,257 @@ bool SPI_flash_erase_all(void);
  * which is a multiple of page_size as supplied to SPI_flash_init.
  * Writes crossing a page boundary will fail.
  */
-bool SPI_flash_program(uint32_t address, const void *src, size_t sizeof_src);
+bool SPI_flash_program(SPIFlash *ctx, uint32_t address,
+        const void *src, size_t sizeof_src);
+
+/**
+ * Start programming a range of previously erased memory in the background.
+ *
+ * Same rules as SPI_flash_program(). The src buffer should remain valid
+ * until cb is called.
+ *
+ * NOTE: cb is called as soon as all data is transferred to the flash chip.
+ * The chip is still busy programming at that point, so the next operation
+ * may fail until programming is finished.
+ */
+bool SPI_flash_program_async(SPIFlash *ctx, uint32_t address,
+        const void *src, size_t sizeof_src,
+        SPIFlashCallback cb, void *cb_ctx);
+
+/**
+ * Program a range of previously erased memory of any length.
+ *
+ * Unlike SPI_flash_program(), the range may cross page boundaries: it is
+ * split into page program operations. Returns as soon as the last page is
+ * transferred, the flash chip may still be busy programming at that point.
+ */
+bool SPI_flash_write(SPIFlash *ctx, uint32_t address,
+        const void *src, size_t sizeof_src);
+
+/**
+ * Start streaming data to a range of previously erased memory.
+ *
+ * Data passed to SPI_flash_writer_append() is collected in page_buffer and
+ * programmed one page at a time. Filling the next page overlaps with the
+ * flash chip programming the previous one.
+ *
+ * @param page_buffer   Buffer of at least page_size bytes (as supplied to
+ *                      SPI_flash_init). It is owned by the writer until
+ *                      SPI_flash_writer_finish() is called.
+ */
+bool SPI_flash_writer_begin(SPIFlash *ctx, SPIFlashWriter *writer,
+        uint32_t address, uint8_t *page_buffer);
+
+/**
+ * Append data to the stream. Returns false if any write failed so far.
+ */
+bool SPI_flash_writer_append(SPIFlashWriter *writer,
+        const void *data, size_t sizeof_data);
+
+/**
+ * Program any remaining data and wait until the flash chip is done.
+ *
+ * Returns false if any write of this stream failed.
+ */
+bool SPI_flash_writer_finish(SPIFlashWriter *writer);
+
+/**
+ * Average write throughput from SPI_flash_writer_begin() until
+ * SPI_flash_writer_finish().
+ */
+uint32_t SPI_flash_writer_bytes_per_sec(const SPIFlashWriter *writer);
+
+/**
+ * Start streaming a range of flash.
+ *
+ * The range is read in chunks into two buffers: while the consumer processes
+ * one chunk (see SPI_flash_stream_next()), the next one is fetched in the
+ * background by the SSP interrupt.
+ *
+ * @param buffers       Memory for two chunks: 2 * chunk_size bytes
+ * @param chunk_size    Size of a chunk. If the stall counters of the stream
+ *                      increase, processing a chunk takes less time than
+ *                      fetching it: larger chunks reduce the overhead.
+ */
+bool SPI_flash_stream_begin(SPIFlash *ctx, SPIFlashStream *stream,
+        uint32_t address, size_t size, void *buffers, size_t chunk_size);
+
+/**
+ * Get the next chunk of the stream, waiting for it if needed.
+ *
+ * The previous chunk is released: its buffer is reused for fetching ahead.
+ *
+ * @param len   Receives the size of the chunk
+ * @return      The chunk data, or NULL at the end of the stream or on error
+ */
+const uint8_t *SPI_flash_stream_next(SPIFlashStream *stream, size_t *len);
+
+/**
+ * Stop streaming: waits for a fetch in progress, so the buffers can be reused
+ */
+void SPI_flash_stream_end(SPIFlashStream *stream);
+
+/**
+ * Add an operation to the queue.
+ *
+ * The operation is executed by SPI_flash_poll() as soon as all previously
+ * submitted operations are finished. For erase and program operations, the
+ * operation is finished when the flash chip is no longer busy, so the next
+ * operation can always start right away.
+ *
+ * NOTE: do not call from an interrupt handler.
+ */
+bool SPI_flash_submit(SPIFlash *ctx, SPIFlashOp *op);
+
+/**
+ * Advance the queue of submitted operations.
+ *
+ * Call this regularly (e.g. from the main loop or a timer tick). It never
+ * waits for the flash chip: while the chip is busy erasing or programming,
+ * this returns right away. Completion callbacks are called from here.
+ */
+void SPI_flash_poll(SPIFlash *ctx);
+
+/**
+ * Check if all submitted operations are finished
+ */
+bool SPI_flash_queue_is_empty(SPIFlash *ctx);
+
+/**
+ * Configure automatic deep power-down.
+ *
+ * When the flash chip was not accessed for idle_timeout_us, SPI_flash_poll()
+ * puts it in deep power-down. The next access transparently wakes it up
+ * again, which adds wake_time_us (tRES1, see the datasheet) of latency.
+ *
+ * @param idle_timeout_us   Quiet period before powering down, 0 to disable.
+ * @param wake_time_us      Time the chip needs to wake up (tRES1).
+ */
+void SPI_flash_set_power_down(SPIFlash *ctx,
+        uint32_t idle_timeout_us, uint32_t wake_time_us);
+
+/**
+ * Set how to wait for erase and program operations to finish.
+ *
+ * The typical and maximum time of each operation are known from SFDP or
+ * the built-in part table (see SPI_flash_get_info()). Instead of reading
+ * the status register continuously, the driver sleeps for the typical time
+ * first and only then polls, a few times per typical time. An operation
+ * that is not done after the maximum time is treated as failed.
+ *
+ * The same timing makes the non-blocking functions report busy without
+ * any bus traffic until the typical time has passed.
+ *
+ * @param sleep Called with the time to wait, e.g. a WFI loop with a timer
+ *              wakeup. NULL restores the default: delay_us().
+ */
+void SPI_flash_set_sleep_func(SPIFlash *ctx, SPIFlashSleepFunc sleep);
+
+/**
+ * Get statistics about time spent in deep power-down and wake latency
+ */
+void SPI_flash_get_power_stats(SPIFlash *ctx, SPIFlashPowerStats *stats);
+
+/**
+ * Read data with priority over a running erase or program operation.
+ *
+ * If the flash chip supports it (see suspend_latency_us in SPIFlashInfo),
+ * the operation is suspended for the read and resumed afterwards. The
+ * worst-case latency is then about suspend_latency_us plus the read itself,
+ * instead of a full erase time. Otherwise this waits for the operation to
+ * finish. A chip that takes longer than suspend_latency_us to suspend is
+ * waited for as if it could not suspend, and resumed after the read.
+ *
+ * NOTE: do not call from an interrupt handler.
+ */
+bool SPI_flash_read_urgent(SPIFlash *ctx, uint32_t address,
+        void *result, size_t sizeof_result);
+
+void SPI_flash_get_urgent_read_stats(SPIFlash *ctx,
+        SPIFlashUrgentReadStats *stats);
+
+/**
+ * Enable a RAM page cache in front of SPI_flash_read().
+ *
+ * Small reads (up to page_size bytes) are served from the cache. On a miss,
+ * the whole page is read into the least recently used entry. Program and
+ * erase operations invalidate the affected pages. Larger reads and
+ * SPI_flash_read_async() bypass the cache.
+ *
+ * The memory may be anywhere, e.g. in the USB RAM region when USB is not
+ * used. Each entry takes page_size + 8 bytes.
+ *
+ * @param cache         Cache state, including hit/miss counters.
+ * @param mem           Memory for the cache entries, 4-byte aligned.
+ * @param sizeof_mem    Size of mem in bytes: the RAM budget of the cache.
+ *
+ * @return              False if mem is too small for a single entry.
+ */
+bool SPI_flash_cache_init(SPIFlash *ctx, SPIFlashCache *cache,
+        void *mem, size_t sizeof_mem);
+
+/**
+ * Keep a pool of pre-erased blocks for write bursts.
+ *
+ * The blocks of the region are handed out in order by
+ * SPI_flash_erase_pool_take(), wrapping around at the end: the region is
+ * used like a ring buffer. A taken block belongs to the caller until it
+ * gives it back with SPI_flash_erase_pool_release(), in the same order.
+ * SPI_flash_poll() prepares the blocks after the taken ones whenever the
+ * operation queue is idle: blocks that are already blank are not erased
+ * again. A burst written to a taken block only pays page program time.
+ *
+ * @param start_address Start of the region, aligned to an erase block
+ * @param block_count   Size of the region in erase blocks
+ * @param target_count  Amount of blocks to keep ready, less than block_count
+ */
+bool SPI_flash_erase_pool_init(SPIFlash *ctx, SPIFlashErasePool *pool,
+        uint32_t start_address, size_t block_count, size_t target_count);
+
+/**
+ * Take the next erased block from the pool.
+ *
+ * The pool does not touch the block again until it is released.
+ *
+ * @param block_address Receives the address of the block
+ * @return              False if no erased block is ready
+ */
+bool SPI_flash_erase_pool_take(SPIFlash *ctx, uint32_t *block_address);
+
+/**
+ * Give the oldest taken block back to the pool, e.g. once its data is no
+ * longer needed. The pool erases it again when its turn comes.
+ *
+ * @param block_address Address of the oldest block that was taken and not
+ *                      released yet
+ * @return              False if that is not the given block
+ */
+bool SPI_flash_erase_pool_release(SPIFlash *ctx, uint32_t block_address);
+
+/**
+ * Read data striped over two flash chips.
+ *
+ * The data is split in stripes of stripe_size bytes, alternating between
+ * the chips: stripe 0 is on flash_a, stripe 1 on flash_b, stripe 2 on flash_a
+ * etc. When both chips are on a different SSP bus, they are read in parallel,
+ * which doubles the sequential read bandwidth.
+ *
+ * @param address       Address in the combined (striped) address space.
+ * @param stripe_size   Stripe size in bytes. Larger stripes have less command
+ *                      overhead, a multiple of page_size is recommended.
+ */
+bool SPI_flash_read_striped(SPIFlash *flash_a, SPIFlash *flash_b,
+        uint32_t address, void *result, size_t sizeof_result,
+        size_t stripe_size);
+
+/**
+ * Program data striped over two flash chips, see SPI_flash_read_striped().
+ *
+ * The range should be erased on both chips.
+ */
+bool SPI_flash_write_striped(SPIFlash *flash_a, SPIFlash *flash_b,
+        uint32_t address, const void *src, size_t sizeof_src,
+        size_t stripe_size);
 
 #endif
 
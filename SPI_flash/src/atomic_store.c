@@ -0,0 +1,300 @@
+#include "atomic_store.h"
+#include "crc32.h"
+
+#include <mcu_timing/delay.h>
+#include <string.h>
+
+#define COMMIT_MAGIC        (0x54494D43)    // "CMIT"
+#define COMMIT_BLANK        (0xFFFFFFFF)
+#define SLOT_NONE           ((size_t)-1)
+
+// The data CRC is calculated through a buffer of this size
+#define CRC_CHUNK           (64)
+
+/**
+ * Commit record. The size divides the page size, so a record never
+ * crosses a page boundary.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t slot;
+    uint32_t length;
+    uint32_t data_crc;
+    uint32_t reserved[2];
+    uint32_t crc;           // CRC of all fields above
+} CommitRecord;
+
+_Static_assert(sizeof(CommitRecord) == 32,
+        "commit record size should divide the page size");
+
+
+static uint32_t record_crc(const CommitRecord *record)
+{
+    return crc32(0, record, offsetof(CommitRecord, crc));
+}
+
+static uint32_t meta_address(const AtomicStore *store, size_t block)
+{
+    return store->start_address + (block * store->block_size);
+}
+
+static uint32_t slot_address(const AtomicStore *store, size_t slot)
+{
+    return meta_address(store, 2) + (slot * store->slot_size);
+}
+
+static bool flash_read(AtomicStore *store, uint32_t address,
+        void *dst, size_t size)
+{
+    return SPI_flash_read_when_ready(store->flash, address, dst, size);
+}
+
+static bool flash_erase(AtomicStore *store, uint32_t address, size_t size)
+{
+    return SPI_flash_wait_ready(store->flash)
+        && SPI_flash_erase_range(store->flash, address, size, NULL);
+}
+
+/**
+ * Calculate the CRC of the data in a slot, as read back from flash
+ */
+static bool slot_crc(AtomicStore *store, size_t slot, size_t length,
+        uint32_t *crc)
+{
+    const uint32_t address = slot_address(store, slot);
+
+    uint8_t chunk[CRC_CHUNK];
+    *crc = 0;
+    for(size_t offset=0;offset<length;offset+=sizeof(chunk)) {
+        size_t len = length - offset;
+        if(len > sizeof(chunk)) {
+            len = sizeof(chunk);
+        }
+        if(!flash_read(store, address + offset, chunk, len)) {
+            return false;
+        }
+        *crc = crc32(*crc, chunk, len);
+    }
+    return true;
+}
+
+/**
+ * Scan a metadata block for the newest valid commit record per slot.
+ *
+ * @param end   Receives the offset where the next record can be written:
+ *              the block size if a damaged record was found
+ */
+static bool meta_scan(AtomicStore *store, size_t block,
+        CommitRecord newest[2], uint32_t *end)
+{
+    const uint32_t address = meta_address(store, block);
+
+    uint32_t offset;
+    for(offset=0;offset<store->block_size;offset+=sizeof(CommitRecord)) {
+        CommitRecord record;
+        if(!flash_read(store, address + offset, &record, sizeof(record))) {
+            return false;
+        }
+        if(record.magic == COMMIT_BLANK) {
+            break;
+        }
+        if((record.magic != COMMIT_MAGIC) || (record.crc != record_crc(&record))
+                || (record.slot > 1) || (record.length > store->slot_size)) {
+            offset = store->block_size;
+            break;
+        }
+        CommitRecord *best = &newest[record.slot];
+        if((best->magic != COMMIT_MAGIC) || (record.seq > best->seq)) {
+            *best = record;
+        }
+    }
+    *end = offset;
+    return true;
+}
+
+bool atomic_store_init(AtomicStore *store, SPIFlash *flash,
+        uint32_t start_address, size_t slot_size)
+{
+    const uint64_t t_start = delay_get_timestamp();
+
+    SPIFlashInfo info;
+    SPI_flash_get_info(flash, &info);
+
+    store->flash = flash;
+    store->start_address = start_address;
+    store->block_size = info.erase_block_size;
+    store->slot_size = slot_size;
+    store->active_slot = SLOT_NONE;
+    store->length = 0;
+    store->seq = 0;
+    store->meta_block = 0;
+    store->meta_offset = 0;
+    store->in_transaction = false;
+
+    if((start_address % store->block_size) || !slot_size
+            || (slot_size % store->block_size)) {
+        return false;
+    }
+    if((start_address + (2 * store->block_size) + (2 * slot_size))
+            > info.total_size) {
+        return false;
+    }
+
+    // Find the newest commit record for each slot and where it is stored
+    CommitRecord newest[2];
+    memset(newest, 0, sizeof(newest));
+    uint32_t newest_seq = 0;
+    bool found = false;
+    for(size_t block=0;block<2;block++) {
+        CommitRecord block_newest[2];
+        memset(block_newest, 0, sizeof(block_newest));
+        uint32_t end;
+        if(!meta_scan(store, block, block_newest, &end)) {
+            return false;
+        }
+        for(size_t slot=0;slot<2;slot++) {
+            const CommitRecord *record = &block_newest[slot];
+            if(record->magic != COMMIT_MAGIC) {
+                continue;
+            }
+            if((newest[slot].magic != COMMIT_MAGIC)
+                    || (record->seq > newest[slot].seq)) {
+                newest[slot] = *record;
+            }
+            if(!found || (record->seq > newest_seq)) {
+                found = true;
+                newest_seq = record->seq;
+                store->meta_block = block;
+                store->meta_offset = end;
+            }
+        }
+    }
+    store->seq = newest_seq;
+
+    if(!found) {
+        // Nothing committed yet: start with a clean metadata block
+        store->meta_block = 0;
+        store->meta_offset = 0;
+        if(!flash_erase(store, meta_address(store, 0), store->block_size)) {
+            return false;
+        }
+    }
+
+    // Use the newest commit with intact data. Normally this is the newest
+    // commit, unless the data was damaged after it was committed.
+    for(size_t n=0;n<2;n++) {
+        size_t slot = (newest[0].seq > newest[1].seq) ? 0 : 1;
+        if(n) {
+            slot^= 1;
+        }
+        const CommitRecord *record = &newest[slot];
+        if(record->magic != COMMIT_MAGIC) {
+            continue;
+        }
+        uint32_t crc;
+        if(!slot_crc(store, slot, record->length, &crc)) {
+            return false;
+        }
+        if(crc == record->data_crc) {
+            store->active_slot = slot;
+            store->length = record->length;
+            break;
+        }
+    }
+
+    store->recovery_us = delay_calc_time_us(t_start, delay_get_timestamp());
+    return true;
+}
+
+size_t atomic_store_get_length(AtomicStore *store)
+{
+    return store->length;
+}
+
+bool atomic_store_read(AtomicStore *store, uint32_t offset,
+        void *dst, size_t size)
+{
+    if((store->active_slot == SLOT_NONE) || (offset > store->length)
+            || (size > (store->length - offset))) {
+        return false;
+    }
+    return flash_read(store, slot_address(store, store->active_slot) + offset,
+            dst, size);
+}
+
+static size_t inactive_slot(const AtomicStore *store)
+{
+    return (store->active_slot == 0) ? 1 : 0;
+}
+
+bool atomic_store_begin(AtomicStore *store)
+{
+    store->in_transaction = false;
+    if(!flash_erase(store, slot_address(store, inactive_slot(store)),
+                store->slot_size)) {
+        return false;
+    }
+    store->in_transaction = true;
+    return true;
+}
+
+bool atomic_store_write(AtomicStore *store, uint32_t offset,
+        const void *src, size_t size)
+{
+    if(!store->in_transaction || (offset > store->slot_size)
+            || (size > (store->slot_size - offset))) {
+        return false;
+    }
+    return SPI_flash_write(store->flash,
+            slot_address(store, inactive_slot(store)) + offset, src, size);
+}
+
+bool atomic_store_commit(AtomicStore *store, size_t length)
+{
+    if(!store->in_transaction || (length > store->slot_size)) {
+        return false;
+    }
+    store->in_transaction = false;
+
+    // The CRC is calculated from what was actually programmed
+    const size_t slot = inactive_slot(store);
+    CommitRecord record = {
+        .magic = COMMIT_MAGIC,
+        .seq = store->seq + 1,
+        .slot = slot,
+        .length = length,
+        .reserved = {0xFFFFFFFF, 0xFFFFFFFF},
+    };
+    if(!slot_crc(store, slot, length, &record.data_crc)) {
+        return false;
+    }
+    record.crc = record_crc(&record);
+
+    // Switch metadata blocks when full: the newest record in the current
+    // block stays valid until the new record is written
+    if((store->meta_offset + sizeof(record)) > store->block_size) {
+        const size_t next = store->meta_block ^ 1;
+        if(!flash_erase(store, meta_address(store, next), store->block_size)) {
+            return false;
+        }
+        store->meta_block = next;
+        store->meta_offset = 0;
+    }
+
+    const uint32_t address = meta_address(store, store->meta_block)
+        + store->meta_offset;
+    if(!SPI_flash_wait_ready(store->flash)
+            || !SPI_flash_program(store->flash, address,
+                &record, sizeof(record))
+            || !SPI_flash_wait_ready(store->flash)) {
+        return false;
+    }
+    store->meta_offset+= sizeof(record);
+
+    store->seq = record.seq;
+    store->active_slot = slot;
+    store->length = length;
+    return true;
+}
+
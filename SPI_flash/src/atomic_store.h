@@ -0,0 +1,89 @@
+#ifndef ATOMIC_STORE_H
+#define ATOMIC_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "SPI_flash.h"
+
+/**
+ * Power-fail-safe storage instance, see atomic_store_init().
+ * All fields are private.
+ */
+typedef struct {
+    SPIFlash *flash;
+    uint32_t start_address;
+    size_t block_size;
+    size_t slot_size;
+
+    // The committed data
+    size_t active_slot;
+    size_t length;
+    uint32_t seq;
+
+    // Commit records are appended in one of two metadata blocks
+    size_t meta_block;
+    uint32_t meta_offset;
+
+    bool in_transaction;
+
+    // Time atomic_store_init() took to find and verify the committed data
+    uint32_t recovery_us;
+} AtomicStore;
+
+
+/**
+ * Mount a power-fail-safe store on a region of SPI flash.
+ *
+ * The data is kept in two slots: an update is written to the inactive slot,
+ * and only becomes visible once a commit record (sequence number, slot,
+ * length, CRC of the data and CRC of the record) is written. A reset at any
+ * point leaves either the old or the new data.
+ *
+ * Commit records are appended to one of two metadata blocks. When it is
+ * full, the other block is erased and used: the newest record always stays
+ * available.
+ *
+ * The region takes 2 * slot_size + 2 erase blocks.
+ *
+ * @param start_address Start of the region, aligned to an erase block
+ * @param slot_size     Maximum size of the data, a multiple of the erase
+ *                      block size
+ */
+bool atomic_store_init(AtomicStore *store, SPIFlash *flash,
+        uint32_t start_address, size_t slot_size);
+
+/**
+ * Length of the committed data, 0 if nothing was committed yet
+ */
+size_t atomic_store_get_length(AtomicStore *store);
+
+/**
+ * Read committed data
+ */
+bool atomic_store_read(AtomicStore *store, uint32_t offset,
+        void *dst, size_t size);
+
+/**
+ * Start an update: this erases the inactive slot.
+ *
+ * The committed data remains readable until atomic_store_commit().
+ */
+bool atomic_store_begin(AtomicStore *store);
+
+/**
+ * Write (part of) the new data. Each byte can only be written once.
+ */
+bool atomic_store_write(AtomicStore *store, uint32_t offset,
+        const void *src, size_t size);
+
+/**
+ * Finish an update: the new data replaces the committed data.
+ *
+ * @param length    Length of the new data
+ */
+bool atomic_store_commit(AtomicStore *store, size_t length);
+
+#endif
+
@@ -0,0 +1,195 @@
+#include "benchmark.h"
+#include "lzss.h"
+
+#include <mcu_timing/delay.h>
+#include <stdio.h>
+#include <string.h>
+
+// Area that is read, erased and programmed: the last 64K of the flash
+#define BENCH_AREA_SIZE         0x10000
+
+// Amount of data read per chunk size
+#define BENCH_READ_SIZE         0x8000
+
+#define BENCH_PROGRAM_PAGES     16
+#define BENCH_JEDEC_COUNT       100
+
+// Amount of synthetic sensor data that is compressed
+#define BENCH_LZSS_SIZE         0x4000
+
+static const size_t read_chunk_sizes[] = {16, 64, 256, 512};
+
+// Large enough for the largest read chunk and a full page
+static uint8_t buffer[512];
+
+
+static void print_result(BenchmarkPrintFunc print, const char *test,
+        uint32_t parameter, uint32_t value, const char *unit)
+{
+    char line[64];
+    snprintf(line, sizeof(line), "BENCH,%s,%u,%u,%s\r\n", test,
+            (unsigned int)parameter, (unsigned int)value, unit);
+    print(line);
+}
+
+static bool bench_read(SPIFlash *flash, BenchmarkPrintFunc print,
+        uint32_t address)
+{
+    for(size_t i=0;i<(sizeof(read_chunk_sizes)/sizeof(read_chunk_sizes[0]));i++) {
+        const size_t chunk = read_chunk_sizes[i];
+
+        const uint64_t t_start = delay_get_timestamp();
+        for(size_t offset=0;offset<BENCH_READ_SIZE;offset+=chunk) {
+            if(!SPI_flash_read(flash, address + offset, buffer, chunk)) {
+                return false;
+            }
+        }
+        const uint64_t t_end = delay_get_timestamp();
+
+        uint64_t time_us = delay_calc_time_us(t_start, t_end);
+        if(!time_us) {
+            time_us = 1;
+        }
+        // bytes per us equals MB/s: report KB/s to keep integer precision
+        const uint32_t kb_per_sec = ((uint64_t)BENCH_READ_SIZE * 1000000)
+            / (time_us * 1024);
+        print_result(print, "read_kbps", chunk, kb_per_sec, "KB/s");
+    }
+    return true;
+}
+
+static bool bench_erase(SPIFlash *flash, BenchmarkPrintFunc print,
+        const SPIFlashInfo *info, uint32_t address)
+{
+    for(size_t i=0;i<SPI_FLASH_ERASE_TYPE_COUNT;i++) {
+        const size_t size = info->erase_types[i].size;
+        if(!size || (size > BENCH_AREA_SIZE)) {
+            continue;
+        }
+
+        // An aligned range of exactly one erase size is erased
+        // with a single command of that size
+        const uint64_t t_start = delay_get_timestamp();
+        if(!SPI_flash_erase_range(flash, address, size, NULL)
+                || !SPI_flash_wait_ready(flash)) {
+            return false;
+        }
+        const uint64_t t_end = delay_get_timestamp();
+
+        print_result(print, "erase_us", size,
+                delay_calc_time_us(t_start, t_end), "us");
+    }
+    return true;
+}
+
+static bool bench_program(SPIFlash *flash, BenchmarkPrintFunc print,
+        const SPIFlashInfo *info, uint32_t address)
+{
+    const size_t page_size = info->page_size;
+    if(page_size > sizeof(buffer)) {
+        return false;
+    }
+
+    uint32_t total_us = 0;
+    uint32_t max_us = 0;
+    for(size_t n=0;n<page_size;n++) {
+        buffer[n] = n;
+    }
+    for(size_t page=0;page<BENCH_PROGRAM_PAGES;page++) {
+        const uint64_t t_start = delay_get_timestamp();
+        if(!SPI_flash_program(flash, address + (page * page_size),
+                    buffer, page_size)) {
+            return false;
+        }
+        if(!SPI_flash_wait_ready(flash)) {
+            return false;
+        }
+        const uint64_t t_end = delay_get_timestamp();
+
+        const uint32_t time_us = delay_calc_time_us(t_start, t_end);
+        total_us+= time_us;
+        if(time_us > max_us) {
+            max_us = time_us;
+        }
+    }
+    print_result(print, "program_avg_us", page_size,
+            total_us / BENCH_PROGRAM_PAGES, "us");
+    print_result(print, "program_max_us", page_size, max_us, "us");
+    return true;
+}
+
+static bool bench_JEDEC(SPIFlash *flash, BenchmarkPrintFunc print)
+{
+    const uint64_t t_start = delay_get_timestamp();
+    for(size_t i=0;i<BENCH_JEDEC_COUNT;i++) {
+        JEDECID ID;
+        if(!SPI_flash_read_JEDEC_ID(flash, &ID)) {
+            return false;
+        }
+    }
+    const uint64_t t_end = delay_get_timestamp();
+
+    // Report in ns: a single round-trip takes only a few us
+    const uint32_t time_ns = (delay_calc_time_us(t_start, t_end) * 1000)
+        / BENCH_JEDEC_COUNT;
+    print_result(print, "jedec_ns", BENCH_JEDEC_COUNT, time_ns, "ns");
+    return true;
+}
+
+static bool lzss_count_output(void *ctx, const uint8_t *data, size_t len)
+{
+    return true;
+}
+
+/**
+ * Compress a trace that resembles logged ADC samples: a millisecond
+ * timestamp and a slowly changing 32-bit value per record.
+ */
+static bool bench_lzss(BenchmarkPrintFunc print)
+{
+    static LZSSEncoder enc;
+    lzss_encoder_init(&enc, lzss_count_output, NULL);
+
+    const uint64_t t_start = delay_get_timestamp();
+    uint32_t record[2] = {0, 1000};
+    for(size_t offset=0;offset<BENCH_LZSS_SIZE;offset+=sizeof(record)) {
+        record[0]++;
+        if(!(record[0] % 16)) {
+            record[1]+= (record[0] & 0x10) ? 1 : -1;
+        }
+        if(!lzss_encoder_write(&enc, record, sizeof(record))) {
+            return false;
+        }
+    }
+    if(!lzss_encoder_finish(&enc)) {
+        return false;
+    }
+    const uint64_t t_end = delay_get_timestamp();
+
+    print_result(print, "lzss_ratio_pct", enc.bytes_in,
+            (enc.bytes_out * 100) / enc.bytes_in, "%");
+    print_result(print, "lzss_encode_us_per_kb", enc.bytes_in,
+            (delay_calc_time_us(t_start, t_end) * 1024) / enc.bytes_in, "us");
+    return true;
+}
+
+bool benchmark_run(SPIFlash *flash, BenchmarkPrintFunc print)
+{
+    SPIFlashInfo info;
+    SPI_flash_get_info(flash, &info);
+    if(info.total_size < BENCH_AREA_SIZE) {
+        return false;
+    }
+    const uint32_t address = info.total_size - BENCH_AREA_SIZE;
+
+    print("BENCH,start,0,0,-\r\n");
+    const bool ok = bench_JEDEC(flash, print)
+        && bench_read(flash, print, address)
+        && bench_erase(flash, print, &info, address)
+        && bench_program(flash, print, &info, address)
+        && bench_lzss(print);
+
+    print(ok ? "BENCH,done,0,1,-\r\n" : "BENCH,done,0,0,-\r\n");
+    return ok;
+}
+
@@ -0,0 +1,30 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "SPI_flash.h"
+
+/**
+ * Print function for the benchmark results: prints a single line
+ */
+typedef void (*BenchmarkPrintFunc)(const char *line);
+
+/**
+ * Run the SPI flash benchmark suite.
+ *
+ * Measures sequential read throughput for several chunk sizes, page program
+ * latency, erase latency per erase size and the JEDEC ID round-trip time.
+ * It also reports the LZSS compression ratio and speed for sensor-like data.
+ * Each result is printed as a machine-readable line:
+ *
+ *      BENCH,<test>,<parameter>,<value>,<unit>
+ *
+ * NOTE: this erases and programs the last 64K of the flash chip!
+ * Run it before enabling the page cache or deep power-down, as those
+ * would be measured as well.
+ *
+ * @return  False if any flash operation failed
+ */
+bool benchmark_run(SPIFlash *flash, BenchmarkPrintFunc print);
+
+#endif
+
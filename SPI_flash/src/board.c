@@ -13,6 +13,8 @@ const uint32_t OscRateIn = 12000000;
 
 static const NVICConfig NVIC_config[] = {
     {TIMER_32_0_IRQn,       1},     // delay timer: high priority
+    {SSP1_IRQn,             2},     // SPI flash
+    {TIMER_16_0_IRQn,       3},     // SPI flash sleep timer
 };
 
 static const PinMuxConfig pinmuxing[] = {
@@ -62,5 +64,9 @@ static const BoardConfig config = {
 void board_setup(void)
 {
     board_set_config(&config);
+
+    // The USB RAM holds the page cache and the overlay window (see link.ld),
+    // but it is not clocked after reset
+    Chip_Clock_EnablePeriphClock(SYSCTL_CLOCK_USBRAM);
 }
 
@@ -0,0 +1,17 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * CRC-32 as used by zlib and Ethernet (reflected, polynomial 0xEDB88320).
+ *
+ * Calculated bit by bit: slow, but without a table in flash or RAM.
+ *
+ * @param crc   0 for the first block of data, or the result of the previous
+ *              call to continue with the next block
+ */
+uint32_t crc32(uint32_t crc, const void *data, size_t len);
+
+#endif
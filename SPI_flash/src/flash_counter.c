@@ -0,0 +1,212 @@
+#include "flash_counter.h"
+
+#include <string.h>
+
+#define SLOT_HEADER_SIZE    (8)
+#define SLOT_BITMAP_SIZE    (FLASH_COUNTER_SLOT_SIZE - SLOT_HEADER_SIZE)
+#define SLOT_BITS           (8*SLOT_BITMAP_SIZE)
+#define SLOT_NONE           ((size_t)-1)
+
+/**
+ * A slot: the count is base + the number of cleared bits in the bitmap.
+ * Bits are cleared in order, starting at bit 0 of the first byte.
+ */
+typedef struct {
+    uint32_t base;
+    uint32_t check;     // ~base: a torn or blank header is not valid
+    uint8_t bitmap[SLOT_BITMAP_SIZE];
+} CounterSlot;
+
+_Static_assert(sizeof(CounterSlot) == FLASH_COUNTER_SLOT_SIZE,
+        "slot layout should match the slot size");
+
+
+static uint32_t slot_address(const FlashCounter *counter, size_t slot)
+{
+    return counter->start_address + (slot * FLASH_COUNTER_SLOT_SIZE);
+}
+
+static bool flash_read(FlashCounter *counter, uint32_t address,
+        void *dst, size_t size)
+{
+    return SPI_flash_read_when_ready(counter->flash, address, dst, size);
+}
+
+static bool header_is_valid(const CounterSlot *slot)
+{
+    return (slot->check == ~slot->base);
+}
+
+static bool is_blank(const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for(size_t i=0;i<size;i++) {
+        if(bytes[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t count_cleared_bits(const uint8_t *bitmap)
+{
+    uint32_t cleared = 0;
+    for(size_t i=0;i<SLOT_BITMAP_SIZE;i++) {
+        cleared+= 8 - __builtin_popcount(bitmap[i]);
+    }
+    return cleared;
+}
+
+/**
+ * Start counting from 'base' in the given slot, or in the first blank slot
+ * after it. The block is erased when counting moves into it.
+ */
+static bool slot_start(FlashCounter *counter, size_t slot, uint32_t base)
+{
+    const size_t slots_per_block = counter->block_size
+        / FLASH_COUNTER_SLOT_SIZE;
+
+    while(true) {
+        const uint32_t address = slot_address(counter, slot);
+
+        if(!(slot % slots_per_block)) {
+            if(!SPI_flash_wait_ready(counter->flash)
+                    || !SPI_flash_erase_block(counter->flash, address)) {
+                return false;
+            }
+            counter->stats.erases++;
+            break;
+        }
+
+        // A slot may have been written partially before a reset:
+        // skip it. At worst, this continues in the next block.
+        CounterSlot contents;
+        if(!flash_read(counter, address, &contents, sizeof(contents))) {
+            return false;
+        }
+        if(is_blank(&contents, sizeof(contents))) {
+            break;
+        }
+        slot = (slot + 1) % counter->slot_count;
+    }
+
+    const uint32_t header[2] = {base, ~base};
+    if(!SPI_flash_wait_ready(counter->flash)
+            || !SPI_flash_program(counter->flash, slot_address(counter, slot),
+                header, sizeof(header))
+            || !SPI_flash_wait_ready(counter->flash)) {
+        return false;
+    }
+    counter->slot = slot;
+    counter->base = base;
+    counter->used = 0;
+    return true;
+}
+
+bool flash_counter_init(FlashCounter *counter, SPIFlash *flash,
+        uint32_t start_address, size_t block_count)
+{
+    SPIFlashInfo info;
+    SPI_flash_get_info(flash, &info);
+
+    // Slots should not cross a page boundary
+    if((info.page_size % FLASH_COUNTER_SLOT_SIZE)
+            || (start_address % info.erase_block_size)
+            || (block_count < 2)
+            || ((start_address + block_count*info.erase_block_size)
+                > info.total_size)) {
+        return false;
+    }
+
+    counter->flash = flash;
+    counter->start_address = start_address;
+    counter->block_size = info.erase_block_size;
+    counter->slot_count = (block_count * info.erase_block_size)
+        / FLASH_COUNTER_SLOT_SIZE;
+    memset(&counter->stats, 0, sizeof(counter->stats));
+
+    // The current slot is the valid one with the highest base
+    counter->slot = SLOT_NONE;
+    counter->base = 0;
+    for(size_t slot=0;slot<counter->slot_count;slot++) {
+        CounterSlot header;
+        if(!flash_read(counter, slot_address(counter, slot),
+                    &header, SLOT_HEADER_SIZE)) {
+            return false;
+        }
+        if(!header_is_valid(&header)) {
+            continue;
+        }
+        if((counter->slot == SLOT_NONE) || (header.base > counter->base)) {
+            counter->slot = slot;
+            counter->base = header.base;
+        }
+    }
+
+    if(counter->slot == SLOT_NONE) {
+        return slot_start(counter, 0, 0);
+    }
+    uint32_t value;
+    return flash_counter_get(counter, &value);
+}
+
+bool flash_counter_get(FlashCounter *counter, uint32_t *value)
+{
+    CounterSlot slot;
+    if(!flash_read(counter, slot_address(counter, counter->slot),
+                &slot, sizeof(slot))
+            || !header_is_valid(&slot)) {
+        return false;
+    }
+    counter->used = count_cleared_bits(slot.bitmap);
+    *value = slot.base + counter->used;
+    return true;
+}
+
+bool flash_counter_add(FlashCounter *counter, uint32_t amount)
+{
+    while(amount) {
+        if(counter->used >= SLOT_BITS) {
+            const size_t next = (counter->slot + 1) % counter->slot_count;
+            if(!slot_start(counter, next, counter->base + SLOT_BITS)) {
+                return false;
+            }
+            counter->stats.slot_rollovers++;
+        }
+
+        uint32_t take = SLOT_BITS - counter->used;
+        if(take > amount) {
+            take = amount;
+        }
+
+        // Only the bytes with newly cleared bits are programmed
+        const uint32_t end = counter->used + take;
+        const uint32_t first = counter->used / 8;
+        const uint32_t last = (end - 1) / 8;
+        uint8_t bytes[SLOT_BITMAP_SIZE];
+        for(uint32_t i=first;i<=last;i++) {
+            uint32_t cleared = end - 8*i;
+            if(cleared > 8) {
+                cleared = 8;
+            }
+            bytes[i - first] = (uint8_t)(0xFF << cleared);
+        }
+
+        const uint32_t address = slot_address(counter, counter->slot)
+            + SLOT_HEADER_SIZE + first;
+        if(!SPI_flash_wait_ready(counter->flash)
+                || !SPI_flash_program(counter->flash, address,
+                    bytes, (last - first) + 1)) {
+            return false;
+        }
+        counter->used = end;
+        amount-= take;
+    }
+    return SPI_flash_wait_ready(counter->flash);
+}
+
+void flash_counter_get_stats(FlashCounter *counter, FlashCounterStats *stats)
+{
+    *stats = counter->stats;
+}
+
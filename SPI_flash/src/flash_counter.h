@@ -0,0 +1,69 @@
+#ifndef FLASH_COUNTER_H
+#define FLASH_COUNTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "SPI_flash.h"
+
+// A counter is stored in slots of this size: a header and a bitmap
+#define FLASH_COUNTER_SLOT_SIZE     (64)
+
+typedef struct {
+    uint32_t slot_rollovers;    // slots that were filled up
+    uint32_t erases;
+} FlashCounterStats;
+
+/**
+ * Persistent counter instance, see flash_counter_init().
+ * All fields are private.
+ */
+typedef struct {
+    SPIFlash *flash;
+    uint32_t start_address;
+    size_t block_size;
+    size_t slot_count;
+
+    // The slot that is counted in, its header value and cleared bits
+    size_t slot;
+    uint32_t base;
+    uint32_t used;
+
+    FlashCounterStats stats;
+} FlashCounter;
+
+
+/**
+ * Mount a persistent, wear-minimising counter on a region of SPI flash.
+ *
+ * The count is stored in unary: each increment clears the next bit of the
+ * bitmap in the current slot, so it programs a single byte and never
+ * erases. The slot header holds the count at which the slot was started.
+ * When a slot is full, counting continues in the next one. Erase blocks
+ * are only erased when counting moves into them: with 4K blocks, that is
+ * once per 28672 increments.
+ *
+ * A reset at any point loses at most the increment in progress.
+ *
+ * @param start_address Start of the region, aligned to an erase block
+ * @param block_count   Size of the region in erase blocks, at least 2
+ */
+bool flash_counter_init(FlashCounter *counter, SPIFlash *flash,
+        uint32_t start_address, size_t block_count);
+
+/**
+ * Read the counter value from flash: a single read of the current slot,
+ * decoded by counting the cleared bits.
+ */
+bool flash_counter_get(FlashCounter *counter, uint32_t *value);
+
+/**
+ * Add to the counter, e.g. 1 per boot or the number of minutes of uptime
+ */
+bool flash_counter_add(FlashCounter *counter, uint32_t amount);
+
+void flash_counter_get_stats(FlashCounter *counter, FlashCounterStats *stats);
+
+#endif
+
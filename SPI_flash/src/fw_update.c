@@ -0,0 +1,395 @@
+#include "fw_update.h"
+#include "crc32.h"
+
+#include <chip.h>
+
+#define IMAGE_MAGIC         (0x57464D49)    // "IMFW"
+#define SLOT_NONE           ((size_t)-1)
+
+// The image CRC is calculated through a buffer of this size
+#define CRC_CHUNK           (64)
+
+// LPC11U IAP ROM interface
+#define IAP_ENTRY_LOCATION  (0x1FFF1FF1)
+#define IAP_SECTOR_SIZE     (0x1000)
+#define IAP_CMD_SUCCESS     (0)
+
+enum IAP_command {
+    IAP_CMD_PREPARE         = 50,
+    IAP_CMD_COPY_RAM        = 51,
+    IAP_CMD_ERASE           = 52,
+};
+
+typedef void (*IAPEntry)(uint32_t *command, uint32_t *result);
+
+// SPI flash READ command and SSP FIFO depth, as used by SPI_flash.c
+#define FLASH_CMD_READ_DATA (0x03)
+#define SSP_FIFO_DEPTH      (8)
+
+// The installer overwrites the internal flash it would otherwise run from:
+// it runs from RAM (copied there at startup like initialized data) and may
+// only call other RAM functions or the ROM. For the same reason, loops must
+// not be turned into library calls such as memset().
+// The host build (see host/) never installs, and builds these as usual.
+#ifndef RAMFUNC
+#define RAMFUNC __attribute__((section(".data.fw_update"), noinline, long_call, \
+            optimize("no-tree-loop-distribute-patterns")))
+#endif
+
+/**
+ * Everything the installer needs, resolved before it starts:
+ * after the first erase, nothing in internal flash can be used.
+ */
+typedef struct {
+    LPC_SSP_T *SSP;
+    volatile uint32_t *cs_set;
+    volatile uint32_t *cs_clr;
+    uint32_t cs_mask;
+
+    uint32_t image_address;
+    size_t image_size;
+    uint8_t *buffer;
+    size_t chunk_size;
+    uint32_t cclk_khz;
+} InstallParams;
+
+
+static uint32_t header_crc(const FWImageHeader *header)
+{
+    return crc32(0, header, offsetof(FWImageHeader, header_crc));
+}
+
+static uint32_t slot_address(const FWUpdate *fw, size_t slot)
+{
+    return fw->start_address + (slot * fw->slot_size);
+}
+
+static uint32_t image_address(const FWUpdate *fw, size_t slot)
+{
+    return slot_address(fw, slot) + fw->page_size;
+}
+
+static bool flash_read(FWUpdate *fw, uint32_t address, void *dst, size_t size)
+{
+    return SPI_flash_read_when_ready(fw->flash, address, dst, size);
+}
+
+/**
+ * Calculate the CRC of an image, as read back from flash
+ */
+static bool image_crc(FWUpdate *fw, size_t slot, size_t size, uint32_t *crc)
+{
+    const uint32_t address = image_address(fw, slot);
+
+    uint8_t chunk[CRC_CHUNK];
+    *crc = 0;
+    for(size_t offset=0;offset<size;offset+=sizeof(chunk)) {
+        size_t len = size - offset;
+        if(len > sizeof(chunk)) {
+            len = sizeof(chunk);
+        }
+        if(!flash_read(fw, address + offset, chunk, len)) {
+            return false;
+        }
+        *crc = crc32(*crc, chunk, len);
+    }
+    return true;
+}
+
+bool fw_update_init(FWUpdate *fw, SPIFlash *flash,
+        uint32_t start_address, size_t slot_size)
+{
+    SPIFlashInfo info;
+    SPI_flash_get_info(flash, &info);
+
+    if((start_address % info.erase_block_size)
+            || !slot_size || (slot_size % info.erase_block_size)
+            || ((start_address + 2*slot_size) > info.total_size)) {
+        return false;
+    }
+
+    fw->flash = flash;
+    fw->start_address = start_address;
+    fw->slot_size = slot_size;
+    fw->page_size = info.page_size;
+    fw->write_slot = SLOT_NONE;
+    fw->in_update = false;
+    return true;
+}
+
+bool fw_update_get_image(FWUpdate *fw, size_t slot, FWImageHeader *header)
+{
+    if(slot > 1) {
+        return false;
+    }
+    if(!flash_read(fw, slot_address(fw, slot), header, sizeof(*header))) {
+        return false;
+    }
+    if((header->magic != IMAGE_MAGIC)
+            || (header->header_crc != header_crc(header))
+            || !header->size
+            || (header->size > (fw->slot_size - fw->page_size))) {
+        return false;
+    }
+
+    uint32_t crc;
+    return image_crc(fw, slot, header->size, &crc) && (crc == header->crc);
+}
+
+bool fw_update_find_newest(FWUpdate *fw, size_t *slot, FWImageHeader *header)
+{
+    size_t newest = SLOT_NONE;
+    for(size_t s=0;s<2;s++) {
+        FWImageHeader h;
+        if(!fw_update_get_image(fw, s, &h)) {
+            continue;
+        }
+        if((newest == SLOT_NONE) || (h.version > header->version)) {
+            newest = s;
+            *header = h;
+        }
+    }
+    if(newest == SLOT_NONE) {
+        return false;
+    }
+    *slot = newest;
+    return true;
+}
+
+bool fw_update_begin(FWUpdate *fw, uint32_t version, size_t size,
+        uint8_t *page_buffer)
+{
+    if(!size || (size > (fw->slot_size - fw->page_size))) {
+        return false;
+    }
+
+    // Keep the newest valid image: it is the fallback if this update fails
+    size_t newest;
+    FWImageHeader header;
+    size_t slot = 0;
+    if(fw_update_find_newest(fw, &newest, &header)) {
+        slot = 1 - newest;
+    }
+
+    fw->in_update = false;
+    if(!SPI_flash_wait_ready(fw->flash)
+            || !SPI_flash_erase_range(fw->flash, slot_address(fw, slot),
+                fw->slot_size, NULL)
+            || !SPI_flash_wait_ready(fw->flash)
+            || !SPI_flash_writer_begin(fw->flash, &fw->writer,
+                image_address(fw, slot), page_buffer)) {
+        return false;
+    }
+
+    fw->write_slot = slot;
+    fw->write_header.magic = IMAGE_MAGIC;
+    fw->write_header.version = version;
+    fw->write_header.size = size;
+    fw->write_crc = 0;
+    fw->in_update = true;
+    return true;
+}
+
+bool fw_update_write(FWUpdate *fw, const void *data, size_t sizeof_data)
+{
+    if(!fw->in_update) {
+        return false;
+    }
+    if(sizeof_data > (fw->write_header.size - fw->writer.bytes_written
+                - fw->writer.buffer_count)) {
+        return false;
+    }
+    fw->write_crc = crc32(fw->write_crc, data, sizeof_data);
+    return SPI_flash_writer_append(&fw->writer, data, sizeof_data);
+}
+
+bool fw_update_finish(FWUpdate *fw)
+{
+    if(!fw->in_update) {
+        return false;
+    }
+    fw->in_update = false;
+
+    if(!SPI_flash_writer_finish(&fw->writer)
+            || (fw->writer.bytes_written != fw->write_header.size)) {
+        return false;
+    }
+
+    // Verify what actually ended up in flash before making it valid
+    uint32_t crc;
+    if(!image_crc(fw, fw->write_slot, fw->write_header.size, &crc)
+            || (crc != fw->write_crc)) {
+        return false;
+    }
+
+    FWImageHeader *header = &fw->write_header;
+    header->crc = crc;
+    header->header_crc = header_crc(header);
+    return SPI_flash_wait_ready(fw->flash)
+        && SPI_flash_program(fw->flash, slot_address(fw, fw->write_slot),
+                header, sizeof(*header))
+        && SPI_flash_wait_ready(fw->flash);
+}
+
+RAMFUNC static bool install_IAP(uint32_t *command)
+{
+    uint32_t result[5];
+    ((IAPEntry)IAP_ENTRY_LOCATION)(command, result);
+    return (result[0] == IAP_CMD_SUCCESS);
+}
+
+/**
+ * Exchange bytes over SSP by polling. Either tx or rx may be NULL to send
+ * dummy bytes or discard the received bytes.
+ */
+RAMFUNC static void install_SPI_transfer(const InstallParams *params,
+        const uint8_t *tx, uint8_t *rx, size_t len)
+{
+    LPC_SSP_T *SSP = params->SSP;
+    size_t tx_count = 0;
+    size_t rx_count = 0;
+    while(rx_count < len) {
+        if((tx_count < len) && ((tx_count - rx_count) < SSP_FIFO_DEPTH)
+                && (SSP->SR & SSP_STAT_TNF)) {
+            SSP->DR = tx ? tx[tx_count] : 0xFF;
+            tx_count++;
+        }
+        if(SSP->SR & SSP_STAT_RNE) {
+            const uint8_t data = SSP->DR;
+            if(rx) {
+                rx[rx_count] = data;
+            }
+            rx_count++;
+        }
+    }
+}
+
+RAMFUNC static void install_read_begin(const InstallParams *params,
+        uint32_t offset)
+{
+    const uint32_t address = params->image_address + offset;
+    uint8_t header[4];
+    header[0] = FLASH_CMD_READ_DATA;
+    header[1] = (address >> 16) & 0xFF;
+    header[2] = (address >> 8 ) & 0xFF;
+    header[3] = (address >> 0 ) & 0xFF;
+
+    *params->cs_clr = params->cs_mask;
+    install_SPI_transfer(params, header, NULL, sizeof(header));
+}
+
+/**
+ * Continue the read command with the chunk at 'offset' and program it.
+ * The flash chip does not mind the clock pausing during programming.
+ */
+RAMFUNC static bool install_chunk(const InstallParams *params,
+        uint32_t offset)
+{
+    size_t len = params->image_size - offset;
+    if(len > params->chunk_size) {
+        len = params->chunk_size;
+    }
+    install_SPI_transfer(params, NULL, params->buffer, len);
+
+    // Pad the last chunk. Volatile stores can not become a memset() call.
+    volatile uint8_t *buffer = params->buffer;
+    const size_t chunk_size = params->chunk_size;
+    for(size_t i=len;i<chunk_size;i++) {
+        buffer[i] = 0xFF;
+    }
+
+    const uint32_t sector = offset / IAP_SECTOR_SIZE;
+    uint32_t command[5];
+    command[0] = IAP_CMD_PREPARE;
+    command[1] = sector;
+    command[2] = sector;
+    if(!install_IAP(command)) {
+        return false;
+    }
+    command[0] = IAP_CMD_COPY_RAM;
+    command[1] = offset;
+    command[2] = (uintptr_t)params->buffer;
+    command[3] = params->chunk_size;
+    command[4] = params->cclk_khz;
+    return install_IAP(command);
+}
+
+RAMFUNC static void install_from_RAM(const InstallParams *params)
+{
+    const uint32_t last_sector = (params->image_size - 1) / IAP_SECTOR_SIZE;
+    const uint32_t chunk_size = params->chunk_size;
+
+    uint32_t command[5];
+    command[0] = IAP_CMD_PREPARE;
+    command[1] = 0;
+    command[2] = last_sector;
+    bool ok = install_IAP(command);
+    if(ok) {
+        command[0] = IAP_CMD_ERASE;
+        command[1] = 0;
+        command[2] = last_sector;
+        command[3] = params->cclk_khz;
+        ok = install_IAP(command);
+    }
+
+    // All chunks but the first with one read command, then the first
+    if(ok && (params->image_size > chunk_size)) {
+        install_read_begin(params, chunk_size);
+        for(uint32_t offset=chunk_size;
+                ok && (offset < params->image_size);
+                offset+=chunk_size) {
+            ok = install_chunk(params, offset);
+        }
+        *params->cs_set = params->cs_mask;
+    }
+    if(ok) {
+        install_read_begin(params, 0);
+        install_chunk(params, 0);
+        *params->cs_set = params->cs_mask;
+    }
+
+    // Boot the new image, or the ISP bootloader if it is incomplete
+    SCB->AIRCR = (0x5FA << SCB_AIRCR_VECTKEY_Pos) | SCB_AIRCR_SYSRESETREQ_Msk;
+    while(true) {
+    }
+}
+
+bool fw_update_install(FWUpdate *fw, size_t slot,
+        void *buffer, size_t sizeof_buffer)
+{
+    if((sizeof_buffer != 256) && (sizeof_buffer != 512)
+            && (sizeof_buffer != 1024) && (sizeof_buffer != 4096)) {
+        return false;
+    }
+    if(((uintptr_t)buffer) % 4) {
+        return false;
+    }
+
+    FWImageHeader header;
+    if(!fw_update_get_image(fw, slot, &header)
+            || (header.size > FW_UPDATE_INTERNAL_FLASH_SIZE)) {
+        return false;
+    }
+    // Reading the image has woken up the flash chip: make sure it is idle
+    if(!SPI_flash_wait_ready(fw->flash)) {
+        return false;
+    }
+
+    const GPIO *cs_pin = fw->flash->cs_pin;
+    const InstallParams params = {
+        .SSP = fw->flash->SSP,
+        .cs_set = &LPC_GPIO->SET[cs_pin->port],
+        .cs_clr = &LPC_GPIO->CLR[cs_pin->port],
+        .cs_mask = (1 << cs_pin->pin),
+        .image_address = image_address(fw, slot),
+        .image_size = header.size,
+        .buffer = buffer,
+        .chunk_size = sizeof_buffer,
+        .cclk_khz = SystemCoreClock / 1000,
+    };
+
+    __disable_irq();
+    install_from_RAM(&params);
+    return false;
+}
+
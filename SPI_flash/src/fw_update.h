@@ -0,0 +1,120 @@
+#ifndef FW_UPDATE_H
+#define FW_UPDATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "SPI_flash.h"
+
+// Size of the internal flash that an image is installed to
+#define FW_UPDATE_INTERNAL_FLASH_SIZE   (0x8000)
+
+/**
+ * Image header, stored in the first page of a slot. The image itself
+ * follows in the next page.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          // image size in bytes
+    uint32_t crc;           // CRC32 of the image
+    uint32_t header_crc;    // CRC32 of all fields above
+} FWImageHeader;
+
+/**
+ * Firmware staging area instance, see fw_update_init().
+ * All fields are private.
+ */
+typedef struct {
+    SPIFlash *flash;
+    uint32_t start_address;
+    size_t slot_size;
+    size_t page_size;
+
+    // Image that is being written, see fw_update_begin()
+    size_t write_slot;
+    FWImageHeader write_header;
+    uint32_t write_crc;
+    SPIFlashWriter writer;
+    bool in_update;
+} FWUpdate;
+
+
+/**
+ * Use a region of SPI flash as a staging area for firmware images.
+ *
+ * The region has two slots of slot_size bytes. A new image is always written
+ * to the slot that does not hold the newest valid image, so a failed or
+ * interrupted download never destroys the image that was there before.
+ *
+ * @param start_address Start of the region, aligned to an erase block
+ * @param slot_size     Size of a slot: a multiple of the erase block size,
+ *                      at least one page more than the largest image
+ */
+bool fw_update_init(FWUpdate *fw, SPIFlash *flash,
+        uint32_t start_address, size_t slot_size);
+
+/**
+ * Read the header of a slot and check the image CRC.
+ *
+ * @param slot      0 or 1
+ * @return          True if the slot holds a complete, valid image
+ */
+bool fw_update_get_image(FWUpdate *fw, size_t slot, FWImageHeader *header);
+
+/**
+ * Find the valid image with the highest version
+ *
+ * @return          False if no slot holds a valid image
+ */
+bool fw_update_find_newest(FWUpdate *fw, size_t *slot, FWImageHeader *header);
+
+/**
+ * Start writing a new image: this erases the target slot.
+ *
+ * @param page_buffer   Buffer of page_size bytes, used until
+ *                      fw_update_finish() is called.
+ */
+bool fw_update_begin(FWUpdate *fw, uint32_t version, size_t size,
+        uint8_t *page_buffer);
+
+/**
+ * Append image data, e.g. as it is received
+ */
+bool fw_update_write(FWUpdate *fw, const void *data, size_t sizeof_data);
+
+/**
+ * Finish the image: the image is read back and verified, and only then
+ * the header is written. Until the header is written, the slot is not
+ * considered valid.
+ */
+bool fw_update_finish(FWUpdate *fw);
+
+/**
+ * Copy a verified image from a slot into internal flash and reset.
+ *
+ * The image is read with a single READ command in chunks of sizeof_buffer
+ * bytes, each chunk is programmed with the IAP ROM calls while the read is
+ * paused. Larger chunks mean fewer IAP calls and a shorter install.
+ *
+ * The copy runs from RAM with interrupts disabled. The first chunk, holding
+ * the vector table, is programmed last: if power fails during the install,
+ * the boot ROM finds no valid user code and starts the ISP bootloader
+ * instead of running a partial image.
+ *
+ * NOTE: the IAP ROM calls use the top 32 bytes of RAM. The stack of the
+ * caller is never returned to, so this is not a problem as long as the
+ * buffer is not there.
+ *
+ * @param buffer        Word-aligned RAM buffer, e.g. in USB RAM
+ * @param sizeof_buffer Chunk size: 256, 512, 1024 or 4096 bytes
+ *
+ * @return              Only returns (false) if the image is invalid
+ *                      or too large: on success, the MCU is reset.
+ */
+bool fw_update_install(FWUpdate *fw, size_t slot,
+        void *buffer, size_t sizeof_buffer);
+
+#endif
+
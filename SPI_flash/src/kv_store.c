@@ -0,0 +1,613 @@
+#include "kv_store.h"
+
+#include <mcu_timing/delay.h>
+#include <string.h>
+
+#define KV_SECTOR_MAGIC         (0x5356454B)    // "KEVS"
+#define KV_SECTOR_RETIRED       (0x00000000)
+#define KV_SECTOR_HEADER_SIZE   (8)
+
+#define KV_RECORD_BLANK         (0xFF)
+#define KV_TYPE_VALUE           (0x01)
+#define KV_TYPE_DELETE          (0x02)
+
+#define KV_LOCATION_EMPTY       (0xFFFF)
+#define KV_LOCATION_DELETED     (0xFFFE)
+#define KV_LOCATION_UNIT        (4)
+
+#define KV_NONE                 ((size_t)-1)
+
+// Records are copied and checked through a buffer of this size
+#define KV_COPY_CHUNK           (64)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+} SectorHeader;
+
+/**
+ * Header in front of each record. The key and value follow directly,
+ * the record is padded to a multiple of 4 bytes.
+ *
+ * The CRC covers the first 4 header bytes, the key and the value: a
+ * record that was interrupted by a power loss does not match.
+ */
+typedef struct {
+    uint8_t key_len;        // KV_RECORD_BLANK marks the end of the log
+    uint8_t type;
+    uint16_t value_len;
+    uint16_t crc;
+    uint16_t reserved;
+} RecordHeader;
+
+_Static_assert(sizeof(SectorHeader) == KV_SECTOR_HEADER_SIZE,
+        "KV_SECTOR_HEADER_SIZE should match the sector header");
+
+
+static uint32_t record_size(const RecordHeader *header)
+{
+    const uint32_t size = sizeof(RecordHeader)
+        + header->key_len + header->value_len;
+    return (size + (KV_LOCATION_UNIT-1)) & ~(KV_LOCATION_UNIT-1);
+}
+
+static uint16_t crc16(uint16_t crc, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    for(size_t i=0;i<len;i++) {
+        crc^= ((uint16_t)bytes[i] << 8);
+        for(size_t bit=0;bit<8;bit++) {
+            if(crc & 0x8000) {
+                crc = (crc << 1) ^ 0x1021;
+            } else {
+                crc = (crc << 1);
+            }
+        }
+    }
+    return crc;
+}
+
+/**
+ * FNV-1a, folded to 16 bits
+ */
+static uint16_t key_hash(const char *key, size_t key_len)
+{
+    uint32_t hash = 2166136261u;
+    for(size_t i=0;i<key_len;i++) {
+        hash^= (uint8_t)key[i];
+        hash*= 16777619u;
+    }
+    return (hash >> 16) ^ (hash & 0xFFFF);
+}
+
+static bool flash_read(KVStore *kv, uint32_t offset, void *dst, size_t size)
+{
+    return SPI_flash_read_when_ready(kv->flash, kv->start_address + offset,
+            dst, size);
+}
+
+static bool flash_write(KVStore *kv, uint32_t offset,
+        const void *src, size_t size)
+{
+    return SPI_flash_write(kv->flash, kv->start_address + offset, src, size);
+}
+
+static uint32_t sector_offset(const KVStore *kv, size_t sector)
+{
+    return sector * kv->sector_size;
+}
+
+/**
+ * Check if the record at a location has the given key
+ */
+static bool key_equals(KVStore *kv, uint16_t location,
+        const char *key, size_t key_len)
+{
+    const uint32_t offset = location * KV_LOCATION_UNIT;
+
+    RecordHeader header;
+    char stored_key[KV_MAX_KEY_LEN];
+    if(!flash_read(kv, offset, &header, sizeof(header))
+            || (header.key_len != key_len)
+            || !flash_read(kv, offset + sizeof(header), stored_key, key_len)) {
+        return false;
+    }
+    return (memcmp(stored_key, key, key_len) == 0);
+}
+
+/**
+ * Look up a key in the index.
+ *
+ * @param free_slot     Receives the first slot a new entry can use,
+ *                      or KV_NONE if the index is full
+ *
+ * @return              The slot of the key, or KV_NONE if not found
+ */
+static size_t index_find(KVStore *kv, const char *key, size_t key_len,
+        uint16_t hash, size_t *free_slot)
+{
+    const size_t mask = kv->index_size - 1;
+
+    *free_slot = KV_NONE;
+    size_t slot = hash & mask;
+    for(size_t n=0;n<kv->index_size;n++, slot = (slot + 1) & mask) {
+        const KVIndexEntry *entry = &kv->index[slot];
+
+        if(entry->location == KV_LOCATION_EMPTY) {
+            if(*free_slot == KV_NONE) {
+                *free_slot = slot;
+            }
+            break;
+        }
+        if(entry->location == KV_LOCATION_DELETED) {
+            if(*free_slot == KV_NONE) {
+                *free_slot = slot;
+            }
+            continue;
+        }
+        if((entry->hash == hash)
+                && key_equals(kv, entry->location, key, key_len)) {
+            return slot;
+        }
+    }
+    return KV_NONE;
+}
+
+/**
+ * Find the index slot that points to a record, or KV_NONE if the record
+ * is not live
+ */
+static size_t index_find_location(KVStore *kv, uint16_t hash,
+        uint16_t location)
+{
+    const size_t mask = kv->index_size - 1;
+
+    size_t slot = hash & mask;
+    for(size_t n=0;n<kv->index_size;n++, slot = (slot + 1) & mask) {
+        const KVIndexEntry *entry = &kv->index[slot];
+        if(entry->location == KV_LOCATION_EMPTY) {
+            break;
+        }
+        if((entry->hash == hash) && (entry->location == location)) {
+            return slot;
+        }
+    }
+    return KV_NONE;
+}
+
+/**
+ * Point the index entry for a key to a new record, or remove it
+ */
+static bool index_update(KVStore *kv, const char *key, size_t key_len,
+        uint8_t type, uint16_t location)
+{
+    const uint16_t hash = key_hash(key, key_len);
+
+    size_t free_slot;
+    const size_t slot = index_find(kv, key, key_len, hash, &free_slot);
+    if(type == KV_TYPE_DELETE) {
+        if(slot != KV_NONE) {
+            kv->index[slot].location = KV_LOCATION_DELETED;
+            kv->key_count--;
+        }
+        return true;
+    }
+
+    if(slot != KV_NONE) {
+        kv->index[slot].location = location;
+        return true;
+    }
+    if(free_slot == KV_NONE) {
+        return false;
+    }
+    kv->index[free_slot].hash = hash;
+    kv->index[free_slot].location = location;
+    kv->key_count++;
+    return true;
+}
+
+/**
+ * Erase a sector and make it the new head
+ */
+static bool sector_start(KVStore *kv, size_t sector)
+{
+    const uint32_t offset = sector_offset(kv, sector);
+    if(!SPI_flash_wait_ready(kv->flash)
+            || !SPI_flash_erase_range(kv->flash, kv->start_address + offset,
+                kv->sector_size, NULL)) {
+        return false;
+    }
+
+    const SectorHeader header = {
+        .magic = KV_SECTOR_MAGIC,
+        .seq = ++kv->seq,
+    };
+    if(!flash_write(kv, offset, &header, sizeof(header))) {
+        return false;
+    }
+    kv->head = sector;
+    kv->write_offset = KV_SECTOR_HEADER_SIZE;
+    return true;
+}
+
+static bool copy_record(KVStore *kv, uint32_t src, uint32_t dst, uint32_t size)
+{
+    uint8_t chunk[KV_COPY_CHUNK];
+    for(uint32_t offset=0;offset<size;offset+=sizeof(chunk)) {
+        uint32_t len = size - offset;
+        if(len > sizeof(chunk)) {
+            len = sizeof(chunk);
+        }
+        if(!flash_read(kv, src + offset, chunk, len)
+                || !flash_write(kv, dst + offset, chunk, len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Copy the live records of the oldest sector to the head, then retire it
+ */
+static bool compact_oldest(KVStore *kv)
+{
+    const uint32_t sector = sector_offset(kv, kv->oldest);
+
+    uint32_t offset = KV_SECTOR_HEADER_SIZE;
+    while((offset + sizeof(RecordHeader)) <= kv->sector_size) {
+        RecordHeader header;
+        if(!flash_read(kv, sector + offset, &header, sizeof(header))) {
+            return false;
+        }
+        if((header.key_len == KV_RECORD_BLANK)
+                || (header.key_len > KV_MAX_KEY_LEN)) {
+            break;
+        }
+        const uint32_t size = record_size(&header);
+        if(size > (kv->sector_size - offset)) {
+            break;
+        }
+
+        // Deleted keys are dropped: all their older values are in this
+        // sector or were already compacted
+        char key[KV_MAX_KEY_LEN];
+        if(header.type == KV_TYPE_VALUE) {
+            if(!flash_read(kv, sector + offset + sizeof(header),
+                        key, header.key_len)) {
+                return false;
+            }
+            const uint16_t location = (sector + offset) / KV_LOCATION_UNIT;
+            const size_t slot = index_find_location(kv,
+                    key_hash(key, header.key_len), location);
+
+            if(slot != KV_NONE) {
+                if(size > (kv->sector_size - kv->write_offset)) {
+                    return false;
+                }
+                const uint32_t dst = sector_offset(kv, kv->head)
+                    + kv->write_offset;
+                if(!copy_record(kv, sector + offset, dst, size)) {
+                    return false;
+                }
+                kv->index[slot].location = dst / KV_LOCATION_UNIT;
+                kv->write_offset+= size;
+            }
+        }
+        offset+= size;
+    }
+
+    // Retire the sector by clearing its magic: it is erased when reused
+    const uint32_t retired = KV_SECTOR_RETIRED;
+    if(!flash_write(kv, sector, &retired, sizeof(retired))) {
+        return false;
+    }
+    kv->oldest = (kv->oldest + 1) % kv->sector_count;
+    kv->free_count++;
+    kv->stats.compactions++;
+    return true;
+}
+
+/**
+ * Move the head to the next sector, compacting the oldest sector
+ * once no free sector would be left
+ */
+static bool advance_head(KVStore *kv)
+{
+    if(!kv->free_count) {
+        return false;
+    }
+    if(!sector_start(kv, (kv->head + 1) % kv->sector_count)) {
+        return false;
+    }
+    kv->free_count--;
+
+    if(!kv->free_count) {
+        return compact_oldest(kv);
+    }
+    return true;
+}
+
+static bool append_record(KVStore *kv, RecordHeader *header,
+        const char *key, const void *value, uint32_t *offset)
+{
+    const uint32_t size = record_size(header);
+    if(size > (kv->sector_size - KV_SECTOR_HEADER_SIZE)) {
+        return false;
+    }
+
+    // A compaction that did not complete leaves no free sector: retry it
+    // before anything else is written to the head
+    if(!kv->free_count && !compact_oldest(kv)) {
+        return false;
+    }
+
+    size_t attempts = 0;
+    while(size > (kv->sector_size - kv->write_offset)) {
+        if((attempts++ >= kv->sector_count) || !advance_head(kv)) {
+            return false;
+        }
+    }
+
+    uint16_t crc = crc16(0xFFFF, header, offsetof(RecordHeader, crc));
+    crc = crc16(crc, key, header->key_len);
+    crc = crc16(crc, value, header->value_len);
+    header->crc = crc;
+    header->reserved = 0xFFFF;
+
+    *offset = sector_offset(kv, kv->head) + kv->write_offset;
+    if(!flash_write(kv, *offset, header, sizeof(*header))
+            || !flash_write(kv, *offset + sizeof(*header),
+                key, header->key_len)
+            || !flash_write(kv, *offset + sizeof(*header) + header->key_len,
+                value, header->value_len)) {
+        return false;
+    }
+    kv->write_offset+= size;
+    return true;
+}
+
+/**
+ * Replay the records of a sector into the index.
+ *
+ * @param end   Receives the offset of the end of the log in this sector
+ */
+static bool sector_replay(KVStore *kv, size_t sector, uint32_t *end)
+{
+    const uint32_t base = sector_offset(kv, sector);
+
+    uint32_t offset = KV_SECTOR_HEADER_SIZE;
+    while((offset + sizeof(RecordHeader)) <= kv->sector_size) {
+        RecordHeader header;
+        if(!flash_read(kv, base + offset, &header, sizeof(header))) {
+            return false;
+        }
+        if(header.key_len == KV_RECORD_BLANK) {
+            break;
+        }
+
+        // A damaged record: nothing after it can be trusted
+        const uint32_t size = record_size(&header);
+        if((header.key_len > KV_MAX_KEY_LEN)
+                || (size > (kv->sector_size - offset))) {
+            offset = kv->sector_size;
+            break;
+        }
+
+        char key[KV_MAX_KEY_LEN];
+        const uint32_t key_offset = base + offset + sizeof(header);
+        if(!flash_read(kv, key_offset, key, header.key_len)) {
+            return false;
+        }
+        uint16_t crc = crc16(0xFFFF, &header, offsetof(RecordHeader, crc));
+        crc = crc16(crc, key, header.key_len);
+
+        uint8_t chunk[KV_COPY_CHUNK];
+        for(uint32_t n=0;n<header.value_len;n+=sizeof(chunk)) {
+            uint32_t len = header.value_len - n;
+            if(len > sizeof(chunk)) {
+                len = sizeof(chunk);
+            }
+            if(!flash_read(kv, key_offset + header.key_len + n, chunk, len)) {
+                return false;
+            }
+            crc = crc16(crc, chunk, len);
+        }
+        if(crc != header.crc) {
+            offset = kv->sector_size;
+            break;
+        }
+
+        if(!index_update(kv, key, header.key_len, header.type,
+                    (base + offset) / KV_LOCATION_UNIT)) {
+            return false;
+        }
+        kv->stats.rebuild_records++;
+        offset+= size;
+    }
+    *end = offset;
+    return true;
+}
+
+bool kv_init(KVStore *kv, SPIFlash *flash,
+        uint32_t start_address, size_t sector_count,
+        KVIndexEntry *index, size_t index_size)
+{
+    const uint64_t t_start = delay_get_timestamp();
+
+    SPIFlashInfo info;
+    SPI_flash_get_info(flash, &info);
+
+    kv->flash = flash;
+    kv->start_address = start_address;
+    kv->sector_size = info.erase_block_size;
+    kv->sector_count = sector_count;
+    kv->index = index;
+    kv->index_size = index_size;
+    kv->key_count = 0;
+    kv->seq = 0;
+    memset(&kv->stats, 0, sizeof(kv->stats));
+
+    const uint32_t region_size = sector_count * kv->sector_size;
+    if((start_address % kv->sector_size)
+            || ((start_address + region_size) > info.total_size)
+            || (region_size > (KV_LOCATION_DELETED * KV_LOCATION_UNIT))) {
+        return false;
+    }
+    if((sector_count < 2) || !index_size || (index_size & (index_size-1))) {
+        return false;
+    }
+
+    for(size_t i=0;i<index_size;i++) {
+        index[i].hash = 0;
+        index[i].location = KV_LOCATION_EMPTY;
+    }
+
+    // The sectors in use are the ones from the lowest to the highest seq
+    size_t oldest = KV_NONE;
+    size_t head = KV_NONE;
+    uint32_t oldest_seq = 0;
+    for(size_t i=0;i<sector_count;i++) {
+        SectorHeader header;
+        if(!flash_read(kv, sector_offset(kv, i), &header, sizeof(header))) {
+            return false;
+        }
+        if(header.magic != KV_SECTOR_MAGIC) {
+            continue;
+        }
+        if((oldest == KV_NONE) || (header.seq < oldest_seq)) {
+            oldest = i;
+            oldest_seq = header.seq;
+        }
+        if((head == KV_NONE) || (header.seq > kv->seq)) {
+            head = i;
+            kv->seq = header.seq;
+        }
+    }
+
+    if(head == KV_NONE) {
+        kv->oldest = 0;
+        kv->free_count = sector_count - 1;
+        if(!sector_start(kv, 0)) {
+            return false;
+        }
+    } else {
+        kv->oldest = oldest;
+        kv->head = head;
+        kv->free_count = sector_count - 1
+            - (((head + sector_count) - oldest) % sector_count);
+
+        // Power was lost during a compaction: the head only holds copies
+        // of records that are still in the oldest sector, and the last one
+        // may be torn. Start the compaction over in an erased head.
+        if(!kv->free_count && !sector_start(kv, head)) {
+            return false;
+        }
+
+        for(size_t i=oldest;;i=(i + 1) % sector_count) {
+            uint32_t end;
+            if(!sector_replay(kv, i, &end)) {
+                return false;
+            }
+            if(i == head) {
+                kv->write_offset = end;
+                break;
+            }
+        }
+        if(!kv->free_count && !compact_oldest(kv)) {
+            return false;
+        }
+    }
+
+    kv->stats.rebuild_us = delay_calc_time_us(t_start, delay_get_timestamp());
+    return true;
+}
+
+bool kv_get(KVStore *kv, const char *key,
+        void *value, size_t sizeof_value, size_t *value_len)
+{
+    const size_t key_len = strlen(key);
+    if(!key_len || (key_len > KV_MAX_KEY_LEN)) {
+        return false;
+    }
+
+    size_t free_slot;
+    const size_t slot = index_find(kv, key, key_len,
+            key_hash(key, key_len), &free_slot);
+    if(slot == KV_NONE) {
+        return false;
+    }
+
+    const uint32_t offset = kv->index[slot].location * KV_LOCATION_UNIT;
+    RecordHeader header;
+    if(!flash_read(kv, offset, &header, sizeof(header))) {
+        return false;
+    }
+    if(value_len) {
+        *value_len = header.value_len;
+    }
+    size_t len = header.value_len;
+    if(len > sizeof_value) {
+        len = sizeof_value;
+    }
+    return flash_read(kv, offset + sizeof(header) + key_len, value, len);
+}
+
+bool kv_set(KVStore *kv, const char *key, const void *value, size_t value_len)
+{
+    const size_t key_len = strlen(key);
+    if(!key_len || (key_len > KV_MAX_KEY_LEN) || (value_len > UINT16_MAX)) {
+        return false;
+    }
+
+    // Check for room in the index before writing anything
+    size_t free_slot;
+    const size_t slot = index_find(kv, key, key_len,
+            key_hash(key, key_len), &free_slot);
+    if((slot == KV_NONE) && (free_slot == KV_NONE)) {
+        return false;
+    }
+
+    RecordHeader header = {
+        .key_len = key_len,
+        .type = KV_TYPE_VALUE,
+        .value_len = value_len,
+    };
+    uint32_t offset;
+    if(!append_record(kv, &header, key, value, &offset)) {
+        return false;
+    }
+    return index_update(kv, key, key_len, KV_TYPE_VALUE,
+            offset / KV_LOCATION_UNIT);
+}
+
+bool kv_delete(KVStore *kv, const char *key)
+{
+    const size_t key_len = strlen(key);
+    if(!key_len || (key_len > KV_MAX_KEY_LEN)) {
+        return false;
+    }
+
+    size_t free_slot;
+    const size_t slot = index_find(kv, key, key_len,
+            key_hash(key, key_len), &free_slot);
+    if(slot == KV_NONE) {
+        return false;
+    }
+
+    RecordHeader header = {
+        .key_len = key_len,
+        .type = KV_TYPE_DELETE,
+        .value_len = 0,
+    };
+    uint32_t offset;
+    if(!append_record(kv, &header, key, NULL, &offset)) {
+        return false;
+    }
+    return index_update(kv, key, key_len, KV_TYPE_DELETE, 0);
+}
+
+void kv_get_stats(KVStore *kv, KVStats *stats)
+{
+    *stats = kv->stats;
+}
+
@@ -0,0 +1,103 @@
+#ifndef KV_STORE_H
+#define KV_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "SPI_flash.h"
+
+#define KV_MAX_KEY_LEN      (32)
+
+/**
+ * Index entry: a hash of the key and the location of its latest record.
+ *
+ * The key itself is only stored in flash: on a hash match it is read back
+ * to compare.
+ */
+typedef struct {
+    uint16_t hash;
+    uint16_t location;  // offset in the region in units of 4 bytes
+} KVIndexEntry;
+
+typedef struct {
+    uint32_t rebuild_records;   // records scanned by kv_init()
+    uint32_t rebuild_us;        // time kv_init() took to rebuild the index
+    uint32_t compactions;
+} KVStats;
+
+/**
+ * Key-value store instance, see kv_init(). All fields are private.
+ */
+typedef struct {
+    SPIFlash *flash;
+    uint32_t start_address;
+    size_t sector_size;
+    size_t sector_count;
+
+    KVIndexEntry *index;
+    size_t index_size;
+    size_t key_count;
+
+    // Sectors in use form a ring from the oldest to the head sector
+    size_t oldest;
+    size_t head;
+    size_t free_count;
+    uint32_t write_offset;
+    uint32_t seq;
+
+    KVStats stats;
+} KVStore;
+
+
+/**
+ * Mount a key-value store on a region of SPI flash.
+ *
+ * Records are appended to the head sector. When it is full, writing
+ * continues in the next sector. Once the last free sector is taken, the
+ * oldest sector is compacted: its live records are copied to the head and
+ * it is erased. At boot, the index is rebuilt by replaying all records, and
+ * a compaction that was interrupted by a power loss is redone.
+ *
+ * @param start_address Start of the region, aligned to an erase block.
+ *                      The region can be up to 256K in size.
+ * @param sector_count  Size of the region in erase blocks, at least 2.
+ *                      The live data should fit in sector_count-1 blocks.
+ * @param index         Memory for the index. Each entry takes 4 bytes.
+ * @param index_size    Number of index entries: a power of two, larger
+ *                      than the amount of keys (the index fails when full).
+ */
+bool kv_init(KVStore *kv, SPIFlash *flash,
+        uint32_t start_address, size_t sector_count,
+        KVIndexEntry *index, size_t index_size);
+
+/**
+ * Get the value of a key.
+ *
+ * @param value         Buffer for the value
+ * @param sizeof_value  Size of the buffer: a longer value is truncated
+ * @param value_len     If not NULL, receives the full length of the value
+ *
+ * @return              False if the key was not found
+ */
+bool kv_get(KVStore *kv, const char *key,
+        void *value, size_t sizeof_value, size_t *value_len);
+
+/**
+ * Set the value of a key, replacing any previous value.
+ *
+ * @param key       Null-terminated, up to KV_MAX_KEY_LEN characters
+ */
+bool kv_set(KVStore *kv, const char *key, const void *value, size_t value_len);
+
+/**
+ * Delete a key
+ *
+ * @return  False if the key was not found or the delete could not be stored
+ */
+bool kv_delete(KVStore *kv, const char *key);
+
+void kv_get_stats(KVStore *kv, KVStats *stats);
+
+#endif
+
@@ -0,0 +1,261 @@
+#include "lzss.h"
+
+#include <string.h>
+
+// Length code of the end marker: valid lengths use much smaller codes
+#define LZSS_END_MARKER     (0xFF)
+
+_Static_assert(LZSS_WINDOW_SIZE == 256,
+        "the match distance is stored in a single byte");
+_Static_assert((LZSS_LOOKAHEAD_SIZE - LZSS_MIN_MATCH) < LZSS_END_MARKER,
+        "match lengths should not collide with the end marker");
+
+
+static void encoder_flush_group(LZSSEncoder *enc)
+{
+    if(!enc->token_count) {
+        return;
+    }
+    if(enc->ok) {
+        enc->ok = enc->write(enc->write_ctx, enc->group, enc->group_len);
+    }
+    enc->bytes_out+= enc->group_len;
+    enc->token_count = 0;
+}
+
+static void encoder_emit(LZSSEncoder *enc, bool literal,
+        uint8_t a, uint8_t b)
+{
+    if(!enc->token_count) {
+        enc->group[0] = 0;
+        enc->group_len = 1;
+    }
+    if(literal) {
+        enc->group[0]|= (1 << enc->token_count);
+        enc->group[enc->group_len++] = a;
+    } else {
+        enc->group[enc->group_len++] = a;
+        enc->group[enc->group_len++] = b;
+    }
+    if(++enc->token_count >= 8) {
+        encoder_flush_group(enc);
+    }
+}
+
+/**
+ * Byte i of a match starting 'distance' bytes back: the match may continue
+ * into the lookahead itself (e.g. a run of equal bytes).
+ */
+static uint8_t encoder_match_byte(const LZSSEncoder *enc,
+        size_t distance, size_t i)
+{
+    if(i < distance) {
+        return enc->window[(enc->window_pos + LZSS_WINDOW_SIZE - distance + i)
+            % LZSS_WINDOW_SIZE];
+    }
+    return enc->lookahead[i - distance];
+}
+
+/**
+ * Encode a single token from the start of the lookahead buffer
+ */
+static void encoder_step(LZSSEncoder *enc)
+{
+    size_t best_len = 0;
+    size_t best_distance = 0;
+    for(size_t distance=1;distance<=enc->window_fill;distance++) {
+        size_t len = 0;
+        while((len < enc->lookahead_count)
+                && (encoder_match_byte(enc, distance, len)
+                    == enc->lookahead[len])) {
+            len++;
+        }
+        if(len > best_len) {
+            best_len = len;
+            best_distance = distance;
+            if(len == enc->lookahead_count) {
+                break;
+            }
+        }
+    }
+
+    size_t consumed = 1;
+    if(best_len >= LZSS_MIN_MATCH) {
+        encoder_emit(enc, false, best_distance - 1, best_len - LZSS_MIN_MATCH);
+        consumed = best_len;
+    } else {
+        encoder_emit(enc, true, enc->lookahead[0], 0);
+    }
+
+    for(size_t i=0;i<consumed;i++) {
+        enc->window[enc->window_pos] = enc->lookahead[i];
+        enc->window_pos = (enc->window_pos + 1) % LZSS_WINDOW_SIZE;
+    }
+    enc->window_fill+= consumed;
+    if(enc->window_fill > LZSS_WINDOW_SIZE) {
+        enc->window_fill = LZSS_WINDOW_SIZE;
+    }
+    enc->lookahead_count-= consumed;
+    memmove(enc->lookahead, enc->lookahead + consumed, enc->lookahead_count);
+}
+
+void lzss_encoder_init(LZSSEncoder *enc, LZSSWriteFunc write, void *write_ctx)
+{
+    enc->write = write;
+    enc->write_ctx = write_ctx;
+    enc->window_pos = 0;
+    enc->window_fill = 0;
+    enc->lookahead_count = 0;
+    enc->group_len = 0;
+    enc->token_count = 0;
+    enc->bytes_in = 0;
+    enc->bytes_out = 0;
+    enc->ok = true;
+}
+
+bool lzss_encoder_write(LZSSEncoder *enc, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+
+    enc->bytes_in+= len;
+    while(len) {
+        size_t chunk = LZSS_LOOKAHEAD_SIZE - enc->lookahead_count;
+        if(chunk > len) {
+            chunk = len;
+        }
+        memcpy(enc->lookahead + enc->lookahead_count, bytes, chunk);
+        enc->lookahead_count+= chunk;
+        bytes+= chunk;
+        len-= chunk;
+
+        // Only encode with a full lookahead: more input may extend a match
+        if(enc->lookahead_count == LZSS_LOOKAHEAD_SIZE) {
+            encoder_step(enc);
+        }
+    }
+    return enc->ok;
+}
+
+bool lzss_encoder_finish(LZSSEncoder *enc)
+{
+    while(enc->lookahead_count) {
+        encoder_step(enc);
+    }
+    encoder_emit(enc, false, 0, LZSS_END_MARKER);
+    encoder_flush_group(enc);
+    return enc->ok;
+}
+
+void lzss_decoder_init(LZSSDecoder *dec, LZSSReadFunc read, void *read_ctx)
+{
+    dec->read = read;
+    dec->read_ctx = read_ctx;
+    dec->window_pos = 0;
+    dec->input_pos = 0;
+    dec->input_len = 0;
+    dec->flags = 0;
+    dec->flags_left = 0;
+    dec->match_distance = 0;
+    dec->match_left = 0;
+    dec->done = false;
+    dec->ok = true;
+}
+
+static bool decoder_input_byte(LZSSDecoder *dec, uint8_t *byte)
+{
+    if(dec->input_pos >= dec->input_len) {
+        size_t len = sizeof(dec->input);
+        if(!dec->read(dec->read_ctx, dec->input, &len) || !len) {
+            dec->ok = false;
+            return false;
+        }
+        dec->input_pos = 0;
+        dec->input_len = len;
+    }
+    *byte = dec->input[dec->input_pos++];
+    return true;
+}
+
+static uint8_t decoder_output(LZSSDecoder *dec, uint8_t byte)
+{
+    dec->window[dec->window_pos] = byte;
+    dec->window_pos = (dec->window_pos + 1) % LZSS_WINDOW_SIZE;
+    return byte;
+}
+
+size_t lzss_decoder_read(LZSSDecoder *dec, void *data, size_t len)
+{
+    uint8_t *bytes = data;
+
+    size_t count = 0;
+    while((count < len) && !dec->done && dec->ok) {
+        if(dec->match_left) {
+            const size_t src = (dec->window_pos + LZSS_WINDOW_SIZE
+                    - dec->match_distance) % LZSS_WINDOW_SIZE;
+            bytes[count++] = decoder_output(dec, dec->window[src]);
+            dec->match_left--;
+            continue;
+        }
+
+        if(!dec->flags_left) {
+            if(!decoder_input_byte(dec, &dec->flags)) {
+                break;
+            }
+            dec->flags_left = 8;
+        }
+        const bool literal = (dec->flags & 1);
+        dec->flags>>= 1;
+        dec->flags_left--;
+
+        uint8_t a;
+        if(!decoder_input_byte(dec, &a)) {
+            break;
+        }
+        if(literal) {
+            bytes[count++] = decoder_output(dec, a);
+            continue;
+        }
+
+        uint8_t b;
+        if(!decoder_input_byte(dec, &b)) {
+            break;
+        }
+        if(b == LZSS_END_MARKER) {
+            dec->done = true;
+            break;
+        }
+        dec->match_distance = a + 1;
+        dec->match_left = b + LZSS_MIN_MATCH;
+    }
+    return count;
+}
+
+bool lzss_decoder_ok(const LZSSDecoder *dec)
+{
+    return dec->ok;
+}
+
+bool lzss_write_to_flash(void *ctx, const uint8_t *data, size_t len)
+{
+    return SPI_flash_writer_append(ctx, data, len);
+}
+
+bool lzss_read_from_flash(void *ctx, uint8_t *data, size_t *len)
+{
+    LZSSFlashSource *source = ctx;
+
+    size_t available = source->end_address - source->address;
+    if(*len > available) {
+        *len = available;
+    }
+    if(!*len) {
+        return true;
+    }
+    if(!SPI_flash_read_when_ready(source->flash, source->address,
+                data, *len)) {
+        return false;
+    }
+    source->address+= *len;
+    return true;
+}
+
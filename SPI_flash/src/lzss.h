@@ -0,0 +1,146 @@
+#ifndef LZSS_H
+#define LZSS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "SPI_flash.h"
+
+// Matches refer back at most this many bytes
+#define LZSS_WINDOW_SIZE        (256)
+
+// Longest match: the encoder buffers this many bytes of input
+#define LZSS_LOOKAHEAD_SIZE     (32)
+
+// Smallest match: shorter repeats are stored as literals
+#define LZSS_MIN_MATCH          (3)
+
+/**
+ * Output of the encoder: called with each group of up to 8 tokens.
+ *
+ * @return  False to abort encoding
+ */
+typedef bool (*LZSSWriteFunc)(void *ctx, const uint8_t *data, size_t len);
+
+/**
+ * Input of the decoder: read up to *len bytes of compressed data.
+ *
+ * @param len   Size of data, receives the amount of bytes read
+ * @return      False on error
+ */
+typedef bool (*LZSSReadFunc)(void *ctx, uint8_t *data, size_t *len);
+
+/**
+ * Streaming LZSS encoder, see lzss_encoder_init(). All fields are private.
+ */
+typedef struct {
+    LZSSWriteFunc write;
+    void *write_ctx;
+
+    uint8_t window[LZSS_WINDOW_SIZE];
+    size_t window_pos;
+    size_t window_fill;
+
+    uint8_t lookahead[LZSS_LOOKAHEAD_SIZE];
+    size_t lookahead_count;
+
+    // A flag byte followed by up to 8 literals (1 byte) or matches (2 bytes)
+    uint8_t group[1 + (8*2)];
+    size_t group_len;
+    size_t token_count;
+
+    uint32_t bytes_in;
+    uint32_t bytes_out;
+    bool ok;
+} LZSSEncoder;
+
+/**
+ * Streaming LZSS decoder, see lzss_decoder_init(). All fields are private.
+ */
+typedef struct {
+    LZSSReadFunc read;
+    void *read_ctx;
+
+    uint8_t window[LZSS_WINDOW_SIZE];
+    size_t window_pos;
+
+    uint8_t input[32];
+    size_t input_pos;
+    size_t input_len;
+
+    uint8_t flags;
+    size_t flags_left;
+    size_t match_distance;
+    size_t match_left;
+
+    bool done;
+    bool ok;
+} LZSSDecoder;
+
+/**
+ * Source for the decoder: compressed data in SPI flash
+ */
+typedef struct {
+    SPIFlash *flash;
+    uint32_t address;
+    uint32_t end_address;
+} LZSSFlashSource;
+
+
+/**
+ * Start compressing a stream.
+ *
+ * The format is LZSS with a small window: groups of a flag byte and 8
+ * tokens. A token is either a literal byte or a match of 2 bytes: the
+ * distance back into the window and the length. The stream ends with an
+ * end marker, so the compressed size need not be stored.
+ *
+ * @param write     Output function. To compress in front of SPI flash, use
+ *                  lzss_write_to_flash() with a SPIFlashWriter as write_ctx.
+ */
+void lzss_encoder_init(LZSSEncoder *enc, LZSSWriteFunc write, void *write_ctx);
+
+/**
+ * Compress data. Returns false if any write failed so far.
+ */
+bool lzss_encoder_write(LZSSEncoder *enc, const void *data, size_t len);
+
+/**
+ * Compress any buffered data and write the end marker
+ */
+bool lzss_encoder_finish(LZSSEncoder *enc);
+
+/**
+ * Start decompressing a stream.
+ *
+ * @param read      Input function. To decompress data stored in SPI flash,
+ *                  use lzss_read_from_flash() with a LZSSFlashSource.
+ */
+void lzss_decoder_init(LZSSDecoder *dec, LZSSReadFunc read, void *read_ctx);
+
+/**
+ * Decompress up to len bytes.
+ *
+ * @return  The amount of bytes decompressed: less than len only at the end
+ *          of the stream or on error (see lzss_decoder_ok()).
+ */
+size_t lzss_decoder_read(LZSSDecoder *dec, void *data, size_t len);
+
+/**
+ * False if the input could not be read or was not a valid stream
+ */
+bool lzss_decoder_ok(const LZSSDecoder *dec);
+
+/**
+ * LZSSWriteFunc for compressing into SPI flash, ctx is a SPIFlashWriter
+ */
+bool lzss_write_to_flash(void *ctx, const uint8_t *data, size_t len);
+
+/**
+ * LZSSReadFunc for decompressing from SPI flash, ctx is a LZSSFlashSource
+ */
+bool lzss_read_from_flash(void *ctx, uint8_t *data, size_t *len);
+
+#endif
+
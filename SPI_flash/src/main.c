@@ -12,15 +12,30 @@
 #include <string.h>
 
 #include "SPI_flash.h"
+#include "overlay.h"
+#include "benchmark.h"
 
 #define CLK_FREQ (48e6)
 
 
-// SPI Flash settings
+// SPI Flash settings, used if the flash chip does not support SFDP
 #define SPI_FLASH_PAGE_SIZE_BYTES           0x100
 #define SPI_FLASH_ERASE_BLOCK_SIZE_BYTES    0x8000
 #define SPI_FLASH_SIZE_BYTES                0x80000
 
+// Time to wake up from deep power-down (tRES1)
+#define SPI_FLASH_WAKE_TIME_US              30
+
+// Page cache: this demo does not use USB, so the USB RAM is free.
+// It fills the lower 1K, the upper 1K is the overlay window (see link.ld).
+#define SPI_FLASH_CACHE_MEM_SIZE            0x0400
+
+// Where SPI_flash_overlays.bin is stored (see README.md)
+#define SPI_FLASH_OVERLAY_IMAGE_ADDRESS     0x60000
+
+// First word of overlay 0: tells if the overlay image is present
+#define DEMO_OVERLAY_MAGIC                  0x4F564C30
+
 // Transmit and receive ring buffer sizes
 #define UART_SRB_SIZE 128	// Tx
 #define UART_RRB_SIZE 32	// Rx
@@ -29,6 +44,31 @@
 STATIC RINGBUFF_T txring, rxring;
 static uint8_t rxbuff[UART_RRB_SIZE], txbuff[UART_SRB_SIZE];
 
+static SPIFlash flash;
+static SPIFlashCache flash_cache;
+static uint32_t flash_cache_mem[SPI_FLASH_CACHE_MEM_SIZE / sizeof(uint32_t)]
+    __attribute__((section(".usb_ram")));
+static OverlayLoader overlays;
+
+static const uint32_t OVERLAY_DATA(0) demo_overlay_magic = DEMO_OVERLAY_MAGIC;
+static const uint16_t OVERLAY_DATA(0) demo_overlay_squares[16] = {
+    0, 1, 4, 9, 16, 25, 36, 49, 64, 81, 100, 121, 144, 169, 196, 225,
+};
+
+/**
+ * Demo function that runs from the overlay window. It may not call
+ * functions in internal flash: they are out of range of a normal call.
+ */
+static uint32_t OVERLAY(0) demo_overlay_sum_squares(size_t n);
+static uint32_t OVERLAY(0) demo_overlay_sum_squares(size_t n)
+{
+    uint32_t sum = 0;
+    for(size_t i=0;(i<n) && (i<16);i++) {
+        sum+= demo_overlay_squares[i];
+    }
+    return sum;
+}
+
 /**
  * Dummy syscall to use printf features
  */
@@ -51,6 +91,71 @@ void UART_IRQHandler(void)
 	Chip_UART_IRQRBHandler(LPC_USART, &rxring, &txring);
 }
 
+/**
+ * SSP1 interrupt handler: drives the SPI flash transfers
+ */
+void SSP1_IRQHandler(void)
+{
+    SPI_flash_IRQHandler(LPC_SSP1);
+}
+
+/**
+ * TIMER16_0 interrupt handler: wakes up flash_sleep_us()
+ */
+void TIMER16_0_IRQHandler(void)
+{
+    Chip_TIMER_ClearMatch(LPC_TIMER16_0, 0);
+}
+
+static void flash_sleep_timer_init(void)
+{
+    // 1us per tick, stop at the match
+    Chip_TIMER_Init(LPC_TIMER16_0);
+    Chip_TIMER_PrescaleSet(LPC_TIMER16_0, (SystemCoreClock / 1000000) - 1);
+    Chip_TIMER_MatchEnableInt(LPC_TIMER16_0, 0);
+    Chip_TIMER_StopOnMatchEnable(LPC_TIMER16_0, 0);
+    NVIC_EnableIRQ(TIMER_16_0_IRQn);
+}
+
+/**
+ * Sleep while the flash chip is erasing or programming: the CPU is woken
+ * up by the timer instead of spinning on the status register.
+ */
+static void flash_sleep_us(uint32_t us)
+{
+    while(us) {
+        const uint32_t chunk = (us > 0xFFFF) ? 0xFFFF : us;
+
+        Chip_TIMER_Reset(LPC_TIMER16_0);
+        Chip_TIMER_SetMatch(LPC_TIMER16_0, 0, chunk);
+        Chip_TIMER_Enable(LPC_TIMER16_0);
+
+        // The timer stops at the match. Other interrupts wake up the CPU
+        // as well. With interrupts masked, WFI still returns on a pending
+        // interrupt, so the match cannot slip in between check and WFI.
+        __disable_irq();
+        while(LPC_TIMER16_0->TCR & TIMER_ENABLE) {
+            __WFI();
+            __enable_irq();
+            __disable_irq();
+        }
+        __enable_irq();
+        us-= chunk;
+    }
+}
+
+/**
+ * Send a string, waiting for room in the UART ring buffer if needed
+ */
+static void uart_print(const char *str)
+{
+    size_t len = strlen(str);
+    while(len) {
+        const size_t sent = Chip_UART_SendRB(LPC_USART, &txring, str, len);
+        str+= sent;
+        len-= sent;
+    }
+}
 
 static void Uart_Init(void)
 {
@@ -94,11 +199,37 @@ int main(void)
 
     delay_us(1000*1000);
 
-    assert(SPI_flash_init(LPC_SSP1,
-                board_get_GPIO(GPIO_ID_FLASH_CS),
-                SPI_FLASH_PAGE_SIZE_BYTES,
-                SPI_FLASH_ERASE_BLOCK_SIZE_BYTES,
-                SPI_FLASH_SIZE_BYTES));
+    // Prefer the geometry as reported by the flash chip itself
+    if(!SPI_flash_init_auto(&flash, LPC_SSP1,
+                board_get_GPIO(GPIO_ID_FLASH_CS))) {
+        assert(SPI_flash_init(&flash, LPC_SSP1,
+                    board_get_GPIO(GPIO_ID_FLASH_CS),
+                    SPI_FLASH_PAGE_SIZE_BYTES,
+                    SPI_FLASH_ERASE_BLOCK_SIZE_BYTES,
+                    SPI_FLASH_SIZE_BYTES));
+    }
+    SPIFlashInfo flash_info;
+    SPI_flash_get_info(&flash, &flash_info);
+
+    // Sleep instead of polling during erase and program operations
+    flash_sleep_timer_init();
+    SPI_flash_set_sleep_func(&flash, flash_sleep_us);
+
+#ifdef SPI_FLASH_BENCHMARK
+    // Measure the bare driver: before the page cache and power-down are on
+    benchmark_run(&flash, uart_print);
+    while(true) {
+        GPIO_HAL_toggle(led);
+        delay_us(500*1000);
+    }
+#endif
+
+    // Put the flash chip in deep power-down after 100ms without access
+    SPI_flash_set_power_down(&flash, 100*1000, SPI_FLASH_WAKE_TIME_US);
+
+    // Serve small repeated reads from RAM
+    SPI_flash_cache_init(&flash, &flash_cache,
+            flash_cache_mem, sizeof(flash_cache_mem));
 
 
     char buf[128];
@@ -111,7 +242,7 @@ int main(void)
 	while(!flash_detected) {
 
         JEDECID SPI_ID;
-        if(SPI_flash_read_JEDEC_ID(&SPI_ID)) {
+        if(SPI_flash_read_JEDEC_ID(&flash, &SPI_ID)) {
             snprintf(buf, sizeof(buf), "SPI Flash: manufacturer=0x%X, dev=0x%X, size=0x%X\r\n",
                     (int)SPI_ID.attributes.manufacturer,
                     (int)SPI_ID.attributes.device,
@@ -128,8 +259,21 @@ int main(void)
 	}
 
     // Step 1: Erase a block (block #3 in this case)
-    const uint32_t erase_offset = 3*SPI_FLASH_ERASE_BLOCK_SIZE_BYTES;
-    assert(SPI_flash_erase_block(erase_offset));
+    const uint32_t erase_offset = 3*flash_info.erase_block_size;
+    assert(SPI_flash_erase_block(&flash, erase_offset));
+
+    // The chip is still erasing: read another block without waiting for it
+    uint8_t urgent[16];
+    assert(SPI_flash_read_urgent(&flash, 0, urgent, sizeof(urgent)));
+    SPIFlashUrgentReadStats urgent_stats;
+    SPI_flash_get_urgent_read_stats(&flash, &urgent_stats);
+    snprintf(buf, sizeof(buf), "SPI Flash: read during erase took %uus "
+            "(suspend latency %uus)\r\n",
+            (unsigned int)urgent_stats.last_latency_us,
+            (unsigned int)flash_info.suspend_latency_us);
+    Chip_UART_SendRB(LPC_USART, &txring, buf, strlen(buf));
+    delay_us(100*1000);
+
     snprintf(buf, sizeof(buf), "SPI Flash: erased a block..\r\n");
     Chip_UART_SendRB(LPC_USART, &txring, buf, strlen(buf));
     delay_us(100*1000);
@@ -138,7 +282,7 @@ int main(void)
     // Step 2: Verify the block is now erased
     uint8_t first_page[256];
     memset(first_page, 0x33, sizeof(first_page));
-    assert(SPI_flash_read(erase_offset, first_page, sizeof(first_page)));
+    assert(SPI_flash_read(&flash, erase_offset, first_page, sizeof(first_page)));
     for(size_t n=0;n<sizeof(first_page);n++) {
         assert(first_page[n] == 0xFF);
     }
@@ -150,7 +294,7 @@ int main(void)
     // Step 3: Program a page within the erased block
     const char *hello_world = "Hello World!";
     const size_t hello_world_len = strlen(hello_world);
-    assert(SPI_flash_program(erase_offset, hello_world, hello_world_len));
+    assert(SPI_flash_program(&flash, erase_offset, hello_world, hello_world_len));
     snprintf(buf, sizeof(buf), "SPI Flash: programmed hello_world string..\r\n");
     Chip_UART_SendRB(LPC_USART, &txring, buf, strlen(buf));
     delay_us(100*1000);
@@ -160,7 +304,7 @@ int main(void)
     uint8_t from_flash[100];
     size_t result_len = 0;
     memset(from_flash, 0x33, sizeof(from_flash));
-    assert(SPI_flash_read(erase_offset, from_flash, sizeof(from_flash)));
+    assert(SPI_flash_read(&flash, erase_offset, from_flash, sizeof(from_flash)));
     for(size_t n=0;n<sizeof(from_flash);n++) {
         if(from_flash[n] == 0xFF) {
             from_flash[n] = 0;
@@ -177,11 +321,41 @@ int main(void)
     delay_us(100*1000);
     
 
+    snprintf(buf, sizeof(buf), "SPI Flash: cache hits=%u, misses=%u\r\n",
+            (unsigned int)flash_cache.hits, (unsigned int)flash_cache.misses);
+    Chip_UART_SendRB(LPC_USART, &txring, buf, strlen(buf));
+    delay_us(100*1000);
+
+
+    // Step 5: run code from SPI flash. Only call into the overlay if the
+    // overlay image was programmed: otherwise the window holds garbage.
+    assert(overlay_init(&overlays, &flash, SPI_FLASH_OVERLAY_IMAGE_ADDRESS));
+    if(overlay_load(&overlays, 0)
+            && (*(volatile const uint32_t*)&demo_overlay_magic
+                == DEMO_OVERLAY_MAGIC)) {
+        const uint32_t sum = demo_overlay_sum_squares(result_len);
+        OverlayStats overlay_stats;
+        overlay_get_stats(&overlays, &overlay_stats);
+        snprintf(buf, sizeof(buf), "SPI Flash: overlay returned %u, "
+                "loaded %uB in %uus (%uus/KB)\r\n",
+                (unsigned int)sum,
+                (unsigned int)overlay_stats.last_load_size,
+                (unsigned int)overlay_stats.last_load_us,
+                (unsigned int)overlay_stats.us_per_KB);
+    } else {
+        snprintf(buf, sizeof(buf), "SPI Flash: no overlay image at 0x%X\r\n",
+                (unsigned int)SPI_FLASH_OVERLAY_IMAGE_ADDRESS);
+    }
+    Chip_UART_SendRB(LPC_USART, &txring, buf, strlen(buf));
+
+
     // Done!
     snprintf(buf, sizeof(buf), "SPI Flash: demo finished!\r\n");
     Chip_UART_SendRB(LPC_USART, &txring, buf, strlen(buf));
 
     while(true) {
+        SPI_flash_poll(&flash);
+
         GPIO_HAL_toggle(led);
         delay_us(100*1000);
 	}
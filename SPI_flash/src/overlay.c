@@ -0,0 +1,96 @@
+#include "overlay.h"
+
+#include <mcu_timing/delay.h>
+
+// Defined in link.ld
+extern uint8_t __overlay_window_start[];
+extern uint8_t __overlay_window_size[];
+extern const uint8_t __overlay_image_start[];
+
+// Defined by the OVERLAY command in link.ld: load addresses of each overlay
+extern const uint8_t __load_start_overlay_0[], __load_stop_overlay_0[];
+extern const uint8_t __load_start_overlay_1[], __load_stop_overlay_1[];
+extern const uint8_t __load_start_overlay_2[], __load_stop_overlay_2[];
+extern const uint8_t __load_start_overlay_3[], __load_stop_overlay_3[];
+
+typedef struct {
+    const uint8_t *load_start;
+    const uint8_t *load_stop;
+} OverlayRange;
+
+static const OverlayRange overlay_ranges[OVERLAY_COUNT] = {
+    {__load_start_overlay_0, __load_stop_overlay_0},
+    {__load_start_overlay_1, __load_stop_overlay_1},
+    {__load_start_overlay_2, __load_stop_overlay_2},
+    {__load_start_overlay_3, __load_stop_overlay_3},
+};
+
+
+bool overlay_init(OverlayLoader *loader, SPIFlash *flash,
+        uint32_t image_address)
+{
+    loader->flash = flash;
+    loader->image_address = image_address;
+    loader->current = OVERLAY_NONE;
+
+    OverlayStats empty = {0};
+    loader->stats = empty;
+    return true;
+}
+
+bool overlay_load(OverlayLoader *loader, size_t overlay)
+{
+    if(overlay >= OVERLAY_COUNT) {
+        return false;
+    }
+    OverlayStats *stats = &loader->stats;
+    if(overlay == loader->current) {
+        stats->hit_count++;
+        return true;
+    }
+
+    const OverlayRange *range = &overlay_ranges[overlay];
+    const size_t size = range->load_stop - range->load_start;
+    const uint32_t address = loader->image_address
+        + (range->load_start - __overlay_image_start);
+    if(size > (size_t)__overlay_window_size) {
+        return false;
+    }
+
+    // Whatever was in the window is gone from here on
+    loader->current = OVERLAY_NONE;
+
+    // Not through SPI_flash_read(): small overlays would evict the page cache
+    const uint64_t t_start = delay_get_timestamp();
+    if(!SPI_flash_wait_ready(loader->flash)
+            || !SPI_flash_read_async(loader->flash, address,
+                __overlay_window_start, size, NULL, NULL)
+            || !SPI_flash_wait_ready(loader->flash)) {
+        return false;
+    }
+    const uint32_t load_us = delay_calc_time_us(t_start,
+            delay_get_timestamp());
+
+    loader->current = overlay;
+    stats->load_count++;
+    stats->last_load_us = load_us;
+    stats->last_load_size = size;
+    stats->total_load_us+= load_us;
+    stats->total_load_bytes+= size;
+    if(stats->total_load_bytes) {
+        stats->us_per_KB = (stats->total_load_us * 1024)
+            / stats->total_load_bytes;
+    }
+    return true;
+}
+
+void overlay_invalidate(OverlayLoader *loader)
+{
+    loader->current = OVERLAY_NONE;
+}
+
+void overlay_get_stats(OverlayLoader *loader, OverlayStats *stats)
+{
+    *stats = loader->stats;
+}
+
@@ -0,0 +1,94 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "SPI_flash.h"
+
+// Number of overlays, as defined in link.ld
+#define OVERLAY_COUNT   (4)
+#define OVERLAY_NONE    ((size_t)-1)
+
+/**
+ * Place a function in overlay n (0 .. OVERLAY_COUNT-1). Use it on both the
+ * declaration and the definition: the overlay window is out of range of a
+ * normal call from internal flash.
+ *
+ * Overlays are linked to run in the overlay window, but are not part of the
+ * firmware image: the 'bin' target packs them in <name>_overlays.bin, which
+ * should be stored in SPI flash. Call overlay_load() before calling any
+ * function in an overlay.
+ *
+ * Overlays may not refer to each other. Only code and constant data can be
+ * in an overlay: variables are not initialized.
+ */
+#define OVERLAY(n)      __attribute__((section(".overlay_" #n), noinline, long_call))
+
+/**
+ * Place constant data in overlay n, e.g. a table used by its functions
+ */
+#define OVERLAY_DATA(n) __attribute__((section(".overlay_" #n ".rodata")))
+
+/**
+ * Overlay load statistics, see overlay_get_stats()
+ */
+typedef struct {
+    uint32_t load_count;    // overlays copied from SPI flash
+    uint32_t hit_count;     // overlay_load() calls that found it loaded
+    uint32_t last_load_us;
+    uint32_t last_load_size;
+
+    // Load latency per KB, over all loads
+    uint32_t us_per_KB;
+    uint64_t total_load_us;
+    uint32_t total_load_bytes;
+} OverlayStats;
+
+/**
+ * Overlay loader instance, see overlay_init(). All fields are private.
+ */
+typedef struct {
+    SPIFlash *flash;
+    uint32_t image_address;
+
+    // Overlay in the window, OVERLAY_NONE if unknown
+    size_t current;
+
+    OverlayStats stats;
+} OverlayLoader;
+
+
+/**
+ * Load overlays from an overlay image in SPI flash.
+ *
+ * The overlay window is in USB RAM: its clock should be enabled first,
+ * see board_setup().
+ *
+ * @param image_address Address of <name>_overlays.bin in SPI flash
+ */
+bool overlay_init(OverlayLoader *loader, SPIFlash *flash,
+        uint32_t image_address);
+
+/**
+ * Make sure the given overlay is in the overlay window.
+ *
+ * The loaded overlay is remembered: this only reads from SPI flash when
+ * a different overlay was loaded last.
+ *
+ * @return  False if the overlay does not exist or could not be read. The
+ *          window contents are undefined then: do not call into it.
+ */
+bool overlay_load(OverlayLoader *loader, size_t overlay);
+
+/**
+ * Forget the loaded overlay, e.g. after the window memory was used
+ * for something else or the overlay image was updated.
+ */
+void overlay_invalidate(OverlayLoader *loader);
+
+void overlay_get_stats(OverlayLoader *loader, OverlayStats *stats);
+
+#endif
+
@@ -13,6 +13,7 @@ const uint32_t OscRateIn = 12000000;
 
 static const NVICConfig NVIC_config[] = {
     {TIMER_32_0_IRQn,       1},     // delay timer: high priority
+    {SSP1_IRQn,             2},     // SPI flash
 };
 
 static const PinMuxConfig pinmuxing[] = {
@@ -23,10 +24,17 @@ static const PinMuxConfig pinmuxing[] = {
         {0,  16, (IOCON_FUNC1)},          // AD5
         {0,  18, (IOCON_FUNC1 | IOCON_MODE_INACT)},          // RXD
         {0,  19, (IOCON_FUNC1 | IOCON_MODE_INACT)},          // TXD
+
+        // SPI FLASH
+        {0,  17, (IOCON_FUNC0)},          // !CS: GPIO
+        {1,  15, (IOCON_FUNC3)},          // SCK1
+        {1,  21, (IOCON_FUNC2)},          // MISO1
+        {1,  22, (IOCON_FUNC2)},          // MOSI1
 };
 
 static const GPIOConfig pin_config[] = {
-    [GPIO_ID_LED] = {{0,  7}, GPIO_CFG_DIR_OUTPUT_LOW},
+    [GPIO_ID_LED]               = {{0,   7}, GPIO_CFG_DIR_OUTPUT_LOW},
+    [GPIO_ID_FLASH_CS]          = {{0,  17}, GPIO_CFG_DIR_OUTPUT_HIGH},
 };
 
 static const enum ADCConfig adc_config[] = {
@@ -3,6 +3,7 @@
 
 enum GPIO_ID {
     GPIO_ID_LED,
+    GPIO_ID_FLASH_CS,
 
     GPIO_ID_MAX // This should be last: it is used to count
 };
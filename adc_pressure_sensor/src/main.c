@@ -7,8 +7,12 @@
 #include <lpc_tools/GPIO_HAL_LPC.h>
 #include <lpc_tools/clock.h>
 #include <mcu_timing/delay.h>
+#include <c_utils/assert.h>
 #include "ADC.h"
+#include "SPI_flash.h"
+#include "sample_log.h"
 #include <stdio.h>
+#include <string.h>
 
 #define CLK_FREQ (48e6)
 
@@ -19,6 +23,19 @@
 STATIC RINGBUFF_T txring, rxring;
 static uint8_t rxbuff[UART_RRB_SIZE], txbuff[UART_SRB_SIZE];
 
+// SPI Flash settings, used if the flash chip does not support SFDP
+#define SPI_FLASH_PAGE_SIZE_BYTES           0x100
+#define SPI_FLASH_ERASE_BLOCK_SIZE_BYTES    0x8000
+#define SPI_FLASH_SIZE_BYTES                0x80000
+
+// Samples are logged at 1kHz, the pressure is printed every 100ms
+#define SAMPLE_INTERVAL_US  (1000)
+#define PRINT_INTERVAL_US   (100*1000)
+
+static SPIFlash flash;
+static SampleLog sample_log;
+static uint32_t sample_log_buffers[2*SPI_FLASH_PAGE_SIZE_BYTES/sizeof(uint32_t)];
+
 /**
  * Dummy syscall to use printf features
  */
@@ -41,6 +58,13 @@ void UART_IRQHandler(void)
 	Chip_UART_IRQRBHandler(LPC_USART, &rxring, &txring);
 }
 
+/**
+ * SSP1 interrupt handler: drives the SPI flash transfers
+ */
+void SSP1_IRQHandler(void)
+{
+    SPI_flash_IRQHandler(LPC_SSP1);
+}
 
 static void Uart_Init(void)
 {
@@ -91,17 +115,56 @@ int main(void)
 	Uart_Init();
 	ADC_init();
 
+    // Prefer the geometry as reported by the flash chip itself
+    if(!SPI_flash_init_auto(&flash, LPC_SSP1,
+                board_get_GPIO(GPIO_ID_FLASH_CS))) {
+        assert(SPI_flash_init(&flash, LPC_SSP1,
+                    board_get_GPIO(GPIO_ID_FLASH_CS),
+                    SPI_FLASH_PAGE_SIZE_BYTES,
+                    SPI_FLASH_ERASE_BLOCK_SIZE_BYTES,
+                    SPI_FLASH_SIZE_BYTES));
+    }
+    SPIFlashInfo flash_info;
+    SPI_flash_get_info(&flash, &flash_info);
+
+    // Log to the whole flash chip
+    assert(sample_log_init(&sample_log, &flash, 0,
+                flash_info.total_size / flash_info.erase_block_size,
+                sample_log_buffers, sizeof(sample_log_buffers)));
+
+    const uint64_t t_boot = delay_get_timestamp();
+    uint64_t t_sample = t_boot;
+    uint64_t t_print = t_boot;
+
 	while(true)
 	{
+        // Sampling only appends to a RAM buffer: it never waits for the flash
+        const uint64_t now = delay_get_timestamp();
+        if(delay_calc_time_us(t_sample, now) < SAMPLE_INTERVAL_US) {
+            sample_log_poll(&sample_log);
+            continue;
+        }
+        t_sample = now;
+
 		int ad_val = ADC_read(ADC_CFG_CH5);
 		int Vsense = ad_val * VREF / 1024;
 		int Vpress = (R1 + R2) / R2 * Vsense;
 		int kPas = Vpress / VP;
-		snprintf(buf, sizeof(buf) - 1, "%d\r\n", kPas);
-		Chip_UART_SendRB(LPC_USART, &txring, buf, sizeof(buf) - 1);
 
-        GPIO_HAL_toggle(led);
-        delay_us(100*1000);
+        const SampleRecord record = {
+            .time_ms = delay_calc_time_us(t_boot, now) / 1000,
+            .value = kPas,
+        };
+        sample_log_append(&sample_log, &record);
+
+        if(delay_calc_time_us(t_print, now) >= PRINT_INTERVAL_US) {
+            t_print = now;
+
+            snprintf(buf, sizeof(buf) - 1, "%d\r\n", kPas);
+            Chip_UART_SendRB(LPC_USART, &txring, buf, strlen(buf));
+
+            GPIO_HAL_toggle(led);
+        }
 	}
 	return 0;
 }
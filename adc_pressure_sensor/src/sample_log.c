@@ -0,0 +1,308 @@
+#include "sample_log.h"
+
+#include <string.h>
+
+#define SAMPLE_LOG_HEADER_SIZE  (sizeof(uint32_t))
+
+// Sectors are blank-checked through a buffer of this size
+#define SAMPLE_LOG_CHECK_CHUNK  (64)
+
+
+static uint32_t page_address(const SampleLog *log, size_t page)
+{
+    return log->start_address + (page * log->page_size);
+}
+
+static uint32_t sector_address(const SampleLog *log, size_t sector)
+{
+    return page_address(log, sector * log->pages_per_sector);
+}
+
+static size_t total_sectors(const SampleLog *log)
+{
+    return log->page_count / log->pages_per_sector;
+}
+
+static bool read_seq(SampleLog *log, size_t page, uint32_t *seq)
+{
+    return SPI_flash_read_when_ready(log->flash, page_address(log, page),
+            seq, sizeof(*seq));
+}
+
+static bool erase_sector(SampleLog *log, size_t sector)
+{
+    if(!SPI_flash_wait_ready(log->flash)
+            || !SPI_flash_erase_range(log->flash, sector_address(log, sector),
+                log->page_size * log->pages_per_sector, NULL)) {
+        return false;
+    }
+    log->stats.erases++;
+    return true;
+}
+
+/**
+ * Erase a sector at boot, unless it is blank already: this saves an erase
+ * cycle and the erase time on every reset.
+ */
+static bool erase_sector_if_used(SampleLog *log, size_t sector)
+{
+    const uint32_t address = sector_address(log, sector);
+    const size_t size = log->page_size * log->pages_per_sector;
+
+    uint8_t chunk[SAMPLE_LOG_CHECK_CHUNK];
+    for(size_t offset=0;offset<size;offset+=sizeof(chunk)) {
+        if(!SPI_flash_read_when_ready(log->flash, address + offset,
+                    chunk, sizeof(chunk))) {
+            return false;
+        }
+        for(size_t i=0;i<sizeof(chunk);i++) {
+            if(chunk[i] != 0xFF) {
+                return erase_sector(log, sector);
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Find the newest page with a binary search.
+ *
+ * Pages are written in order and the sequence number of a page is always
+ * its position modulo page_count. Starting from page 0, the pages up to the
+ * newest page have a sequence number of at least that of page 0. After it
+ * follow erased pages and older pages.
+ *
+ * If page 0 is erased, the log is either empty, or sector 0 was erased
+ * ahead of a newest page in the last sector: in that case all pages from
+ * sector 1 up to the newest page are written, and after it erased.
+ */
+static bool find_newest(SampleLog *log, uint32_t *newest_seq)
+{
+    *newest_seq = SAMPLE_LOG_SEQ_NONE;
+
+    size_t lo = 0;
+    uint32_t seq_min;
+    if(!read_seq(log, 0, &seq_min)) {
+        return false;
+    }
+    if(seq_min == SAMPLE_LOG_SEQ_NONE) {
+        lo = log->pages_per_sector;
+        if(!read_seq(log, lo, &seq_min)) {
+            return false;
+        }
+        if(seq_min == SAMPLE_LOG_SEQ_NONE) {
+            return true;
+        }
+    }
+
+    // Invariant: page lo is part of the newest run, hi is the last candidate
+    size_t hi = log->page_count - 1;
+    uint32_t lo_seq = seq_min;
+    while(lo < hi) {
+        const size_t mid = lo + ((hi - lo + 1) / 2);
+        uint32_t seq;
+        if(!read_seq(log, mid, &seq)) {
+            return false;
+        }
+        if((seq != SAMPLE_LOG_SEQ_NONE) && (seq >= seq_min)) {
+            lo = mid;
+            lo_seq = seq;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    *newest_seq = lo_seq;
+    return true;
+}
+
+bool sample_log_init(SampleLog *log, SPIFlash *flash,
+        uint32_t start_address, size_t sector_count,
+        void *buffers, size_t sizeof_buffers)
+{
+    SPIFlashInfo info;
+    SPI_flash_get_info(flash, &info);
+
+    log->flash = flash;
+    log->start_address = start_address;
+    log->page_size = info.page_size;
+    log->pages_per_sector = info.erase_block_size / info.page_size;
+    log->page_count = sector_count * log->pages_per_sector;
+    log->records_per_page = (info.page_size - SAMPLE_LOG_HEADER_SIZE)
+        / sizeof(SampleRecord);
+    memset(&log->stats, 0, sizeof(log->stats));
+
+    if((start_address % info.erase_block_size) || (sector_count < 2)
+            || ((start_address + (sector_count * info.erase_block_size))
+                > info.total_size)) {
+        return false;
+    }
+    if(sizeof_buffers < (2 * info.page_size)) {
+        return false;
+    }
+    log->buffers[0] = buffers;
+    log->buffers[1] = (uint8_t*)buffers + info.page_size;
+    log->buffer_full[0] = false;
+    log->buffer_full[1] = false;
+    log->fill_buffer = 0;
+    log->fill_count = 0;
+    log->program_buffer = 0;
+    log->program_busy = false;
+    log->erase_busy = false;
+
+    if(!find_newest(log, &log->newest_seq)) {
+        return false;
+    }
+    log->fill_seq = log->newest_seq + 1;
+
+    // Restore the erase-ahead state: a power loss may have interrupted it.
+    // At the start of a sector, only that sector has to be blank: writing
+    // its first page erases the one after it.
+    const size_t next_page = log->fill_seq % log->page_count;
+    const size_t next_sector = next_page / log->pages_per_sector;
+    if(!(next_page % log->pages_per_sector)) {
+        return erase_sector_if_used(log, next_sector);
+    }
+    return erase_sector_if_used(log, (next_sector + 1) % sector_count);
+}
+
+bool sample_log_append(SampleLog *log, const SampleRecord *record)
+{
+    const size_t b = log->fill_buffer;
+    if(log->buffer_full[b]) {
+        log->stats.dropped++;
+        return false;
+    }
+
+    uint8_t *buffer = log->buffers[b];
+    if(!log->fill_count) {
+        const uint32_t seq = log->fill_seq;
+        memcpy(buffer, &seq, sizeof(seq));
+    }
+    memcpy(buffer + SAMPLE_LOG_HEADER_SIZE
+            + (log->fill_count * sizeof(SampleRecord)),
+            record, sizeof(SampleRecord));
+    log->stats.appended++;
+
+    if(++log->fill_count >= log->records_per_page) {
+        log->buffer_full[b] = true;
+        log->fill_buffer = b ^ 1;
+        log->fill_count = 0;
+        log->fill_seq++;
+    }
+    return true;
+}
+
+/**
+ * Start programming the next full buffer, and erase the next sector
+ * as soon as the first page of a sector is written.
+ */
+static void start_program(SampleLog *log)
+{
+    const uint8_t *buffer = log->buffers[log->program_buffer];
+
+    uint32_t seq;
+    memcpy(&seq, buffer, sizeof(seq));
+    const size_t page = seq % log->page_count;
+    const bool sector_start = !(page % log->pages_per_sector);
+
+    // The erase op is reused for the next sector: wait until it is free.
+    // Note that the queue runs in order, so the previous erase is
+    // always finished before this page is programmed.
+    if(sector_start && log->erase_busy) {
+        return;
+    }
+
+    const SPIFlashOp program = {
+        .type = SPI_FLASH_OP_PROGRAM,
+        .address = page_address(log, page),
+        .buffer = (void*)buffer,
+        .size = SAMPLE_LOG_HEADER_SIZE
+            + (log->records_per_page * sizeof(SampleRecord)),
+    };
+    log->program_op = program;
+    log->program_busy = SPI_flash_submit(log->flash, &log->program_op);
+
+    if(sector_start) {
+        const size_t sector = page / log->pages_per_sector;
+        const SPIFlashOp erase = {
+            .type = SPI_FLASH_OP_ERASE_BLOCK,
+            .address = sector_address(log, (sector + 1) % total_sectors(log)),
+        };
+        log->erase_op = erase;
+        log->erase_busy = SPI_flash_submit(log->flash, &log->erase_op);
+    }
+}
+
+void sample_log_poll(SampleLog *log)
+{
+    if(log->erase_busy
+            && (log->erase_op.state == SPI_FLASH_OP_STATE_DONE)) {
+        log->erase_busy = false;
+        if(log->erase_op.ok) {
+            log->stats.erases++;
+        } else {
+            log->stats.errors++;
+        }
+    }
+
+    if(log->program_busy
+            && (log->program_op.state == SPI_FLASH_OP_STATE_DONE)) {
+        log->program_busy = false;
+        if(log->program_op.ok) {
+            memcpy(&log->newest_seq, log->buffers[log->program_buffer],
+                    sizeof(log->newest_seq));
+            log->stats.pages_written++;
+        } else {
+            log->stats.errors++;
+        }
+        log->buffer_full[log->program_buffer] = false;
+        log->program_buffer^= 1;
+    }
+
+    if(!log->program_busy && log->buffer_full[log->program_buffer]) {
+        start_program(log);
+    }
+
+    SPI_flash_poll(log->flash);
+}
+
+uint32_t sample_log_newest_seq(SampleLog *log)
+{
+    return log->newest_seq;
+}
+
+size_t sample_log_read_page(SampleLog *log, uint32_t seq,
+        SampleRecord *records, size_t max_records)
+{
+    if((log->newest_seq == SAMPLE_LOG_SEQ_NONE) || (seq > log->newest_seq)) {
+        return 0;
+    }
+
+    // Let queued operations finish first: the read itself is blocking
+    while(!SPI_flash_queue_is_empty(log->flash)) {
+        SPI_flash_poll(log->flash);
+    }
+
+    const size_t page = seq % log->page_count;
+    uint32_t stored_seq;
+    if(!read_seq(log, page, &stored_seq) || (stored_seq != seq)) {
+        return 0;
+    }
+
+    size_t count = log->records_per_page;
+    if(count > max_records) {
+        count = max_records;
+    }
+    if(!SPI_flash_read(log->flash,
+                page_address(log, page) + SAMPLE_LOG_HEADER_SIZE,
+                records, count * sizeof(SampleRecord))) {
+        return 0;
+    }
+    return count;
+}
+
+void sample_log_get_stats(SampleLog *log, SampleLogStats *stats)
+{
+    *stats = log->stats;
+}
+
@@ -0,0 +1,114 @@
+#ifndef SAMPLE_LOG_H
+#define SAMPLE_LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "SPI_flash.h"
+
+// Value of the page sequence number in an erased page
+#define SAMPLE_LOG_SEQ_NONE     (0xFFFFFFFF)
+
+typedef struct {
+    uint32_t time_ms;
+    int32_t value;
+} SampleRecord;
+
+typedef struct {
+    uint32_t appended;
+    uint32_t dropped;       // records lost because both buffers were full
+    uint32_t pages_written;
+    uint32_t erases;
+    uint32_t errors;        // failed program or erase operations
+} SampleLogStats;
+
+/**
+ * Circular sample log instance, see sample_log_init(). All fields are private.
+ */
+typedef struct {
+    SPIFlash *flash;
+    uint32_t start_address;
+    size_t page_size;
+    size_t page_count;
+    size_t pages_per_sector;
+    size_t records_per_page;
+
+    // Two page buffers: one is filled while the other is programmed
+    uint8_t *buffers[2];
+    volatile bool buffer_full[2];
+    volatile size_t fill_buffer;
+    volatile size_t fill_count;
+    size_t program_buffer;
+
+    // Sequence number of the page being filled
+    volatile uint32_t fill_seq;
+
+    // Sequence number of the newest page in flash
+    uint32_t newest_seq;
+
+    SPIFlashOp program_op;
+    SPIFlashOp erase_op;
+    bool program_busy;
+    bool erase_busy;
+
+    SampleLogStats stats;
+} SampleLog;
+
+
+/**
+ * Open a circular log of samples on a region of SPI flash.
+ *
+ * Records are collected in RAM and written a page at a time. Each page
+ * starts with a sequence number: the newest page is found at boot with a
+ * binary search. The sector after the one being written is erased ahead
+ * of time, so writing never has to wait for an erase. Once the log is full,
+ * the oldest sector is overwritten.
+ *
+ * @param start_address Start of the region, aligned to an erase block
+ * @param sector_count  Size of the region in erase blocks, at least 2
+ * @param buffers       Memory for two page buffers, 4-byte aligned
+ * @param sizeof_buffers Size of buffers: at least 2 * page_size bytes
+ */
+bool sample_log_init(SampleLog *log, SPIFlash *flash,
+        uint32_t start_address, size_t sector_count,
+        void *buffers, size_t sizeof_buffers);
+
+/**
+ * Add a record to the log.
+ *
+ * This never waits for the flash and may be called from an interrupt.
+ * If the flash can not keep up, the record is dropped.
+ */
+bool sample_log_append(SampleLog *log, const SampleRecord *record);
+
+/**
+ * Write full pages to flash: call this regularly, e.g. from the main loop.
+ *
+ * This also calls SPI_flash_poll(), which drives the flash operations.
+ */
+void sample_log_poll(SampleLog *log);
+
+/**
+ * Sequence number of the newest page in flash,
+ * or SAMPLE_LOG_SEQ_NONE if the log is empty
+ */
+uint32_t sample_log_newest_seq(SampleLog *log);
+
+/**
+ * Read the records of a page.
+ *
+ * @param seq           Sequence number of the page
+ * @param records       Buffer for the records
+ * @param max_records   Size of the buffer in records
+ *
+ * @return              The amount of records read, 0 if the page is
+ *                      not (or no longer) in the log
+ */
+size_t sample_log_read_page(SampleLog *log, uint32_t seq,
+        SampleRecord *records, size_t max_records);
+
+void sample_log_get_stats(SampleLog *log, SampleLogStats *stats);
+
+#endif
+